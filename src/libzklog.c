@@ -0,0 +1,528 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+/*
+ * libzklog: decoding ZooKeeper txnlogs (see libzklog.h).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "libzklog.h"
+
+struct zkl_cursor {
+	const uint8_t *zc_data;
+	size_t zc_len;
+	/* Whether we mapped zc_data (rather than being given it). */
+	int zc_mapped;
+	/* Where the next txn starts, or where the bad one went wrong. */
+	size_t zc_off;
+	size_t zc_released;
+	int zc_done;
+};
+
+const char *
+zktxn_type_to_name(enum zktxn_type type)
+{
+	switch (type) {
+	case ZK_NOTIFICATION:
+		return ("NOTIFICATION");
+	case ZK_CREATE:
+		return ("CREATE");
+	case ZK_DELETE:
+		return ("DELETE");
+	case ZK_CHECK:
+		return ("CHECK");
+	case ZK_EXISTS:
+		return ("EXISTS");
+	case ZK_GETDATA:
+		return ("GETDATA");
+	case ZK_SETDATA:
+		return ("SETDATA");
+	case ZK_GETACL:
+		return ("GETACL");
+	case ZK_SETACL:
+		return ("SETACL");
+	case ZK_GETCHILDREN:
+		return ("GETCHILDREN");
+	case ZK_SYNC:
+		return ("SYNC");
+	case ZK_CREATESESSION:
+		return ("CREATESESSION");
+	case ZK_CLOSESESSION:
+		return ("CLOSESESSION");
+	case ZK_MULTI:
+		return ("MULTI");
+	case ZK_ERROR:
+		return ("ERROR");
+	default:
+		return ("???");
+	}
+}
+
+const char *
+zkerr_to_name(enum zkerr err)
+{
+	switch (err) {
+	case ERR_SYSTEM_ERROR:
+		return ("SYSTEM_ERROR");
+	case ERR_RUNTIME_INCONSIST:
+		return ("RUNTIME_INCONSIST");
+	case ERR_DATA_INCONSIST:
+		return ("DATA_INCONSIST");
+	case ERR_CONNECTION_LOSS:
+		return ("CONNECTION_LOSS");
+	case ERR_UNIMPL:
+		return ("UNIMPL");
+	case ERR_TIMEOUT:
+		return ("TIMEOUT");
+	case ERR_BAD_ARGS:
+		return ("BAD_ARGS");
+	case ERR_NO_NODE:
+		return ("NO_NODE");
+	case ERR_NODE_EXISTS:
+		return ("NODE_EXISTS");
+	case ERR_SESSION_EXPIRED:
+		return ("SESSION_EXPIRED");
+	case ERR_NOT_EMPTY:
+		return ("NOT_EMPTY");
+	default:
+		return ("???");
+	}
+}
+
+const char *
+zkl_strerror(int err)
+{
+	switch (err) {
+	case ZKL_OK:
+		return ("no error");
+	case ZKL_ESYS:
+		return (strerror(errno));
+	case ZKL_ECOMPRESSED:
+		return ("txnlog is compressed");
+	case ZKL_ESMALL:
+		return ("file is too small to be a txnlog");
+	case ZKL_EMAGIC:
+		return ("bad magic number");
+	case ZKL_EVERSION:
+		return ("unknown log version");
+	case ZKL_ETRUNC:
+		return ("txn runs past the end of the log");
+	case ZKL_ETXNLEN:
+		return ("txn entry too short");
+	case ZKL_ETERM:
+		return ("txn entry has no terminator");
+	case ZKL_ESHORT:
+		return ("txn too short for its type");
+	case ZKL_EPATHLEN:
+		return ("txn too short (decoding node name)");
+	case ZKL_EPATH:
+		return ("txn too short (in node name)");
+	case ZKL_EDATALEN:
+		return ("txn too short (decoding data field)");
+	case ZKL_EDATA:
+		return ("txn too short (in data)");
+	case ZKL_ECHILD:
+		return ("MULTI too short (at child txn)");
+	case ZKL_ECHILDLEN:
+		return ("MULTI too short (after inner length of child txn)");
+	default:
+		return ("unknown error");
+	}
+}
+
+/*
+ * Checks the header at the start of a log of "len" bytes.
+ */
+int
+zkl_log_check(const void *data, size_t len)
+{
+	const struct zklog *log = data;
+
+	if (len < sizeof (struct zklog))
+		return (ZKL_ESMALL);
+	if (zk_load32(&log->zl_magic) != ZKLOG_MAGIC)
+		return (ZKL_EMAGIC);
+	if (zk_load32(&log->zl_version) != ZKLOG_VERSION_2)
+		return (ZKL_EVERSION);
+	return (ZKL_OK);
+}
+
+/*
+ * Finds the txn at "*offsetp" in the "len" bytes of a log at "data", checking
+ * its length and terminator. On success, this returns 1, with the txn and its
+ * length (as in its zt_len) in "*txnp" and "*txnlenp", and "*offsetp" moved
+ * on to the next txn. At the end of the txns (which is followed by the zeroes
+ * of the preallocated space, so a zero length) it returns 0, and on an error,
+ * the error, with "*offsetp" moved to where the txn went wrong.
+ */
+int
+zkl_frame(const uint8_t *data, size_t len, size_t *offsetp,
+    const struct zktxn **txnp, uint32_t *txnlenp)
+{
+	size_t offset = *offsetp;
+	const struct zktxn *txn = (const struct zktxn *)(data + offset);
+	size_t hdrlen = offsetof(struct zktxn, zt_len) + sizeof (txn->zt_len);
+	uint32_t txnlen;
+
+	if (offset > len || len - offset < hdrlen) {
+		*offsetp = offset + hdrlen;
+		return (ZKL_ETRUNC);
+	}
+	offset += hdrlen;
+
+	txnlen = zk_load32(&txn->zt_len);
+	if (txnlen == 0)
+		return (0);
+	if (txnlen < ZKTXN_MIN_LEN) {
+		*offsetp = offset;
+		return (ZKL_ETXNLEN);
+	}
+
+	if (len - offset <= txnlen) {
+		*offsetp = offset + txnlen;
+		return (ZKL_ETRUNC);
+	}
+	offset += txnlen;
+	if (data[offset] != ZKTXN_TERMINATOR) {
+		*offsetp = offset;
+		return (ZKL_ETERM);
+	}
+
+	*offsetp = offset + 1;
+	*txnp = txn;
+	*txnlenp = txnlen;
+	return (1);
+}
+
+/*
+ * Gives the pages of a mapped log before "offset" back to the system, in
+ * ZKL_RELEASE-sized pieces, once there's that much more than the last time
+ * ("*releasedp", which starts at a multiple of ZKL_RELEASE).
+ */
+void
+zkl_release(const void *data, size_t offset, size_t *releasedp)
+{
+	size_t upto;
+
+	if (offset - *releasedp < ZKL_RELEASE)
+		return;
+	upto = offset - offset % ZKL_RELEASE;
+	(void) madvise((caddr_t)data + *releasedp, upto - *releasedp,
+	    MADV_DONTNEED);
+	*releasedp = upto;
+}
+
+/*
+ * Gives back the rest of the pages before "offset", once we're done with the
+ * part of a mapped log that ends there (which must be inside the mapping).
+ * The page it ends in goes too; if anything still wants the rest of it, it
+ * just gets read in again.
+ */
+void
+zkl_release_rest(const void *data, size_t offset, size_t *releasedp)
+{
+	if (offset <= *releasedp)
+		return;
+	(void) madvise((caddr_t)data + *releasedp, offset - *releasedp,
+	    MADV_DONTNEED);
+	*releasedp = offset - offset % ZKL_RELEASE;
+}
+
+/*
+ * Loads the header of a txn found by zkl_frame() into "t". The body isn't
+ * decoded until zkl_body().
+ */
+void
+zkl_txn_init(struct zkl_txn *t, const struct zktxn *txn, uint32_t txnlen)
+{
+	t->zkt_hdr.zth_sessionid = zk_load64(&txn->zt_sessionid);
+	t->zkt_hdr.zth_cxid = zk_load32(&txn->zt_cxid);
+	t->zkt_hdr.zth_zxid = zk_load64(&txn->zt_zxid);
+	t->zkt_hdr.zth_time = zk_load64(&txn->zt_time);
+	t->zkt_hdr.zth_type = (int32_t)zk_load32(&txn->zt_type);
+	t->zkt_type = t->zkt_hdr.zth_type;
+	t->zkt_child = -1;
+	t->zkt_body = (const uint8_t *)&txn->zt_inner;
+	t->zkt_bodylen = txnlen - ZKTXN_MIN_LEN;
+}
+
+/*
+ * Decodes the fields in the body of a txn (or child) for its type. If the
+ * body is too short for them, this returns the error, but everything that
+ * comes before the problem is still filled in.
+ */
+int
+zkl_body(struct zkl_txn *t)
+{
+	const uint8_t *body = t->zkt_body;
+	size_t len = t->zkt_bodylen;
+	const char *nul;
+	uint32_t v;
+	size_t off;
+
+	t->zkt_err = 0;
+	t->zkt_timeout = 0;
+	t->zkt_count = 0;
+	t->zkt_path = NULL;
+	t->zkt_pathlen = -1;
+	t->zkt_data = NULL;
+	t->zkt_datalen = -1;
+
+	switch (t->zkt_type) {
+	case ZK_ERROR:
+	case ZK_CREATESESSION:
+	case ZK_MULTI:
+		if (len < sizeof (v))
+			return (ZKL_ESHORT);
+		v = zk_load32(body);
+		if (t->zkt_type == ZK_ERROR)
+			t->zkt_err = (int32_t)v;
+		else if (t->zkt_type == ZK_CREATESESSION)
+			t->zkt_timeout = (int32_t)v;
+		else
+			t->zkt_count = v;
+		return (ZKL_OK);
+	case ZK_CREATE:
+	case ZK_SETDATA:
+	case ZK_DELETE:
+	case ZK_CHECK:
+	case ZK_SETACL:
+		break;
+	default:
+		/* Other types have nothing that we decode. */
+		return (ZKL_OK);
+	}
+
+	if (len < sizeof (v))
+		return (ZKL_EPATHLEN);
+	v = zk_load32(body);
+	if (v > len - sizeof (v))
+		return (ZKL_EPATH);
+	t->zkt_path = (const char *)body + sizeof (v);
+	nul = memchr(t->zkt_path, '\0', v);
+	t->zkt_pathlen = (nul != NULL) ? nul - t->zkt_path : (int32_t)v;
+
+	/* Only CREATE/SETDATA have data fields. */
+	if (t->zkt_type != ZK_CREATE && t->zkt_type != ZK_SETDATA)
+		return (ZKL_OK);
+
+	off = sizeof (v) + v;
+	if (len - off < sizeof (v))
+		return (ZKL_EDATALEN);
+	v = zk_load32(body + off);
+	off += sizeof (v);
+
+	/*
+	 * CREATE can have data len set to -1 (signed) to indicate that no
+	 * data was included with the CREATE command. ZK plays a bit fast and
+	 * loose with signedness unfortunately.
+	 */
+	if ((int32_t)v < 0)
+		return (ZKL_OK);
+	t->zkt_datalen = (int32_t)v;
+	if (v > len - off)
+		return (ZKL_EDATA);
+	t->zkt_data = body + off;
+
+	return (ZKL_OK);
+}
+
+void
+zkl_multi_init(struct zkl_multi *m, const struct zkl_txn *t)
+{
+	m->zkm_txn = t;
+	m->zkm_off = sizeof (uint32_t);
+	m->zkm_i = 0;
+	m->zkm_err = ZKL_OK;
+}
+
+/*
+ * Fills in "c" with the next child of a MULTI, returning 1, or 0 once there
+ * are no more. If the MULTI is too short for the child (ZKL_ECHILD or
+ * ZKL_ECHILDLEN) that's the end of the children; if it's only the body of
+ * the child that's bad, this returns the error from zkl_body(), and the next
+ * call moves on as usual.
+ */
+int
+zkl_multi_next(struct zkl_multi *m, struct zkl_txn *c)
+{
+	const struct zkl_txn *t = m->zkm_txn;
+	size_t len = t->zkt_bodylen;
+	size_t off = m->zkm_off;
+	uint32_t clen;
+	int rv;
+
+	if (m->zkm_err != ZKL_OK)
+		return (m->zkm_err);
+	if (m->zkm_i >= t->zkt_count)
+		return (0);
+
+	if (len - off < 2 * sizeof (uint32_t))
+		return (m->zkm_err = ZKL_ECHILD);
+	clen = zk_load32(t->zkt_body + off + sizeof (uint32_t));
+	if (clen > len - off - 2 * sizeof (uint32_t))
+		return (m->zkm_err = ZKL_ECHILDLEN);
+
+	c->zkt_hdr = t->zkt_hdr;
+	c->zkt_type = (int32_t)zk_load32(t->zkt_body + off);
+	c->zkt_child = (int32_t)m->zkm_i;
+	c->zkt_body = t->zkt_body + off + 2 * sizeof (uint32_t);
+	c->zkt_bodylen = clen;
+	m->zkm_off = off + 2 * sizeof (uint32_t) + clen;
+	m->zkm_i++;
+
+	rv = zkl_body(c);
+	return (rv != ZKL_OK ? rv : 1);
+}
+
+static int
+zkl_cursor_alloc(const void *data, size_t len, int mapped,
+    struct zkl_cursor **curp)
+{
+	struct zkl_cursor *cur;
+	int rv;
+
+	if ((rv = zkl_log_check(data, len)) != ZKL_OK)
+		return (rv);
+	if ((cur = calloc(1, sizeof (*cur))) == NULL)
+		return (ZKL_ESYS);
+	cur->zc_data = data;
+	cur->zc_len = len;
+	cur->zc_mapped = mapped;
+	cur->zc_off = offsetof(struct zklog, zl_txns);
+	*curp = cur;
+	return (ZKL_OK);
+}
+
+/*
+ * Opens the log at "path", mapping it, and checks its header. Compressed logs
+ * can't be mapped, so they get ZKL_ECOMPRESSED.
+ */
+int
+zkl_open(const char *path, struct zkl_cursor **curp)
+{
+	static const uint8_t gzip_magic[] = { 0x1F, 0x8B };
+	static const uint8_t zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+	uint8_t head[sizeof (struct zklog)];
+	struct stat st;
+	void *data;
+	ssize_t n;
+	int fd, rv, saved;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (ZKL_ESYS);
+	if (fstat(fd, &st) != 0 || (n = pread(fd, head, sizeof (head), 0)) < 0)
+		goto fail;
+
+	if (((size_t)n >= sizeof (gzip_magic) &&
+	    bcmp(head, gzip_magic, sizeof (gzip_magic)) == 0) ||
+	    ((size_t)n >= sizeof (zstd_magic) &&
+	    bcmp(head, zstd_magic, sizeof (zstd_magic)) == 0)) {
+		(void) close(fd);
+		return (ZKL_ECOMPRESSED);
+	}
+	if ((rv = zkl_log_check(head, n)) != ZKL_OK) {
+		(void) close(fd);
+		return (rv);
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto fail;
+	(void) close(fd);
+	(void) madvise((caddr_t)data, st.st_size, MADV_SEQUENTIAL);
+
+	if ((rv = zkl_cursor_alloc(data, st.st_size, 1, curp)) != ZKL_OK) {
+		saved = errno;
+		(void) munmap(data, st.st_size);
+		errno = saved;
+	}
+	return (rv);
+
+fail:
+	saved = errno;
+	(void) close(fd);
+	errno = saved;
+	return (ZKL_ESYS);
+}
+
+/*
+ * Like zkl_open(), but for a log which is already in memory, which has to
+ * stay there until the cursor is closed.
+ */
+int
+zkl_open_buf(const void *data, size_t len, struct zkl_cursor **curp)
+{
+	return (zkl_cursor_alloc(data, len, 0, curp));
+}
+
+/*
+ * Fills in "t" with the next txn, returning 1, or 0 at the end of the log.
+ * A bad body (from zkl_body()) is returned as an error, but the cursor still
+ * moves past the txn. After any other error there's no telling where the next
+ * txn starts, so that's the end: zkl_offset() says where it went wrong.
+ */
+int
+zkl_next(struct zkl_cursor *cur, struct zkl_txn *t)
+{
+	const struct zktxn *txn;
+	uint32_t txnlen;
+	int rv;
+
+	if (cur->zc_done || cur->zc_off >= cur->zc_len)
+		return (0);
+	if ((rv = zkl_frame(cur->zc_data, cur->zc_len, &cur->zc_off, &txn,
+	    &txnlen)) <= 0) {
+		cur->zc_done = 1;
+		return (rv);
+	}
+
+	if (cur->zc_mapped)
+		zkl_release(cur->zc_data, cur->zc_off, &cur->zc_released);
+
+	zkl_txn_init(t, txn, txnlen);
+	rv = zkl_body(t);
+	return (rv != ZKL_OK ? rv : 1);
+}
+
+size_t
+zkl_offset(const struct zkl_cursor *cur)
+{
+	return (cur->zc_off);
+}
+
+uint64_t
+zkl_dbid(const struct zkl_cursor *cur)
+{
+	const struct zklog *log = (const struct zklog *)cur->zc_data;
+
+	return (zk_load64(&log->zl_dbid));
+}
+
+void
+zkl_close(struct zkl_cursor *cur)
+{
+	if (cur == NULL)
+		return;
+	if (cur->zc_mapped)
+		(void) munmap((void *)cur->zc_data, cur->zc_len);
+	free(cur);
+}
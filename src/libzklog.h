@@ -0,0 +1,305 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+/*
+ * libzklog: decoding ZooKeeper txnlogs.
+ *
+ * This is the decoder from zklog, without any of its output: it walks the
+ * txns in a log, and gives back views of them that point into the log
+ * rather than copies. A cursor is the simple way in:
+ *
+ *	struct zkl_cursor *cur;
+ *	struct zkl_txn t;
+ *	int rv;
+ *
+ *	if ((rv = zkl_open(path, &cur)) != ZKL_OK)
+ *		... zkl_strerror(rv) ...
+ *	while ((rv = zkl_next(cur, &t)) > 0) {
+ *		... t.zkt_hdr.zth_zxid, t.zkt_path ...
+ *	}
+ *	zkl_close(cur);
+ *
+ * and the children of a MULTI come from a zkl_multi. The pieces underneath
+ * (zkl_frame(), zkl_txn_init() and zkl_body()) are there for callers, like
+ * zklog itself, which do their own walking of a log.
+ *
+ * Nothing here exits or prints: everything that can fail returns one of the
+ * (negative) ZKL_E* codes. Views are only good while the cursor (or whatever
+ * memory they were decoded from) is open.
+ */
+
+#ifndef	_LIBZKLOG_H
+#define	_LIBZKLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <strings.h>
+
+/*
+ * Sadly endian.h was added in a "recent" platform version for SmartOS/illumos
+ * and we can't easily detect it without something like autotools. We need to
+ * build on platforms from before this work, so the cowardly way out is just
+ * to macro it up like we do here.
+ */
+#if defined(__sun)
+#include <netinet/in.h>
+#define	be64toh(v)	(ntohll(v))
+#define	be32toh(v)	(ntohl(v))
+#define	htobe64(v)	(htonll(v))
+#define	htobe32(v)	(htonl(v))
+#else
+/* Everyone else has it :( */
+#include <endian.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* These all come from the ZooKeeper source (including the values). */
+
+#define	ZKLOG_MAGIC		0x5A4B4C47
+#define	ZKTXN_TERMINATOR	0x42
+
+enum zklog_versions {
+	ZKLOG_VERSION_2 = 2
+};
+
+enum zktxn_type {
+	ZK_NOTIFICATION = 0,
+	ZK_CREATE = 1,
+	ZK_DELETE = 2,
+	ZK_EXISTS = 3,
+	ZK_GETDATA = 4,
+	ZK_SETDATA = 5,
+	ZK_GETACL = 6,
+	ZK_SETACL = 7,
+	ZK_GETCHILDREN = 8,
+	ZK_SYNC = 9,
+	ZK_CHECK = 13,
+	ZK_MULTI = 14,
+	ZK_CREATE2 = 15,
+	ZK_CREATECONTAINER = 19,
+	ZK_DELETECONTAINER = 20,
+	ZK_CREATETTL = 21,
+	ZK_CREATESESSION = -10,
+	ZK_CLOSESESSION = -11,
+	ZK_ERROR = -1
+	/*
+	 * Worth noting that this list is not complete: there are other types
+	 * of txns that can be in the logs which we will just ignore.
+	 */
+};
+
+enum zkerr {
+	ERR_SYSTEM_ERROR = -1,
+	ERR_RUNTIME_INCONSIST = -2,
+	ERR_DATA_INCONSIST = -3,
+	ERR_CONNECTION_LOSS = -4,
+	ERR_UNIMPL = -6,
+	ERR_TIMEOUT = -7,
+	ERR_BAD_ARGS = -8,
+	ERR_NO_NODE = -101,
+	ERR_NODE_EXISTS = -110,
+	ERR_SESSION_EXPIRED = -112,
+	ERR_NOT_EMPTY = -111,
+	/* Once again, this is incomplete. */
+};
+
+struct zktxn_err {
+	uint32_t ze_err;
+} __attribute__((packed));
+
+struct zktxn_createsess {
+	uint32_t zcs_timeout;
+} __attribute__((packed));
+
+struct zktxn_multitxn {
+	uint32_t zmt_type;
+	uint32_t zmt_len;
+	union {
+		struct zktxn_err zti_err;
+		struct zktxn_createsess zti_createsess;
+	} zmt_inner;
+} __attribute__((packed));
+
+struct zktxn_multi {
+	uint32_t zm_ntxns;
+	struct zktxn_multitxn zm_txns[];
+} __attribute__((packed));
+
+struct zk_string {
+	uint32_t zs_len;
+	char zs_str[];
+} __attribute__((packed));
+
+struct zktxn {
+	uint64_t zt_checksum;
+	uint32_t zt_len;
+	uint64_t zt_sessionid;
+	uint32_t zt_cxid;
+	uint64_t zt_zxid;
+	uint64_t zt_time;
+	uint32_t zt_type;
+	union {
+		struct zktxn_err zti_err;
+		struct zktxn_createsess zti_createsess;
+		struct zktxn_multi zti_multi;
+	} zt_inner;
+} __attribute__((packed));
+/*
+ * Minimum length is the size of all the fields after zt_len but before
+ * zt_inner. This is also the size you have to subtract from zt_len to get
+ * the *actual* size of zt_inner for a specific zktxn.
+ */
+#define	ZKTXN_MIN_LEN	\
+    (offsetof(struct zktxn, zt_inner) - offsetof(struct zktxn, zt_len) - \
+    sizeof (uint32_t))
+
+struct zklog {
+	uint32_t zl_magic;
+	uint32_t zl_version;
+	uint64_t zl_dbid;
+	struct zktxn zl_txns[];
+} __attribute__((packed));
+
+/* End of things from the ZooKeeper source. */
+
+/*
+ * Logs are normally mapped read-only (so that decoding one doesn't make a
+ * private copy of every page of it), and so all the big-endian fields in them
+ * are converted as they're loaded, with these.
+ */
+static inline uint32_t
+zk_load32(const void *p)
+{
+	uint32_t v;
+
+	bcopy(p, &v, sizeof (v));
+	return (be32toh(v));
+}
+
+static inline uint64_t
+zk_load64(const void *p)
+{
+	uint64_t v;
+
+	bcopy(p, &v, sizeof (v));
+	return (be64toh(v));
+}
+
+/*
+ * Anything going through a mapped log should tell the system it can have the
+ * pages behind it back every ZKL_RELEASE bytes (with zkl_release()), and the
+ * rest once it's done (with zkl_release_rest()). Otherwise they'd all stay in
+ * memory until the log is unmapped, and big logs would push everything else
+ * out. Views into them stay good: the pages just get read in again if they're
+ * used.
+ */
+#define	ZKL_RELEASE		(8 * 1024 * 1024)
+
+/* Error codes. These are all negative, so that 0 and up can mean success. */
+enum zkl_error {
+	ZKL_OK = 0,
+	ZKL_ESYS = -1,		/* a system call failed: see errno */
+	ZKL_ECOMPRESSED = -2,	/* the log is compressed */
+	ZKL_ESMALL = -3,	/* too small to be a txnlog */
+	ZKL_EMAGIC = -4,	/* bad magic number */
+	ZKL_EVERSION = -5,	/* unknown log version */
+	ZKL_ETRUNC = -6,	/* txn runs off the end of the log */
+	ZKL_ETXNLEN = -7,	/* txn too short for its header */
+	ZKL_ETERM = -8,		/* txn doesn't end with ZKTXN_TERMINATOR */
+	ZKL_ESHORT = -9,	/* body too short for its type */
+	ZKL_EPATHLEN = -10,	/* body too short for the length of the path */
+	ZKL_EPATH = -11,	/* path runs off the end of the body */
+	ZKL_EDATALEN = -12,	/* body too short for the length of the data */
+	ZKL_EDATA = -13,	/* data runs off the end of the body */
+	ZKL_ECHILD = -14,	/* MULTI too short for a child's header */
+	ZKL_ECHILDLEN = -15	/* child runs off the end of the MULTI */
+};
+
+/* The header of a txn, in host byte order. */
+struct zktxnhdr {
+	uint64_t zth_sessionid;
+	uint32_t zth_cxid;
+	uint64_t zth_zxid;
+	uint64_t zth_time;
+	int32_t zth_type;
+};
+
+/*
+ * A view of a txn, or of a child of a MULTI (which shares the header of its
+ * MULTI, but has its own type). The body is the part of the txn after the
+ * header; the fields after it are decoded from it by zkl_body(), and point
+ * into it.
+ */
+struct zkl_txn {
+	struct zktxnhdr zkt_hdr;
+	int32_t zkt_type;
+	/* The index of a child in its MULTI, or -1. */
+	int32_t zkt_child;
+	const uint8_t *zkt_body;
+	size_t zkt_bodylen;
+
+	/* For ERROR, the error code; for CREATESESSION, the timeout. */
+	int32_t zkt_err;
+	int32_t zkt_timeout;
+	/* For MULTI, the number of children. */
+	uint32_t zkt_count;
+
+	/*
+	 * The path (for CREATE, SETDATA, DELETE, CHECK and SETACL) and data
+	 * (for CREATE and SETDATA) are NULL, with a length of -1, if the txn
+	 * doesn't have them. The path stops at any NUL in it. After
+	 * ZKL_EDATA the data is NULL, but its length is the one it claims.
+	 */
+	const char *zkt_path;
+	int32_t zkt_pathlen;
+	const uint8_t *zkt_data;
+	int32_t zkt_datalen;
+};
+
+/* Walks the children of a MULTI. */
+struct zkl_multi {
+	const struct zkl_txn *zkm_txn;
+	size_t zkm_off;
+	/* The index of the next child (or the bad one, after an error). */
+	uint32_t zkm_i;
+	int zkm_err;
+};
+
+struct zkl_cursor;
+
+extern const char *zktxn_type_to_name(enum zktxn_type);
+extern const char *zkerr_to_name(enum zkerr);
+extern const char *zkl_strerror(int);
+
+extern int zkl_log_check(const void *, size_t);
+extern int zkl_frame(const uint8_t *, size_t, size_t *, const struct zktxn **,
+    uint32_t *);
+extern void zkl_release(const void *, size_t, size_t *);
+extern void zkl_release_rest(const void *, size_t, size_t *);
+extern void zkl_txn_init(struct zkl_txn *, const struct zktxn *, uint32_t);
+extern int zkl_body(struct zkl_txn *);
+extern void zkl_multi_init(struct zkl_multi *, const struct zkl_txn *);
+extern int zkl_multi_next(struct zkl_multi *, struct zkl_txn *);
+
+extern int zkl_open(const char *, struct zkl_cursor **);
+extern int zkl_open_buf(const void *, size_t, struct zkl_cursor **);
+extern int zkl_next(struct zkl_cursor *, struct zkl_txn *);
+extern size_t zkl_offset(const struct zkl_cursor *);
+extern uint64_t zkl_dbid(const struct zkl_cursor *);
+extern void zkl_close(struct zkl_cursor *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* !_LIBZKLOG_H */
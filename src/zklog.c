@@ -5,7 +5,7 @@
  */
 
 /*
- * Copyright (c) 2019, Joyent, Inc.
+ * Copyright 2026 Joyent, Inc.
  */
 
 #include <stdint.h>
@@ -25,21 +25,34 @@
 #include <err.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <poll.h>
+#include <getopt.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef ZKLOG_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "libzklog.h"
 
 /*
- * Sadly endian.h was added in a "recent" platform version for SmartOS/illumos
- * and we can't easily detect it without something like autotools. We need to
- * build on platforms from before this work, so the cowardly way out is just
- * to macro it up like we do here.
+ * We also build on platforms without <sys/debug.h>, so we have our own
+ * version of the one assertion macro we need.
  */
-#if defined(__sun)
-#include <netinet/in.h>
-#define	be64toh(v)	(ntohll(v))
-#define	be32toh(v)	(ntohl(v))
-#else
-/* Everyone else has it :( */
-#include <endian.h>
-#endif
+#define	VERIFY0(x)	do { \
+	if ((x) != 0) { \
+		errx(ZKLOG_EXIT_ERROR, "assertion failed: " #x " == 0 " \
+		    "(%s:%d)", __FILE__, __LINE__); \
+	} \
+    } while (0)
 
 /* Our exit status codes. */
 enum zklog_error_codes {
@@ -49,548 +62,7624 @@ enum zklog_error_codes {
 };
 
 
-/* These all come from the ZooKeeper source (including the values). */
+/*
+ * The ID number of the server that a session was created on is encoded in the
+ * top 8 bits of the session ID.
+ */
+inline static uint8_t
+sid_to_srvid(uint64_t sid)
+{
+	return ((sid >> 56) & 0xFF);
+}
 
-const uint32_t ZKLOG_MAGIC = 0x5A4B4C47;
-const uint8_t ZKTXN_TERMINATOR = 0x42;
+/*
+ * Session tracking. There can be hundreds of thousands of sessions open at
+ * once in a long run of logs, so we keep them in an open-addressed table
+ * (with linear probing, and backward-shift deletion so that there are no
+ * tombstones to wade through). The entries themselves come from slabs of
+ * SESSION_SLAB at a time, and go back on a free list when the session is
+ * closed, rather than each being a separate allocation.
+ */
+struct session_state {
+	/* The next free entry, while on the free list. */
+	struct session_state *ss_next;
+	uint64_t ss_sid;
+	uint64_t ss_start;
+	/* For --state, the ephemeral nodes the session owns. */
+	struct zknode *ss_ephemerals;
+};
 
-enum zklog_versions {
-	ZKLOG_VERSION_2 = 2
+struct session_table {
+	struct session_state **st_slots;
+	size_t st_size;
+	size_t st_n;
 };
 
-enum zktxn_type {
-	ZK_NOTIFICATION = 0,
-	ZK_CREATE = 1,
-	ZK_DELETE = 2,
-	ZK_EXISTS = 3,
-	ZK_GETDATA = 4,
-	ZK_SETDATA = 5,
-	ZK_GETACL = 6,
-	ZK_SETACL = 7,
-	ZK_GETCHILDREN = 8,
-	ZK_SYNC = 9,
-	ZK_CHECK = 13,
-	ZK_MULTI = 14,
-	ZK_CREATESESSION = -10,
-	ZK_CLOSESESSION = -11,
-	ZK_ERROR = -1
+#define	SESSION_SLAB	4096
+
+static struct session_state *session_free_list = NULL;
+struct session_table sessions;
+
+static struct session_state *
+session_alloc(void)
+{
+	struct session_state *sess;
+
+	if (session_free_list == NULL) {
+		sess = calloc(SESSION_SLAB, sizeof (struct session_state));
+		if (sess == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		for (size_t i = 0; i < SESSION_SLAB - 1; ++i)
+			sess[i].ss_next = &sess[i + 1];
+		session_free_list = sess;
+	}
+
+	sess = session_free_list;
+	session_free_list = sess->ss_next;
+	sess->ss_next = NULL;
+	sess->ss_ephemerals = NULL;
+	return (sess);
+}
+
+static void
+session_release(struct session_state *sess)
+{
+	sess->ss_next = session_free_list;
+	session_free_list = sess;
+}
+
+inline static size_t
+session_hash(const struct session_table *t, uint64_t sid)
+{
 	/*
-	 * Worth noting that this list is not complete: there are other types
-	 * of txns that can be in the logs which we will just ignore.
+	 * The top byte of a session id is the server id, and the rest is a
+	 * counter (started from the time), so mix them all up.
 	 */
-};
+	return ((sid * 0x9E3779B97F4A7C15ULL) >> 32 & (t->st_size - 1));
+}
 
-enum zkerr {
-	ERR_SYSTEM_ERROR = -1,
-	ERR_RUNTIME_INCONSIST = -2,
-	ERR_DATA_INCONSIST = -3,
-	ERR_CONNECTION_LOSS = -4,
-	ERR_UNIMPL = -6,
-	ERR_TIMEOUT = -7,
-	ERR_BAD_ARGS = -8,
-	ERR_NO_NODE = -101,
-	ERR_NODE_EXISTS = -110,
-	ERR_SESSION_EXPIRED = -112,
-	ERR_NOT_EMPTY = -111,
-	/* Once again, this is incomplete. */
-};
+static struct session_state *
+session_lookup(const struct session_table *t, uint64_t sid)
+{
+	size_t i;
 
-/*
- * The ID number of the server that a session was created on is encoded in the
- * top 8 bits of the session ID.
- */
-inline static uint8_t
-sid_to_srvid(uint64_t sid)
+	if (t->st_n == 0)
+		return (NULL);
+	for (i = session_hash(t, sid); t->st_slots[i] != NULL;
+	    i = (i + 1) & (t->st_size - 1)) {
+		if (t->st_slots[i]->ss_sid == sid)
+			return (t->st_slots[i]);
+	}
+	return (NULL);
+}
+
+/* Adds a session, which must not be in the table already. */
+static void
+session_insert(struct session_table *t, struct session_state *sess)
 {
-	return ((sid >> 56) & 0xFF);
+	size_t i;
+
+	if (2 * (t->st_n + 1) > t->st_size) {
+		struct session_table old = *t;
+
+		t->st_size = (old.st_size == 0) ? 1024 : old.st_size * 2;
+		t->st_slots = calloc(t->st_size,
+		    sizeof (struct session_state *));
+		if (t->st_slots == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		t->st_n = 0;
+		for (i = 0; i < old.st_size; ++i) {
+			if (old.st_slots[i] != NULL)
+				session_insert(t, old.st_slots[i]);
+		}
+		free(old.st_slots);
+	}
+
+	for (i = session_hash(t, sess->ss_sid); t->st_slots[i] != NULL;
+	    i = (i + 1) & (t->st_size - 1))
+		;
+	t->st_slots[i] = sess;
+	t->st_n++;
 }
 
-const char *
-zktxn_type_to_name(enum zktxn_type type)
+static void
+session_remove(struct session_table *t, struct session_state *sess)
 {
-	switch (type) {
-	case ZK_NOTIFICATION:
-		return ("NOTIFICATION");
-	case ZK_CREATE:
-		return ("CREATE");
-	case ZK_DELETE:
-		return ("DELETE");
-	case ZK_CHECK:
-		return ("CHECK");
-	case ZK_EXISTS:
-		return ("EXISTS");
-	case ZK_GETDATA:
-		return ("GETDATA");
-	case ZK_SETDATA:
-		return ("SETDATA");
-	case ZK_GETACL:
-		return ("GETACL");
-	case ZK_SETACL:
-		return ("SETACL");
-	case ZK_GETCHILDREN:
-		return ("GETCHILDREN");
-	case ZK_SYNC:
-		return ("SYNC");
-	case ZK_CREATESESSION:
-		return ("CREATESESSION");
-	case ZK_CLOSESESSION:
-		return ("CLOSESESSION");
-	case ZK_MULTI:
-		return ("MULTI");
-	case ZK_ERROR:
-		return ("ERROR");
-	default:
-		return ("???");
-	}
-}
-
-const char *
-zkerr_to_name(enum zkerr err)
-{
-	switch (err) {
-	case ERR_SYSTEM_ERROR:
-		return ("SYSTEM_ERROR");
-	case ERR_RUNTIME_INCONSIST:
-		return ("RUNTIME_INCONSIST");
-	case ERR_DATA_INCONSIST:
-		return ("DATA_INCONSIST");
-	case ERR_CONNECTION_LOSS:
-		return ("CONNECTION_LOSS");
-	case ERR_UNIMPL:
-		return ("UNIMPL");
-	case ERR_TIMEOUT:
-		return ("TIMEOUT");
-	case ERR_BAD_ARGS:
-		return ("BAD_ARGS");
-	case ERR_NO_NODE:
-		return ("NO_NODE");
-	case ERR_NODE_EXISTS:
-		return ("NODE_EXISTS");
-	case ERR_SESSION_EXPIRED:
-		return ("SESSION_EXPIRED");
-	case ERR_NOT_EMPTY:
-		return ("NOT_EMPTY");
-	default:
-		return ("???");
+	size_t mask = t->st_size - 1;
+	size_t i, j, home;
+
+	for (i = session_hash(t, sess->ss_sid); t->st_slots[i] != sess;
+	    i = (i + 1) & mask)
+		;
+	t->st_slots[i] = NULL;
+	t->st_n--;
+
+	/*
+	 * Move back any entries after it in the run that would no longer be
+	 * found, i.e. whose home slot isn't cyclically in (i, j].
+	 */
+	for (j = (i + 1) & mask; t->st_slots[j] != NULL; j = (j + 1) & mask) {
+		home = session_hash(t, t->st_slots[j]->ss_sid);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			t->st_slots[i] = t->st_slots[j];
+			t->st_slots[j] = NULL;
+			i = j;
+		}
 	}
 }
 
-struct zktxn_err {
-	uint32_t ze_err;
-} __attribute__((packed));
+/* The -t, --since and --until options, in ms since the epoch. */
+static uint64_t zklog_since = 0;
+static uint64_t zklog_until = UINT64_MAX;
+static uint64_t zklog_zxid_from = 0;
+static uint64_t zklog_zxid_to = UINT64_MAX;
+/* Whether any of the options that use the index were given. */
+static int zklog_ranged = 0;
+/* --index-dir, where the indexes are kept (if anywhere). */
+static const char *zklog_index_dir = NULL;
+static uint64_t zklog_sid = 0;
+static uint8_t zklog_srvid = 0;
+static int zklog_dumpdata = 0;
+/* --merge, and the gaps it found (see "Merging" below). */
+static int zklog_merge = 0;
+static uint64_t zklog_gaps = 0;
+static uint64_t zklog_missing = 0;
 
-struct zktxn_createsess {
-	uint32_t zcs_timeout;
-} __attribute__((packed));
+/* Upper bound on -j, to keep a typo from creating a million threads. */
+#define	ZKLOG_MAX_THREADS	1024
 
-struct zktxn_multitxn {
-	uint32_t zmt_type;
-	uint32_t zmt_len;
-	union {
-		struct zktxn_err zti_err;
-		struct zktxn_createsess zti_createsess;
-	} zmt_inner;
-} __attribute__((packed));
+/* How much output a streaming decode accumulates before emitting it. */
+#define	ZKLOG_STREAM_FLUSH	(64 * 1024)
 
-struct zktxn_multi {
-	uint32_t zm_ntxns;
-	struct zktxn_multitxn zm_txns[];
-} __attribute__((packed));
+/*
+ * A growable buffer of formatted output text.
+ */
+struct zkbuf {
+	char *zb_data;
+	size_t zb_len;
+	size_t zb_size;
+};
 
-struct zk_string {
-	uint32_t zs_len;
-	char zs_str[];
-} __attribute__((packed));
+/*
+ * Formatting a timestamp means a gmtime_r() call, but consecutive txns are
+ * very often in the same second. So we keep the formatted date and time
+ * (up to the seconds) for the last second we saw, and only fill in the
+ * milliseconds for each txn.
+ */
+struct zktimecache {
+	int ztc_valid;
+	time_t ztc_sec;
+	size_t ztc_len;
+	char ztc_prefix[48];
+};
 
-struct zktxn {
-	uint64_t zt_checksum;
-	uint32_t zt_len;
-	uint64_t zt_sessionid;
-	uint32_t zt_cxid;
-	uint64_t zt_zxid;
-	uint64_t zt_time;
-	uint32_t zt_type;
-	union {
-		struct zktxn_err zti_err;
-		struct zktxn_createsess zti_createsess;
-		struct zktxn_multi zti_multi;
-	} zt_inner;
-} __attribute__((packed));
 /*
- * Minimum length is the size of all the fields after zt_len but before
- * zt_inner. This is also the size you have to subtract from zt_len to get
- * the *actual* size of zt_inner for a specific zktxn.
+ * Each txn we decode produces one "zkrec", which points at the JSON text
+ * formatted for it (if it passed the filters) in the buffer of the job that
+ * decoded it. We keep just enough information about the txn itself to do
+ * session tracking and merging after the fact.
  */
-#define	ZKTXN_MIN_LEN	\
-    (offsetof(struct zktxn, zt_inner) - offsetof(struct zktxn, zt_len) - \
-    sizeof (uint32_t))
+struct zkrec {
+	uint64_t zr_zxid;
+	uint64_t zr_sid;
+	uint64_t zr_time;
+	int32_t zr_type;
+	uint32_t zr_cxid;
+	uint32_t zr_output;
+	/* Offset and length of this record's text in zj_out. */
+	size_t zr_off;
+	size_t zr_len;
+	/*
+	 * Offset within the text where the "duration" of a CLOSESESSION goes,
+	 * since we can't know it until all the txns before this one have been
+	 * through session tracking.
+	 */
+	size_t zr_split;
+};
 
-struct zklog {
-	uint32_t zl_magic;
-	uint32_t zl_version;
-	uint64_t zl_dbid;
-	struct zktxn zl_txns[];
-} __attribute__((packed));
+/* How a txnlog file is compressed, if it is (see decode_stream()). */
+enum zkcomp {
+	ZKCOMP_NONE = 0,
+	ZKCOMP_GZIP,
+	ZKCOMP_ZSTD
+};
 
-/* End of things from the ZooKeeper source. */
+/*
+ * A txnlog file, mapped into memory while any of its txns are being decoded
+ * (unless it's compressed, in which case zf_data is NULL).
+ */
+struct zkfile {
+	const char *zf_name;
+	size_t zf_index;
+	uint64_t zf_first_zxid;
+	int zf_fd;
+	enum zkcomp zf_comp;
+	uint8_t *zf_data;
+	size_t zf_len;
+	/* Number of jobs still decoding from the mapping (see -j). */
+	size_t zf_refs;
+};
 
-struct session_state {
-	struct session_state *ss_next;
-	struct session_state *ss_prev;
-	uint64_t ss_sid;
-	uint64_t ss_start;
+/*
+ * A "zkjob" is the unit of decoding work: a range of txns within a txnlog
+ * file, decoded into a list of records and their text. Jobs can be decoded on
+ * worker threads (see -j), with all session tracking and output done
+ * afterwards on the main thread by emit_rec().
+ */
+struct zkjob {
+	struct zkfile *zj_file;
+	uint64_t zj_first_zxid;
+	/*
+	 * Byte range of the txns in the file covered by this job. A job with
+	 * zj_end of 0 covers the whole file, which has not been opened yet.
+	 */
+	size_t zj_start;
+	size_t zj_end;
+
+	struct zkbuf zj_out;
+	struct zktimecache zj_timecache;
+	struct zkrec *zj_recs;
+	size_t zj_nrecs;
+	size_t zj_recsize;
+	/* Whether -e matched only some children of the txn being decoded. */
+	int zj_filtkids;
+	/* Where a compressed log's decoding is to carry on from. */
+	struct zkstream *zj_stream;
+
+	/* Cursor used by the merge, and state shared with the workers. */
+	size_t zj_next;
+	struct zkjob *zj_link;
+	int zj_claimed;
+	int zj_done;
+
+	/* If decoding failed, this is how we exit once we get this far. */
+	int zj_errcode;
+	char zj_errmsg[PATH_MAX + 128];
 };
 
-inline static unsigned int
-sid_to_hash_bucket(uint64_t sid)
+/*
+ * Records a decoding failure in the job, to be reported once all the output
+ * preceding it has been written. Always returns -1, so decoding functions can
+ * "return (zkjob_fail(...))".
+ */
+static int
+zkjob_fail(struct zkjob *job, int code, const char *fmt, ...)
 {
-	return (sid & 0xFF);
+	va_list ap;
+
+	job->zj_errcode = code;
+	va_start(ap, fmt);
+	(void) vsnprintf(job->zj_errmsg, sizeof (job->zj_errmsg), fmt, ap);
+	va_end(ap);
+
+	return (-1);
 }
-#define	SID_HASH_BUCKETS	256
-struct session_state *sessions[SID_HASH_BUCKETS];
 
-static time_t zklog_mintime = 0;
-static uint64_t zklog_sid = 0;
-static uint8_t zklog_srvid = 0;
-static int zklog_dumpdata = 0;
+/*
+ * Like zkjob_fail(), but appends the description of errno the way err(3)
+ * would.
+ */
+static int
+zkjob_fail_errno(struct zkjob *job, const char *fmt, ...)
+{
+	int e = errno;
+	va_list ap;
+	size_t len;
+
+	job->zj_errcode = ZKLOG_EXIT_ERROR;
+	va_start(ap, fmt);
+	(void) vsnprintf(job->zj_errmsg, sizeof (job->zj_errmsg), fmt, ap);
+	va_end(ap);
+	len = strlen(job->zj_errmsg);
+	(void) snprintf(job->zj_errmsg + len, sizeof (job->zj_errmsg) - len,
+	    ": %s", strerror(e));
+
+	return (-1);
+}
 
 /*
  * Increments an offset by a given amount, checking for overflow.
  * The offset must be a size_t for this to work (and the amt any type <=
- * a size_t).
+ * a size_t). On overflow the enclosing function fails the job.
  */
-#define	OFFSET_ADD(offs, amt)	do { \
+#define	OFFSET_ADD(job, offs, amt)	do { \
 	size_t _new_offset = (offs) + (amt); \
 	if (_new_offset < (offs) || _new_offset < (amt)) { \
-		errx(ZKLOG_EXIT_BAD_FORMAT, "bad length caused overflow"); \
+		return (zkjob_fail((job), ZKLOG_EXIT_BAD_FORMAT, \
+		    "bad length caused overflow")); \
 	} \
 	(offs) = _new_offset; \
     } while (0);
 
 static void
-print_inner(struct zktxn *txn, const char *timebuf, enum zktxn_type type,
-    void *inner, size_t len)
+zkbuf_reserve(struct zkbuf *buf, size_t len)
+{
+	size_t nsize;
+	char *ndata;
+
+	if (buf->zb_size - buf->zb_len >= len)
+		return;
+
+	nsize = buf->zb_size == 0 ? 65536 : buf->zb_size;
+	while (nsize - buf->zb_len < len)
+		nsize *= 2;
+
+	ndata = realloc(buf->zb_data, nsize);
+	if (ndata == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	buf->zb_data = ndata;
+	buf->zb_size = nsize;
+}
+
+/*
+ * The output engine. All the per-record formatting below appends straight
+ * into a zkbuf without going through printf(3C): on logs with lots of node
+ * data, formatting used to dominate the run time.
+ */
+static inline void
+zkbuf_append(struct zkbuf *buf, const void *data, size_t len)
+{
+	zkbuf_reserve(buf, len);
+	bcopy(data, buf->zb_data + buf->zb_len, len);
+	buf->zb_len += len;
+}
+
+/* Appends a string literal. */
+#define	ZKBUF_LIT(buf, lit)	zkbuf_append((buf), (lit), sizeof (lit) - 1)
+
+static inline void
+zkbuf_str(struct zkbuf *buf, const char *str)
+{
+	zkbuf_append(buf, str, strlen(str));
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/*
+ * Each byte value's two hex digits, for hex-encoding node data a byte at a
+ * time rather than a nibble at a time. Filled in by hextab_init().
+ */
+static uint16_t hextab[256];
+
+static void
+hextab_init(void)
+{
+	for (unsigned int i = 0; i < 256; ++i) {
+		char pair[2] = { hexdigits[i >> 4], hexdigits[i & 0xF] };
+		bcopy(pair, &hextab[i], sizeof (pair));
+	}
+}
+
+static void
+zkbuf_hexdata(struct zkbuf *buf, const uint8_t *data, size_t len)
+{
+	char *p;
+
+	zkbuf_reserve(buf, 2 * len);
+	p = buf->zb_data + buf->zb_len;
+	for (size_t i = 0; i < len; ++i)
+		bcopy(&hextab[data[i]], p + 2 * i, 2);
+	buf->zb_len += 2 * len;
+}
+
+/* Like "%" PRIx64. */
+static void
+zkbuf_hex(struct zkbuf *buf, uint64_t v)
+{
+	char tmp[16];
+	size_t i = sizeof (tmp);
+
+	do {
+		tmp[--i] = hexdigits[v & 0xF];
+		v >>= 4;
+	} while (v != 0);
+	zkbuf_append(buf, tmp + i, sizeof (tmp) - i);
+}
+
+/* Like "%" PRIu64. */
+static void
+zkbuf_uint(struct zkbuf *buf, uint64_t v)
+{
+	char tmp[20];
+	size_t i = sizeof (tmp);
+
+	do {
+		tmp[--i] = '0' + (v % 10);
+		v /= 10;
+	} while (v != 0);
+	zkbuf_append(buf, tmp + i, sizeof (tmp) - i);
+}
+
+/* Like "%d" (or "%" PRId64). */
+static void
+zkbuf_int(struct zkbuf *buf, int64_t v)
+{
+	if (v < 0) {
+		ZKBUF_LIT(buf, "-");
+		zkbuf_uint(buf, -(uint64_t)v);
+	} else {
+		zkbuf_uint(buf, (uint64_t)v);
+	}
+}
+
+/*
+ * Formats a ZK timestamp (in ms) into "timebuf" as an ISO 8601 string,
+ * returning its length or -1 if the time couldn't be converted.
+ */
+static ssize_t
+format_time(struct zktimecache *tc, uint64_t ms, char *timebuf)
+{
+	time_t t = ms / 1000;
+	unsigned int tms = ms % 1000;
+	struct tm tm;
+	int len;
+
+	if (!tc->ztc_valid || tc->ztc_sec != t) {
+		if (gmtime_r(&t, &tm) == NULL)
+			return (-1);
+		len = snprintf(tc->ztc_prefix, sizeof (tc->ztc_prefix),
+		    "%04d-%02d-%02dT%02d:%02d:%02d.",
+		    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		    tm.tm_hour, tm.tm_min, tm.tm_sec);
+		if (len < 0 || (size_t)len >= sizeof (tc->ztc_prefix))
+			return (-1);
+		tc->ztc_len = len;
+		tc->ztc_sec = t;
+		tc->ztc_valid = 1;
+	}
+
+	bcopy(tc->ztc_prefix, timebuf, tc->ztc_len);
+	timebuf[tc->ztc_len] = '0' + tms / 100;
+	timebuf[tc->ztc_len + 1] = '0' + (tms / 10) % 10;
+	timebuf[tc->ztc_len + 2] = '0' + tms % 10;
+	timebuf[tc->ztc_len + 3] = 'Z';
+
+	return (tc->ztc_len + 4);
+}
+
+/*
+ * Our standard output, which is written with write(2) whenever more than
+ * ZKLOG_OUT_FLUSH bytes have built up. Only the main thread writes here.
+ */
+static struct zkbuf zklog_out;
+#define	ZKLOG_OUT_FLUSH		(256 * 1024)
+
+static void
+zkout_flush(void)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < zklog_out.zb_len) {
+		n = write(STDOUT_FILENO, zklog_out.zb_data + off,
+		    zklog_out.zb_len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err(ZKLOG_EXIT_ERROR, "error writing output");
+		}
+		off += n;
+	}
+	zklog_out.zb_len = 0;
+}
+
+static inline void
+zkout_check(void)
+{
+	if (zklog_out.zb_len >= ZKLOG_OUT_FLUSH)
+		zkout_flush();
+}
+
+static void
+zkbuf_free(struct zkbuf *buf)
+{
+	free(buf->zb_data);
+	bzero(buf, sizeof (*buf));
+}
+
+static struct zkrec *
+zkjob_add_rec(struct zkjob *job)
+{
+	struct zkrec *rec;
+
+	if (job->zj_nrecs == job->zj_recsize) {
+		size_t nsize = job->zj_recsize == 0 ? 1024 :
+		    job->zj_recsize * 2;
+		rec = realloc(job->zj_recs, nsize * sizeof (struct zkrec));
+		if (rec == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		job->zj_recs = rec;
+		job->zj_recsize = nsize;
+	}
+
+	rec = &job->zj_recs[job->zj_nrecs++];
+	bzero(rec, sizeof (*rec));
+	return (rec);
+}
+
+static void
+zkjob_reset(struct zkjob *job)
+{
+	job->zj_out.zb_len = 0;
+	job->zj_nrecs = 0;
+	job->zj_next = 0;
+}
+
+static void
+zkjob_free(struct zkjob *job)
+{
+	zkbuf_free(&job->zj_out);
+	free(job->zj_recs);
+	job->zj_recs = NULL;
+	job->zj_nrecs = job->zj_recsize = job->zj_next = 0;
+}
+
+/*
+ * Prints the fields common to all txns (and the children of a MULTI).
+ */
+static void
+print_header(struct zkbuf *out, const char *timebuf, size_t timelen,
+    int32_t type, const struct zktxnhdr *hdr)
+{
+	ZKBUF_LIT(out, "{\"time\":\"");
+	zkbuf_append(out, timebuf, timelen);
+	ZKBUF_LIT(out, "\",\"type\":\"");
+	zkbuf_str(out, zktxn_type_to_name((enum zktxn_type)type));
+	ZKBUF_LIT(out, "\",\"typeid\":");
+	zkbuf_int(out, type);
+	ZKBUF_LIT(out, ",\"sessionid\":\"");
+	zkbuf_hex(out, hdr->zth_sessionid);
+	ZKBUF_LIT(out, "\",\"cxid\":\"");
+	zkbuf_hex(out, hdr->zth_cxid);
+	ZKBUF_LIT(out, "\",\"zxid\":\"");
+	zkbuf_hex(out, hdr->zth_zxid);
+	ZKBUF_LIT(out, "\"");
+}
+
+/*
+ * Filter expressions (-e).
+ *
+ * These are compiled once into a tree of predicates, which we evaluate on the
+ * fields of each txn as they are in the log, before formatting anything. For
+ * example:
+ *
+ *	type in (CREATE,DELETE) and path ^= /com/joyent/us-east/moray
+ *	not srvid = 3 and (data ~ "10.0.0.5" or err = NO_NODE)
+ *
+ * A predicate is a field, an operator and a value, or a list of values in
+ * parentheses, any of which can match. Paths are matched against all their
+ * values at once through a trie. The children of a MULTI are each matched
+ * separately, and the MULTI is output (with only the children that match) if
+ * it or any of them match.
+ */
+enum zkfilt_op {
+	ZKF_AND,
+	ZKF_OR,
+	ZKF_NOT,
+	ZKF_TYPE,		/* type = / in */
+	ZKF_ERR,		/* err = / in */
+	ZKF_SID,		/* sid = / in */
+	ZKF_SRVID,		/* srvid = / in */
+	ZKF_ZXID,		/* zxid =, <, <=, >, >= */
+	ZKF_PATH,		/* path = / in, ^= (trie) */
+	ZKF_PATH_SUB,		/* path ~ */
+	ZKF_DATA_SUB		/* data ~ */
+};
+
+enum zkfilt_cmp {
+	ZKC_EQ,
+	ZKC_LT,
+	ZKC_LE,
+	ZKC_GT,
+	ZKC_GE
+};
+
+/*
+ * A byte-wise trie of paths. A node is terminal if a path (for "=") or prefix
+ * (for "^=") ends there.
+ */
+struct zktrie {
+	int ztn_term;
+	size_t ztn_nkids;
+	uint8_t *ztn_keys;
+	struct zktrie **ztn_kids;
+};
+
+struct zkfilt {
+	enum zkfilt_op zfl_op;
+	struct zkfilt *zfl_left;
+	struct zkfilt *zfl_right;
+
+	/* Values to compare with (any of which can match). */
+	size_t zfl_nvals;
+	int64_t *zfl_ints;
+	char **zfl_strs;
+	size_t *zfl_lens;
+	enum zkfilt_cmp zfl_cmp;
+
+	/* For ZKF_PATH: the trie, and whether it holds prefixes. */
+	struct zktrie *zfl_trie;
+	int zfl_prefix;
+};
+
+
+static struct zkfilt *zklog_filter = NULL;
+
+static void
+zktrie_add(struct zktrie *t, const char *str, size_t len)
+{
+	struct zktrie *kid;
+	size_t i;
+
+	for (; len > 0; ++str, --len) {
+		for (i = 0; i < t->ztn_nkids; ++i) {
+			if (t->ztn_keys[i] == (uint8_t)*str)
+				break;
+		}
+		if (i == t->ztn_nkids) {
+			t->ztn_keys = realloc(t->ztn_keys, i + 1);
+			t->ztn_kids = realloc(t->ztn_kids,
+			    (i + 1) * sizeof (struct zktrie *));
+			kid = calloc(1, sizeof (struct zktrie));
+			if (t->ztn_keys == NULL || t->ztn_kids == NULL ||
+			    kid == NULL) {
+				err(ZKLOG_EXIT_ERROR,
+				    "failed to allocate memory");
+			}
+			t->ztn_keys[i] = (uint8_t)*str;
+			t->ztn_kids[i] = kid;
+			t->ztn_nkids++;
+		}
+		t = t->ztn_kids[i];
+	}
+	t->ztn_term = 1;
+}
+
+static int
+zktrie_match(const struct zktrie *t, const char *str, size_t len, int prefix)
+{
+	size_t i;
+
+	for (; len > 0; ++str, --len) {
+		if (prefix && t->ztn_term)
+			return (1);
+		for (i = 0; i < t->ztn_nkids; ++i) {
+			if (t->ztn_keys[i] == (uint8_t)*str)
+				break;
+		}
+		if (i == t->ztn_nkids)
+			return (0);
+		t = t->ztn_kids[i];
+	}
+	return (t->ztn_term);
+}
+
+static int
+bytes_contain(const uint8_t *hay, size_t haylen, const char *needle,
+    size_t len)
+{
+	if (len == 0)
+		return (1);
+	for (size_t i = 0; i + len <= haylen; ++i) {
+		if (hay[i] == (uint8_t)needle[0] &&
+		    bcmp(hay + i, needle, len) == 0) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+static int
+filt_ints(const struct zkfilt *fl, int64_t v)
+{
+	for (size_t i = 0; i < fl->zfl_nvals; ++i) {
+		if (fl->zfl_ints[i] == v)
+			return (1);
+	}
+	return (0);
+}
+
+static int
+filt_match(const struct zkfilt *fl, const struct zkl_txn *t)
+{
+	size_t i;
+
+	switch (fl->zfl_op) {
+	case ZKF_AND:
+		return (filt_match(fl->zfl_left, t) &&
+		    filt_match(fl->zfl_right, t));
+	case ZKF_OR:
+		return (filt_match(fl->zfl_left, t) ||
+		    filt_match(fl->zfl_right, t));
+	case ZKF_NOT:
+		return (!filt_match(fl->zfl_left, t));
+	case ZKF_TYPE:
+		return (filt_ints(fl, t->zkt_type));
+	case ZKF_ERR:
+		return (t->zkt_type == ZK_ERROR && filt_ints(fl, t->zkt_err));
+	case ZKF_SID:
+		return (filt_ints(fl, (int64_t)t->zkt_hdr.zth_sessionid));
+	case ZKF_SRVID:
+		return (filt_ints(fl, sid_to_srvid(t->zkt_hdr.zth_sessionid)));
+	case ZKF_ZXID: {
+		uint64_t v = (uint64_t)fl->zfl_ints[0];
+
+		switch (fl->zfl_cmp) {
+		case ZKC_LT:
+			return (t->zkt_hdr.zth_zxid < v);
+		case ZKC_LE:
+			return (t->zkt_hdr.zth_zxid <= v);
+		case ZKC_GT:
+			return (t->zkt_hdr.zth_zxid > v);
+		case ZKC_GE:
+			return (t->zkt_hdr.zth_zxid >= v);
+		default:
+			return (filt_ints(fl, (int64_t)t->zkt_hdr.zth_zxid));
+		}
+	}
+	case ZKF_PATH:
+		return (t->zkt_pathlen >= 0 && zktrie_match(fl->zfl_trie,
+		    t->zkt_path, t->zkt_pathlen, fl->zfl_prefix));
+	case ZKF_PATH_SUB:
+		if (t->zkt_pathlen < 0)
+			return (0);
+		for (i = 0; i < fl->zfl_nvals; ++i) {
+			if (bytes_contain((const uint8_t *)t->zkt_path,
+			    t->zkt_pathlen, fl->zfl_strs[i], fl->zfl_lens[i]))
+				return (1);
+		}
+		return (0);
+	case ZKF_DATA_SUB:
+		if (t->zkt_data == NULL)
+			return (0);
+		for (i = 0; i < fl->zfl_nvals; ++i) {
+			if (bytes_contain(t->zkt_data, t->zkt_datalen,
+			    fl->zfl_strs[i], fl->zfl_lens[i]))
+				return (1);
+		}
+		return (0);
+	}
+	return (0);
+}
+
+/* What filt_txn() decided. */
+enum zkfilt_result {
+	ZKFR_NONE = 0,		/* leave the txn out */
+	ZKFR_TXN,		/* the txn matched: output all of it */
+	ZKFR_CHILDREN		/* only children of a MULTI matched */
+};
+
+/*
+ * Decides whether to output a txn. A MULTI is output if either it or any of
+ * its children match. If it matched itself, all of its children go with it;
+ * if only children did, print_inner() leaves out the ones that don't.
+ */
+static enum zkfilt_result
+filt_txn(const struct zkl_txn *t)
+{
+	struct zkl_multi m;
+	struct zkl_txn c;
+	int rv;
+
+	if (filt_match(zklog_filter, t))
+		return (ZKFR_TXN);
+	if (t->zkt_type != ZK_MULTI)
+		return (ZKFR_NONE);
+
+	/* Children with bad bodies are matched on what they do have. */
+	zkl_multi_init(&m, t);
+	while ((rv = zkl_multi_next(&m, &c)) != 0 && rv != ZKL_ECHILD &&
+	    rv != ZKL_ECHILDLEN) {
+		if (filt_match(zklog_filter, &c))
+			return (ZKFR_CHILDREN);
+	}
+	return (ZKFR_NONE);
+}
+
+/* The parser, a simple recursive-descent one over a list of tokens. */
+struct zkparse {
+	const char *zps_expr;
+	const char *zps_pos;
+	/* The current token. */
+	const char *zps_tok;
+	size_t zps_toklen;
+	int zps_quoted;
+};
+
+static void __attribute__((noreturn))
+filt_error(struct zkparse *p, const char *msg)
+{
+	errx(ZKLOG_EXIT_USAGE, "invalid filter expression: %s at offset %d "
+	    "of '%s'", msg, (int)(p->zps_tok - p->zps_expr), p->zps_expr);
+}
+
+static void
+filt_next(struct zkparse *p)
+{
+	const char *s = p->zps_pos;
+	const char *end;
+
+	while (*s == ' ' || *s == '\t' || *s == '\n')
+		s++;
+	p->zps_tok = s;
+	p->zps_quoted = 0;
+
+	if (*s == '\0') {
+		p->zps_toklen = 0;
+	} else if (*s == '"') {
+		if ((end = strchr(s + 1, '"')) == NULL)
+			filt_error(p, "unterminated string");
+		p->zps_tok = s + 1;
+		p->zps_toklen = end - s - 1;
+		p->zps_quoted = 1;
+		s = end + 1;
+		p->zps_pos = s;
+		return;
+	} else if (strchr("(),~", *s) != NULL) {
+		p->zps_toklen = 1;
+	} else if (strchr("!^<>=", *s) != NULL) {
+		p->zps_toklen = (s[1] == '=') ? 2 : 1;
+	} else {
+		p->zps_toklen = strcspn(s, " \t\n(),~!^<>=\"");
+	}
+	p->zps_pos = s + p->zps_toklen;
+}
+
+static int
+filt_is(const struct zkparse *p, const char *tok)
+{
+	return (!p->zps_quoted && p->zps_toklen == strlen(tok) &&
+	    strncmp(p->zps_tok, tok, p->zps_toklen) == 0);
+}
+
+static const int32_t zktxn_types[] = {
+	ZK_NOTIFICATION, ZK_CREATE, ZK_DELETE, ZK_EXISTS, ZK_GETDATA,
+	ZK_SETDATA, ZK_GETACL, ZK_SETACL, ZK_GETCHILDREN, ZK_SYNC, ZK_CHECK,
+	ZK_MULTI, ZK_CREATESESSION, ZK_CLOSESESSION, ZK_ERROR
+};
+
+static const int32_t zkerrs[] = {
+	ERR_SYSTEM_ERROR, ERR_RUNTIME_INCONSIST, ERR_DATA_INCONSIST,
+	ERR_CONNECTION_LOSS, ERR_UNIMPL, ERR_TIMEOUT, ERR_BAD_ARGS,
+	ERR_NO_NODE, ERR_NODE_EXISTS, ERR_SESSION_EXPIRED, ERR_NOT_EMPTY
+};
+
+/* Parses the current token as a value for a field. */
+static void
+filt_value(struct zkparse *p, struct zkfilt *fl)
+{
+	size_t n = fl->zfl_nvals;
+	char *str, *end;
+	int64_t v = 0;
+	size_t i;
+
+	if (p->zps_toklen == 0 && !p->zps_quoted)
+		filt_error(p, "expected a value");
+	if ((str = strndup(p->zps_tok, p->zps_toklen)) == NULL ||
+	    (fl->zfl_ints = realloc(fl->zfl_ints,
+	    (n + 1) * sizeof (int64_t))) == NULL ||
+	    (fl->zfl_strs = realloc(fl->zfl_strs,
+	    (n + 1) * sizeof (char *))) == NULL ||
+	    (fl->zfl_lens = realloc(fl->zfl_lens,
+	    (n + 1) * sizeof (size_t))) == NULL) {
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+
+	errno = 0;
+	switch (fl->zfl_op) {
+	case ZKF_TYPE:
+		for (i = 0; i < sizeof (zktxn_types) / sizeof (int32_t); ++i) {
+			if (strcmp(str, zktxn_type_to_name(
+			    (enum zktxn_type)zktxn_types[i])) == 0) {
+				break;
+			}
+		}
+		if (i < sizeof (zktxn_types) / sizeof (int32_t)) {
+			v = zktxn_types[i];
+		} else {
+			v = strtoll(str, &end, 10);
+			if (errno != 0 || *end != '\0' || *str == '\0')
+				filt_error(p, "unknown txn type");
+		}
+		break;
+	case ZKF_ERR:
+		for (i = 0; i < sizeof (zkerrs) / sizeof (int32_t); ++i) {
+			if (strcmp(str, zkerr_to_name(
+			    (enum zkerr)zkerrs[i])) == 0) {
+				break;
+			}
+		}
+		if (i < sizeof (zkerrs) / sizeof (int32_t)) {
+			v = zkerrs[i];
+		} else {
+			v = strtoll(str, &end, 10);
+			if (errno != 0 || *end != '\0' || *str == '\0')
+				filt_error(p, "unknown error");
+		}
+		break;
+	case ZKF_SID:
+	case ZKF_ZXID:
+		/* In hex, as we print them (and as -s takes them). */
+		v = (int64_t)strtoull(str, &end, 16);
+		if (errno != 0 || *end != '\0' || *str == '\0')
+			filt_error(p, "invalid id");
+		break;
+	case ZKF_SRVID:
+		v = (int64_t)strtoull(str, &end, 0);
+		if (errno != 0 || *end != '\0' || *str == '\0' || v > 0xFF)
+			filt_error(p, "invalid server id");
+		break;
+	case ZKF_PATH:
+		zktrie_add(fl->zfl_trie, str, p->zps_toklen);
+		break;
+	default:
+		break;
+	}
+
+	fl->zfl_ints[n] = v;
+	fl->zfl_strs[n] = str;
+	fl->zfl_lens[n] = p->zps_toklen;
+	fl->zfl_nvals++;
+	filt_next(p);
+}
+
+static struct zkfilt *filt_or(struct zkparse *);
+
+static struct zkfilt *
+filt_alloc(enum zkfilt_op op, struct zkfilt *left, struct zkfilt *right)
+{
+	struct zkfilt *fl;
+
+	if ((fl = calloc(1, sizeof (*fl))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	fl->zfl_op = op;
+	fl->zfl_left = left;
+	fl->zfl_right = right;
+	return (fl);
+}
+
+/* field op value | field op (value, ...) | ( expr ) | not primary */
+static struct zkfilt *
+filt_primary(struct zkparse *p)
+{
+	struct zkfilt *fl;
+	enum zkfilt_op op;
+	int neg = 0, list = 0;
+
+	if (filt_is(p, "not")) {
+		filt_next(p);
+		return (filt_alloc(ZKF_NOT, filt_primary(p), NULL));
+	}
+	if (filt_is(p, "(")) {
+		filt_next(p);
+		fl = filt_or(p);
+		if (!filt_is(p, ")"))
+			filt_error(p, "expected ')'");
+		filt_next(p);
+		return (fl);
+	}
+
+	if (filt_is(p, "type"))
+		op = ZKF_TYPE;
+	else if (filt_is(p, "err"))
+		op = ZKF_ERR;
+	else if (filt_is(p, "sid"))
+		op = ZKF_SID;
+	else if (filt_is(p, "srvid"))
+		op = ZKF_SRVID;
+	else if (filt_is(p, "zxid"))
+		op = ZKF_ZXID;
+	else if (filt_is(p, "path"))
+		op = ZKF_PATH;
+	else if (filt_is(p, "data"))
+		op = ZKF_DATA_SUB;
+	else
+		filt_error(p, "expected a field name");
+	fl = filt_alloc(op, NULL, NULL);
+	filt_next(p);
+
+	if (filt_is(p, "=") || filt_is(p, "in")) {
+		list = filt_is(p, "in");
+		if (op == ZKF_DATA_SUB)
+			filt_error(p, "data can only be matched with '~'");
+	} else if (filt_is(p, "!=")) {
+		neg = 1;
+		if (op == ZKF_DATA_SUB)
+			filt_error(p, "data can only be matched with '~'");
+	} else if (filt_is(p, "^=") && op == ZKF_PATH) {
+		fl->zfl_prefix = 1;
+	} else if (filt_is(p, "~") && (op == ZKF_PATH ||
+	    op == ZKF_DATA_SUB)) {
+		if (op == ZKF_PATH)
+			fl->zfl_op = op = ZKF_PATH_SUB;
+	} else if (op == ZKF_ZXID && filt_is(p, "<")) {
+		fl->zfl_cmp = ZKC_LT;
+	} else if (op == ZKF_ZXID && filt_is(p, "<=")) {
+		fl->zfl_cmp = ZKC_LE;
+	} else if (op == ZKF_ZXID && filt_is(p, ">")) {
+		fl->zfl_cmp = ZKC_GT;
+	} else if (op == ZKF_ZXID && filt_is(p, ">=")) {
+		fl->zfl_cmp = ZKC_GE;
+	} else {
+		filt_error(p, "unexpected operator for this field");
+	}
+	filt_next(p);
+
+	if (op == ZKF_PATH &&
+	    (fl->zfl_trie = calloc(1, sizeof (struct zktrie))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+
+	if (filt_is(p, "(") && fl->zfl_cmp == ZKC_EQ) {
+		filt_next(p);
+		for (;;) {
+			filt_value(p, fl);
+			if (filt_is(p, ")"))
+				break;
+			if (!filt_is(p, ","))
+				filt_error(p, "expected ',' or ')'");
+			filt_next(p);
+		}
+		filt_next(p);
+	} else if (list) {
+		filt_error(p, "expected '(' after 'in'");
+	} else {
+		filt_value(p, fl);
+	}
+
+	return (neg ? filt_alloc(ZKF_NOT, fl, NULL) : fl);
+}
+
+static struct zkfilt *
+filt_and(struct zkparse *p)
+{
+	struct zkfilt *fl = filt_primary(p);
+
+	while (filt_is(p, "and")) {
+		filt_next(p);
+		fl = filt_alloc(ZKF_AND, fl, filt_primary(p));
+	}
+	return (fl);
+}
+
+static struct zkfilt *
+filt_or(struct zkparse *p)
+{
+	struct zkfilt *fl = filt_and(p), *right;
+
+	while (filt_is(p, "or")) {
+		filt_next(p);
+		right = filt_and(p);
+
+		/*
+		 * Alternative paths go into the same trie, so that any number
+		 * of them only takes one walk down the path to check.
+		 */
+		if (fl->zfl_op == ZKF_PATH && right->zfl_op == ZKF_PATH &&
+		    fl->zfl_prefix == right->zfl_prefix) {
+			for (size_t i = 0; i < right->zfl_nvals; ++i) {
+				zktrie_add(fl->zfl_trie, right->zfl_strs[i],
+				    right->zfl_lens[i]);
+			}
+			continue;
+		}
+		fl = filt_alloc(ZKF_OR, fl, right);
+	}
+	return (fl);
+}
+
+static struct zkfilt *
+filt_compile(const char *expr)
+{
+	struct zkparse p;
+	struct zkfilt *fl;
+
+	bzero(&p, sizeof (p));
+	p.zps_expr = p.zps_pos = expr;
+	filt_next(&p);
+	fl = filt_or(&p);
+	if (p.zps_toklen != 0 || p.zps_quoted)
+		filt_error(&p, "unexpected text");
+	return (fl);
+}
+
+/*
+ * Fails the job for a txn (or child) whose body is too short for its type,
+ * given the error from zkl_body(). Problems with the data only matter if
+ * we're going to output it (-d): otherwise the txn just goes without.
+ */
+static int
+txn_check(struct zkjob *job, struct zkl_txn *t, int rv)
+{
+	const char *name;
+	size_t len = t->zkt_bodylen;
+
+	if (rv == ZKL_OK)
+		return (0);
+
+	name = zktxn_type_to_name((enum zktxn_type)t->zkt_type);
+	switch (rv) {
+	case ZKL_ESHORT:
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+		    "txn too short for ZK_%s: %lu", name, len));
+	case ZKL_EPATHLEN:
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+		    "txn too short for %s (decoding node name): %lu",
+		    name, len));
+	case ZKL_EPATH:
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+		    "txn too short for %s: %lu", name, len));
+	case ZKL_EDATALEN:
+	case ZKL_EDATA:
+		if (!zklog_dumpdata) {
+			t->zkt_data = NULL;
+			t->zkt_datalen = -1;
+			return (0);
+		}
+		if (rv == ZKL_EDATALEN) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "txn too short for %s (decoding data field): %lu",
+			    name, len));
+		}
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+		    "txn too short for %s (in data, %u bytes): %lu",
+		    name, (uint32_t)t->zkt_datalen, len));
+	default:
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "%s",
+		    zkl_strerror(rv)));
+	}
+}
+
+/*
+ * Gets the next child of a MULTI that we're going to output, skipping those
+ * that -e leaves out (when the MULTI was only output for some of them),
+ * returning 1 (or 0 once there are no more, or -1 if the MULTI or the child
+ * is bad).
+ */
+static int
+multi_next(struct zkjob *job, struct zkl_multi *m, struct zkl_txn *c)
+{
+	int rv;
+
+	while ((rv = zkl_multi_next(m, c)) != 0) {
+		if (rv == ZKL_ECHILD) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "txn too short for ZK_MULTI (at child txn %zu): "
+			    "%lu", (size_t)m->zkm_i, m->zkm_txn->zkt_bodylen));
+		}
+		if (rv == ZKL_ECHILDLEN) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "txn too short for ZK_MULTI (after inner length of "
+			    "child txn %zu): %lu", (size_t)m->zkm_i,
+			    m->zkm_txn->zkt_bodylen));
+		}
+		if (job->zj_filtkids && !filt_match(zklog_filter, c))
+			continue;
+		if (txn_check(job, c, rv < 0 ? rv : ZKL_OK) != 0)
+			return (-1);
+		return (1);
+	}
+	return (0);
+}
+
+static int
+print_inner(struct zkjob *job, const char *timebuf, size_t timelen,
+    const struct zkl_txn *t)
+{
+	struct zkbuf *out = &job->zj_out;
+	struct zkl_multi m;
+	struct zkl_txn c;
+	int rv;
+
+	if (t->zkt_type == ZK_ERROR) {
+		ZKBUF_LIT(out, ",\"error\":\"");
+		zkbuf_str(out, zkerr_to_name(t->zkt_err));
+		ZKBUF_LIT(out, "\",\"errid\":");
+		zkbuf_int(out, t->zkt_err);
+
+	} else if (t->zkt_type == ZK_CREATESESSION) {
+		ZKBUF_LIT(out, ",\"timeout\":\"");
+		zkbuf_int(out, t->zkt_timeout);
+		ZKBUF_LIT(out, "\"");
+
+	} else if (t->zkt_path != NULL) {
+		ZKBUF_LIT(out, ",\"path\":\"");
+		zkbuf_append(out, t->zkt_path, t->zkt_pathlen);
+		ZKBUF_LIT(out, "\"");
+
+		/* Skip the data unless they gave us -d. */
+		if (zklog_dumpdata && t->zkt_data != NULL) {
+			ZKBUF_LIT(out, ",\"data\":\"");
+			zkbuf_hexdata(out, t->zkt_data, t->zkt_datalen);
+			ZKBUF_LIT(out, "\"");
+		}
+
+	} else if (t->zkt_type == ZK_MULTI) {
+		ZKBUF_LIT(out, ",\"count\":");
+		zkbuf_int(out, (int32_t)t->zkt_count);
+
+		zkl_multi_init(&m, t);
+		while ((rv = multi_next(job, &m, &c)) > 0) {
+			/* Close the record before; the caller closes ours. */
+			ZKBUF_LIT(out, "}\n");
+			print_header(out, timebuf, timelen, c.zkt_type,
+			    &c.zkt_hdr);
+
+			if (print_inner(job, timebuf, timelen, &c) != 0)
+				return (-1);
+		}
+		if (rv < 0)
+			return (-1);
+	}
+	/*
+	 * For other types we don't print any additional information. Not
+	 * handling them here is fine.
+	 */
+	return (0);
+}
+
+/*
+ * Binary output (-o bin).
+ *
+ * For analysis tools, which would otherwise spend most of their time parsing
+ * our JSON back in, we can write a stream of fixed-layout binary records
+ * instead. The format is stable: anything added in future will be a new kind
+ * of record (which readers should skip), or use space that's reserved here.
+ *
+ * All integers are little-endian. The stream starts with an 8-byte header:
+ *
+ *	0	u32	magic, 0x424C4B5A ("ZKLB" as bytes)
+ *	4	u32	version, 1
+ *
+ * Then come the records. Each one is a multiple of 8 bytes long (so that
+ * every record, and every u64 in one, is 8-byte aligned if the file is), and
+ * starts with:
+ *
+ *	0	u32	length of the whole record, including this header and
+ *			any padding at the end
+ *	4	u16	kind (below)
+ *	6	u16	flags
+ *
+ * Kind 1 (PATH) defines a path in the dictionary, before any TXN record that
+ * refers to it. Ids are assigned from 0 in order.
+ *
+ *	8	u32	id
+ *	12	u32	length of the path
+ *	16		the path (not NUL-terminated)
+ *
+ * Kind 2 (TXN) is a txn, or a child txn of a MULTI (which follow the MULTI,
+ * and have flag 0x1 set). Flag 0x2 means the data of the txn is included.
+ *
+ *	8	u64	zxid
+ *	16	u64	time (ms since the epoch)
+ *	24	u64	session id
+ *	32	u64	duration of the session in ms (for CLOSESESSION, when we
+ *			saw it created; otherwise 0)
+ *	40	u32	cxid
+ *	44	i32	type (as "typeid" in the JSON)
+ *	48	u32	path id, or 0xFFFFFFFF if the txn has no path
+ *	52	i32	for ERROR, the error code; for CREATESESSION, the
+ *			timeout; for MULTI, the number of children; else 0
+ *	56	i32	length of the data, or -1 if the txn has none (the data
+ *			itself is only included with flag 0x2)
+ *	60	u32	reserved (0)
+ *	64		the data
+ *
+ * Kind 3 (TYPE) names a txn type. These all come at the start.
+ *
+ *	8	i32	type
+ *	12	u32	length of the name
+ *	16		the name
+ *
+ * Kind 4 (GAP) is a range of zxids that none of the logs had (--merge), in
+ * order with the TXN records around it.
+ *
+ *	8	u64	first zxid missing
+ *	16	u64	last zxid missing
+ *	24	u64	time of the txn before the gap
+ *	32	u64	time of the txn after it
+ *
+ * Txns are decoded (on worker threads, for -j) with the path in front of
+ * each TXN record: paths only get their ids in emit_rec(), as the records are
+ * output in order.
+ */
+#define	ZKBIN_MAGIC		0x424C4B5A
+#define	ZKBIN_VERSION		1
+#define	ZKBIN_KIND_PATH		1
+#define	ZKBIN_KIND_TXN		2
+#define	ZKBIN_KIND_TYPE		3
+#define	ZKBIN_KIND_GAP		4
+#define	ZKBIN_FLAG_CHILD	0x1
+#define	ZKBIN_FLAG_DATA		0x2
+#define	ZKBIN_NO_PATH		0xFFFFFFFFU
+#define	ZKBIN_TXN_DURATION	32
+#define	ZKBIN_TXN_PATH		48
+
+static int zklog_binary = 0;
+/* --aggregate decodes txns the same way (see "Aggregation" below). */
+static int zklog_aggregate = 0;
+
+/* A dictionary of strings, numbered from 0 in the order they're added. */
+struct zkdict {
+	/* Open-addressed, holding (id + 1) of each path, or 0 if empty. */
+	uint32_t *zd_slots;
+	size_t zd_size;
+	char **zd_strs;
+	size_t *zd_lens;
+	uint32_t zd_n;
+	size_t zd_alloc;
+};
+
+/* The paths given ids so far, used only on the main thread. */
+static struct zkdict zklog_paths;
+
+static void
+zkbuf_le(struct zkbuf *buf, uint64_t v, size_t len)
+{
+	uint8_t b[8];
+
+	for (size_t i = 0; i < len; ++i, v >>= 8)
+		b[i] = v & 0xFF;
+	zkbuf_append(buf, b, len);
+}
+
+static void
+zkbuf_pad8(struct zkbuf *buf, size_t start)
+{
+	static const uint8_t zeros[8] = { 0 };
+
+	zkbuf_append(buf, zeros, (8 - (buf->zb_len - start) % 8) % 8);
+}
+
+static void
+zkbin_patch(uint8_t *p, uint64_t v, size_t len)
+{
+	for (size_t i = 0; i < len; ++i, v >>= 8)
+		p[i] = v & 0xFF;
+}
+
+static uint32_t
+zkdict_hash(const char *str, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t)str[i]) * 16777619U;
+	return (h);
+}
+
+/*
+ * Looks up the id of a string, adding it to the dictionary (and setting
+ * "isnew") if it isn't there yet.
+ */
+static uint32_t
+zkdict_id(struct zkdict *d, const char *str, size_t len, int *isnew)
+{
+	size_t mask, i, start;
+	uint32_t id;
+
+	if (2 * (d->zd_n + 1) > d->zd_size) {
+		uint32_t *old = d->zd_slots;
+		size_t oldsize = d->zd_size;
+
+		d->zd_size = (oldsize == 0) ? 1024 : oldsize * 2;
+		if ((d->zd_slots = calloc(d->zd_size, sizeof (uint32_t))) ==
+		    NULL) {
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		}
+		mask = d->zd_size - 1;
+		for (i = 0; i < oldsize; ++i) {
+			if (old[i] == 0)
+				continue;
+			id = old[i] - 1;
+			start = zkdict_hash(d->zd_strs[id], d->zd_lens[id]);
+			for (start &= mask; d->zd_slots[start] != 0;
+			    start = (start + 1) & mask)
+				;
+			d->zd_slots[start] = old[i];
+		}
+		free(old);
+	}
+
+	mask = d->zd_size - 1;
+	for (i = zkdict_hash(str, len) & mask; d->zd_slots[i] != 0;
+	    i = (i + 1) & mask) {
+		id = d->zd_slots[i] - 1;
+		if (d->zd_lens[id] == len &&
+		    bcmp(d->zd_strs[id], str, len) == 0) {
+			*isnew = 0;
+			return (id);
+		}
+	}
+
+	if (d->zd_n == d->zd_alloc) {
+		d->zd_alloc = (d->zd_alloc == 0) ? 1024 : d->zd_alloc * 2;
+		d->zd_strs = realloc(d->zd_strs, d->zd_alloc * sizeof (char *));
+		d->zd_lens = realloc(d->zd_lens, d->zd_alloc * sizeof (size_t));
+		if (d->zd_strs == NULL || d->zd_lens == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+	id = d->zd_n++;
+	if ((d->zd_strs[id] = malloc(len + 1)) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	bcopy(str, d->zd_strs[id], len);
+	d->zd_lens[id] = len;
+	d->zd_slots[i] = id + 1;
+	*isnew = 1;
+
+	return (id);
+}
+
+/* Writes the header and TYPE records at the start of the output. */
+static void
+zkbin_start(void)
+{
+	size_t start;
+
+	zkbuf_le(&zklog_out, ZKBIN_MAGIC, 4);
+	zkbuf_le(&zklog_out, ZKBIN_VERSION, 4);
+
+	for (size_t i = 0; i < sizeof (zktxn_types) / sizeof (int32_t); ++i) {
+		const char *name = zktxn_type_to_name(
+		    (enum zktxn_type)zktxn_types[i]);
+		size_t len = strlen(name);
+
+		start = zklog_out.zb_len;
+		zkbuf_le(&zklog_out, 0, 4);
+		zkbuf_le(&zklog_out, ZKBIN_KIND_TYPE, 2);
+		zkbuf_le(&zklog_out, 0, 2);
+		zkbuf_le(&zklog_out, (uint32_t)zktxn_types[i], 4);
+		zkbuf_le(&zklog_out, len, 4);
+		zkbuf_append(&zklog_out, name, len);
+		zkbuf_pad8(&zklog_out, start);
+		zkbin_patch((uint8_t *)zklog_out.zb_data + start,
+		    zklog_out.zb_len - start, 4);
+	}
+}
+
+/*
+ * Appends a TXN record to the job's output, preceded by the length of its
+ * path (in host byte order, or UINT32_MAX if it has none) and the path.
+ */
+static void
+zkbin_rec(struct zkbuf *out, const struct zkl_txn *t, uint16_t flags)
+{
+	int data = zklog_dumpdata && t->zkt_data != NULL;
+	uint32_t pathlen = ZKBIN_NO_PATH;
+	int32_t aux = 0;
+	size_t start;
+
+	if (t->zkt_type == ZK_ERROR)
+		aux = t->zkt_err;
+	else if (t->zkt_type == ZK_CREATESESSION)
+		aux = t->zkt_timeout;
+	else if (t->zkt_type == ZK_MULTI)
+		aux = (int32_t)t->zkt_count;
+
+	if (t->zkt_pathlen >= 0)
+		pathlen = (uint32_t)t->zkt_pathlen;
+	zkbuf_append(out, &pathlen, sizeof (pathlen));
+	if (t->zkt_pathlen >= 0)
+		zkbuf_append(out, t->zkt_path, t->zkt_pathlen);
+
+	start = out->zb_len;
+	zkbuf_le(out, 0, 4);
+	zkbuf_le(out, ZKBIN_KIND_TXN, 2);
+	zkbuf_le(out, flags | (data ? ZKBIN_FLAG_DATA : 0), 2);
+	zkbuf_le(out, t->zkt_hdr.zth_zxid, 8);
+	zkbuf_le(out, t->zkt_hdr.zth_time, 8);
+	zkbuf_le(out, t->zkt_hdr.zth_sessionid, 8);
+	zkbuf_le(out, 0, 8);
+	zkbuf_le(out, t->zkt_hdr.zth_cxid, 4);
+	zkbuf_le(out, (uint32_t)t->zkt_type, 4);
+	zkbuf_le(out, ZKBIN_NO_PATH, 4);
+	zkbuf_le(out, (uint32_t)aux, 4);
+	zkbuf_le(out, (uint32_t)t->zkt_datalen, 4);
+	zkbuf_le(out, 0, 4);
+	if (data)
+		zkbuf_append(out, t->zkt_data, t->zkt_datalen);
+	zkbuf_pad8(out, start);
+	zkbin_patch((uint8_t *)out->zb_data + start, out->zb_len - start, 4);
+}
+
+/*
+ * The binary equivalent of print_inner(): appends the TXN record for a txn or
+ * child txn, and those of the children of a MULTI after it.
+ */
+static int
+zkbin_inner(struct zkjob *job, const struct zkl_txn *t, uint16_t flags)
+{
+	struct zkl_multi m;
+	struct zkl_txn c;
+	int rv;
+
+	zkbin_rec(&job->zj_out, t, flags);
+	if (t->zkt_type != ZK_MULTI)
+		return (0);
+
+	zkl_multi_init(&m, t);
+	while ((rv = multi_next(job, &m, &c)) > 0) {
+		if (zkbin_inner(job, &c, ZKBIN_FLAG_CHILD) != 0)
+			return (-1);
+	}
+	return (rv);
+}
+
+/*
+ * Outputs the TXN records of a txn (and any children), giving each its path
+ * id (which might mean writing out a PATH record first). The duration only
+ * goes in the first.
+ */
+static void
+zkbin_emit(const struct zkjob *job, const struct zkrec *rec,
+    uint64_t duration)
+{
+	const char *text = job->zj_out.zb_data + rec->zr_off;
+	const char *end = text + rec->zr_len;
+	uint32_t pathlen, id, len;
+	const uint8_t *p;
+	uint8_t *out;
+	size_t start;
+	int isnew;
+
+	while (text < end) {
+		bcopy(text, &pathlen, sizeof (pathlen));
+		text += sizeof (pathlen);
+		id = ZKBIN_NO_PATH;
+		if (pathlen != ZKBIN_NO_PATH) {
+			id = zkdict_id(&zklog_paths, text, pathlen, &isnew);
+			if (isnew) {
+				start = zklog_out.zb_len;
+				zkbuf_le(&zklog_out, 0, 4);
+				zkbuf_le(&zklog_out, ZKBIN_KIND_PATH, 2);
+				zkbuf_le(&zklog_out, 0, 2);
+				zkbuf_le(&zklog_out, id, 4);
+				zkbuf_le(&zklog_out, pathlen, 4);
+				zkbuf_append(&zklog_out, text, pathlen);
+				zkbuf_pad8(&zklog_out, start);
+				zkbin_patch((uint8_t *)zklog_out.zb_data +
+				    start, zklog_out.zb_len - start, 4);
+			}
+			text += pathlen;
+		}
+
+		p = (const uint8_t *)text;
+		len = p[0] | (p[1] << 8) | (p[2] << 16) |
+		    ((uint32_t)p[3] << 24);
+		zkbuf_append(&zklog_out, text, len);
+		out = (uint8_t *)zklog_out.zb_data + zklog_out.zb_len - len;
+		zkbin_patch(out + ZKBIN_TXN_PATH, id, 4);
+		zkbin_patch(out + ZKBIN_TXN_DURATION, duration, 8);
+		duration = 0;
+		text += len;
+	}
+}
+/*
+ * Decodes a single txn which starts at "txn" and has already had its length
+ * ("txnlen", as in its zt_len) and terminator validated, adding a record for
+ * it to the job.
+ */
+static int
+decode_txn(struct zkjob *job, const struct zktxn *txn, uint32_t txnlen)
+{
+	struct zkrec *rec;
+	struct zkl_txn t;
+	const struct zktxnhdr *hdr = &t.zkt_hdr;
+	char timebuf[64];
+	ssize_t timelen;
+	int output = 1;
+	int rv = ZKL_OK;
+
+	zkl_txn_init(&t, txn, txnlen);
+
+	if (hdr->zth_time < zklog_since || hdr->zth_time > zklog_until)
+		output = 0;
+	if (hdr->zth_zxid < zklog_zxid_from || hdr->zth_zxid > zklog_zxid_to)
+		output = 0;
+	if (zklog_sid != 0 && zklog_sid != hdr->zth_sessionid)
+		output = 0;
+	if (zklog_srvid != 0 &&
+	    sid_to_srvid(hdr->zth_sessionid) != zklog_srvid) {
+		output = 0;
+	}
+	if (output)
+		rv = zkl_body(&t);
+	job->zj_filtkids = 0;
+	if (output && zklog_filter != NULL) {
+		switch (filt_txn(&t)) {
+		case ZKFR_NONE:
+			output = 0;
+			break;
+		case ZKFR_CHILDREN:
+			job->zj_filtkids = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/*
+	 * Filtered-out txns only need a record if session tracking has to see
+	 * them, or (for --merge) to tell them apart from the ones missing.
+	 */
+	if (!output && !zklog_merge && t.zkt_type != ZK_CREATESESSION &&
+	    t.zkt_type != ZK_CLOSESESSION) {
+		return (0);
+	}
+
+	rec = zkjob_add_rec(job);
+	rec->zr_zxid = hdr->zth_zxid;
+	rec->zr_sid = hdr->zth_sessionid;
+	rec->zr_time = hdr->zth_time;
+	rec->zr_type = hdr->zth_type;
+	rec->zr_cxid = hdr->zth_cxid;
+	rec->zr_output = output;
+	rec->zr_off = job->zj_out.zb_len;
+
+	if (!output)
+		return (0);
+
+	if (txn_check(job, &t, rv) != 0) {
+		job->zj_nrecs--;
+		return (-1);
+	}
+
+	if (zklog_binary || zklog_aggregate) {
+		if (zkbin_inner(job, &t, 0) != 0) {
+			job->zj_out.zb_len = rec->zr_off;
+			job->zj_nrecs--;
+			return (-1);
+		}
+		rec->zr_len = job->zj_out.zb_len - rec->zr_off;
+		return (0);
+	}
+
+	timelen = format_time(&job->zj_timecache, hdr->zth_time, timebuf);
+	if (timelen < 0) {
+		job->zj_nrecs--;
+		return (zkjob_fail_errno(job,
+		    "failed to convert time format"));
+	}
+
+	print_header(&job->zj_out, timebuf, timelen, t.zkt_type, hdr);
+	rec->zr_split = job->zj_out.zb_len - rec->zr_off;
+
+	if (print_inner(job, timebuf, timelen, &t) != 0) {
+		/* Drop this txn's partial output. */
+		job->zj_out.zb_len = rec->zr_off;
+		job->zj_nrecs--;
+		return (-1);
+	}
+
+	ZKBUF_LIT(&job->zj_out, "}\n");
+	rec->zr_len = job->zj_out.zb_len - rec->zr_off;
+
+	return (0);
+}
+
+static void emit_job(struct zkjob *);
+
+/*
+ * Walks the txns in a mapped txnlog from "offset" up to "end" (or the end of
+ * the preallocated space, whichever comes first), decoding each into the job.
+ * If "stream" is set, records are emitted as we go rather than accumulated.
+ *
+ * We never go back to a txn once it's decoded, so as we go we give back the
+ * pages behind us (see ZKL_RELEASE).
+ */
+static int
+decode_txns(struct zkjob *job, size_t offset, size_t end, int stream)
+{
+	const char *fname = job->zj_file->zf_name;
+	uint8_t *data = job->zj_file->zf_data;
+	size_t len = job->zj_file->zf_len;
+	size_t released = offset - offset % ZKL_RELEASE;
+	size_t done = offset;
+	const struct zktxn *txn;
+	uint32_t txnlen;
+	int rv, ret = 0;
+
+	while (offset < end) {
+		if ((rv = zkl_frame(data, len, &offset, &txn, &txnlen)) == 0)
+			break;
+		if (rv == ZKL_ETXNLEN) {
+			ret = zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "txn "
+			    "entry too short in '%s' around +0x%lx", fname,
+			    offset);
+			break;
+		}
+		if (rv < 0) {
+			ret = zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "bad txn entry in '%s' around +0x%lx", fname,
+			    offset);
+			break;
+		}
+
+		if (decode_txn(job, txn, txnlen) != 0) {
+			ret = -1;
+			break;
+		}
+
+		if (stream && job->zj_out.zb_len >= ZKLOG_STREAM_FLUSH)
+			emit_job(job);
+
+		done = offset;
+		zkl_release(data, done, &released);
+	}
+
+	/*
+	 * A chunk (see split_file()) rarely ends on a ZKL_RELEASE boundary, so
+	 * give back the rest of what we've been through now.
+	 */
+	zkl_release_rest(data, done, &released);
+
+	return (ret);
+}
+
+/*
+ * Fails the job for a log whose header zkl_log_check() didn't like.
+ */
+static int
+zkfile_bad_log(struct zkjob *job, const void *data, int rv)
+{
+	const char *fname = job->zj_file->zf_name;
+	const struct zklog *log = data;
+
+	if (rv == ZKL_ESMALL) {
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "file %s is too "
+		    "small to be a txnlog", fname));
+	}
+	if (rv == ZKL_EMAGIC) {
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "bad magic "
+		    "number in '%s'", fname));
+	}
+	return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "txnlog '%s' has "
+	    "unknown log version: %u", fname, zk_load32(&log->zl_version)));
+}
+
+/*
+ * Compressed txnlogs.
+ *
+ * Archived logs are often gzipped (or compressed with zstd, if we're built
+ * with ZKLOG_ZSTD), and we can decode them without decompressing them to
+ * disk first. They can't be mapped, so instead a thread decompresses the
+ * log into a ring of ZKSTREAM_NBLOCKS blocks, while zkstream_decode() moves
+ * them through a window just big enough to hold the txn it's on, and checks
+ * the txns against it as decode_txns() does against the mapping.
+ *
+ * The index (for the range options) and -j's splitting of big files both
+ * need the mapping, so for a compressed log we decode every txn (and let the
+ * filters sort them out), one part after another (see zkpool_stream()) even
+ * with -j. Looking for the
+ * sessions created in a log we skipped (see session_load_created()) means
+ * decompressing it too. --state can't replay compressed logs.
+ */
+#define	ZKSTREAM_BLOCK		(1024 * 1024)
+#define	ZKSTREAM_NBLOCKS	4
+#define	ZKSTREAM_READ		(256 * 1024)
+
+static const uint8_t zkcomp_gzip_magic[] = { 0x1F, 0x8B };
+static const uint8_t zkcomp_zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+/* A decompressor, reading from a file. */
+struct zkz {
+	enum zkcomp zz_comp;
+	int zz_fd;
+	uint8_t *zz_in;
+	int zz_ineof;
+	int zz_eof;
+	z_stream zz_gz;
+#ifdef ZKLOG_ZSTD
+	ZSTD_DStream *zz_zstd;
+	ZSTD_inBuffer zz_zin;
+	/* Whether we're part way through a frame. */
+	int zz_zframe;
+#endif
+	char zz_errmsg[128];
+};
+
+/* Works out whether a file is compressed, from its first few bytes. */
+static enum zkcomp
+zkcomp_detect(int fd)
+{
+	uint8_t magic[4];
+	ssize_t n;
+
+	n = pread(fd, magic, sizeof (magic), 0);
+	if (n >= (ssize_t)sizeof (zkcomp_gzip_magic) &&
+	    bcmp(magic, zkcomp_gzip_magic, sizeof (zkcomp_gzip_magic)) == 0) {
+		return (ZKCOMP_GZIP);
+	}
+	if (n >= (ssize_t)sizeof (zkcomp_zstd_magic) &&
+	    bcmp(magic, zkcomp_zstd_magic, sizeof (zkcomp_zstd_magic)) == 0) {
+		return (ZKCOMP_ZSTD);
+	}
+	return (ZKCOMP_NONE);
+}
+
+/* Records what went wrong, returning -1. */
+static int
+zkz_fail(struct zkz *zz, const char *msg)
+{
+	(void) snprintf(zz->zz_errmsg, sizeof (zz->zz_errmsg), "%s", msg);
+	return (-1);
+}
+
+/* Returns 0, or -1 with a message in zz_errmsg. */
+static int
+zkz_init(struct zkz *zz, enum zkcomp comp, int fd)
+{
+	bzero(zz, sizeof (*zz));
+	zz->zz_comp = comp;
+	zz->zz_fd = fd;
+	if ((zz->zz_in = malloc(ZKSTREAM_READ)) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+
+	if (comp == ZKCOMP_GZIP) {
+		/* The 32 is for gzip (or zlib) headers. */
+		if (inflateInit2(&zz->zz_gz, 15 + 32) != Z_OK)
+			return (zkz_fail(zz, "failed to set up zlib"));
+		return (0);
+	}
+
+#ifdef ZKLOG_ZSTD
+	if ((zz->zz_zstd = ZSTD_createDStream()) == NULL ||
+	    ZSTD_isError(ZSTD_initDStream(zz->zz_zstd))) {
+		return (zkz_fail(zz, "failed to set up zstd"));
+	}
+	zz->zz_zin.src = zz->zz_in;
+	return (0);
+#else
+	return (zkz_fail(zz, "zklog was built without zstd support"));
+#endif
+}
+
+static void
+zkz_fini(struct zkz *zz)
+{
+	if (zz->zz_comp == ZKCOMP_GZIP)
+		(void) inflateEnd(&zz->zz_gz);
+#ifdef ZKLOG_ZSTD
+	else if (zz->zz_zstd != NULL)
+		(void) ZSTD_freeDStream(zz->zz_zstd);
+#endif
+	free(zz->zz_in);
+}
+
+/* Reads more compressed data, if the last lot ("avail" left) is used up. */
+static int
+zkz_fill(struct zkz *zz, size_t avail)
+{
+	ssize_t n;
+
+	if (avail > 0 || zz->zz_ineof)
+		return (0);
+	if ((n = read(zz->zz_fd, zz->zz_in, ZKSTREAM_READ)) < 0)
+		return (zkz_fail(zz, strerror(errno)));
+	if (n == 0)
+		zz->zz_ineof = 1;
+	if (zz->zz_comp == ZKCOMP_GZIP) {
+		zz->zz_gz.next_in = zz->zz_in;
+		zz->zz_gz.avail_in = n;
+	}
+#ifdef ZKLOG_ZSTD
+	else {
+		zz->zz_zin.size = n;
+		zz->zz_zin.pos = 0;
+	}
+#endif
+	return (0);
+}
+
+static int
+zkz_gzip(struct zkz *zz, uint8_t *buf, size_t len, size_t *donep)
+{
+	z_stream *gz = &zz->zz_gz;
+	size_t prev = *donep;
+	int rv;
+
+	if (zkz_fill(zz, gz->avail_in) != 0)
+		return (-1);
+	gz->next_out = buf + prev;
+	gz->avail_out = len - prev;
+	rv = inflate(gz, Z_NO_FLUSH);
+	*donep = len - gz->avail_out;
+
+	if (rv == Z_STREAM_END) {
+		/* There may be more gzip members after this one. */
+		if (zkz_fill(zz, gz->avail_in) != 0)
+			return (-1);
+		if (gz->avail_in == 0)
+			zz->zz_eof = 1;
+		else if (inflateReset(gz) != Z_OK)
+			return (zkz_fail(zz, "failed to reset zlib"));
+		return (0);
+	}
+	if (rv == Z_BUF_ERROR && zz->zz_ineof && *donep == prev)
+		return (zkz_fail(zz, "unexpected end of file"));
+	if (rv != Z_OK && rv != Z_BUF_ERROR)
+		return (zkz_fail(zz, gz->msg != NULL ? gz->msg : "bad data"));
+	return (0);
+}
+
+#ifdef ZKLOG_ZSTD
+static int
+zkz_zstd(struct zkz *zz, uint8_t *buf, size_t len, size_t *donep)
+{
+	ZSTD_outBuffer zout = { buf, len, *donep };
+	size_t inpos, rv;
+
+	if (zkz_fill(zz, zz->zz_zin.size - zz->zz_zin.pos) != 0)
+		return (-1);
+	inpos = zz->zz_zin.pos;
+	rv = ZSTD_decompressStream(zz->zz_zstd, &zout, &zz->zz_zin);
+	if (ZSTD_isError(rv))
+		return (zkz_fail(zz, ZSTD_getErrorName(rv)));
+
+	/* A frame is done once it's all been read and flushed. */
+	if (zout.pos != *donep || zz->zz_zin.pos != inpos) {
+		zz->zz_zframe = (rv != 0);
+	} else if (zz->zz_ineof) {
+		if (zz->zz_zframe)
+			return (zkz_fail(zz, "unexpected end of file"));
+		zz->zz_eof = 1;
+	}
+	*donep = zout.pos;
+	return (0);
+}
+#endif
+
+/*
+ * Decompresses up to "len" bytes into "buf", returning how many (which is
+ * only short at the end of the file), or -1 with a message in zz_errmsg.
+ */
+static ssize_t
+zkz_read(struct zkz *zz, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	int rv;
+
+	while (done < len && !zz->zz_eof) {
+#ifdef ZKLOG_ZSTD
+		if (zz->zz_comp == ZKCOMP_ZSTD)
+			rv = zkz_zstd(zz, buf, len, &done);
+		else
+#endif
+			rv = zkz_gzip(zz, buf, len, &done);
+		if (rv != 0)
+			return (-1);
+	}
+
+	return (done);
+}
+
+
+/*
+ * The decompression thread, and the ring of blocks it fills in for
+ * zkstream_decode().
+ */
+struct zkstream {
+	struct zkz zs_z;
+	pthread_t zs_thread;
+	pthread_mutex_t zs_lock;
+	pthread_cond_t zs_cv;
+	uint8_t *zs_blocks[ZKSTREAM_NBLOCKS];
+	size_t zs_lens[ZKSTREAM_NBLOCKS];
+	/* The oldest full block, and how many are full. */
+	size_t zs_head;
+	size_t zs_count;
+	/* Set by the thread when it's done, and by zkstream_close() to stop. */
+	int zs_done;
+	int zs_err;
+	int zs_stop;
+	/*
+	 * The window the txns are decoded from, the position in it of the
+	 * next one, and the offset in the log of its start.
+	 */
+	struct zkbuf zs_win;
+	size_t zs_pos;
+	size_t zs_base;
+};
+
+static void zkstream_close(struct zkstream *);
+
+static void *
+zkstream_thread(void *arg)
+{
+	struct zkstream *zs = arg;
+	size_t slot;
+	ssize_t n;
+
+	VERIFY0(pthread_mutex_lock(&zs->zs_lock));
+	for (;;) {
+		while (zs->zs_count == ZKSTREAM_NBLOCKS && !zs->zs_stop)
+			VERIFY0(pthread_cond_wait(&zs->zs_cv, &zs->zs_lock));
+		if (zs->zs_stop)
+			break;
+		slot = (zs->zs_head + zs->zs_count) % ZKSTREAM_NBLOCKS;
+		VERIFY0(pthread_mutex_unlock(&zs->zs_lock));
+
+		n = zkz_read(&zs->zs_z, zs->zs_blocks[slot], ZKSTREAM_BLOCK);
+
+		VERIFY0(pthread_mutex_lock(&zs->zs_lock));
+		if (n < 0) {
+			zs->zs_err = 1;
+			break;
+		}
+		if (n > 0) {
+			zs->zs_lens[slot] = n;
+			zs->zs_count++;
+		}
+		if (n < ZKSTREAM_BLOCK)
+			break;
+		VERIFY0(pthread_cond_broadcast(&zs->zs_cv));
+	}
+	zs->zs_done = 1;
+	VERIFY0(pthread_cond_broadcast(&zs->zs_cv));
+	VERIFY0(pthread_mutex_unlock(&zs->zs_lock));
+
+	return (NULL);
+}
+
+/*
+ * Appends the next block to the window, returning 1, or 0 at the end of the
+ * file, or -1 on error.
+ */
+static int
+zkstream_next(struct zkstream *zs, struct zkbuf *win)
+{
+	int rv = 1;
+
+	VERIFY0(pthread_mutex_lock(&zs->zs_lock));
+	while (zs->zs_count == 0 && !zs->zs_done)
+		VERIFY0(pthread_cond_wait(&zs->zs_cv, &zs->zs_lock));
+	if (zs->zs_count == 0) {
+		rv = zs->zs_err ? -1 : 0;
+	} else {
+		/* Copying it can happen while the thread fills the others. */
+		VERIFY0(pthread_mutex_unlock(&zs->zs_lock));
+		zkbuf_append(win, zs->zs_blocks[zs->zs_head],
+		    zs->zs_lens[zs->zs_head]);
+		VERIFY0(pthread_mutex_lock(&zs->zs_lock));
+		zs->zs_head = (zs->zs_head + 1) % ZKSTREAM_NBLOCKS;
+		zs->zs_count--;
+		VERIFY0(pthread_cond_broadcast(&zs->zs_cv));
+	}
+	VERIFY0(pthread_mutex_unlock(&zs->zs_lock));
+
+	return (rv);
+}
+
+/*
+ * Makes sure the window has at least "need" bytes from "*posp" on, moving
+ * what's left of it to the front first if need be. Returns 1 if it does, 0
+ * if the file ends first, or -1 on error.
+ */
+static int
+zkstream_need(struct zkstream *zs, struct zkbuf *win, size_t *posp,
+    size_t need)
+{
+	int rv;
+
+	while (win->zb_len - *posp < need) {
+		if (*posp > 0) {
+			(void) memmove(win->zb_data, win->zb_data + *posp,
+			    win->zb_len - *posp);
+			win->zb_len -= *posp;
+			*posp = 0;
+		}
+		if ((rv = zkstream_next(zs, win)) <= 0)
+			return (rv);
+	}
+	return (1);
+}
+
+/*
+ * Starts decompressing a job's log into a new stream, and checks its header
+ * as zkfile_open() would have. Returns NULL if that fails, having failed the
+ * job.
+ */
+static struct zkstream *
+zkstream_open(struct zkjob *job)
+{
+	const char *fname = job->zj_file->zf_name;
+	struct zkstream *zs;
+	size_t i;
+	int got, rv;
+
+	if ((zs = calloc(1, sizeof (*zs))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	if (zkz_init(&zs->zs_z, job->zj_file->zf_comp,
+	    job->zj_file->zf_fd) != 0) {
+		(void) zkjob_fail(job, ZKLOG_EXIT_ERROR, "error decompressing "
+		    "'%s': %s", fname, zs->zs_z.zz_errmsg);
+		zkz_fini(&zs->zs_z);
+		free(zs);
+		return (NULL);
+	}
+	for (i = 0; i < ZKSTREAM_NBLOCKS; ++i) {
+		if ((zs->zs_blocks[i] = malloc(ZKSTREAM_BLOCK)) == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+	VERIFY0(pthread_mutex_init(&zs->zs_lock, NULL));
+	VERIFY0(pthread_cond_init(&zs->zs_cv, NULL));
+	if ((errno = pthread_create(&zs->zs_thread, NULL, zkstream_thread,
+	    zs)) != 0) {
+		err(ZKLOG_EXIT_ERROR, "failed to create thread");
+	}
+
+	if ((got = zkstream_need(zs, &zs->zs_win, &zs->zs_pos,
+	    sizeof (struct zklog))) == 0) {
+		(void) zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "file %s is too "
+		    "small to be a txnlog", fname);
+	} else if (got < 0) {
+		(void) zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "error "
+		    "decompressing '%s': %s", fname, zs->zs_z.zz_errmsg);
+	} else if ((rv = zkl_log_check(zs->zs_win.zb_data,
+	    zs->zs_win.zb_len)) != ZKL_OK) {
+		(void) zkfile_bad_log(job, zs->zs_win.zb_data, rv);
+	} else {
+		zs->zs_pos = sizeof (struct zklog);
+		return (zs);
+	}
+
+	zkstream_close(zs);
+	return (NULL);
+}
+
+/*
+ * Stops the decompression thread and frees the stream.
+ */
+static void
+zkstream_close(struct zkstream *zs)
+{
+	size_t i;
+
+	VERIFY0(pthread_mutex_lock(&zs->zs_lock));
+	zs->zs_stop = 1;
+	VERIFY0(pthread_cond_broadcast(&zs->zs_cv));
+	VERIFY0(pthread_mutex_unlock(&zs->zs_lock));
+	VERIFY0(pthread_join(zs->zs_thread, NULL));
+	VERIFY0(pthread_mutex_destroy(&zs->zs_lock));
+	VERIFY0(pthread_cond_destroy(&zs->zs_cv));
+	for (i = 0; i < ZKSTREAM_NBLOCKS; ++i)
+		free(zs->zs_blocks[i]);
+	zkz_fini(&zs->zs_z);
+	zkbuf_free(&zs->zs_win);
+	free(zs);
+}
+
+/*
+ * The equivalent of decode_txns() for a compressed log: passes each of the
+ * stream's txns to "txnfunc" (decode_txn(), unless we're only after the
+ * sessions in it). It stops early, returning 1, once the job holds "limit"
+ * bytes of records, and picks up from there when it's called again (with
+ * this job or another). Otherwise it returns 0 at the end of the log, or -1
+ * if decoding failed.
+ */
+static int
+zkstream_decode(struct zkjob *job, struct zkstream *zs,
+    int (*txnfunc)(struct zkjob *, const struct zktxn *, uint32_t),
+    int stream, size_t limit)
+{
+	const char *fname = job->zj_file->zf_name;
+	struct zkbuf *win = &zs->zs_win;
+	const struct zktxn *txn;
+	size_t offset;
+	uint32_t txnlen;
+	int got;
+
+	/* zs_base is the offset in the log of the start of the window. */
+	for (;;) {
+		size_t hdrlen = offsetof(struct zktxn, zt_len) +
+		    sizeof (txn->zt_len);
+
+		if (job->zj_out.zb_len + job->zj_nrecs *
+		    sizeof (struct zkrec) >= limit) {
+			return (1);
+		}
+
+		/* The window can move in zkstream_need(). */
+		zs->zs_base += zs->zs_pos;
+		got = zkstream_need(zs, win, &zs->zs_pos, hdrlen);
+		zs->zs_base -= zs->zs_pos;
+		if (got < 0)
+			goto fail;
+		offset = zs->zs_base + zs->zs_pos + hdrlen;
+		if (got == 0) {
+			if (win->zb_len == zs->zs_pos)
+				return (0);
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "bad txn entry in '%s' around +0x%lx", fname,
+			    offset));
+		}
+
+		txn = (const struct zktxn *)(win->zb_data + zs->zs_pos);
+		txnlen = zk_load32(&txn->zt_len);
+		if (txnlen == 0) {
+			/*
+			 * This is normally the preallocated space at the end,
+			 * but it could be corruption, which the decompressor
+			 * can only tell us about once it's seen the rest.
+			 */
+			do {
+				win->zb_len = 0;
+			} while ((got = zkstream_next(zs, win)) > 0);
+			if (got < 0)
+				goto fail;
+			return (0);
+		}
+		if (txnlen < ZKTXN_MIN_LEN) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "txn "
+			    "entry too short in '%s' around +0x%lx", fname,
+			    offset));
+		}
+
+		offset += txnlen;
+		zs->zs_base += zs->zs_pos;
+		got = zkstream_need(zs, win, &zs->zs_pos, hdrlen + txnlen + 1);
+		zs->zs_base -= zs->zs_pos;
+		if (got < 0)
+			goto fail;
+		txn = (const struct zktxn *)(win->zb_data + zs->zs_pos);
+		if (got == 0 || (uint8_t)win->zb_data[zs->zs_pos + hdrlen +
+		    txnlen] != ZKTXN_TERMINATOR) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "bad txn entry in '%s' around +0x%lx", fname,
+			    offset));
+		}
+
+		if (txnfunc(job, txn, txnlen) != 0)
+			return (-1);
+		zs->zs_pos += hdrlen + txnlen + 1;
+
+		if (stream && job->zj_out.zb_len >= ZKLOG_STREAM_FLUSH)
+			emit_job(job);
+	}
+
+fail:
+	return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "error decompressing "
+	    "'%s': %s", fname, zs->zs_z.zz_errmsg));
+}
+
+/*
+ * Decodes the whole of a compressed log in one go.
+ */
+static int
+decode_stream(struct zkjob *job, int (*txnfunc)(struct zkjob *,
+    const struct zktxn *, uint32_t), int stream)
+{
+	struct zkstream *zs;
+	int rv;
+
+	if ((zs = zkstream_open(job)) == NULL)
+		return (-1);
+	rv = zkstream_decode(job, zs, txnfunc, stream, SIZE_MAX);
+	zkstream_close(zs);
+
+	return (rv);
+}
+
+/*
+ * Opens and maps a txnlog file and checks its header, setting the job's range
+ * to cover all of its txns. A compressed file is only opened, since
+ * decode_stream() reads it (and checks its header) from the start.
+ */
+static int
+zkfile_open(struct zkjob *job)
+{
+	struct zkfile *zf = job->zj_file;
+	const char *fname = zf->zf_name;
+	struct zklog *log;
+	struct stat stat;
+	int rv;
+
+	zf->zf_fd = open(fname, O_RDONLY);
+	if (zf->zf_fd < 0) {
+		return (zkjob_fail_errno(job, "error opening file '%s'",
+		    fname));
+	}
+
+	if ((zf->zf_comp = zkcomp_detect(zf->zf_fd)) != ZKCOMP_NONE) {
+#ifndef ZKLOG_ZSTD
+		if (zf->zf_comp == ZKCOMP_ZSTD) {
+			(void) close(zf->zf_fd);
+			return (zkjob_fail(job, ZKLOG_EXIT_ERROR, "'%s' is "
+			    "zstd-compressed, but zklog was built without zstd "
+			    "support", fname));
+		}
+#endif
+		zf->zf_data = NULL;
+		zf->zf_len = 0;
+		job->zj_start = 0;
+		job->zj_end = SIZE_MAX;
+		return (0);
+	}
+
+	if (fstat(zf->zf_fd, &stat)) {
+		rv = zkjob_fail_errno(job, "error getting size of file '%s'",
+		    fname);
+		(void) close(zf->zf_fd);
+		return (rv);
+	}
+
+	zf->zf_len = stat.st_size;
+	if (zf->zf_len < sizeof (struct zklog)) {
+		(void) close(zf->zf_fd);
+		return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "file %s is too "
+		    "small to be a txnlog", fname));
+	}
+
+	zf->zf_data = mmap(NULL, zf->zf_len, PROT_READ, MAP_PRIVATE,
+	    zf->zf_fd, 0);
+	if (zf->zf_data == MAP_FAILED) {
+		rv = zkjob_fail_errno(job, "error mapping file '%s' into "
+		    "memory", fname);
+		(void) close(zf->zf_fd);
+		return (rv);
+	}
+
+	(void) madvise((caddr_t)zf->zf_data, zf->zf_len, MADV_SEQUENTIAL);
+	log = (struct zklog *)zf->zf_data;
+
+	if ((rv = zkl_log_check(log, zf->zf_len)) == ZKL_OK) {
+		job->zj_start = (uintptr_t)log->zl_txns - (uintptr_t)log;
+		job->zj_end = zf->zf_len;
+		return (0);
+	}
+	rv = zkfile_bad_log(job, log, rv);
+
+	(void) munmap((void *)zf->zf_data, zf->zf_len);
+	(void) close(zf->zf_fd);
+	return (rv);
+}
+
+static int
+zkfile_close(struct zkjob *job)
+{
+	struct zkfile *zf = job->zj_file;
+	int rv = 0;
+
+	/* Don't clobber the report of any earlier failure. */
+	if (zf->zf_data != NULL && munmap((void *)zf->zf_data, zf->zf_len) &&
+	    job->zj_errcode == 0) {
+		rv = zkjob_fail_errno(job, "error unmapping '%s'",
+		    zf->zf_name);
+	}
+
+	if (close(zf->zf_fd) && job->zj_errcode == 0) {
+		rv = zkjob_fail_errno(job, "error closing file '%s'",
+		    zf->zf_name);
+	}
+
+	return (rv);
+}
+
+/*
+ * Sidecar indexes (--zxid-from, --zxid-to, --since, --until).
+ *
+ * To answer a query about a range of zxids or times without decoding every
+ * txn in every log, we build a small index of each txnlog we're asked to look
+ * at. By default it's thrown away afterwards, but with --index-dir we keep it
+ * in that directory, so that the next query only has to scan what's been
+ * written since (we never write into the log's own directory, which belongs
+ * to ZK). The file is named after the log's absolute path, with each "/" (and
+ * "%") escaped as "%2F" (and "%25"), so that any run can tell whether the log
+ * it belongs to is still there; each run with --index-dir removes those whose
+ * log isn't (see zkidx_prune()). The index samples the log every
+ * ZKLOG_INDEX_INTERVAL bytes, recording the offset and zxid of the first txn
+ * at or after that point, along with the lowest and highest timestamps of the
+ * txns from there to the next sample. Zxids only ever go up within a log, but
+ * timestamps come from whichever server was leader, so we can't assume they
+ * do; the min/max let us bound them anyway.
+ *
+ * The index is only trusted if the dbid in the log header matches, and the
+ * log hasn't shrunk. The live log has txns appended to its preallocated
+ * space without changing its size, so we also record where the txns ended,
+ * and if there's a txn there now we re-scan from the last sample onwards.
+ *
+ * The index also lists every CREATESESSION txn in the log, so that when we
+ * skip over the txn that created a session, we can still work out the
+ * duration to report when it's closed (see session_created()).
+ *
+ * All the fields are stored big-endian, as in the txnlogs themselves.
+ */
+#define	ZKIDX_MAGIC		0x5A4B4958	/* "ZKIX" */
+#define	ZKIDX_VERSION		2
+#define	ZKIDX_SUFFIX		".zkidx"
+#define	ZKLOG_INDEX_INTERVAL	(64 * 1024)
+
+struct zkidx_hdr {
+	uint32_t zih_magic;
+	uint32_t zih_version;
+	uint64_t zih_dbid;
+	uint64_t zih_filesize;
+	/* Offset just past the last txn indexed, and its zxid. */
+	uint64_t zih_end;
+	uint64_t zih_last_zxid;
+	uint32_t zih_interval;
+	uint32_t zih_nents;
+	uint32_t zih_nsess;
+	uint32_t zih_pad;
+} __attribute__((packed));
+
+struct zkidx_ent {
+	uint64_t zie_off;
+	uint64_t zie_zxid;
+	uint64_t zie_tmin;
+	uint64_t zie_tmax;
+} __attribute__((packed));
+
+struct zkidx_sess {
+	uint64_t zis_off;
+	uint64_t zis_sid;
+	uint64_t zis_time;
+} __attribute__((packed));
+
+/* The index, in host byte order. */
+struct zkidx {
+	struct zkidx_hdr zi_hdr;
+	struct zkidx_ent *zi_ents;
+	size_t zi_size;
+	struct zkidx_sess *zi_sess;
+	size_t zi_sesssize;
+};
+
+/*
+ * Works out where the index for a log is kept. Returns -1 if it isn't (because
+ * there's no --index-dir, or we can't name the log).
+ */
+static int
+zkidx_path(const char *fname, char *path, size_t pathlen)
+{
+	char real[PATH_MAX];
+	size_t off;
+	int n;
+
+	if (zklog_index_dir == NULL || realpath(fname, real) == NULL)
+		return (-1);
+
+	if ((n = snprintf(path, pathlen, "%s/", zklog_index_dir)) < 0 ||
+	    (size_t)n >= pathlen) {
+		return (-1);
+	}
+	off = n;
+	for (const char *p = real; *p != '\0'; ++p) {
+		if (pathlen - off < 4)
+			return (-1);
+		if (*p == '/' || *p == '%') {
+			(void) snprintf(path + off, 4, "%%%02X",
+			    (unsigned char)*p);
+			off += 3;
+		} else {
+			path[off++] = *p;
+		}
+	}
+	if ((n = snprintf(path + off, pathlen - off, "%s", ZKIDX_SUFFIX)) < 0 ||
+	    (size_t)n >= pathlen - off) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Removes the indexes in --index-dir whose logs have gone (ZK having purged
+ * them, say), so that the directory doesn't grow without bound.
+ */
+static void
+zkidx_prune(void)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char log[PATH_MAX], path[PATH_MAX];
+	size_t len, i, j;
+
+	if ((dir = opendir(zklog_index_dir)) == NULL) {
+		err(ZKLOG_EXIT_ERROR, "error opening directory '%s'",
+		    zklog_index_dir);
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (len <= strlen(ZKIDX_SUFFIX) || strcmp(de->d_name + len -
+		    strlen(ZKIDX_SUFFIX), ZKIDX_SUFFIX) != 0) {
+			continue;
+		}
+		len -= strlen(ZKIDX_SUFFIX);
+
+		/* Anything that isn't one of ours, we leave alone. */
+		for (i = 0, j = 0; i < len && j < sizeof (log) - 1; ++j) {
+			if (de->d_name[i] != '%') {
+				log[j] = de->d_name[i++];
+				continue;
+			}
+			if (strncmp(de->d_name + i, "%2F", 3) == 0)
+				log[j] = '/';
+			else if (strncmp(de->d_name + i, "%25", 3) == 0)
+				log[j] = '%';
+			else
+				break;
+			i += 3;
+		}
+		if (i < len || j == 0 || log[0] != '/')
+			continue;
+		log[j] = '\0';
+
+		if (stat(log, &st) == 0 || errno != ENOENT)
+			continue;
+		if (snprintf(path, sizeof (path), "%s/%s", zklog_index_dir,
+		    de->d_name) >= (int)sizeof (path)) {
+			continue;
+		}
+		if (unlink(path) != 0 && errno != ENOENT)
+			warn("error removing stale index '%s'", path);
+	}
+	(void) closedir(dir);
+}
+
+static void
+zkidx_free(struct zkidx *idx)
+{
+	free(idx->zi_ents);
+	free(idx->zi_sess);
+	bzero(idx, sizeof (*idx));
+}
+
+static struct zkidx_ent *
+zkidx_add(struct zkidx *idx)
+{
+	struct zkidx_ent *ent;
+
+	if (idx->zi_hdr.zih_nents == idx->zi_size) {
+		size_t nsize = idx->zi_size == 0 ? 256 : idx->zi_size * 2;
+		ent = realloc(idx->zi_ents, nsize * sizeof (*ent));
+		if (ent == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		idx->zi_ents = ent;
+		idx->zi_size = nsize;
+	}
+
+	return (&idx->zi_ents[idx->zi_hdr.zih_nents++]);
+}
+
+static struct zkidx_sess *
+zkidx_add_sess(struct zkidx *idx)
+{
+	struct zkidx_sess *sess;
+
+	if (idx->zi_hdr.zih_nsess == idx->zi_sesssize) {
+		size_t nsize = idx->zi_sesssize == 0 ? 64 :
+		    idx->zi_sesssize * 2;
+		sess = realloc(idx->zi_sess, nsize * sizeof (*sess));
+		if (sess == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		idx->zi_sess = sess;
+		idx->zi_sesssize = nsize;
+	}
+
+	return (&idx->zi_sess[idx->zi_hdr.zih_nsess++]);
+}
+
+/*
+ * Loads the index for a file, if there is one. Returns 0 on success, with the
+ * index as it was written (still to be checked against the file).
+ */
+static int
+zkidx_load(const char *path, struct zkidx *idx)
+{
+	struct zkidx_hdr *hdr = &idx->zi_hdr;
+	struct zkidx_ent *ent;
+	struct zkidx_sess *sess;
+	struct stat st;
+	size_t len, slen;
+	int fd;
+
+	bzero(idx, sizeof (*idx));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+	if (fstat(fd, &st) != 0 || pread(fd, hdr, sizeof (*hdr), 0) !=
+	    (ssize_t)sizeof (*hdr)) {
+		(void) close(fd);
+		return (-1);
+	}
+
+	hdr->zih_magic = be32toh(hdr->zih_magic);
+	hdr->zih_version = be32toh(hdr->zih_version);
+	hdr->zih_dbid = be64toh(hdr->zih_dbid);
+	hdr->zih_filesize = be64toh(hdr->zih_filesize);
+	hdr->zih_end = be64toh(hdr->zih_end);
+	hdr->zih_last_zxid = be64toh(hdr->zih_last_zxid);
+	hdr->zih_interval = be32toh(hdr->zih_interval);
+	hdr->zih_nents = be32toh(hdr->zih_nents);
+	hdr->zih_nsess = be32toh(hdr->zih_nsess);
+
+	len = hdr->zih_nents * sizeof (struct zkidx_ent);
+	slen = hdr->zih_nsess * sizeof (struct zkidx_sess);
+	if (hdr->zih_magic != ZKIDX_MAGIC ||
+	    hdr->zih_version != ZKIDX_VERSION ||
+	    hdr->zih_interval != ZKLOG_INDEX_INTERVAL ||
+	    (size_t)st.st_size != sizeof (*hdr) + len + slen) {
+		(void) close(fd);
+		return (-1);
+	}
+
+	idx->zi_size = hdr->zih_nents;
+	idx->zi_sesssize = hdr->zih_nsess;
+	if ((idx->zi_ents = malloc(len + 1)) == NULL ||
+	    (idx->zi_sess = malloc(slen + 1)) == NULL) {
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+	if (pread(fd, idx->zi_ents, len, sizeof (*hdr)) != (ssize_t)len ||
+	    pread(fd, idx->zi_sess, slen, sizeof (*hdr) + len) !=
+	    (ssize_t)slen) {
+		(void) close(fd);
+		zkidx_free(idx);
+		return (-1);
+	}
+	(void) close(fd);
+
+	for (ent = idx->zi_ents; ent < idx->zi_ents + hdr->zih_nents; ++ent) {
+		ent->zie_off = be64toh(ent->zie_off);
+		ent->zie_zxid = be64toh(ent->zie_zxid);
+		ent->zie_tmin = be64toh(ent->zie_tmin);
+		ent->zie_tmax = be64toh(ent->zie_tmax);
+	}
+	for (sess = idx->zi_sess; sess < idx->zi_sess + hdr->zih_nsess;
+	    ++sess) {
+		sess->zis_off = be64toh(sess->zis_off);
+		sess->zis_sid = be64toh(sess->zis_sid);
+		sess->zis_time = be64toh(sess->zis_time);
+	}
+
+	return (0);
+}
+
+/*
+ * Writes out the index, replacing any existing one atomically. Failing to
+ * write an index (say, because the logs are on a read-only archive volume)
+ * isn't fatal: it just means we'll have to scan the log again next time.
+ */
+static void
+zkidx_save(const char *path, const struct zkidx *idx)
+{
+	static int warned = 0;
+	const struct zkidx_hdr *hdr = &idx->zi_hdr;
+	char tmp[PATH_MAX];
+	struct zkbuf buf;
+	uint64_t v64;
+	uint32_t v32;
+	size_t off = 0;
+	ssize_t n;
+	int fd;
+
+#define	PUT32(v)	do { \
+	v32 = htobe32(v); \
+	zkbuf_append(&buf, &v32, sizeof (v32)); \
+    } while (0)
+#define	PUT64(v)	do { \
+	v64 = htobe64(v); \
+	zkbuf_append(&buf, &v64, sizeof (v64)); \
+    } while (0)
+
+	bzero(&buf, sizeof (buf));
+	PUT32(hdr->zih_magic);
+	PUT32(hdr->zih_version);
+	PUT64(hdr->zih_dbid);
+	PUT64(hdr->zih_filesize);
+	PUT64(hdr->zih_end);
+	PUT64(hdr->zih_last_zxid);
+	PUT32(hdr->zih_interval);
+	PUT32(hdr->zih_nents);
+	PUT32(hdr->zih_nsess);
+	PUT32(0);
+	for (uint32_t i = 0; i < hdr->zih_nents; ++i) {
+		PUT64(idx->zi_ents[i].zie_off);
+		PUT64(idx->zi_ents[i].zie_zxid);
+		PUT64(idx->zi_ents[i].zie_tmin);
+		PUT64(idx->zi_ents[i].zie_tmax);
+	}
+	for (uint32_t i = 0; i < hdr->zih_nsess; ++i) {
+		PUT64(idx->zi_sess[i].zis_off);
+		PUT64(idx->zi_sess[i].zis_sid);
+		PUT64(idx->zi_sess[i].zis_time);
+	}
+#undef	PUT32
+#undef	PUT64
+
+	if (snprintf(tmp, sizeof (tmp), "%s.%ld.%p", path, (long)getpid(),
+	    (void *)idx) >= (int)sizeof (tmp)) {
+		zkbuf_free(&buf);
+		return;
+	}
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+		goto fail;
+	while (off < buf.zb_len) {
+		n = write(fd, buf.zb_data + off, buf.zb_len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			(void) close(fd);
+			(void) unlink(tmp);
+			goto fail;
+		}
+		off += n;
+	}
+	if (close(fd) != 0 || rename(tmp, path) != 0) {
+		(void) unlink(tmp);
+		goto fail;
+	}
+	zkbuf_free(&buf);
+	return;
+
+fail:
+	if (!warned) {
+		warned = 1;
+		warn("not saving index '%s'", path);
+	}
+	zkbuf_free(&buf);
+}
+
+/*
+ * Scans the txns of a mapped log from "offset", adding them to the index.
+ * Like split_file(), this only checks what it needs to in order to keep
+ * going: if there's a problem, the decoding pass will find it.
+ */
+static void
+zkidx_scan(struct zkidx *idx, const struct zkfile *zf, size_t offset)
+{
+	struct zkidx_hdr *hdr = &idx->zi_hdr;
+	struct zkidx_ent *ent = NULL;
+	struct zkidx_sess *sess;
+	const struct zktxn *txn;
+	size_t next = offset;
+	uint64_t zxid, t;
+	uint32_t txnlen;
+
+	if (hdr->zih_nents > 0)
+		ent = &idx->zi_ents[hdr->zih_nents - 1];
+
+	for (; zkl_frame(zf->zf_data, zf->zf_len, &next, &txn, &txnlen) > 0;
+	    offset = next) {
+		zxid = zk_load64(&txn->zt_zxid);
+		t = zk_load64(&txn->zt_time);
+
+		if (ent == NULL ||
+		    offset - ent->zie_off >= ZKLOG_INDEX_INTERVAL) {
+			ent = zkidx_add(idx);
+			ent->zie_off = offset;
+			ent->zie_zxid = zxid;
+			ent->zie_tmin = ent->zie_tmax = t;
+		}
+		if (t < ent->zie_tmin)
+			ent->zie_tmin = t;
+		if (t > ent->zie_tmax)
+			ent->zie_tmax = t;
+
+		if ((int32_t)zk_load32(&txn->zt_type) == ZK_CREATESESSION) {
+			sess = zkidx_add_sess(idx);
+			sess->zis_off = offset;
+			sess->zis_sid = zk_load64(&txn->zt_sessionid);
+			sess->zis_time = t;
+		}
+
+		hdr->zih_last_zxid = zxid;
+	}
+
+	hdr->zih_end = offset;
+}
+
+/*
+ * Brings the index for a (mapped) log up to date, loading it if there is
+ * one and saving it if we had to change it. Without --index-dir, this just
+ * builds it.
+ */
+static void
+zkidx_get(const struct zkfile *zf, struct zkidx *idx)
+{
+	const struct zklog *log = (const struct zklog *)zf->zf_data;
+	struct zkidx_hdr *hdr = &idx->zi_hdr;
+	const struct zktxn *txn;
+	struct zkidx_ent *last;
+	char path[PATH_MAX];
+	uint32_t txnlen;
+	size_t next;
+	int saved, rv;
+
+	bzero(idx, sizeof (*idx));
+	saved = (zkidx_path(zf->zf_name, path, sizeof (path)) == 0);
+
+	if (saved && zkidx_load(path, idx) == 0 &&
+	    hdr->zih_dbid == zk_load64(&log->zl_dbid) &&
+	    hdr->zih_filesize <= zf->zf_len && hdr->zih_end <= zf->zf_len) {
+		/* If nothing's been written since, it's good as it is. */
+		next = hdr->zih_end;
+		rv = zkl_frame(zf->zf_data, zf->zf_len, &next, &txn, &txnlen);
+		if (rv == 0 || rv == ZKL_ETRUNC)
+			return;
+
+		/*
+		 * Otherwise the last sample may be incomplete, so we drop it
+		 * and scan from there, as long as it still points at the same
+		 * txn (if it doesn't, this isn't the log we indexed).
+		 */
+		if (hdr->zih_nents == 0) {
+			zkidx_scan(idx, zf, sizeof (struct zklog));
+			goto save;
+		}
+		last = &idx->zi_ents[hdr->zih_nents - 1];
+		next = last->zie_off;
+		rv = zkl_frame(zf->zf_data, zf->zf_len, &next, &txn, &txnlen);
+		if (rv > 0 && zk_load64(&txn->zt_zxid) == last->zie_zxid) {
+			hdr->zih_nents--;
+			while (hdr->zih_nsess > 0 && idx->zi_sess[
+			    hdr->zih_nsess - 1].zis_off >= last->zie_off) {
+				hdr->zih_nsess--;
+			}
+			zkidx_scan(idx, zf, last->zie_off);
+			goto save;
+		}
+	}
+
+	zkidx_free(idx);
+	hdr->zih_magic = ZKIDX_MAGIC;
+	hdr->zih_version = ZKIDX_VERSION;
+	hdr->zih_interval = ZKLOG_INDEX_INTERVAL;
+	hdr->zih_dbid = zk_load64(&log->zl_dbid);
+	zkidx_scan(idx, zf, sizeof (struct zklog));
+
+save:
+	hdr->zih_filesize = zf->zf_len;
+	if (saved)
+		zkidx_save(path, idx);
+}
+
+/*
+ * Narrows the range of a job covering a whole file down to the part that
+ * could contain txns matching the zxid and time options, using its index.
+ */
+static void
+zkidx_narrow(struct zkjob *job)
+{
+	struct zkidx idx;
+	struct zkidx_ent *ents;
+	uint64_t t;
+	size_t i, n, lo, hi, start, end;
+
+	zkidx_get(job->zj_file, &idx);
+	ents = idx.zi_ents;
+	n = idx.zi_hdr.zih_nents;
+
+	/*
+	 * The range starts at the last sample before which every txn either
+	 * has a zxid below the ones we want, or is too early.
+	 */
+	lo = 0;
+	for (hi = n; lo + 1 < hi; ) {
+		size_t mid = (lo + hi) / 2;
+		if (ents[mid].zie_zxid <= zklog_zxid_from)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	for (i = 0, t = 0; i < n && t < zklog_since; ++i) {
+		if (i > lo)
+			lo = i;
+		if (ents[i].zie_tmax > t)
+			t = ents[i].zie_tmax;
+	}
+	start = (n > 0) ? ents[lo].zie_off : job->zj_start;
+
+	/*
+	 * And it ends at the first sample after which every txn either has
+	 * too high a zxid, or is too late. Past the last sample we leave the
+	 * end alone, so that decoding still finds (and reports) whatever
+	 * stopped the scan.
+	 */
+	end = job->zj_end;
+	for (i = n, t = UINT64_MAX; i > 0; --i) {
+		if (ents[i - 1].zie_tmin < t)
+			t = ents[i - 1].zie_tmin;
+		if (ents[i - 1].zie_zxid <= zklog_zxid_to && t <= zklog_until)
+			break;
+		end = ents[i - 1].zie_off;
+	}
+
+	if (start > job->zj_start)
+		job->zj_start = start;
+	if (end < job->zj_end)
+		job->zj_end = end;
+	if (job->zj_end < job->zj_start)
+		job->zj_end = job->zj_start;
+
+	zkidx_free(&idx);
+}
+
+/*
+ * Decodes all the txns in a txnlog file into records in the job. If "stream"
+ * is set, records are emitted as we go rather than accumulated.
+ */
+static int
+do_file(struct zkjob *job, int stream)
+{
+	int rv;
+
+	if (zkfile_open(job) != 0)
+		return (-1);
+
+	if (job->zj_file->zf_comp != ZKCOMP_NONE) {
+		rv = decode_stream(job, decode_txn, stream);
+	} else {
+		if (zklog_ranged)
+			zkidx_narrow(job);
+		rv = decode_txns(job, job->zj_start, job->zj_end, stream);
+	}
+
+	if (zkfile_close(job) != 0 && rv == 0)
+		rv = -1;
+
+	return (rv);
+}
+
+/*
+ * When a range lets us skip decoding some of the logs, we can come across a
+ * session being closed without having seen it created. We then look for its
+ * creation in the indexes of the logs we were given (see zkidx_get()),
+ * starting from the log with the close in it and working backwards, and
+ * loading each index at most once. This way we only pay for the sessions we
+ * actually need a duration for.
+ */
+static char **zklog_logs = NULL;
+static size_t zklog_nlogs = 0;
+/* Index in zklog_logs of the first log we're decoding. */
+static size_t zklog_logs_first = 0;
+static uint8_t *zklog_created_loaded = NULL;
+static struct session_table zklog_created;
+
+/* A compressed log has no index, so we look at each of its txns instead. */
+static int
+session_scan_txn(struct zkjob *job, const struct zktxn *txn, uint32_t txnlen)
+{
+	struct session_state *sess;
+	uint64_t sid;
+
+	(void) job;
+	(void) txnlen;
+	if ((int32_t)zk_load32(&txn->zt_type) != ZK_CREATESESSION)
+		return (0);
+
+	sid = zk_load64(&txn->zt_sessionid);
+	if ((sess = session_lookup(&zklog_created, sid)) == NULL) {
+		sess = session_alloc();
+		sess->ss_sid = sid;
+		session_insert(&zklog_created, sess);
+	}
+	sess->ss_start = zk_load64(&txn->zt_time);
+
+	return (0);
+}
+
+static void
+session_load_created(size_t i)
+{
+	struct zkfile file;
+	struct zkjob job;
+	struct zkidx idx;
+	struct session_state *sess;
+	uint32_t j;
+
+	zklog_created_loaded[i] = 1;
+
+	bzero(&file, sizeof (file));
+	bzero(&job, sizeof (job));
+	file.zf_name = zklog_logs[i];
+	job.zj_file = &file;
+
+	/* If the log has a problem, decoding it is what reports that. */
+	if (zkfile_open(&job) != 0)
+		return;
+	if (file.zf_comp != ZKCOMP_NONE) {
+		(void) decode_stream(&job, session_scan_txn, 0);
+		(void) zkfile_close(&job);
+		return;
+	}
+
+	zkidx_get(&file, &idx);
+	for (j = 0; j < idx.zi_hdr.zih_nsess; ++j) {
+		/* Session ids aren't reused, but if one is, the last wins. */
+		sess = session_lookup(&zklog_created, idx.zi_sess[j].zis_sid);
+		if (sess == NULL) {
+			sess = session_alloc();
+			sess->ss_sid = idx.zi_sess[j].zis_sid;
+			session_insert(&zklog_created, sess);
+		}
+		sess->ss_start = idx.zi_sess[j].zis_time;
+	}
+	zkidx_free(&idx);
+
+	(void) zkfile_close(&job);
+}
+
+/*
+ * Finds when the session with the given id was created, for a close found in
+ * the given log. Returns 0 if none of the logs have its creation.
+ */
+static int
+session_created(uint64_t sid, size_t log, uint64_t *startp)
+{
+	struct session_state *sess;
+	size_t i;
+
+	if (zklog_nlogs == 0 || log >= zklog_nlogs)
+		return (0);
+	if (zklog_created_loaded == NULL &&
+	    (zklog_created_loaded = calloc(zklog_nlogs, 1)) == NULL) {
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+
+	for (;;) {
+		if ((sess = session_lookup(&zklog_created, sid)) != NULL) {
+			*startp = sess->ss_start;
+			return (1);
+		}
+
+		for (i = log + 1; i > 0 && zklog_created_loaded[i - 1]; --i)
+			;
+		if (i > 0) {
+			session_load_created(i - 1);
+			continue;
+		}
+
+		/* The logs might not have been given in order. */
+		i = log + 1;
+		while (i < zklog_nlogs && zklog_created_loaded[i])
+			++i;
+		if (i == zklog_nlogs)
+			return (0);
+		session_load_created(i);
+	}
+}
+
+/*
+ * Tracks session creation and closure, in log order, returning the duration
+ * of the session if this record closes one we saw created.
+ */
+static uint64_t
+session_track(const struct zkjob *job, const struct zkrec *rec)
+{
+	struct session_state *sess;
+	uint64_t duration = 0;
+	uint64_t start;
+
+	if (rec->zr_type != ZK_CREATESESSION &&
+	    rec->zr_type != ZK_CLOSESESSION) {
+		return (0);
+	}
+
+	sess = session_lookup(&sessions, rec->zr_sid);
+
+	if (sess == NULL && rec->zr_type == ZK_CREATESESSION) {
+		sess = session_alloc();
+		sess->ss_sid = rec->zr_sid;
+		sess->ss_start = rec->zr_time;
+		session_insert(&sessions, sess);
+	}
+
+	if (sess != NULL && rec->zr_type == ZK_CLOSESESSION) {
+		duration = rec->zr_time - sess->ss_start;
+		session_remove(&sessions, sess);
+		session_release(sess);
+	} else if (sess == NULL && rec->zr_type == ZK_CLOSESESSION &&
+	    zklog_ranged && session_created(rec->zr_sid, zklog_logs_first +
+	    job->zj_file->zf_index, &start)) {
+		duration = rec->zr_time - start;
+	}
+
+	return (duration);
+}
+
+/*
+ * Session lifetime histograms (--session-hist).
+ *
+ * For each server id, we count the sessions created and closed among the
+ * txns we output, and histograms of how long the closed ones lasted. ZK's
+ * session tracker closes an expired session with a CLOSESESSION with a cxid
+ * of 0, whereas a client's own close has the xid of its request (which
+ * start at 1), so those are counted separately. Closes of sessions we
+ * didn't see created (and so have no "duration" in the JSON) can only be
+ * counted.
+ */
+#define	SESSION_HIST_BUCKETS	9
+
+static const uint64_t session_hist_bounds[SESSION_HIST_BUCKETS - 1] = {
+	1000, 10 * 1000, 60 * 1000, 600 * 1000, 3600 * 1000,
+	6 * 3600 * 1000, 24 * 3600 * 1000, 7 * 24 * 3600 * 1000ULL
+};
+
+static const char *session_hist_names[SESSION_HIST_BUCKETS] = {
+	"1s", "10s", "1m", "10m", "1h", "6h", "1d", "7d", "inf"
+};
+
+struct session_hist {
+	uint64_t sh_created;
+	uint64_t sh_closed;
+	uint64_t sh_expired;
+	uint64_t sh_unknown;
+	uint64_t sh_hist_closed[SESSION_HIST_BUCKETS];
+	uint64_t sh_hist_expired[SESSION_HIST_BUCKETS];
+};
+
+static int zklog_sesshist = 0;
+static struct session_hist zklog_hists[256];
+
+/* Counts a record that was output, with the duration from session_track(). */
+static void
+session_hist_add(const struct zkrec *rec, uint64_t duration)
+{
+	struct session_hist *h = &zklog_hists[sid_to_srvid(rec->zr_sid)];
+	uint64_t *hist;
+	size_t b;
+
+	if (rec->zr_type == ZK_CREATESESSION) {
+		h->sh_created++;
+		return;
+	}
+	if (rec->zr_type != ZK_CLOSESESSION)
+		return;
+
+	if (rec->zr_cxid == 0) {
+		h->sh_expired++;
+		hist = h->sh_hist_expired;
+	} else {
+		h->sh_closed++;
+		hist = h->sh_hist_closed;
+	}
+	if (duration == 0) {
+		h->sh_unknown++;
+		return;
+	}
+	for (b = 0; b < SESSION_HIST_BUCKETS - 1; ++b) {
+		if (duration < session_hist_bounds[b])
+			break;
+	}
+	hist[b]++;
+}
+
+static void
+session_hist_buckets(struct zkbuf *out, const char *name,
+    const uint64_t *hist)
+{
+	ZKBUF_LIT(out, ",\"");
+	zkbuf_str(out, name);
+	ZKBUF_LIT(out, "\":{");
+	for (size_t b = 0; b < SESSION_HIST_BUCKETS; ++b) {
+		if (b > 0)
+			ZKBUF_LIT(out, ",");
+		ZKBUF_LIT(out, "\"");
+		zkbuf_str(out, session_hist_names[b]);
+		ZKBUF_LIT(out, "\":");
+		zkbuf_uint(out, hist[b]);
+	}
+	ZKBUF_LIT(out, "}");
+}
+
+/*
+ * Prints a _SESSIONHIST record for each server id with any sessions, along
+ * with the number of its sessions still open at the end (as -S would list).
+ */
+static void
+session_hist_print(void)
+{
+	struct zkbuf *out = &zklog_out;
+	const struct session_hist *h;
+	struct session_state *sess;
+	uint64_t open[256];
+	size_t i;
+
+	bzero(open, sizeof (open));
+	for (i = 0; i < sessions.st_size; ++i) {
+		if ((sess = sessions.st_slots[i]) == NULL)
+			continue;
+		if (zklog_sid != 0 && zklog_sid != sess->ss_sid)
+			continue;
+		open[sid_to_srvid(sess->ss_sid)]++;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		h = &zklog_hists[i];
+		if (h->sh_created == 0 && h->sh_closed == 0 &&
+		    h->sh_expired == 0 && open[i] == 0) {
+			continue;
+		}
+		if (zklog_srvid != 0 && i != zklog_srvid)
+			continue;
+		ZKBUF_LIT(out, "{\"type\":\"_SESSIONHIST\",\"srvid\":");
+		zkbuf_uint(out, i);
+		ZKBUF_LIT(out, ",\"created\":");
+		zkbuf_uint(out, h->sh_created);
+		ZKBUF_LIT(out, ",\"closed\":");
+		zkbuf_uint(out, h->sh_closed);
+		ZKBUF_LIT(out, ",\"expired\":");
+		zkbuf_uint(out, h->sh_expired);
+		ZKBUF_LIT(out, ",\"noDuration\":");
+		zkbuf_uint(out, h->sh_unknown);
+		ZKBUF_LIT(out, ",\"open\":");
+		zkbuf_uint(out, open[i]);
+		session_hist_buckets(out, "closedLifetimes", h->sh_hist_closed);
+		session_hist_buckets(out, "expiredLifetimes",
+		    h->sh_hist_expired);
+		ZKBUF_LIT(out, "}\n");
+		zkout_check();
+	}
+}
+
+/*
+ * Aggregation (--aggregate).
+ *
+ * Rather than output each txn, this works out where the writes are going
+ * and prints a short summary at the end. The txns are decoded exactly as
+ * for -o bin (so that -j, the filters and the children of a MULTI all work
+ * the same way), but emit_rec() adds up the TXN records instead of writing
+ * them out. The summary is a series of JSON records, each with a "type"
+ * starting with "_" (like the _SESSION records of -S):
+ *
+ *	_SUMMARY	totals over everything decoded
+ *	_TXNTYPE	the number of txns of each type
+ *	_SERVER		totals for the sessions of each server id
+ *	_RATE		totals for each --interval, in time order
+ *	_PREFIX		the top --top path prefixes (the first --depth
+ *			components of a path) by the number of writes
+ *	_PATH		the top --top paths by the bytes of data written
+ *	_SESSIONSTAT	the top --top sessions by the number of writes
+ *
+ * A "write" is a txn (or child of a MULTI) that changes a node, and its
+ * bytes are the length of the data it sets. Sessions are counted as created
+ * and closed in the _RATE and _SERVER of their CREATESESSION and
+ * CLOSESESSION txns.
+ */
+struct zkstat {
+	uint64_t zst_txns;
+	uint64_t zst_writes;
+	uint64_t zst_bytes;
+	uint64_t zst_created;
+	uint64_t zst_closed;
+};
+
+/* Stats for each of a set of 64-bit keys, in an open-addressed table. */
+struct zkumap {
+	uint64_t *zum_keys;
+	uint8_t *zum_used;
+	struct zkstat *zum_stats;
+	size_t zum_size;
+	size_t zum_n;
+};
+
+/* Stats for each of a set of strings. */
+struct zksmap {
+	struct zkdict zsm_dict;
+	struct zkstat *zsm_stats;
+	size_t zsm_alloc;
+};
+
+static size_t zkagg_top = 10;
+static size_t zkagg_depth = 3;
+static uint64_t zkagg_interval = 3600 * 1000;
+
+static struct zkstat zkagg_total;
+static uint64_t zkagg_zxids[2];
+static uint64_t zkagg_times[2] = { UINT64_MAX, 0 };
+static uint64_t zkagg_ndurations;
+static uint64_t zkagg_duration_sum;
+static uint64_t zkagg_duration_max;
+static struct zkumap zkagg_types;
+static struct zkumap zkagg_servers;
+static struct zkumap zkagg_rates;
+static struct zkumap zkagg_sessions;
+static struct zksmap zkagg_prefixes;
+static struct zksmap zkagg_paths;
+
+static struct zkstat *
+zkumap_get(struct zkumap *m, uint64_t key)
+{
+	size_t mask, i;
+
+	if (2 * (m->zum_n + 1) > m->zum_size) {
+		struct zkumap old = *m;
+
+		m->zum_size = (old.zum_size == 0) ? 64 : old.zum_size * 2;
+		m->zum_keys = calloc(m->zum_size, sizeof (uint64_t));
+		m->zum_used = calloc(m->zum_size, 1);
+		m->zum_stats = calloc(m->zum_size, sizeof (struct zkstat));
+		if (m->zum_keys == NULL || m->zum_used == NULL ||
+		    m->zum_stats == NULL) {
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		}
+		m->zum_n = 0;
+		for (i = 0; i < old.zum_size; ++i) {
+			if (old.zum_used[i])
+				*zkumap_get(m, old.zum_keys[i]) =
+				    old.zum_stats[i];
+		}
+		free(old.zum_keys);
+		free(old.zum_used);
+		free(old.zum_stats);
+	}
+
+	mask = m->zum_size - 1;
+	for (i = (key * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+	    m->zum_used[i]; i = (i + 1) & mask) {
+		if (m->zum_keys[i] == key)
+			return (&m->zum_stats[i]);
+	}
+	m->zum_used[i] = 1;
+	m->zum_keys[i] = key;
+	m->zum_n++;
+	return (&m->zum_stats[i]);
+}
+
+static struct zkstat *
+zksmap_get(struct zksmap *m, const char *str, size_t len)
+{
+	uint32_t id;
+	int isnew;
+
+	id = zkdict_id(&m->zsm_dict, str, len, &isnew);
+	if (id == m->zsm_alloc) {
+		m->zsm_alloc = (m->zsm_alloc == 0) ? 1024 : m->zsm_alloc * 2;
+		m->zsm_stats = realloc(m->zsm_stats,
+		    m->zsm_alloc * sizeof (struct zkstat));
+		if (m->zsm_stats == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+	if (isnew)
+		bzero(&m->zsm_stats[id], sizeof (struct zkstat));
+	return (&m->zsm_stats[id]);
+}
+
+/*
+ * Adds up the TXN records of a txn (and any children) that passed the
+ * filters. "duration" is as for the txn's CLOSESESSION, if it is one.
+ */
+static void
+zkagg_rec(const struct zkjob *job, const struct zkrec *rec, uint64_t duration)
+{
+	const uint8_t *text = (const uint8_t *)job->zj_out.zb_data +
+	    rec->zr_off;
+	const uint8_t *end = text + rec->zr_len;
+	const char *path = NULL;
+	struct zkstat *st[4];
+	uint32_t pathlen, len;
+	int32_t type, datalen;
+	uint64_t bytes;
+	size_t i, n, depth;
+	int write;
+
+	if (zkagg_total.zst_txns == 0)
+		zkagg_zxids[0] = rec->zr_zxid;
+	zkagg_zxids[1] = rec->zr_zxid;
+	if (rec->zr_time < zkagg_times[0])
+		zkagg_times[0] = rec->zr_time;
+	if (rec->zr_time > zkagg_times[1])
+		zkagg_times[1] = rec->zr_time;
+
+	st[0] = &zkagg_total;
+	st[1] = zkumap_get(&zkagg_servers, sid_to_srvid(rec->zr_sid));
+	st[2] = zkumap_get(&zkagg_rates, rec->zr_time / zkagg_interval);
+	st[3] = zkumap_get(&zkagg_sessions, rec->zr_sid);
+	for (i = 0; i < 4; ++i) {
+		st[i]->zst_txns++;
+		if (rec->zr_type == ZK_CREATESESSION)
+			st[i]->zst_created++;
+		else if (rec->zr_type == ZK_CLOSESESSION)
+			st[i]->zst_closed++;
+	}
+	if (duration != 0) {
+		zkagg_ndurations++;
+		zkagg_duration_sum += duration;
+		if (duration > zkagg_duration_max)
+			zkagg_duration_max = duration;
+	}
+
+	while (text < end) {
+		bcopy(text, &pathlen, sizeof (pathlen));
+		text += sizeof (pathlen);
+		if (pathlen != ZKBIN_NO_PATH) {
+			path = (const char *)text;
+			text += pathlen;
+		}
+		len = text[0] | (text[1] << 8) | (text[2] << 16) |
+		    ((uint32_t)text[3] << 24);
+		type = (int32_t)(text[44] | (text[45] << 8) |
+		    (text[46] << 16) | ((uint32_t)text[47] << 24));
+		datalen = (int32_t)(text[56] | (text[57] << 8) |
+		    (text[58] << 16) | ((uint32_t)text[59] << 24));
+		text += len;
+
+		zkumap_get(&zkagg_types, (uint32_t)type)->zst_txns++;
+		write = (pathlen != ZKBIN_NO_PATH && type != ZK_CHECK);
+		if (!write)
+			continue;
+		bytes = (datalen > 0) ? (uint64_t)datalen : 0;
+
+		/* The prefix runs up to the slash after its last component. */
+		for (n = 1, depth = 0; n < pathlen; ++n) {
+			if (path[n] == '/' && ++depth == zkagg_depth)
+				break;
+		}
+		if (n > pathlen)
+			n = pathlen;
+		st[0] = zksmap_get(&zkagg_prefixes, path, n);
+		st[1] = zksmap_get(&zkagg_paths, path, pathlen);
+		st[0]->zst_writes++;
+		st[0]->zst_bytes += bytes;
+		st[1]->zst_writes++;
+		st[1]->zst_bytes += bytes;
+
+		st[0] = &zkagg_total;
+		st[1] = zkumap_get(&zkagg_servers, sid_to_srvid(rec->zr_sid));
+		st[2] = zkumap_get(&zkagg_rates, rec->zr_time / zkagg_interval);
+		st[3] = zkumap_get(&zkagg_sessions, rec->zr_sid);
+		for (i = 0; i < 4; ++i) {
+			st[i]->zst_writes++;
+			st[i]->zst_bytes += bytes;
+		}
+	}
+}
+
+/* What zkagg_sort() orders by (all but the keys, descending). */
+enum zkagg_order {
+	ZKAGG_KEYS,
+	ZKAGG_TXNS,
+	ZKAGG_WRITES,
+	ZKAGG_BYTES
+};
+
+static const struct zkstat *zkagg_sort_stats;
+static const uint64_t *zkagg_sort_keys;
+static enum zkagg_order zkagg_sort_order;
+
+static uint64_t
+zkagg_sortval(size_t i)
+{
+	switch (zkagg_sort_order) {
+	case ZKAGG_KEYS:
+		return (zkagg_sort_keys[i]);
+	case ZKAGG_TXNS:
+		return (zkagg_sort_stats[i].zst_txns);
+	case ZKAGG_WRITES:
+		return (zkagg_sort_stats[i].zst_writes);
+	default:
+		return (zkagg_sort_stats[i].zst_bytes);
+	}
+}
+
+static int
+zkagg_cmp(const void *a, const void *b)
+{
+	size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+	uint64_t va = zkagg_sortval(ia), vb = zkagg_sortval(ib);
+
+	if (zkagg_sort_order != ZKAGG_KEYS && va != vb)
+		return ((va < vb) - (va > vb));
+	if (va != vb)
+		return ((va > vb) - (va < vb));
+	return ((ia > ib) - (ia < ib));
+}
+
+/*
+ * Returns the indexes of the entries in a table (which has a "used" array if
+ * it's a zkumap) in the given order, skipping any with no writes if
+ * "writes" is set.
+ */
+static size_t *
+zkagg_sort(const struct zkstat *stats, const uint64_t *keys,
+    const uint8_t *used, size_t n, enum zkagg_order order, int writes,
+    size_t *countp)
+{
+	size_t *idx, count = 0;
+
+	if ((idx = malloc((n + 1) * sizeof (size_t))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	for (size_t i = 0; i < n; ++i) {
+		if ((used != NULL && !used[i]) ||
+		    (writes && stats[i].zst_writes == 0)) {
+			continue;
+		}
+		idx[count++] = i;
+	}
+	zkagg_sort_stats = stats;
+	zkagg_sort_keys = keys;
+	zkagg_sort_order = order;
+	qsort(idx, count, sizeof (size_t), zkagg_cmp);
+	*countp = count;
+	return (idx);
+}
+
+static void
+zkagg_stat(struct zkbuf *out, const struct zkstat *st)
+{
+	ZKBUF_LIT(out, "\"txns\":");
+	zkbuf_uint(out, st->zst_txns);
+	ZKBUF_LIT(out, ",\"writes\":");
+	zkbuf_uint(out, st->zst_writes);
+	ZKBUF_LIT(out, ",\"bytes\":");
+	zkbuf_uint(out, st->zst_bytes);
+	ZKBUF_LIT(out, ",\"sessionsCreated\":");
+	zkbuf_uint(out, st->zst_created);
+	ZKBUF_LIT(out, ",\"sessionsClosed\":");
+	zkbuf_uint(out, st->zst_closed);
+	ZKBUF_LIT(out, "}\n");
+	zkout_check();
+}
+
+static void
+zkagg_time(struct zkbuf *out, struct zktimecache *tc, const char *name,
+    uint64_t ms)
+{
+	char timebuf[64];
+	ssize_t len;
+
+	if ((len = format_time(tc, ms, timebuf)) < 0)
+		err(ZKLOG_EXIT_ERROR, "failed to convert time format");
+	ZKBUF_LIT(out, ",\"");
+	zkbuf_str(out, name);
+	ZKBUF_LIT(out, "\":\"");
+	zkbuf_append(out, timebuf, len);
+	ZKBUF_LIT(out, "\"");
+}
+
+/* Prints the summary records. */
+static void
+zkagg_print(void)
+{
+	struct zkbuf *out = &zklog_out;
+	struct zktimecache tc;
+	const struct zksmap *sm;
+	size_t *idx, n, i;
+
+	bzero(&tc, sizeof (tc));
+
+	ZKBUF_LIT(out, "{\"type\":\"_SUMMARY\"");
+	if (zkagg_total.zst_txns > 0) {
+		ZKBUF_LIT(out, ",\"firstZxid\":\"");
+		zkbuf_hex(out, zkagg_zxids[0]);
+		ZKBUF_LIT(out, "\",\"lastZxid\":\"");
+		zkbuf_hex(out, zkagg_zxids[1]);
+		ZKBUF_LIT(out, "\"");
+		zkagg_time(out, &tc, "start", zkagg_times[0]);
+		zkagg_time(out, &tc, "end", zkagg_times[1]);
+	}
+	ZKBUF_LIT(out, ",\"sessions\":");
+	zkbuf_uint(out, zkagg_sessions.zum_n);
+	if (zklog_merge) {
+		ZKBUF_LIT(out, ",\"gaps\":");
+		zkbuf_uint(out, zklog_gaps);
+		ZKBUF_LIT(out, ",\"missingZxids\":");
+		zkbuf_uint(out, zklog_missing);
+	}
+	if (zkagg_ndurations > 0) {
+		ZKBUF_LIT(out, ",\"meanDuration\":");
+		zkbuf_uint(out, zkagg_duration_sum / zkagg_ndurations);
+		ZKBUF_LIT(out, ",\"maxDuration\":");
+		zkbuf_uint(out, zkagg_duration_max);
+	}
+	ZKBUF_LIT(out, ",");
+	zkagg_stat(out, &zkagg_total);
+
+	idx = zkagg_sort(zkagg_types.zum_stats, zkagg_types.zum_keys,
+	    zkagg_types.zum_used, zkagg_types.zum_size, ZKAGG_TXNS, 0, &n);
+	for (i = 0; i < n; ++i) {
+		int32_t type = (int32_t)zkagg_types.zum_keys[idx[i]];
+
+		ZKBUF_LIT(out, "{\"type\":\"_TXNTYPE\",\"name\":\"");
+		zkbuf_str(out, zktxn_type_to_name((enum zktxn_type)type));
+		ZKBUF_LIT(out, "\",\"typeid\":");
+		zkbuf_int(out, type);
+		ZKBUF_LIT(out, ",\"txns\":");
+		zkbuf_uint(out, zkagg_types.zum_stats[idx[i]].zst_txns);
+		ZKBUF_LIT(out, "}\n");
+		zkout_check();
+	}
+	free(idx);
+
+	idx = zkagg_sort(zkagg_servers.zum_stats, zkagg_servers.zum_keys,
+	    zkagg_servers.zum_used, zkagg_servers.zum_size, ZKAGG_KEYS, 0,
+	    &n);
+	for (i = 0; i < n; ++i) {
+		ZKBUF_LIT(out, "{\"type\":\"_SERVER\",\"srvid\":");
+		zkbuf_uint(out, zkagg_servers.zum_keys[idx[i]]);
+		ZKBUF_LIT(out, ",");
+		zkagg_stat(out, &zkagg_servers.zum_stats[idx[i]]);
+	}
+	free(idx);
+
+	idx = zkagg_sort(zkagg_rates.zum_stats, zkagg_rates.zum_keys,
+	    zkagg_rates.zum_used, zkagg_rates.zum_size, ZKAGG_KEYS, 0, &n);
+	for (i = 0; i < n; ++i) {
+		ZKBUF_LIT(out, "{\"type\":\"_RATE\"");
+		zkagg_time(out, &tc, "time",
+		    zkagg_rates.zum_keys[idx[i]] * zkagg_interval);
+		ZKBUF_LIT(out, ",");
+		zkagg_stat(out, &zkagg_rates.zum_stats[idx[i]]);
+	}
+	free(idx);
+
+	for (int p = 0; p < 2; ++p) {
+		sm = (p == 0) ? &zkagg_prefixes : &zkagg_paths;
+		idx = zkagg_sort(sm->zsm_stats, NULL, NULL,
+		    sm->zsm_dict.zd_n, (p == 0) ? ZKAGG_WRITES : ZKAGG_BYTES,
+		    0, &n);
+		for (i = 0; i < n && i < zkagg_top; ++i) {
+			if (p == 0) {
+				ZKBUF_LIT(out, "{\"type\":\"_PREFIX\","
+				    "\"prefix\":\"");
+			} else {
+				ZKBUF_LIT(out, "{\"type\":\"_PATH\","
+				    "\"path\":\"");
+			}
+			zkbuf_append(out, sm->zsm_dict.zd_strs[idx[i]],
+			    sm->zsm_dict.zd_lens[idx[i]]);
+			ZKBUF_LIT(out, "\",\"writes\":");
+			zkbuf_uint(out, sm->zsm_stats[idx[i]].zst_writes);
+			ZKBUF_LIT(out, ",\"bytes\":");
+			zkbuf_uint(out, sm->zsm_stats[idx[i]].zst_bytes);
+			ZKBUF_LIT(out, "}\n");
+			zkout_check();
+		}
+		free(idx);
+	}
+
+	idx = zkagg_sort(zkagg_sessions.zum_stats, NULL,
+	    zkagg_sessions.zum_used, zkagg_sessions.zum_size, ZKAGG_WRITES, 1,
+	    &n);
+	for (i = 0; i < n && i < zkagg_top; ++i) {
+		ZKBUF_LIT(out, "{\"type\":\"_SESSIONSTAT\",\"sessionid\":\"");
+		zkbuf_hex(out, zkagg_sessions.zum_keys[idx[i]]);
+		ZKBUF_LIT(out, "\",");
+		zkagg_stat(out, &zkagg_sessions.zum_stats[idx[i]]);
+	}
+	free(idx);
+}
+
+/*
+ * Runs a record through session tracking and writes out its text. This must
+ * be called for every record, in log order.
+ */
+static void
+emit_rec(const struct zkjob *job, const struct zkrec *rec)
+{
+	const char *text = job->zj_out.zb_data + rec->zr_off;
+	uint64_t duration;
+
+	duration = session_track(job, rec);
+
+	if (!rec->zr_output)
+		return;
+	if (zklog_sesshist)
+		session_hist_add(rec, duration);
+
+	if (zklog_aggregate) {
+		zkagg_rec(job, rec, duration);
+		return;
+	} else if (zklog_binary) {
+		zkbin_emit(job, rec, duration);
+	} else if (rec->zr_type == ZK_CLOSESESSION && duration != 0) {
+		zkbuf_append(&zklog_out, text, rec->zr_split);
+		ZKBUF_LIT(&zklog_out, ",\"duration\":");
+		zkbuf_uint(&zklog_out, duration);
+		zkbuf_append(&zklog_out, text + rec->zr_split,
+		    rec->zr_len - rec->zr_split);
+	} else {
+		zkbuf_append(&zklog_out, text, rec->zr_len);
+	}
+	zkout_check();
+}
+
+/*
+ * Emits all the records accumulated in the job so far and discards them.
+ */
+static void
+emit_job(struct zkjob *job)
+{
+	for (size_t i = 0; i < job->zj_nrecs; ++i)
+		emit_rec(job, &job->zj_recs[i]);
+	zkjob_reset(job);
+}
+
+static void __attribute__((noreturn))
+zkjob_exit(struct zkjob *job)
+{
+	zkout_flush();
+	errx(job->zj_errcode, "%s", job->zj_errmsg);
+}
+
+/*
+ * Parallel decoding (-j).
+ *
+ * Each file starts out as a single job, and the jobs are sorted by the zxid
+ * of the first txn in their file (read up front). A worker thread that picks
+ * up a large file first makes a quick pass over it that only follows the txn
+ * length and terminator fields, to find where to split it into chunks. It
+ * keeps the first chunk for itself and queues the rest as jobs right behind
+ * it (or among the jobs for any other files that overlap it), so that one big
+ * txnlog is decoded on as many threads as a directory full of small ones.
+ *
+ * Meanwhile the main thread merges the records of completed jobs by zxid.
+ * Records below the lowest first zxid of all the work still outstanding are
+ * safe to emit straight away, since no job can produce anything earlier than
+ * its first txn. Workers are only allowed to run a bounded number of jobs
+ * ahead of the merge, which keeps memory use proportional to the number of
+ * threads rather than the size of the input.
+ *
+ * All session tracking happens in emit_rec() as the records are merged, so
+ * it sees every txn in zxid order no matter which file or thread it came
+ * from.
+ */
+struct zkpool {
+	pthread_mutex_t zp_lock;
+	pthread_cond_t zp_done_cv;
+	pthread_cond_t zp_window_cv;
+	unsigned int zp_nthreads;
+	/* All the jobs not yet handed to the merge, in merge order. */
+	struct zkjob *zp_limit;
+	/* Number of jobs claimed but not yet handed to the merge. */
+	size_t zp_inflight;
+	size_t zp_window;
+	/* Number of files being opened, which may yet add more jobs. */
+	size_t zp_opening;
+};
+
+/* Files smaller than two chunks are decoded as a single job. */
+#define	ZKLOG_CHUNK_SIZE	(4 * 1024 * 1024)
+
+/*
+ * Reads the zxid of the first txn in a file, for ordering the work. Problems
+ * with the file are left for zkfile_open() to find and report: such files
+ * sort first, so that their errors come out at the same point they would
+ * have without -j.
+ */
+static uint64_t
+first_zxid(const char *fname)
+{
+	uint8_t hdr[sizeof (struct zklog) + sizeof (struct zktxn)];
+	struct zktxn *txn = (struct zktxn *)(hdr + sizeof (struct zklog));
+	ssize_t need = sizeof (struct zklog) + offsetof(struct zktxn, zt_time);
+	enum zkcomp comp;
+	struct zkz zz;
+	uint64_t zxid = 0;
+	ssize_t got;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return (0);
+	if ((comp = zkcomp_detect(fd)) != ZKCOMP_NONE) {
+		got = (zkz_init(&zz, comp, fd) == 0) ?
+		    zkz_read(&zz, hdr, need) : -1;
+		zkz_fini(&zz);
+	} else {
+		got = pread(fd, hdr, need, 0);
+	}
+	if (got == need) {
+		if (zk_load32(&txn->zt_len) == 0)
+			zxid = UINT64_MAX;
+		else
+			zxid = zk_load64(&txn->zt_zxid);
+	}
+	(void) close(fd);
+
+	return (zxid);
+}
+
+static int
+zkfile_cmp_first(const void *a, const void *b)
+{
+	const struct zkfile *fa = a, *fb = b;
+
+	if (fa->zf_first_zxid != fb->zf_first_zxid)
+		return (fa->zf_first_zxid < fb->zf_first_zxid ? -1 : 1);
+	return (fa->zf_index < fb->zf_index ? -1 : 1);
+}
+
+static struct zkjob *
+zkjob_alloc(struct zkfile *zf, uint64_t first_zxid, size_t start, size_t end)
+{
+	struct zkjob *job;
+
+	if ((job = calloc(1, sizeof (struct zkjob))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	job->zj_file = zf;
+	job->zj_first_zxid = first_zxid;
+	job->zj_start = start;
+	job->zj_end = end;
+
+	return (job);
+}
+
+/*
+ * The boundary pass over a newly opened file: follows the txn lengths from
+ * the start of the job and splits off everything beyond the first chunk into
+ * new jobs, which are returned as a list. This only validates what it needs
+ * to in order to keep going; if it finds anything wrong it just stops
+ * splitting, leaving the problem to be found and reported at the right point
+ * by the job that decodes that part of the file. Like decode_txns(), it gives
+ * back the pages it's done with as it goes, since the jobs may not get to
+ * them for a while.
+ */
+static struct zkjob *
+split_file(struct zkjob *job)
+{
+	struct zkfile *zf = job->zj_file;
+	struct zkjob *head = NULL, **tail = &head, *prev = job;
+	size_t offset = job->zj_start;
+	size_t chunk_start = offset;
+	size_t end = job->zj_end;
+	size_t released = offset - offset % ZKL_RELEASE;
+	size_t next = offset;
+	const struct zktxn *txn;
+	uint32_t txnlen;
+
+	while (offset < end &&
+	    zkl_frame(zf->zf_data, zf->zf_len, &next, &txn, &txnlen) > 0) {
+		if (offset - chunk_start >= ZKLOG_CHUNK_SIZE) {
+			prev->zj_end = offset;
+			prev = zkjob_alloc(zf, zk_load64(&txn->zt_zxid), offset,
+			    end);
+			*tail = prev;
+			tail = &prev->zj_link;
+			chunk_start = offset;
+		}
+
+		offset = next;
+		zkl_release(zf->zf_data, offset, &released);
+	}
+	zkl_release_rest(zf->zf_data, offset, &released);
+
+	/*
+	 * The last chunk runs to the end of the original job (usually the end
+	 * of the file), so that it finds the end of the log (or the problem
+	 * that stopped us) itself.
+	 */
+	return (head);
+}
+
+/*
+ * Queues a list of new jobs for a file behind "pos". Each goes in by its
+ * first zxid: that's right behind the one before it, unless other logs
+ * overlap it (as with --merge), when their jobs for the same txns have to be
+ * interleaved with these. Otherwise the merge would be left holding all of
+ * this file before it got to any of them. Must be called with zp_lock held.
+ */
+static void
+zkpool_queue(struct zkjob *pos, struct zkjob *jobs)
+{
+	struct zkjob *next;
+
+	for (; jobs != NULL; jobs = next) {
+		next = jobs->zj_link;
+		while (pos->zj_link != NULL &&
+		    pos->zj_link->zj_first_zxid <= jobs->zj_first_zxid) {
+			pos = pos->zj_link;
+		}
+		jobs->zj_link = pos->zj_link;
+		pos->zj_link = jobs;
+		pos = jobs;
+		jobs->zj_file->zf_refs++;
+	}
+}
+
+/*
+ * Decodes the next part of a compressed log. It can't be split up front the
+ * way a mapped one can, so instead we stop once the job holds a chunk's
+ * worth of records, and queue another to carry on from there. The merge can
+ * then have this part while the rest waits its turn in the window like any
+ * other chunk, so we never hold more of the log's output than that.
+ */
+static void
+zkpool_stream(struct zkpool *pool, struct zkjob *job)
+{
+	struct zkstream *zs = job->zj_stream;
+	struct zkjob *rest;
+
+	job->zj_stream = NULL;
+	if (zs == NULL && (zs = zkstream_open(job)) == NULL)
+		return;
+	if (zkstream_decode(job, zs, decode_txn, 0, ZKLOG_CHUNK_SIZE) != 1) {
+		zkstream_close(zs);
+		return;
+	}
+
+	/* We stopped after a record, so there's at least one. */
+	rest = zkjob_alloc(job->zj_file,
+	    job->zj_recs[job->zj_nrecs - 1].zr_zxid + 1,
+	    zs->zs_base + zs->zs_pos, SIZE_MAX);
+	rest->zj_stream = zs;
+
+	VERIFY0(pthread_mutex_lock(&pool->zp_lock));
+	zkpool_queue(job, rest);
+	VERIFY0(pthread_cond_broadcast(&pool->zp_window_cv));
+	VERIFY0(pthread_mutex_unlock(&pool->zp_lock));
+}
+
+/*
+ * Decodes one job on a worker thread. The first job for each file opens it,
+ * and may split it into more jobs; whichever job finishes with the file last
+ * unmaps it.
+ */
+static void
+zkpool_run(struct zkpool *pool, struct zkjob *job)
+{
+	struct zkfile *zf = job->zj_file;
+	struct zkjob *chunks;
+	int unmap;
+
+	if (job->zj_end == 0) {
+		int rv;
+
+		chunks = NULL;
+		if ((rv = zkfile_open(job)) == 0 && zklog_ranged &&
+		    zf->zf_comp == ZKCOMP_NONE) {
+			zkidx_narrow(job);
+		}
+		if (rv == 0 && zf->zf_comp == ZKCOMP_NONE &&
+		    job->zj_end - job->zj_start >= 2 * ZKLOG_CHUNK_SIZE) {
+			chunks = split_file(job);
+		}
+
+		VERIFY0(pthread_mutex_lock(&pool->zp_lock));
+		zf->zf_refs = 1;
+		zkpool_queue(job, chunks);
+		pool->zp_opening--;
+		VERIFY0(pthread_cond_broadcast(&pool->zp_window_cv));
+		VERIFY0(pthread_mutex_unlock(&pool->zp_lock));
+
+		if (rv != 0)
+			return;
+	}
+
+	if (zf->zf_comp != ZKCOMP_NONE)
+		zkpool_stream(pool, job);
+	else
+		(void) decode_txns(job, job->zj_start, job->zj_end, 0);
+
+	VERIFY0(pthread_mutex_lock(&pool->zp_lock));
+	unmap = (--zf->zf_refs == 0);
+	VERIFY0(pthread_mutex_unlock(&pool->zp_lock));
+
+	if (unmap)
+		(void) zkfile_close(job);
+}
+
+static void *
+zkpool_worker(void *arg)
+{
+	struct zkpool *pool = arg;
+	struct zkjob *job;
+
+	VERIFY0(pthread_mutex_lock(&pool->zp_lock));
+	for (;;) {
+		/*
+		 * Jobs split off a file are queued behind it, so the first
+		 * unclaimed job isn't necessarily after the last one claimed.
+		 * Everything between the merge and it is in flight, though,
+		 * so this doesn't take long.
+		 */
+		for (job = pool->zp_limit; job != NULL; job = job->zj_link) {
+			if (!job->zj_claimed)
+				break;
+		}
+		if (job == NULL && pool->zp_opening == 0)
+			break;
+		if (job == NULL || pool->zp_inflight >= pool->zp_window) {
+			VERIFY0(pthread_cond_wait(&pool->zp_window_cv,
+			    &pool->zp_lock));
+			continue;
+		}
+
+		job->zj_claimed = 1;
+		pool->zp_inflight++;
+		if (job->zj_end == 0)
+			pool->zp_opening++;
+		VERIFY0(pthread_mutex_unlock(&pool->zp_lock));
+
+		zkpool_run(pool, job);
+
+		VERIFY0(pthread_mutex_lock(&pool->zp_lock));
+		job->zj_done = 1;
+		VERIFY0(pthread_cond_broadcast(&pool->zp_done_cv));
+	}
+	VERIFY0(pthread_mutex_unlock(&pool->zp_lock));
+
+	return (NULL);
+}
+
+/*
+ * Returns the lowest zxid that any job not yet handed to the merge could
+ * produce. Must be called with zp_lock held.
+ */
+static uint64_t
+zkpool_bound(struct zkpool *pool)
+{
+	uint64_t bound = UINT64_MAX;
+	struct zkjob *job;
+
+	/*
+	 * The jobs are kept in order of their first zxid (see zkpool_run()),
+	 * so we needn't look past the first unclaimed whole-file job.
+	 */
+	for (job = pool->zp_limit; job != NULL; job = job->zj_link) {
+		if (job->zj_first_zxid < bound)
+			bound = job->zj_first_zxid;
+		if (!job->zj_claimed && job->zj_end == 0)
+			break;
+	}
+
+	return (bound);
+}
+
+/*
+ * A binary min-heap of jobs, ordered by the zxid of their next record.
+ */
+struct zkheap {
+	struct zkjob **zh_jobs;
+	size_t zh_n;
+	size_t zh_size;
+};
+
+static int
+heap_less(struct zkjob *a, struct zkjob *b)
+{
+	uint64_t za = a->zj_recs[a->zj_next].zr_zxid;
+	uint64_t zb = b->zj_recs[b->zj_next].zr_zxid;
+
+	if (za != zb)
+		return (za < zb);
+	if (a->zj_file->zf_index != b->zj_file->zf_index)
+		return (a->zj_file->zf_index < b->zj_file->zf_index);
+	return (a->zj_start < b->zj_start);
+}
+
+static void
+heap_sift_down(struct zkheap *h, size_t i)
+{
+	struct zkjob **heap = h->zh_jobs;
+
+	for (;;) {
+		size_t l = 2 * i + 1, r = l + 1, min = i;
+		struct zkjob *tmp;
+
+		if (l < h->zh_n && heap_less(heap[l], heap[min]))
+			min = l;
+		if (r < h->zh_n && heap_less(heap[r], heap[min]))
+			min = r;
+		if (min == i)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void
+heap_push(struct zkheap *h, struct zkjob *job)
+{
+	struct zkjob **heap;
+	size_t i;
+
+	if (h->zh_n == h->zh_size) {
+		h->zh_size = h->zh_size == 0 ? 64 : h->zh_size * 2;
+		heap = realloc(h->zh_jobs, h->zh_size * sizeof (*heap));
+		if (heap == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		h->zh_jobs = heap;
+	}
+	heap = h->zh_jobs;
+
+	i = h->zh_n++;
+	heap[i] = job;
+	while (i > 0 && heap_less(heap[i], heap[(i - 1) / 2])) {
+		struct zkjob *tmp = heap[i];
+		heap[i] = heap[(i - 1) / 2];
+		heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+/*
+ * A job with no records left is finished with: if it failed, this is the
+ * point in the output where we report it.
+ */
+static void
+zkjob_retire(struct zkjob *job)
+{
+	if (job->zj_errcode != 0)
+		zkjob_exit(job);
+	zkjob_free(job);
+	free(job);
+}
+
+/*
+ * Merging members' logs (--merge).
+ *
+ * Every member of an ensemble logs the same committed txns, but each rolls
+ * over to a new log at its own points, and one that was down for a while (or
+ * was rebuilt from another's snapshot) won't have the txns from then. With
+ * --merge the logs we're given, or the -D directories (one for each member),
+ * can come from any of them. The parallel decoding above already merges its
+ * records into zxid order; all we do is drop the copies of each txn after the
+ * first, and look for zxids that none of the logs had. Nothing more is held in
+ * memory than for -j: the logs are mapped and split into chunks (even on one
+ * thread), and the chunks of all the logs are decoded in order of their first
+ * zxid, only a bounded number of them ahead of the merge. A compressed log
+ * can't be split up front, but it's decoded a chunk's worth at a time instead
+ * (see zkpool_stream()).
+ *
+ * A zxid has the epoch of the leader that proposed it in its high 32 bits and
+ * a counter in the low 32, which starts from 1 in each epoch. So txns are
+ * missing where the counter skips some, or a new epoch starts after 1; those
+ * at the end of an epoch can't be told apart from its having ended there.
+ * Each range missing (within the range options, if any) is reported in its
+ * place among the txns, with type "_GAP", and we exit with status 3 if there
+ * were any.
+ */
+#define	ZXID_EPOCH(zxid)	((zxid) >> 32)
+#define	ZXID_COUNTER(zxid)	((zxid) & 0xFFFFFFFFULL)
+
+/* The last txn from the merge, once there's been one. */
+static int zklog_merge_any = 0;
+static uint64_t zklog_merge_zxid;
+static uint64_t zklog_merge_time;
+static struct zktimecache zklog_merge_tc;
+
+/*
+ * Reports the zxids from "first" to "last" missing, between the last txn and
+ * one at time "next".
+ */
+static void
+merge_gap(uint64_t first, uint64_t last, uint64_t next)
+{
+	struct zkbuf *out = &zklog_out;
+	size_t start;
+
+	if (first < zklog_zxid_from)
+		first = zklog_zxid_from;
+	if (last > zklog_zxid_to)
+		last = zklog_zxid_to;
+	if (first > last || next < zklog_since ||
+	    zklog_merge_time > zklog_until) {
+		return;
+	}
+	zklog_gaps++;
+	zklog_missing += last - first + 1;
+
+	if (zklog_aggregate)
+		return;
+	if (zklog_binary) {
+		start = out->zb_len;
+		zkbuf_le(out, 0, 4);
+		zkbuf_le(out, ZKBIN_KIND_GAP, 2);
+		zkbuf_le(out, 0, 2);
+		zkbuf_le(out, first, 8);
+		zkbuf_le(out, last, 8);
+		zkbuf_le(out, zklog_merge_time, 8);
+		zkbuf_le(out, next, 8);
+		zkbin_patch((uint8_t *)out->zb_data + start,
+		    out->zb_len - start, 4);
+	} else {
+		ZKBUF_LIT(out, "{\"type\":\"_GAP\",\"firstZxid\":\"");
+		zkbuf_hex(out, first);
+		ZKBUF_LIT(out, "\",\"lastZxid\":\"");
+		zkbuf_hex(out, last);
+		ZKBUF_LIT(out, "\",\"count\":");
+		zkbuf_uint(out, last - first + 1);
+		zkagg_time(out, &zklog_merge_tc, "start", zklog_merge_time);
+		zkagg_time(out, &zklog_merge_tc, "end", next);
+		ZKBUF_LIT(out, "}\n");
+	}
+	zkout_check();
+}
+
+/*
+ * Returns whether a record from the merge is the first copy of its txn,
+ * reporting any gap between it and the one before.
+ */
+static int
+merge_rec(const struct zkrec *rec)
+{
+	uint64_t zxid = rec->zr_zxid;
+
+	if (zklog_merge_any) {
+		if (zxid == zklog_merge_zxid)
+			return (0);
+		if (ZXID_EPOCH(zxid) == ZXID_EPOCH(zklog_merge_zxid)) {
+			if (zxid > zklog_merge_zxid + 1) {
+				merge_gap(zklog_merge_zxid + 1, zxid - 1,
+				    rec->zr_time);
+			}
+		} else if (zxid > zklog_merge_zxid && ZXID_COUNTER(zxid) > 1) {
+			merge_gap(zxid - ZXID_COUNTER(zxid) + 1, zxid - 1,
+			    rec->zr_time);
+		}
+	}
+	zklog_merge_any = 1;
+	zklog_merge_zxid = zxid;
+	zklog_merge_time = rec->zr_time;
+
+	return (1);
+}
+
+static void
+do_files_parallel(char **fnames, size_t nfiles, unsigned int nthreads)
+{
+	struct zkpool pool;
+	struct zkheap heap;
+	struct zkfile *files;
+	struct zkjob **tail;
+	pthread_t *threads;
+	size_t i;
+
+	bzero(&pool, sizeof (pool));
+	bzero(&heap, sizeof (heap));
+	VERIFY0(pthread_mutex_init(&pool.zp_lock, NULL));
+	VERIFY0(pthread_cond_init(&pool.zp_done_cv, NULL));
+	VERIFY0(pthread_cond_init(&pool.zp_window_cv, NULL));
+	pool.zp_nthreads = nthreads;
+	pool.zp_window = 2 * nthreads;
+
+	files = calloc(nfiles, sizeof (struct zkfile));
+	threads = calloc(nthreads, sizeof (pthread_t));
+	if (files == NULL || threads == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < nfiles; ++i) {
+		files[i].zf_name = fnames[i];
+		files[i].zf_index = i;
+		files[i].zf_first_zxid = first_zxid(fnames[i]);
+	}
+	qsort(files, nfiles, sizeof (struct zkfile), zkfile_cmp_first);
+
+	tail = &pool.zp_limit;
+	for (i = 0; i < nfiles; ++i) {
+		*tail = zkjob_alloc(&files[i], files[i].zf_first_zxid, 0, 0);
+		tail = &(*tail)->zj_link;
+	}
+
+	for (i = 0; i < nthreads; ++i) {
+		if ((errno = pthread_create(&threads[i], NULL, zkpool_worker,
+		    &pool)) != 0) {
+			err(ZKLOG_EXIT_ERROR, "failed to create thread");
+		}
+	}
+
+	for (;;) {
+		uint64_t bound;
+		int emitted = 0;
+
+		VERIFY0(pthread_mutex_lock(&pool.zp_lock));
+		while (pool.zp_limit != NULL && pool.zp_limit->zj_done) {
+			struct zkjob *job = pool.zp_limit;
+			pool.zp_limit = job->zj_link;
+			pool.zp_inflight--;
+			if (job->zj_nrecs > 0)
+				heap_push(&heap, job);
+			else
+				zkjob_retire(job);
+		}
+		bound = zkpool_bound(&pool);
+		VERIFY0(pthread_cond_broadcast(&pool.zp_window_cv));
+		VERIFY0(pthread_mutex_unlock(&pool.zp_lock));
+
+		if (heap.zh_n == 0 && pool.zp_limit == NULL)
+			break;
+
+		while (heap.zh_n > 0) {
+			struct zkjob *job = heap.zh_jobs[0];
+			struct zkrec *rec = &job->zj_recs[job->zj_next];
+
+			if (pool.zp_limit != NULL && rec->zr_zxid >= bound)
+				break;
+
+			if (!zklog_merge || merge_rec(rec))
+				emit_rec(job, rec);
+			emitted = 1;
+
+			if (++job->zj_next == job->zj_nrecs) {
+				zkjob_retire(job);
+				heap.zh_jobs[0] = heap.zh_jobs[--heap.zh_n];
+			}
+			heap_sift_down(&heap, 0);
+		}
+
+		if (emitted)
+			continue;
+
+		VERIFY0(pthread_mutex_lock(&pool.zp_lock));
+		while (pool.zp_limit != NULL && !pool.zp_limit->zj_done) {
+			VERIFY0(pthread_cond_wait(&pool.zp_done_cv,
+			    &pool.zp_lock));
+		}
+		VERIFY0(pthread_mutex_unlock(&pool.zp_lock));
+	}
+
+	for (i = 0; i < nthreads; ++i)
+		VERIFY0(pthread_join(threads[i], NULL));
+
+	free(threads);
+	free(heap.zh_jobs);
+	free(files);
+}
+
+/*
+ * Puts the files into the order -j decodes them in, for when there's only
+ * one thread: with nothing to hand chunks to, and no members to merge, we
+ * decode them in that order as we would without -j, streaming the output.
+ */
+static void
+order_files(char **fnames, size_t nfiles)
+{
+	struct zkfile *files;
+	char **given;
+	size_t i;
+
+	if (nfiles < 2)
+		return;
+	files = calloc(nfiles, sizeof (struct zkfile));
+	given = calloc(nfiles, sizeof (char *));
+	if (files == NULL || given == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	bcopy(fnames, given, nfiles * sizeof (char *));
+	for (i = 0; i < nfiles; ++i) {
+		files[i].zf_name = fnames[i];
+		files[i].zf_index = i;
+		files[i].zf_first_zxid = first_zxid(fnames[i]);
+	}
+	qsort(files, nfiles, sizeof (struct zkfile), zkfile_cmp_first);
+	for (i = 0; i < nfiles; ++i)
+		fnames[i] = given[files[i].zf_index];
+	free(given);
+	free(files);
+}
+
+static void
+do_files(char **fnames, size_t nfiles)
+{
+	struct zkfile file;
+	struct zkjob job;
+
+	for (size_t i = 0; i < nfiles; ++i) {
+		bzero(&file, sizeof (file));
+		bzero(&job, sizeof (job));
+		file.zf_name = fnames[i];
+		file.zf_index = i;
+		job.zj_file = &file;
+		if (do_file(&job, 1) != 0) {
+			emit_job(&job);
+			zkjob_exit(&job);
+		}
+		emit_job(&job);
+		zkjob_free(&job);
+	}
+}
+
+/*
+ * Verification (--verify).
+ *
+ * Each txn carries the Adler-32 of everything its zt_len covers, which ZK
+ * computes when it writes the txn and checks when it replays the log. With
+ * --verify we check it for every txn instead of decoding them, to scrub the
+ * logs. We don't stop at the first problem: each run of txns that fail the
+ * check is reported as a "_CORRUPT" record, with its byte range in the log
+ * and the zxids it claims to cover, and we carry on after it. If the framing
+ * (a length or terminator) is damaged we have to search for the next txn we
+ * can believe in: one whose checksum holds. ZK stores the checksum in a long,
+ * so its high half is always zero, which rules out almost every offset before
+ * we compute anything. Each log then gets a "_VERIFY" record saying what we
+ * found, and if any were damaged we exit with ZKLOG_EXIT_BAD_FORMAT.
+ *
+ * This has to keep up with the disks, so the checksum is done 16 bytes at a
+ * time with SSE2 where we have it (which is any amd64 machine), and -j
+ * verifies that many logs at once.
+ */
+#define	ZKADLER_BASE		65521
+/* The most bytes we can sum before s2 could overflow 32 bits (as in zlib). */
+#define	ZKADLER_NMAX		5552
+/* The longest txn we'll believe in while looking for the next good one. */
+#define	ZKVERIFY_MAX_TXN	(1024 * 1024)
+
+static uint32_t
+zk_adler32(const uint8_t *p, size_t len)
+{
+	uint32_t s1 = 1, s2 = 0;
+	size_t n;
+
+	while (len > 0) {
+		n = (len < ZKADLER_NMAX) ? len : ZKADLER_NMAX;
+		len -= n;
+#ifdef __SSE2__
+		/*
+		 * For each block of 16 bytes, s1 gains their sum, and s2 gains
+		 * 16 times the s1 from before the block, plus the bytes
+		 * weighted 16 down to 1. We keep the sums of the blocks, the
+		 * running total of the s1s before each block, and the weighted
+		 * sums in vectors, and only add them up at the end.
+		 */
+		if (n >= 16) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i wlo = _mm_set_epi16(9, 10, 11, 12, 13, 14,
+			    15, 16);
+			const __m128i whi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7,
+			    8);
+			__m128i vs1 = zero, vs1p = zero, vs2 = zero, b;
+			uint32_t t1[4], tp[4], t2[4];
+			size_t i, nb = n / 16;
+
+			for (i = 0; i < nb; ++i, p += 16) {
+				b = _mm_loadu_si128((const __m128i *)p);
+				vs1p = _mm_add_epi32(vs1p, vs1);
+				vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(b, zero));
+				vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(
+				    _mm_unpacklo_epi8(b, zero), wlo));
+				vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(
+				    _mm_unpackhi_epi8(b, zero), whi));
+			}
+			_mm_storeu_si128((__m128i *)t1, vs1);
+			_mm_storeu_si128((__m128i *)tp, vs1p);
+			_mm_storeu_si128((__m128i *)t2, vs2);
+
+			/* The sums of bytes are in the low half of each 64. */
+			s2 += nb * 16 * s1 + 16 * (tp[0] + tp[2]) +
+			    t2[0] + t2[1] + t2[2] + t2[3];
+			s1 += t1[0] + t1[2];
+			n -= nb * 16;
+		}
+#endif
+		for (; n > 0; --n) {
+			s1 += *p++;
+			s2 += s1;
+		}
+		s1 %= ZKADLER_BASE;
+		s2 %= ZKADLER_BASE;
+	}
+
+	return ((s2 << 16) | s1);
+}
+
+/* What we've found in one log. */
+struct zkverify {
+	/* First, so that verify_stream_txn() can get back here from it. */
+	struct zkjob zv_job;
+	struct zkfile zv_file;
+	struct zkbuf zv_out;
+	uint64_t zv_txns;
+	uint64_t zv_corrupt;
+	uint64_t zv_first_zxid;
+	uint64_t zv_last_zxid;
+	/* Offset of the next txn. */
+	size_t zv_off;
+	/* The run of txns failing the checksum we're in, if zv_run_txns > 0. */
+	size_t zv_run_start;
+	size_t zv_run_end;
+	uint64_t zv_run_txns;
+	uint64_t zv_run_first;
+	uint64_t zv_run_last;
+	int zv_bad;
+	int zv_done;
+};
+
+static void
+verify_corrupt(struct zkverify *zv, const char *reason, size_t start,
+    size_t end)
+{
+	struct zkbuf *out = &zv->zv_out;
+
+	zv->zv_bad = 1;
+	ZKBUF_LIT(out, "{\"type\":\"_CORRUPT\",\"file\":\"");
+	zkbuf_str(out, zv->zv_file.zf_name);
+	ZKBUF_LIT(out, "\",\"reason\":\"");
+	zkbuf_str(out, reason);
+	ZKBUF_LIT(out, "\",\"start\":");
+	zkbuf_uint(out, start);
+	ZKBUF_LIT(out, ",\"end\":");
+	zkbuf_uint(out, end);
+}
+
+/* Reports the run of txns failing the checksum we're in, if any. */
+static void
+verify_end_run(struct zkverify *zv)
+{
+	struct zkbuf *out = &zv->zv_out;
+
+	if (zv->zv_run_txns == 0)
+		return;
+
+	verify_corrupt(zv, "checksum", zv->zv_run_start, zv->zv_run_end);
+	ZKBUF_LIT(out, ",\"txns\":");
+	zkbuf_uint(out, zv->zv_run_txns);
+	ZKBUF_LIT(out, ",\"firstZxid\":\"");
+	zkbuf_hex(out, zv->zv_run_first);
+	ZKBUF_LIT(out, "\",\"lastZxid\":\"");
+	zkbuf_hex(out, zv->zv_run_last);
+	ZKBUF_LIT(out, "\"}\n");
+	zv->zv_run_txns = 0;
+}
+
+/* Checks a (well-framed) txn at zv_off, and moves past it. */
+static void
+verify_txn(struct zkverify *zv, const struct zktxn *txn, uint32_t txnlen)
+{
+	size_t start = zv->zv_off;
+	uint64_t zxid = zk_load64(&txn->zt_zxid);
+
+	zv->zv_off += offsetof(struct zktxn, zt_sessionid) + txnlen + 1;
+	zv->zv_txns++;
+
+	if (zk_adler32((const uint8_t *)&txn->zt_sessionid, txnlen) ==
+	    zk_load64(&txn->zt_checksum)) {
+		verify_end_run(zv);
+		if (zv->zv_txns - zv->zv_corrupt == 1)
+			zv->zv_first_zxid = zxid;
+		zv->zv_last_zxid = zxid;
+		return;
+	}
+
+	zv->zv_corrupt++;
+	if (zv->zv_run_txns++ == 0) {
+		zv->zv_run_start = start;
+		zv->zv_run_first = zxid;
+	}
+	zv->zv_run_end = zv->zv_off;
+	zv->zv_run_last = zxid;
+}
+
+static int
+verify_stream_txn(struct zkjob *job, const struct zktxn *txn, uint32_t txnlen)
+{
+	verify_txn((struct zkverify *)job, txn, txnlen);
+	return (0);
+}
+
+/*
+ * Looks for the next txn at or after "offset" in a damaged log, returning its
+ * offset. If there isn't one, we return the end of the data (the start of
+ * the zeros at the end, if there are any).
+ */
+static size_t
+verify_resync(const uint8_t *data, size_t len, size_t offset)
+{
+	size_t hdrlen = offsetof(struct zktxn, zt_sessionid);
+	const struct zktxn *txn;
+	uint32_t txnlen;
+	size_t nz;
+
+	for (; len - offset > hdrlen; ++offset) {
+		txn = (const struct zktxn *)(data + offset);
+		if (zk_load32(&txn->zt_checksum) != 0)
+			continue;
+		txnlen = zk_load32(&txn->zt_len);
+
+		/*
+		 * If there's a run of zeros here, a txn can't start until
+		 * there are fewer than a header's worth of them left, and if
+		 * it goes on to the end, that's where the data ends.
+		 */
+		if (txnlen == 0 &&
+		    zk_load32((const uint8_t *)&txn->zt_checksum + 4) == 0) {
+			for (nz = offset; nz < len && data[nz] == 0; ++nz)
+				;
+			if (nz == len)
+				return (offset);
+			offset = nz - hdrlen;
+			continue;
+		}
+
+		if (txnlen < ZKTXN_MIN_LEN || txnlen > ZKVERIFY_MAX_TXN ||
+		    txnlen >= len - offset - hdrlen ||
+		    data[offset + hdrlen + txnlen] != ZKTXN_TERMINATOR) {
+			continue;
+		}
+		if (zk_adler32((const uint8_t *)&txn->zt_sessionid, txnlen) ==
+		    zk_load64(&txn->zt_checksum)) {
+			return (offset);
+		}
+	}
+
+	return (len);
+}
+
+/* Walks the txns in a mapped log, checking each one. */
+static void
+verify_mapped(struct zkverify *zv)
+{
+	const uint8_t *data = zv->zv_file.zf_data;
+	size_t len = zv->zv_file.zf_len;
+	size_t hdrlen = offsetof(struct zktxn, zt_sessionid);
+	size_t released = 0, next, i;
+	const struct zktxn *txn;
+	uint32_t txnlen;
+	int rv;
+
+	while (zv->zv_off < len) {
+		next = zv->zv_off;
+		rv = zkl_frame(data, len, &next, &txn, &txnlen);
+
+		if (rv > 0) {
+			verify_txn(zv, txn, txnlen);
+			goto release;
+		}
+		if (rv == 0 || len - zv->zv_off <= hdrlen) {
+			/* The rest should be the preallocated zeros. */
+			for (i = zv->zv_off; i < len && data[i] == 0; ++i)
+				;
+			if (i == len)
+				break;
+		}
+
+		verify_end_run(zv);
+		next = verify_resync(data, len, zv->zv_off + 1);
+		verify_corrupt(zv, "framing", zv->zv_off, next);
+		ZKBUF_LIT(&zv->zv_out, "}\n");
+		zv->zv_off = next;
+
+release:
+		zkl_release(data, zv->zv_off, &released);
+	}
+	verify_end_run(zv);
+}
+
+static void
+verify_file(struct zkverify *zv)
+{
+	struct zkjob *job = &zv->zv_job;
+	struct zkbuf *out = &zv->zv_out;
+
+	job->zj_file = &zv->zv_file;
+	if (zkfile_open(job) == 0) {
+		zv->zv_off = sizeof (struct zklog);
+		if (zv->zv_file.zf_comp != ZKCOMP_NONE)
+			(void) decode_stream(job, verify_stream_txn, 0);
+		else
+			verify_mapped(zv);
+		verify_end_run(zv);
+		(void) zkfile_close(job);
+	}
+
+	ZKBUF_LIT(out, "{\"type\":\"_VERIFY\",\"file\":\"");
+	zkbuf_str(out, zv->zv_file.zf_name);
+	ZKBUF_LIT(out, "\",\"txns\":");
+	zkbuf_uint(out, zv->zv_txns);
+	ZKBUF_LIT(out, ",\"corrupt\":");
+	zkbuf_uint(out, zv->zv_corrupt);
+	ZKBUF_LIT(out, ",\"bytes\":");
+	zkbuf_uint(out, zv->zv_off);
+	if (zv->zv_txns > zv->zv_corrupt) {
+		ZKBUF_LIT(out, ",\"firstZxid\":\"");
+		zkbuf_hex(out, zv->zv_first_zxid);
+		ZKBUF_LIT(out, "\",\"lastZxid\":\"");
+		zkbuf_hex(out, zv->zv_last_zxid);
+		ZKBUF_LIT(out, "\"");
+	}
+	if (job->zj_errcode != 0) {
+		zv->zv_bad = 1;
+		ZKBUF_LIT(out, ",\"error\":\"");
+		zkbuf_str(out, job->zj_errmsg);
+		ZKBUF_LIT(out, "\"");
+	}
+	if (zv->zv_bad)
+		ZKBUF_LIT(out, ",\"ok\":false}\n");
+	else
+		ZKBUF_LIT(out, ",\"ok\":true}\n");
+}
+
+struct zkverify_pool {
+	pthread_mutex_t zvp_lock;
+	pthread_cond_t zvp_done_cv;
+	struct zkverify *zvp_logs;
+	size_t zvp_nlogs;
+	size_t zvp_next;
+};
+
+static void *
+verify_worker(void *arg)
+{
+	struct zkverify_pool *pool = arg;
+	struct zkverify *zv;
+
+	VERIFY0(pthread_mutex_lock(&pool->zvp_lock));
+	while (pool->zvp_next < pool->zvp_nlogs) {
+		zv = &pool->zvp_logs[pool->zvp_next++];
+		VERIFY0(pthread_mutex_unlock(&pool->zvp_lock));
+
+		verify_file(zv);
+
+		VERIFY0(pthread_mutex_lock(&pool->zvp_lock));
+		zv->zv_done = 1;
+		VERIFY0(pthread_cond_broadcast(&pool->zvp_done_cv));
+	}
+	VERIFY0(pthread_mutex_unlock(&pool->zvp_lock));
+
+	return (NULL);
+}
+
+/*
+ * Verifies the logs, on "nthreads" threads if that's more than zero, and
+ * reports on them in the order given.
+ */
+static void
+do_verify(char **fnames, size_t nfiles, unsigned int nthreads)
+{
+	struct zkverify_pool pool;
+	pthread_t *threads = NULL;
+	struct zkverify *zv;
+	int bad = 0;
+	size_t i;
+
+	bzero(&pool, sizeof (pool));
+	if ((pool.zvp_logs = calloc(nfiles, sizeof (*zv))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	pool.zvp_nlogs = nfiles;
+	for (i = 0; i < nfiles; ++i) {
+		pool.zvp_logs[i].zv_file.zf_name = fnames[i];
+		pool.zvp_logs[i].zv_file.zf_index = i;
+	}
+
+	if (nthreads > nfiles)
+		nthreads = nfiles;
+	if (nthreads > 0) {
+		VERIFY0(pthread_mutex_init(&pool.zvp_lock, NULL));
+		VERIFY0(pthread_cond_init(&pool.zvp_done_cv, NULL));
+		if ((threads = calloc(nthreads, sizeof (pthread_t))) == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		for (i = 0; i < nthreads; ++i) {
+			if ((errno = pthread_create(&threads[i], NULL,
+			    verify_worker, &pool)) != 0) {
+				err(ZKLOG_EXIT_ERROR,
+				    "failed to create thread");
+			}
+		}
+	}
+
+	for (i = 0; i < nfiles; ++i) {
+		zv = &pool.zvp_logs[i];
+		if (nthreads == 0) {
+			verify_file(zv);
+		} else {
+			VERIFY0(pthread_mutex_lock(&pool.zvp_lock));
+			while (!zv->zv_done) {
+				VERIFY0(pthread_cond_wait(&pool.zvp_done_cv,
+				    &pool.zvp_lock));
+			}
+			VERIFY0(pthread_mutex_unlock(&pool.zvp_lock));
+		}
+		zkbuf_append(&zklog_out, zv->zv_out.zb_data,
+		    zv->zv_out.zb_len);
+		zkbuf_free(&zv->zv_out);
+		zkout_check();
+		bad |= zv->zv_bad;
+	}
+	zkout_flush();
+
+	if (nthreads > 0) {
+		for (i = 0; i < nthreads; ++i)
+			VERIFY0(pthread_join(threads[i], NULL));
+		VERIFY0(pthread_mutex_destroy(&pool.zvp_lock));
+		VERIFY0(pthread_cond_destroy(&pool.zvp_done_cv));
+		free(threads);
+	}
+	free(pool.zvp_logs);
+
+	if (bad)
+		exit(ZKLOG_EXIT_BAD_FORMAT);
+}
+
+/*
+ * Follow mode (-f).
+ *
+ * ZooKeeper preallocates its txnlogs and writes new txns into the zeroed
+ * space at the end, and grows the file by another preallocation when that
+ * runs out. A mapping is sized by st_size when the file is opened, so rather
+ * than remapping as the log fills, we pread(2) everything from the offset of
+ * the first txn we haven't seen yet, each time we're told the file has
+ * changed. A txn is only decoded once its terminator byte has been
+ * written. When there's nothing new in the file and ZK has started a newer
+ * log in the same directory, we take one last look at the old one and then
+ * move on to the new one.
+ */
+#define	ZKLOG_FOLLOW_POLL_MS	250
+#define	ZKLOG_FOLLOW_READ	(256 * 1024)
+
+struct zkfollow {
+	char zfo_dir[PATH_MAX];
+	char zfo_path[PATH_MAX];
+	/* zxid from the name of the current log, if it has one. */
+	uint64_t zfo_zxid;
+	int zfo_named;
+	int zfo_fd;
+	/* Where to read from next, and where to put it. */
+	size_t zfo_off;
+	struct zkbuf zfo_in;
+#if defined(__linux__)
+	int zfo_ifd;
+	int zfo_fwd;
+#endif
+};
+
+/*
+ * Parses the zxid out of a file name like "log.<zxid>" (with the given
+ * prefix), the way ZK names its txnlogs and snapshots.
+ */
+static int
+name_zxid(const char *name, const char *prefix, uint64_t *zxidp)
+{
+	const char *base = strrchr(name, '/');
+	size_t plen = strlen(prefix);
+	char *p;
+
+	base = (base == NULL) ? name : base + 1;
+	if (strncmp(base, prefix, plen) != 0 || base[plen] == '\0')
+		return (0);
+
+	errno = 0;
+	*zxidp = strtoull(base + plen, &p, 16);
+	return (errno == 0 && *p == '\0');
+}
+
+/*
+ * Looks for the log ZK would roll over to after the current one: the one in
+ * the same directory with the lowest zxid above it.
+ */
+static int
+follow_next(struct zkfollow *fo, char *path, size_t pathlen)
+{
+	DIR *dir;
+	struct dirent *de;
+	char name[PATH_MAX];
+	uint64_t zxid, best = 0;
+	int found = 0;
+
+	if (!fo->zfo_named || (dir = opendir(fo->zfo_dir)) == NULL)
+		return (0);
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!name_zxid(de->d_name, "log.", &zxid) ||
+		    zxid <= fo->zfo_zxid) {
+			continue;
+		}
+		if (found && zxid >= best)
+			continue;
+		best = zxid;
+		found = 1;
+		(void) snprintf(name, sizeof (name), "%s", de->d_name);
+	}
+	(void) closedir(dir);
+
+	if (found && snprintf(path, pathlen, "%s/%s", fo->zfo_dir, name) >=
+	    (int)pathlen) {
+		errx(ZKLOG_EXIT_ERROR, "path too long: '%s/%s'", fo->zfo_dir,
+		    name);
+	}
+
+	return (found);
+}
+
+static void
+follow_open(struct zkfollow *fo, const char *path)
+{
+	const char *slash;
+
+	if (snprintf(fo->zfo_path, sizeof (fo->zfo_path), "%s", path) >=
+	    (int)sizeof (fo->zfo_path)) {
+		errx(ZKLOG_EXIT_USAGE, "path too long: '%s'", path);
+	}
+
+	slash = strrchr(path, '/');
+	if (slash == NULL) {
+		(void) snprintf(fo->zfo_dir, sizeof (fo->zfo_dir), ".");
+	} else {
+		(void) snprintf(fo->zfo_dir, sizeof (fo->zfo_dir), "%.*s",
+		    (int)(slash - path + (slash == path)), path);
+	}
+	fo->zfo_named = name_zxid(path, "log.", &fo->zfo_zxid);
+
+	fo->zfo_fd = open(path, O_RDONLY);
+	if (fo->zfo_fd < 0)
+		err(ZKLOG_EXIT_ERROR, "error opening file '%s'", path);
+	fo->zfo_off = 0;
+
+#if defined(__linux__)
+	if (fo->zfo_ifd >= 0) {
+		if (fo->zfo_fwd >= 0)
+			(void) inotify_rm_watch(fo->zfo_ifd, fo->zfo_fwd);
+		fo->zfo_fwd = inotify_add_watch(fo->zfo_ifd, path, IN_MODIFY);
+	}
+#endif
+}
+
+/*
+ * Waits until something may have changed: either the file has been written
+ * to or a new file has appeared in its directory (when we can be told about
+ * these things), or a short time has passed.
+ */
+static void
+follow_wait(struct zkfollow *fo)
+{
+#if defined(__linux__)
+	if (fo->zfo_ifd >= 0) {
+		struct pollfd pfd = { .fd = fo->zfo_ifd, .events = POLLIN };
+		char events[4096];
+
+		if (poll(&pfd, 1, ZKLOG_FOLLOW_POLL_MS) > 0) {
+			while (read(fo->zfo_ifd, events, sizeof (events)) > 0)
+				;
+		}
+		return;
+	}
+#endif
+	(void) poll(NULL, 0, ZKLOG_FOLLOW_POLL_MS);
+}
+
+/*
+ * Reads and decodes as many complete txns as are available at our offset in
+ * the current log. Returns the number decoded.
+ */
+static size_t
+follow_read(struct zkfollow *fo, struct zkjob *job)
+{
+	struct zkbuf *in = &fo->zfo_in;
+	size_t want = ZKLOG_FOLLOW_READ;
+	size_t offset, next, grow, ntxns = 0;
+	const struct zktxn *txn;
+	uint32_t txnlen;
+	ssize_t n;
+	int rv;
+
+	for (;;) {
+		/* The header, if we haven't seen it yet. */
+		if (fo->zfo_off == 0) {
+			struct zklog log;
+
+			n = pread(fo->zfo_fd, &log, sizeof (log), 0);
+			if (n < 0) {
+				err(ZKLOG_EXIT_ERROR, "error reading file '%s'",
+				    fo->zfo_path);
+			}
+			if (n < (ssize_t)sizeof (log))
+				return (ntxns);
+			if (zk_load32(&log.zl_magic) != ZKLOG_MAGIC) {
+				errx(ZKLOG_EXIT_BAD_FORMAT, "bad magic number "
+				    "in '%s'", fo->zfo_path);
+			}
+			if (zk_load32(&log.zl_version) != ZKLOG_VERSION_2) {
+				errx(ZKLOG_EXIT_BAD_FORMAT, "txnlog '%s' has "
+				    "unknown log version: %u", fo->zfo_path,
+				    zk_load32(&log.zl_version));
+			}
+			fo->zfo_off = sizeof (log);
+		}
+
+		in->zb_len = 0;
+		zkbuf_reserve(in, want);
+		n = pread(fo->zfo_fd, in->zb_data, want, fo->zfo_off);
+		if (n < 0) {
+			err(ZKLOG_EXIT_ERROR, "error reading file '%s'",
+			    fo->zfo_path);
+		}
+		in->zb_len = n;
+
+		offset = 0;
+		grow = 0;
+		for (;;) {
+			next = offset;
+			rv = zkl_frame((const uint8_t *)in->zb_data, in->zb_len,
+			    &next, &txn, &txnlen);
+			if (rv == 0)
+				break;
+			if (rv == ZKL_ETXNLEN) {
+				errx(ZKLOG_EXIT_BAD_FORMAT, "txn entry too "
+				    "short in '%s' around +0x%lx", fo->zfo_path,
+				    fo->zfo_off + offset);
+			}
+
+			/*
+			 * If we don't have the whole txn, either it hasn't all
+			 * been written yet or it's bigger than our buffer.
+			 * Likewise if its terminator hasn't been written yet.
+			 */
+			if (rv == ZKL_ETRUNC) {
+				if (offset == 0 && (size_t)n == want)
+					grow = next + 1;
+				break;
+			}
+			if (rv == ZKL_ETERM && in->zb_data[next] == 0)
+				break;
+			if (rv < 0) {
+				errx(ZKLOG_EXIT_BAD_FORMAT, "bad txn entry in "
+				    "'%s' around +0x%lx", fo->zfo_path,
+				    fo->zfo_off + next);
+			}
+
+			if (decode_txn(job, txn, txnlen) != 0) {
+				emit_job(job);
+				zkjob_exit(job);
+			}
+			offset = next;
+			ntxns++;
+		}
+
+		fo->zfo_off += offset;
+		emit_job(job);
+		zkout_flush();
+
+		if (offset > 0)
+			continue;
+		if (grow == 0)
+			return (ntxns);
+		want = grow;
+	}
+}
+
+static void __attribute__((noreturn))
+do_follow(const char *fname)
+{
+	struct zkfollow fo;
+	struct zkfile file;
+	struct zkjob job;
+	char next[PATH_MAX];
+	int rolling = 0;
+
+	bzero(&fo, sizeof (fo));
+	bzero(&file, sizeof (file));
+	bzero(&job, sizeof (job));
+	file.zf_name = fo.zfo_path;
+	job.zj_file = &file;
+
+#if defined(__linux__)
+	fo.zfo_fwd = -1;
+	fo.zfo_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	follow_open(&fo, fname);
+#if defined(__linux__)
+	if (fo.zfo_ifd >= 0 && inotify_add_watch(fo.zfo_ifd, fo.zfo_dir,
+	    IN_CREATE | IN_MOVED_TO) < 0) {
+		(void) close(fo.zfo_ifd);
+		fo.zfo_ifd = -1;
+	}
+#endif
+
+	for (;;) {
+		if (follow_read(&fo, &job) > 0) {
+			rolling = 0;
+			continue;
+		}
+
+		/*
+		 * ZK stops writing to a log before it creates the next one,
+		 * but we may have looked at the old one just before its last
+		 * write. So once we see a newer log we check the old one once
+		 * more before moving on.
+		 */
+		if (rolling) {
+			if (close(fo.zfo_fd)) {
+				err(ZKLOG_EXIT_ERROR, "error closing file "
+				    "'%s'", fo.zfo_path);
+			}
+			follow_open(&fo, next);
+			rolling = 0;
+			continue;
+		}
+		if (follow_next(&fo, next, sizeof (next))) {
+			rolling = 1;
+			continue;
+		}
+
+		follow_wait(&fo);
+	}
+}
+
+/*
+ * Directory mode (-D). We decode the txnlogs in a ZK data directory in zxid
+ * order, going by their names. ZK names each log for the zxid of its first
+ * txn, so with --zxid-from or --zxid-to we can leave out whole logs without
+ * even opening them; the time options are handled per log, by the index.
+ * Compressed logs ("log.<zxid>.gz" and so on) count too.
+ */
+struct zklogname {
+	uint64_t zln_zxid;
+	char *zln_path;
+};
+
+/*
+ * Where there's both a log and a compressed copy of it, the log (with the
+ * shorter name) sorts first, and is the one we use.
+ */
+static int
+zklogname_cmp(const void *a, const void *b)
+{
+	const struct zklogname *la = a, *lb = b;
+	size_t lena, lenb;
+
+	if (la->zln_zxid != lb->zln_zxid)
+		return (la->zln_zxid < lb->zln_zxid ? -1 : 1);
+	lena = strlen(la->zln_path);
+	lenb = strlen(lb->zln_path);
+	if (lena != lenb)
+		return (lena < lenb ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Like name_zxid() for a txnlog, but also takes the names of compressed ones
+ * ("log.<zxid>.gz" or "log.<zxid>.zst").
+ */
+static int
+log_zxid(const char *name, uint64_t *zxidp)
+{
+	static const char *suffixes[] = { ".gz", ".zst" };
+	char base[NAME_MAX + 1];
+	size_t len = strlen(name), slen, i;
+
+	if (name_zxid(name, "log.", zxidp))
+		return (1);
+	for (i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); ++i) {
+		slen = strlen(suffixes[i]);
+		if (len <= slen || len - slen >= sizeof (base) ||
+		    strcmp(name + len - slen, suffixes[i]) != 0) {
+			continue;
+		}
+		bcopy(name, base, len - slen);
+		base[len - slen] = '\0';
+		return (name_zxid(base, "log.", zxidp));
+	}
+	return (0);
+}
+
+/*
+ * Lists the txnlogs in a directory in zxid order, and works out which of
+ * them ("*nselp" of them, from "*firstp") could contain the zxids we want.
+ */
+static char **
+dir_logs(const char *dname, size_t *nlogsp, size_t *firstp, size_t *nselp)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct zklogname *names = NULL, *nn;
+	size_t n = 0, size = 0, len, i, first, last;
+	uint64_t zxid;
+	char **paths;
+
+	if ((dir = opendir(dname)) == NULL)
+		err(ZKLOG_EXIT_ERROR, "error opening directory '%s'", dname);
+
+	while ((errno = 0, de = readdir(dir)) != NULL) {
+		if (!log_zxid(de->d_name, &zxid))
+			continue;
+		if (n == size) {
+			size = (size == 0) ? 64 : size * 2;
+			nn = realloc(names, size * sizeof (*nn));
+			if (nn == NULL) {
+				err(ZKLOG_EXIT_ERROR,
+				    "failed to allocate memory");
+			}
+			names = nn;
+		}
+		len = strlen(dname) + strlen(de->d_name) + 2;
+		names[n].zln_zxid = zxid;
+		if ((names[n].zln_path = malloc(len)) == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		(void) snprintf(names[n].zln_path, len, "%s/%s", dname,
+		    de->d_name);
+		n++;
+	}
+	if (errno != 0)
+		err(ZKLOG_EXIT_ERROR, "error reading directory '%s'", dname);
+	(void) closedir(dir);
+
+	if (n == 0)
+		errx(ZKLOG_EXIT_ERROR, "no txnlogs found in '%s'", dname);
+
+	qsort(names, n, sizeof (*names), zklogname_cmp);
+	for (i = 1, len = 1; i < n; ++i) {
+		if (names[i].zln_zxid == names[len - 1].zln_zxid)
+			free(names[i].zln_path);
+		else
+			names[len++] = names[i];
+	}
+	n = len;
+
+	/*
+	 * Every zxid in a log is below the name of the next one, so we skip
+	 * the logs where that's no higher than the first zxid we want, and the
+	 * ones named for a zxid past the last one.
+	 */
+	for (first = 0; first + 1 < n &&
+	    names[first + 1].zln_zxid <= zklog_zxid_from; ++first)
+		;
+	for (last = first; last + 1 < n &&
+	    names[last + 1].zln_zxid <= zklog_zxid_to; ++last)
+		;
+	*nselp = (names[first].zln_zxid > zklog_zxid_to) ? 0 :
+	    last - first + 1;
+
+	if ((paths = calloc(n, sizeof (char *))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n; ++i)
+		paths[i] = names[i].zln_path;
+	free(names);
+
+	*nlogsp = n;
+	*firstp = first;
+	return (paths);
+}
+
+/*
+ * Like dir_logs(), but for several directories (one for each member, with
+ * --merge). The logs we're decoding from all of them go together in the
+ * middle of the list, so that session_created() can still find the others.
+ */
+static char **
+merge_dir_logs(const char **dnames, size_t ndirs, size_t *nlogsp,
+    size_t *firstp, size_t *nselp)
+{
+	char ***lists;
+	size_t *ns, *firsts, *nsels;
+	size_t i, n = 0, pre = 0, sel = 0, post;
+	char **paths;
+
+	lists = calloc(ndirs, sizeof (char **));
+	ns = calloc(ndirs, sizeof (size_t));
+	firsts = calloc(ndirs, sizeof (size_t));
+	nsels = calloc(ndirs, sizeof (size_t));
+	if (lists == NULL || ns == NULL || firsts == NULL || nsels == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+
+	for (i = 0; i < ndirs; ++i) {
+		lists[i] = dir_logs(dnames[i], &ns[i], &firsts[i], &nsels[i]);
+		n += ns[i];
+		pre += firsts[i];
+		sel += nsels[i];
+	}
+
+	if ((paths = calloc(n, sizeof (char *))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	*nlogsp = n;
+	*firstp = pre;
+	*nselp = sel;
+
+	post = pre + sel;
+	sel = pre;
+	pre = 0;
+	for (i = 0; i < ndirs; ++i) {
+		bcopy(lists[i], &paths[pre], firsts[i] * sizeof (char *));
+		pre += firsts[i];
+		bcopy(&lists[i][firsts[i]], &paths[sel],
+		    nsels[i] * sizeof (char *));
+		sel += nsels[i];
+		bcopy(&lists[i][firsts[i] + nsels[i]], &paths[post],
+		    (ns[i] - firsts[i] - nsels[i]) * sizeof (char *));
+		post += ns[i] - firsts[i] - nsels[i];
+		free(lists[i]);
+	}
+	free(lists);
+	free(ns);
+	free(firsts);
+	free(nsels);
+
+	return (paths);
+}
+
+/*
+ * Snapshots and state (--state).
+ *
+ * ZK periodically writes its whole DataTree out to a "snapshot.<zxid>" file,
+ * named for the last zxid applied to the tree when it started. To see what
+ * the tree looked like at some point, we load a snapshot into a tree of our
+ * own, replay the txns after it from the txnlogs up to the point we were
+ * asked for (by --zxid-to or --until), and then print the nodes under a path.
+ *
+ * Snapshots are "fuzzy": txns applied while one was being written may or may
+ * not be in it. ZK copes with this by replaying the txns after the snapshot's
+ * zxid and ignoring the ones that fail (creating a node that's already there
+ * and so on), and so do we. The state we print is exact as long as the point
+ * we replay to is after the snapshot was finished.
+ *
+ * Container and TTL nodes get the same special ephemeralOwner a snapshot
+ * would give them, but we don't expire them ourselves: the leader removes
+ * empty containers and expired TTL nodes with txns of its own, which we
+ * replay like any other.
+ *
+ * Children are found through a hash table keyed on the parent node and the
+ * child's name, so that nodes with many thousands of children (as in the
+ * registrar tree) don't make loading and replaying quadratic.
+ */
+#define	ZKSNAP_MAGIC	0x5A4B534E	/* "ZKSN" */
+
+/* Special ephemeralOwner values for container and TTL nodes (ZK 3.5+). */
+#define	ZKSNAP_OWNER_CONTAINER	0x8000000000000000ULL
+#define	ZKSNAP_OWNER_TTL_MASK	0xFF00000000000000ULL
+#define	ZKSNAP_OWNER_TTL_MAX	0x000000FFFFFFFFFFULL
+
+struct zknode {
+	struct zknode *zn_parent;
+	char *zn_name;
+	size_t zn_namelen;
+	uint32_t zn_hash;
+
+	/* Children, in no particular order until we print them. */
+	struct zknode **zn_kids;
+	uint32_t zn_nkids;
+	uint32_t zn_kidsize;
+	/* Our index in zn_parent->zn_kids. */
+	uint32_t zn_slot;
+
+	uint8_t *zn_data;
+	int32_t zn_datalen;
+
+	uint64_t zn_czxid;
+	uint64_t zn_mzxid;
+	uint64_t zn_pzxid;
+	uint64_t zn_ctime;
+	uint64_t zn_mtime;
+	int32_t zn_version;
+	int32_t zn_cversion;
+	int32_t zn_aversion;
+	uint64_t zn_owner;
+
+	/* The other ephemeral nodes of our owner (see ztr_owners). */
+	struct zknode *zn_eph_next;
+	struct zknode *zn_eph_prev;
+};
+
+struct zktree {
+	struct zknode ztr_root;
+	/* Open-addressed (linear probing), all the nodes but the root. */
+	struct zknode **ztr_table;
+	size_t ztr_tabsize;
+	size_t ztr_count;
+	/*
+	 * The sessions owning ephemeral nodes, each with a list of them, so
+	 * that closing a session only has to look at its own.
+	 */
+	struct session_table ztr_owners;
+	/* The zxid and time of the last txn applied to the tree. */
+	uint64_t ztr_zxid;
+	uint64_t ztr_time;
+
+	/*
+	 * If set, called for each txn we replay, before it's counted in
+	 * ztr_zxid, with the paths of the nodes it created, changed or removed
+	 * in ztr_changed (each followed by a NUL), which it should empty.
+	 */
+	void (*ztr_hook)(struct zktree *, uint64_t, uint64_t);
+	struct zkbuf ztr_changed;
+};
+
+/*
+ * A bounds-checked cursor for reading the big-endian ("jute") records in
+ * snapshots and txns. Reading past the end sets zc_short and returns zeros,
+ * so callers can read a whole record and check once.
+ */
+struct zkcur {
+	const uint8_t *zc_data;
+	size_t zc_len;
+	size_t zc_off;
+	int zc_short;
+};
+
+static const void *
+zkcur_take(struct zkcur *c, size_t len)
+{
+	const void *p;
+
+	if (c->zc_short || c->zc_len - c->zc_off < len) {
+		c->zc_short = 1;
+		return (NULL);
+	}
+	p = c->zc_data + c->zc_off;
+	c->zc_off += len;
+	return (p);
+}
+
+static uint32_t
+zkcur_u32(struct zkcur *c)
+{
+	const void *p = zkcur_take(c, sizeof (uint32_t));
+
+	return (p == NULL ? 0 : zk_load32(p));
+}
+
+static uint64_t
+zkcur_u64(struct zkcur *c)
+{
+	const void *p = zkcur_take(c, sizeof (uint64_t));
+
+	return (p == NULL ? 0 : zk_load64(p));
+}
+
+/*
+ * Reads a string or buffer, returning its length (-1 if it's null) and
+ * pointing "*datap" at its contents.
+ */
+static int32_t
+zkcur_buf(struct zkcur *c, const uint8_t **datap)
+{
+	int32_t len = (int32_t)zkcur_u32(c);
+
+	*datap = NULL;
+	if (len <= 0)
+		return (len < 0 ? -1 : 0);
+	*datap = zkcur_take(c, len);
+	return (*datap == NULL ? -1 : len);
+}
+
+static uint32_t
+zktree_hash(const struct zknode *parent, const char *name, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL ^ (uintptr_t)parent;
+
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t)name[i]) * 1099511628211ULL;
+	return ((uint32_t)(h ^ (h >> 32)));
+}
+
+static struct zknode *
+zktree_child(const struct zktree *t, const struct zknode *parent,
+    const char *name, size_t len)
+{
+	uint32_t hash = zktree_hash(parent, name, len);
+	size_t mask = t->ztr_tabsize - 1;
+	struct zknode *n;
+
+	if (t->ztr_tabsize == 0)
+		return (NULL);
+	for (size_t i = hash & mask; (n = t->ztr_table[i]) != NULL;
+	    i = (i + 1) & mask) {
+		if (n->zn_hash == hash && n->zn_parent == parent &&
+		    n->zn_namelen == len && bcmp(n->zn_name, name, len) == 0)
+			return (n);
+	}
+	return (NULL);
+}
+
+static void
+zktree_insert(struct zktree *t, struct zknode *n)
+{
+	size_t mask, i;
+
+	if (2 * (t->ztr_count + 1) > t->ztr_tabsize) {
+		struct zknode **old = t->ztr_table;
+		size_t oldsize = t->ztr_tabsize;
+
+		t->ztr_tabsize = (oldsize == 0) ? 1024 : oldsize * 2;
+		t->ztr_table = calloc(t->ztr_tabsize, sizeof (*old));
+		if (t->ztr_table == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		t->ztr_count = 0;
+		for (i = 0; i < oldsize; ++i) {
+			if (old[i] != NULL)
+				zktree_insert(t, old[i]);
+		}
+		free(old);
+	}
+
+	mask = t->ztr_tabsize - 1;
+	for (i = n->zn_hash & mask; t->ztr_table[i] != NULL; i = (i + 1) & mask)
+		;
+	t->ztr_table[i] = n;
+	t->ztr_count++;
+}
+
+static void
+zktree_unhash(struct zktree *t, const struct zknode *n)
+{
+	size_t mask = t->ztr_tabsize - 1;
+	size_t i, j, k;
+
+	for (i = n->zn_hash & mask; t->ztr_table[i] != n; i = (i + 1) & mask)
+		;
+	t->ztr_table[i] = NULL;
+	t->ztr_count--;
+
+	/*
+	 * Shift back any entries after it that would no longer be found,
+	 * rather than leaving a tombstone.
+	 */
+	for (j = (i + 1) & mask; t->ztr_table[j] != NULL; j = (j + 1) & mask) {
+		k = t->ztr_table[j]->zn_hash & mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			t->ztr_table[i] = t->ztr_table[j];
+			t->ztr_table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/* Appends the path of a node (other than the root) to "buf". */
+static void
+zknode_path(const struct zknode *n, struct zkbuf *buf)
+{
+	if (n->zn_parent->zn_parent != NULL)
+		zknode_path(n->zn_parent, buf);
+	ZKBUF_LIT(buf, "/");
+	zkbuf_append(buf, n->zn_name, n->zn_namelen);
+}
+
+/* Notes a node that a txn changed, for the tree's hook. */
+static void
+zktree_note(struct zktree *t, const struct zknode *n)
+{
+	if (t->ztr_hook == NULL)
+		return;
+	zknode_path(n, &t->ztr_changed);
+	zkbuf_append(&t->ztr_changed, "", 1);
+}
+
+static void
+zktree_set_data(struct zknode *n, const uint8_t *data, int32_t len)
+{
+	free(n->zn_data);
+	n->zn_data = NULL;
+	n->zn_datalen = len;
+	if (len > 0) {
+		if ((n->zn_data = malloc(len)) == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		bcopy(data, n->zn_data, len);
+	}
+}
+
+/* Whether an ephemeralOwner is a session (rather than a container or TTL). */
+static int
+zknode_owner_is_session(uint64_t owner)
+{
+	return (owner != 0 && owner != ZKSNAP_OWNER_CONTAINER &&
+	    (owner & ZKSNAP_OWNER_TTL_MASK) != ZKSNAP_OWNER_TTL_MASK);
+}
+
+static void
+zktree_set_owner(struct zktree *t, struct zknode *n, uint64_t owner)
+{
+	struct session_state *own;
+
+	n->zn_owner = owner;
+	if (!zknode_owner_is_session(owner))
+		return;
+	if ((own = session_lookup(&t->ztr_owners, owner)) == NULL) {
+		own = session_alloc();
+		own->ss_sid = owner;
+		session_insert(&t->ztr_owners, own);
+	}
+	n->zn_eph_next = own->ss_ephemerals;
+	if (own->ss_ephemerals != NULL)
+		own->ss_ephemerals->zn_eph_prev = n;
+	own->ss_ephemerals = n;
+}
+
+/*
+ * Takes an ephemeral node off its owner's list, and the owner out of the
+ * table once it has none left.
+ */
+static void
+zktree_unlink_owner(struct zktree *t, struct zknode *n)
+{
+	struct session_state *own;
+
+	if (!zknode_owner_is_session(n->zn_owner))
+		return;
+	if (n->zn_eph_prev != NULL) {
+		n->zn_eph_prev->zn_eph_next = n->zn_eph_next;
+	} else if ((own = session_lookup(&t->ztr_owners, n->zn_owner)) !=
+	    NULL && own->ss_ephemerals == n) {
+		own->ss_ephemerals = n->zn_eph_next;
+		if (own->ss_ephemerals == NULL) {
+			session_remove(&t->ztr_owners, own);
+			session_release(own);
+		}
+	}
+	if (n->zn_eph_next != NULL)
+		n->zn_eph_next->zn_eph_prev = n->zn_eph_prev;
+	n->zn_eph_next = n->zn_eph_prev = NULL;
+}
+
+static struct zknode *
+zktree_add(struct zktree *t, struct zknode *parent, const char *name,
+    size_t len)
+{
+	struct zknode *n, **kids;
+
+	if ((n = calloc(1, sizeof (*n))) == NULL ||
+	    (n->zn_name = malloc(len + 1)) == NULL) {
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+	bcopy(name, n->zn_name, len);
+	n->zn_name[len] = '\0';
+	n->zn_namelen = len;
+	n->zn_parent = parent;
+	n->zn_hash = zktree_hash(parent, name, len);
+	n->zn_datalen = -1;
+
+	if (parent->zn_nkids == parent->zn_kidsize) {
+		uint32_t nsize = parent->zn_kidsize == 0 ? 4 :
+		    parent->zn_kidsize * 2;
+		kids = realloc(parent->zn_kids, nsize * sizeof (*kids));
+		if (kids == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		parent->zn_kids = kids;
+		parent->zn_kidsize = nsize;
+	}
+	n->zn_slot = parent->zn_nkids;
+	parent->zn_kids[parent->zn_nkids++] = n;
+
+	zktree_insert(t, n);
+	return (n);
+}
+
+/* Removes a node and everything under it. */
+static void
+zktree_remove(struct zktree *t, struct zknode *n)
+{
+	struct zknode *parent = n->zn_parent;
+
+	zktree_note(t, n);
+	while (n->zn_nkids > 0)
+		zktree_remove(t, n->zn_kids[n->zn_nkids - 1]);
+
+	zktree_unhash(t, n);
+	parent->zn_kids[n->zn_slot] = parent->zn_kids[--parent->zn_nkids];
+	parent->zn_kids[n->zn_slot]->zn_slot = n->zn_slot;
+
+	zktree_unlink_owner(t, n);
+
+	free(n->zn_kids);
+	free(n->zn_data);
+	free(n->zn_name);
+	free(n);
+}
+
+/*
+ * Finds the node at a path. If "basep" is given, we find its parent instead,
+ * and point "basep" and "baselenp" at the last component of the path.
+ */
+static struct zknode *
+zktree_lookup(struct zktree *t, const char *path, size_t len,
+    const char **basep, size_t *baselenp)
+{
+	struct zknode *n = &t->ztr_root;
+	const char *p, *end = path + len, *slash;
+
+	if (len == 0 || path[0] != '/')
+		return (NULL);
+	if (len == 1)
+		return (basep == NULL ? n : NULL);
+
+	for (p = path + 1; ; p = slash + 1) {
+		if ((slash = memchr(p, '/', end - p)) == NULL)
+			slash = end;
+		if (slash == p)
+			return (NULL);
+		if (slash == end && basep != NULL) {
+			*basep = p;
+			*baselenp = end - p;
+			return (n);
+		}
+		if ((n = zktree_child(t, n, p, slash - p)) == NULL ||
+		    slash == end) {
+			return (n);
+		}
+	}
+}
+
+/*
+ * Loads a snapshot file into an empty tree.
+ */
+static void
+snap_load(struct zktree *t, const char *fname)
+{
+	struct zkcur c;
+	struct stat st;
+	struct zknode *n, *parent;
+	const uint8_t *path, *data, *s;
+	const char *base;
+	size_t baselen;
+	uint64_t zxid;
+	int32_t pathlen, datalen, cnt;
+	int fd;
+	void *map;
+
+	if ((fd = open(fname, O_RDONLY)) < 0)
+		err(ZKLOG_EXIT_ERROR, "error opening file '%s'", fname);
+	if (fstat(fd, &st) != 0)
+		err(ZKLOG_EXIT_ERROR, "error getting size of file '%s'", fname);
+	if (st.st_size == 0) {
+		errx(ZKLOG_EXIT_BAD_FORMAT, "file %s is too small to be a "
+		    "snapshot", fname);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err(ZKLOG_EXIT_ERROR, "error mapping file '%s' into memory",
+		    fname);
+	}
+
+	bzero(&c, sizeof (c));
+	c.zc_data = map;
+	c.zc_len = st.st_size;
+
+	if (zkcur_u32(&c) != ZKSNAP_MAGIC)
+		errx(ZKLOG_EXIT_BAD_FORMAT, "bad magic number in '%s'", fname);
+	(void) zkcur_u32(&c);	/* version */
+	(void) zkcur_u64(&c);	/* dbid */
+
+	/* The sessions open at the time, with their timeouts. */
+	for (cnt = (int32_t)zkcur_u32(&c); cnt > 0 && !c.zc_short; --cnt) {
+		(void) zkcur_u64(&c);
+		(void) zkcur_u32(&c);
+	}
+
+	/* The ACLs, which nodes refer to by number. We don't keep them. */
+	for (cnt = (int32_t)zkcur_u32(&c); cnt > 0 && !c.zc_short; --cnt) {
+		int32_t nacls;
+
+		(void) zkcur_u64(&c);
+		nacls = (int32_t)zkcur_u32(&c);
+		for (; nacls > 0 && !c.zc_short; --nacls) {
+			(void) zkcur_u32(&c);
+			(void) zkcur_buf(&c, &s);
+			(void) zkcur_buf(&c, &s);
+		}
+	}
+
+	/*
+	 * Then the nodes, each after its parent, ending with a path of "/".
+	 * The root node itself has an empty path.
+	 */
+	t->ztr_zxid = 0;
+	for (;;) {
+		pathlen = zkcur_buf(&c, &path);
+		if (c.zc_short)
+			break;
+		if (pathlen == 1 && path[0] == '/')
+			break;
+
+		if (pathlen <= 0) {
+			n = &t->ztr_root;
+		} else if ((parent = zktree_lookup(t, (const char *)path,
+		    pathlen, &base, &baselen)) == NULL ||
+		    zktree_child(t, parent, base, baselen) != NULL) {
+			errx(ZKLOG_EXIT_BAD_FORMAT, "bad node '%.*s' in "
+			    "snapshot '%s'", (int)pathlen, path, fname);
+		} else {
+			n = zktree_add(t, parent, base, baselen);
+		}
+
+		datalen = zkcur_buf(&c, &data);
+		zktree_set_data(n, data, datalen);
+		(void) zkcur_u64(&c);	/* acl */
+		n->zn_czxid = zkcur_u64(&c);
+		n->zn_mzxid = zkcur_u64(&c);
+		n->zn_ctime = zkcur_u64(&c);
+		n->zn_mtime = zkcur_u64(&c);
+		n->zn_version = (int32_t)zkcur_u32(&c);
+		n->zn_cversion = (int32_t)zkcur_u32(&c);
+		n->zn_aversion = (int32_t)zkcur_u32(&c);
+		zktree_set_owner(t, n, zkcur_u64(&c));
+		n->zn_pzxid = zkcur_u64(&c);
+
+		zxid = n->zn_mzxid > n->zn_pzxid ? n->zn_mzxid : n->zn_pzxid;
+		if (zxid > t->ztr_zxid)
+			t->ztr_zxid = zxid;
+	}
+	if (c.zc_short) {
+		errx(ZKLOG_EXIT_BAD_FORMAT, "snapshot '%s' is truncated",
+		    fname);
+	}
+
+	/*
+	 * We replay from the zxid in the name, if it has one: the zxids in the
+	 * nodes only tell us about the txns that are in the snapshot.
+	 */
+	if (name_zxid(fname, "snapshot.", &zxid))
+		t->ztr_zxid = zxid;
+
+	(void) munmap(map, st.st_size);
+	(void) close(fd);
+}
+
+/*
+ * Applies one txn (or one txn within a multi) to the tree. Returns -1 if the
+ * txn is too short for its type.
+ */
+static int
+snap_apply(struct zktree *t, int32_t type, uint64_t sid, uint64_t zxid,
+    uint64_t time, struct zkcur *c)
+{
+	struct zknode *n, *parent;
+	struct session_state *own;
+	const uint8_t *path, *data, *s;
+	const char *base;
+	size_t baselen;
+	int32_t pathlen, datalen, nacls, version, pversion;
+	uint64_t ttl = 0;
+	uint8_t ephemeral = 0;
+	const uint8_t *b;
+
+	switch (type) {
+	case ZK_CREATE:
+	case ZK_CREATE2:
+	case ZK_CREATECONTAINER:
+	case ZK_CREATETTL:
+		pathlen = zkcur_buf(c, &path);
+		datalen = zkcur_buf(c, &data);
+		nacls = (int32_t)zkcur_u32(c);
+		for (; nacls > 0 && !c->zc_short; --nacls) {
+			(void) zkcur_u32(c);
+			(void) zkcur_buf(c, &s);
+			(void) zkcur_buf(c, &s);
+		}
+		if (type == ZK_CREATE || type == ZK_CREATE2) {
+			if ((b = zkcur_take(c, 1)) != NULL)
+				ephemeral = *b;
+		}
+		pversion = (int32_t)zkcur_u32(c);
+		if (type == ZK_CREATETTL)
+			ttl = zkcur_u64(c);
+		if (c->zc_short)
+			return (-1);
+
+		if (pathlen <= 0 || (parent = zktree_lookup(t,
+		    (const char *)path, pathlen, &base, &baselen)) == NULL ||
+		    zktree_child(t, parent, base, baselen) != NULL) {
+			return (0);
+		}
+		n = zktree_add(t, parent, base, baselen);
+		zktree_set_data(n, data, datalen);
+		zktree_note(t, n);
+		n->zn_czxid = n->zn_mzxid = n->zn_pzxid = zxid;
+		n->zn_ctime = n->zn_mtime = time;
+		if (ephemeral)
+			zktree_set_owner(t, n, sid);
+		else if (type == ZK_CREATECONTAINER)
+			n->zn_owner = ZKSNAP_OWNER_CONTAINER;
+		else if (type == ZK_CREATETTL)
+			n->zn_owner = ZKSNAP_OWNER_TTL_MASK |
+			    (ttl & ZKSNAP_OWNER_TTL_MAX);
+		parent->zn_cversion = pversion;
+		parent->zn_pzxid = zxid;
+		break;
+
+	case ZK_DELETE:
+	case ZK_DELETECONTAINER:
+		pathlen = zkcur_buf(c, &path);
+		if (c->zc_short)
+			return (-1);
+		if (pathlen <= 0 || (n = zktree_lookup(t, (const char *)path,
+		    pathlen, NULL, NULL)) == NULL || n == &t->ztr_root) {
+			return (0);
+		}
+		parent = n->zn_parent;
+		zktree_remove(t, n);
+		parent->zn_cversion++;
+		parent->zn_pzxid = zxid;
+		break;
+
+	case ZK_SETDATA:
+		pathlen = zkcur_buf(c, &path);
+		datalen = zkcur_buf(c, &data);
+		version = (int32_t)zkcur_u32(c);
+		if (c->zc_short)
+			return (-1);
+		if (pathlen <= 0 || (n = zktree_lookup(t, (const char *)path,
+		    pathlen, NULL, NULL)) == NULL) {
+			return (0);
+		}
+		zktree_set_data(n, data, datalen);
+		zktree_note(t, n);
+		n->zn_version = version;
+		n->zn_mzxid = zxid;
+		n->zn_mtime = time;
+		break;
+
+	case ZK_SETACL:
+		pathlen = zkcur_buf(c, &path);
+		nacls = (int32_t)zkcur_u32(c);
+		for (; nacls > 0 && !c->zc_short; --nacls) {
+			(void) zkcur_u32(c);
+			(void) zkcur_buf(c, &s);
+			(void) zkcur_buf(c, &s);
+		}
+		version = (int32_t)zkcur_u32(c);
+		if (c->zc_short)
+			return (-1);
+		if (pathlen > 0 && (n = zktree_lookup(t, (const char *)path,
+		    pathlen, NULL, NULL)) != NULL) {
+			n->zn_aversion = version;
+		}
+		break;
+
+	case ZK_CLOSESESSION:
+		/* Removing the last of them takes the session out too. */
+		while ((own = session_lookup(&t->ztr_owners, sid)) != NULL) {
+			n = own->ss_ephemerals;
+			parent = n->zn_parent;
+			zktree_remove(t, n);
+			parent->zn_cversion++;
+			parent->zn_pzxid = zxid;
+		}
+		break;
+
+	case ZK_MULTI: {
+		int32_t i, ntxns = (int32_t)zkcur_u32(c);
+
+		for (i = 0; i < ntxns && !c->zc_short; ++i) {
+			int32_t mtype = (int32_t)zkcur_u32(c);
+			int32_t mlen = (int32_t)zkcur_u32(c);
+			struct zkcur mc;
+
+			bzero(&mc, sizeof (mc));
+			if (mlen < 0 || (mc.zc_data = zkcur_take(c, mlen)) ==
+			    NULL) {
+				return (-1);
+			}
+			mc.zc_len = mlen;
+			if (snap_apply(t, mtype, sid, zxid, time, &mc) != 0)
+				return (-1);
+		}
+		if (c->zc_short)
+			return (-1);
+		break;
+	}
+
+	default:
+		/* Nothing else changes the tree. */
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * Replays the txns in a txnlog after the tree's zxid, up to the end of the
+ * range we were asked for. Returns 1 once we've passed the end of the range,
+ * so that the caller knows not to look at any more logs.
+ */
+static int
+snap_replay(struct zktree *t, struct zkjob *job)
+{
+	struct zkfile *zf = job->zj_file;
+	const char *fname = zf->zf_name;
+	const uint8_t *data = zf->zf_data;
+	size_t len = zf->zf_len;
+	size_t offset = job->zj_start, next;
+	const struct zktxn *txn;
+	struct zkcur c;
+	uint32_t txnlen;
+	uint64_t zxid, time;
+	int32_t type;
+	int rv;
+
+	for (; offset < len; offset = next) {
+		next = offset;
+		if ((rv = zkl_frame(data, len, &next, &txn, &txnlen)) == 0)
+			break;
+		if (rv == ZKL_ETXNLEN) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT, "txn "
+			    "entry too short in '%s' around +0x%lx", fname,
+			    offset));
+		}
+		if (rv < 0) {
+			return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+			    "bad txn entry in '%s' around +0x%lx", fname,
+			    offset));
+		}
+
+		zxid = zk_load64(&txn->zt_zxid);
+		time = zk_load64(&txn->zt_time);
+		type = (int32_t)zk_load32(&txn->zt_type);
+
+		if (zxid > zklog_zxid_to || time > zklog_until)
+			return (1);
+
+		if (zxid > t->ztr_zxid) {
+			bzero(&c, sizeof (c));
+			c.zc_data = (const uint8_t *)&txn->zt_inner;
+			c.zc_len = txnlen - ZKTXN_MIN_LEN;
+			if (snap_apply(t, type, zk_load64(&txn->zt_sessionid),
+			    zxid, time, &c) != 0) {
+				return (zkjob_fail(job, ZKLOG_EXIT_BAD_FORMAT,
+				    "txn too short for %s in '%s' around "
+				    "+0x%lx", zktxn_type_to_name(type), fname,
+				    offset));
+			}
+			if (t->ztr_hook != NULL)
+				t->ztr_hook(t, zxid, time);
+			t->ztr_zxid = zxid;
+			t->ztr_time = time;
+		}
+	}
+
+	return (0);
+}
+
+static int
+zknode_cmp(const void *a, const void *b)
+{
+	const struct zknode *na = *(struct zknode * const *)a;
+	const struct zknode *nb = *(struct zknode * const *)b;
+	size_t len = na->zn_namelen < nb->zn_namelen ? na->zn_namelen :
+	    nb->zn_namelen;
+	int rv;
+
+	if ((rv = memcmp(na->zn_name, nb->zn_name, len)) != 0)
+		return (rv);
+	return ((na->zn_namelen > nb->zn_namelen) -
+	    (na->zn_namelen < nb->zn_namelen));
+}
+
+/*
+ * Prints a node and everything under it, in order of path. "path" holds the
+ * node's path, and we add the children's names to it as we go.
+ */
+static void
+snap_print(struct zktimecache *tc, struct zknode *n, struct zkbuf *path)
+{
+	char timebuf[64];
+	ssize_t timelen;
+	size_t pathlen = path->zb_len;
+
+	ZKBUF_LIT(&zklog_out, "{\"path\":\"");
+	if (pathlen == 0)
+		ZKBUF_LIT(&zklog_out, "/");
+	else
+		zkbuf_append(&zklog_out, path->zb_data, pathlen);
+	ZKBUF_LIT(&zklog_out, "\",\"czxid\":\"");
+	zkbuf_hex(&zklog_out, n->zn_czxid);
+	ZKBUF_LIT(&zklog_out, "\",\"mzxid\":\"");
+	zkbuf_hex(&zklog_out, n->zn_mzxid);
+	ZKBUF_LIT(&zklog_out, "\",\"pzxid\":\"");
+	zkbuf_hex(&zklog_out, n->zn_pzxid);
+	ZKBUF_LIT(&zklog_out, "\",\"ctime\":\"");
+	if ((timelen = format_time(tc, n->zn_ctime, timebuf)) > 0)
+		zkbuf_append(&zklog_out, timebuf, timelen);
+	ZKBUF_LIT(&zklog_out, "\",\"mtime\":\"");
+	if ((timelen = format_time(tc, n->zn_mtime, timebuf)) > 0)
+		zkbuf_append(&zklog_out, timebuf, timelen);
+	ZKBUF_LIT(&zklog_out, "\",\"version\":");
+	zkbuf_int(&zklog_out, n->zn_version);
+	ZKBUF_LIT(&zklog_out, ",\"cversion\":");
+	zkbuf_int(&zklog_out, n->zn_cversion);
+	ZKBUF_LIT(&zklog_out, ",\"aversion\":");
+	zkbuf_int(&zklog_out, n->zn_aversion);
+	ZKBUF_LIT(&zklog_out, ",\"ephemeralOwner\":\"");
+	zkbuf_hex(&zklog_out, n->zn_owner);
+	ZKBUF_LIT(&zklog_out, "\",\"numChildren\":");
+	zkbuf_uint(&zklog_out, n->zn_nkids);
+	ZKBUF_LIT(&zklog_out, ",\"dataLength\":");
+	zkbuf_uint(&zklog_out, n->zn_datalen > 0 ? n->zn_datalen : 0);
+	if (zklog_dumpdata && n->zn_datalen > 0) {
+		ZKBUF_LIT(&zklog_out, ",\"data\":\"");
+		zkbuf_hexdata(&zklog_out, n->zn_data, n->zn_datalen);
+		ZKBUF_LIT(&zklog_out, "\"");
+	}
+	ZKBUF_LIT(&zklog_out, "}\n");
+	zkout_check();
+
+	if (n->zn_nkids > 1) {
+		qsort(n->zn_kids, n->zn_nkids, sizeof (struct zknode *),
+		    zknode_cmp);
+	}
+	for (uint32_t i = 0; i < n->zn_nkids; ++i) {
+		ZKBUF_LIT(path, "/");
+		zkbuf_append(path, n->zn_kids[i]->zn_name,
+		    n->zn_kids[i]->zn_namelen);
+		snap_print(tc, n->zn_kids[i], path);
+		path->zb_len = pathlen;
+	}
+}
+
+/*
+ * Picks the snapshot to start from in a data directory (-D): the newest one
+ * from no later than the given zxid and time. For the time, which we can't
+ * compare with the zxid in the name, we go by when the snapshot was written.
+ */
+static char *
+dir_snapshot(const char *dname, uint64_t maxzxid, uint64_t maxtime)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX], *best = NULL;
+	uint64_t zxid, bestzxid = 0;
+
+	if ((dir = opendir(dname)) == NULL)
+		err(ZKLOG_EXIT_ERROR, "error opening directory '%s'", dname);
+	while ((errno = 0, de = readdir(dir)) != NULL) {
+		if (!name_zxid(de->d_name, "snapshot.", &zxid) ||
+		    zxid > maxzxid || (best != NULL && zxid <= bestzxid))
+			continue;
+		if (snprintf(path, sizeof (path), "%s/%s", dname,
+		    de->d_name) >= (int)sizeof (path)) {
+			errx(ZKLOG_EXIT_ERROR, "path too long: '%s/%s'", dname,
+			    de->d_name);
+		}
+		if (maxtime != UINT64_MAX && (stat(path, &st) != 0 ||
+		    (uint64_t)st.st_mtime * 1000 > maxtime)) {
+			continue;
+		}
+		free(best);
+		if ((best = strdup(path)) == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		bestzxid = zxid;
+	}
+	if (errno != 0)
+		err(ZKLOG_EXIT_ERROR, "error reading directory '%s'", dname);
+	(void) closedir(dir);
+
+	if (best == NULL) {
+		errx(ZKLOG_EXIT_ERROR, "no snapshot in '%s' from before the "
+		    "given zxid or time", dname);
+	}
+	return (best);
+}
+
+/*
+ * Replays the txnlogs on top of a tree loaded from a snapshot, up to the end
+ * of the range. Logs from a directory are already in order, but if the user
+ * gave us a list we sort it.
+ */
+static void
+state_replay(struct zktree *tree, const char *dname, char **fnames,
+    size_t nfiles)
+{
+	struct zkfile *files = NULL;
+	struct zkjob job;
+	size_t i, nlogs, first;
+	char **logs = NULL;
+	int done = 0;
+
+	if (dname != NULL) {
+		/* Only the logs with txns after the snapshot. */
+		zklog_zxid_from = tree->ztr_zxid + 1;
+		logs = dir_logs(dname, &nlogs, &first, &nfiles);
+		fnames = &logs[first];
+	}
+
+	if (nfiles > 0 && (files = calloc(nfiles,
+	    sizeof (struct zkfile))) == NULL) {
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	}
+	for (i = 0; i < nfiles; ++i) {
+		files[i].zf_name = fnames[i];
+		files[i].zf_index = i;
+		if (dname == NULL)
+			files[i].zf_first_zxid = first_zxid(fnames[i]);
+	}
+	if (dname == NULL)
+		qsort(files, nfiles, sizeof (struct zkfile), zkfile_cmp_first);
+
+	for (i = 0; i < nfiles && !done; ++i) {
+		bzero(&job, sizeof (job));
+		job.zj_file = &files[i];
+		if (zkfile_open(&job) != 0)
+			zkjob_exit(&job);
+		if (files[i].zf_comp != ZKCOMP_NONE) {
+			errx(ZKLOG_EXIT_ERROR, "can't replay compressed txnlog "
+			    "'%s' for --state", files[i].zf_name);
+		}
+		if ((done = snap_replay(tree, &job)) < 0)
+			zkjob_exit(&job);
+		if (zkfile_close(&job) != 0)
+			zkjob_exit(&job);
+	}
+
+	free(files);
+	if (logs != NULL) {
+		for (i = 0; i < nlogs; ++i)
+			free(logs[i]);
+		free(logs);
+	}
+}
+
+/*
+ * Loads a snapshot, replays the txnlogs on top of it and prints the subtree
+ * we were asked for.
+ */
+static void
+do_state(const char *snapshot, const char *dname, char **fnames,
+    size_t nfiles, const char *root)
+{
+	struct zktree tree;
+	struct zktimecache tc;
+	struct zkbuf path;
+	struct zknode *n;
+
+	bzero(&tree, sizeof (tree));
+	snap_load(&tree, snapshot);
+	state_replay(&tree, dname, fnames, nfiles);
+
+	if ((n = zktree_lookup(&tree, root, strlen(root), NULL,
+	    NULL)) == NULL) {
+		errx(ZKLOG_EXIT_ERROR, "no node at '%s' at zxid 0x%" PRIx64,
+		    root, tree.ztr_zxid);
+	}
+
+	bzero(&tc, sizeof (tc));
+	bzero(&path, sizeof (path));
+	if (n != &tree.ztr_root)
+		zkbuf_append(&path, root, strlen(root));
+	snap_print(&tc, n, &path);
+	zkout_flush();
+
+	zkbuf_free(&path);
+}
+
+/*
+ * DNS replay (--dns and --dns-timeline).
+ *
+ * binder answers queries from a cache of the registrar tree in ZK (see
+ * lib/zk.js), where the node for a name is at its labels in reverse (so
+ * "db.us-east.joyent.us" is at /us/joyent/us-east/db), and holds a JSON record
+ * like
+ *
+ *	{"type":"host","host":{"address":"10.0.0.5"},"ttl":60}
+ *
+ * Service records have the instances of the service as their children. To see
+ * what binder would have answered at some point, we replay the logs into a
+ * tree as --state does, and answer from that the way resolve() and
+ * resolvePtr() in lib/server.js do, with --path standing in for binder's DNS
+ * domain. The differences are that:
+ *
+ *  - we don't know binder's configuration, so we don't refuse names that are
+ *    outside its domain or recurse for the ones it doesn't have;
+ *  - binder shuffles the instances of a service, where we sort them by name;
+ *  - binder ignores data that isn't a JSON object, and keeps the record that
+ *    was there before, where we treat the node as having an invalid record;
+ *  - and binder keeps serving the PTR record for a node that's been deleted,
+ *    until some other node gets its address, where we don't.
+ *
+ * With --dns-timeline, we keep the answers to A queries for every name under
+ * --path that has a record (and to SRV queries for the services) as we
+ * replay, and print what they were at the start of the range and then each
+ * change to one.
+ */
+#define	DNSJSON_MAXDEPTH	32
+
+enum dns_qtype {
+	DNS_A,
+	DNS_SRV,
+	DNS_PTR
+};
+
+static const char *dns_qtypes[] = { "A", "SRV", "PTR" };
+
+enum dnsjson_type {
+	DJ_NULL,
+	DJ_BOOL,
+	DJ_NUM,
+	DJ_STR,
+	DJ_ARR,
+	DJ_OBJ
+};
+
+/*
+ * A value in a parsed record. Strings and numbers are left as the text in the
+ * record (for a string, between the quotes), which we can output as it is.
+ * The members of an array or object are linked from dj_kids through dj_next,
+ * by their index in the record (0, the top value, is never a member).
+ */
+struct dnsjson {
+	enum dnsjson_type dj_type;
+	const char *dj_text;
+	size_t dj_len;
+	const char *dj_key;
+	size_t dj_keylen;
+	uint32_t dj_kids;
+	uint32_t dj_next;
+};
+
+struct dnsrec {
+	struct dnsjson *dr_vals;
+	uint32_t dr_nvals;
+	uint32_t dr_size;
+	const char *dr_p;
+	const char *dr_end;
+};
+
+/* A TTL, as the text we output and its value. */
+struct dnsttl {
+	const char *dt_text;
+	size_t dt_len;
+	double dt_val;
+};
+
+/* An answer, as the JSON members of a _DNS or _DNSCHANGE record. */
+struct dnsans {
+	const char *da_rcode;
+	struct zkbuf da_an;
+	struct zkbuf da_ad;
+	struct zkbuf da_au;
+	struct zkbuf da_out;
+};
+
+/* The last answer to a query in the timeline. */
+struct dnsent {
+	char *de_ans;
+	size_t de_len;
+	/* For an A query for a service, (id + 1) of its SRV query. */
+	uint32_t de_srv;
+	/* The last txn we looked at it for. */
+	uint64_t de_gen;
+};
+
+struct dnsstate {
+	struct zktree *ds_tree;
+	const char *ds_root;
+	size_t ds_rootlen;
+	struct dnsrec ds_rec;
+	struct dnsans ds_ans;
+	struct zkbuf ds_name;
+	struct zkbuf ds_path;
+	struct zkbuf ds_key;
+
+	/*
+	 * For --dns-timeline: the queries, named like "A <name>" in a
+	 * dictionary, and their answers by id.
+	 */
+	struct zkdict ds_queries;
+	struct dnsent *ds_ents;
+	size_t ds_nents;
+	uint64_t ds_gen;
+	/* Print only this query (if set), and only once we've started. */
+	const char *ds_only;
+	uint64_t ds_zxid_from;
+	uint64_t ds_since;
+	int ds_started;
+	struct zktimecache ds_tc;
+};
+
+static struct dnsstate zklog_dns;
+
+static void
+dnsjson_ws(struct dnsrec *r)
+{
+	while (r->dr_p < r->dr_end && (*r->dr_p == ' ' || *r->dr_p == '\t' ||
+	    *r->dr_p == '\n' || *r->dr_p == '\r'))
+		r->dr_p++;
+}
+
+static int
+dnsjson_digits(struct dnsrec *r)
+{
+	const char *start = r->dr_p;
+
+	while (r->dr_p < r->dr_end && *r->dr_p >= '0' && *r->dr_p <= '9')
+		r->dr_p++;
+	return (r->dr_p > start ? 0 : -1);
+}
+
+static int
+dnsjson_str(struct dnsrec *r, const char **textp, size_t *lenp)
+{
+	const char *p = r->dr_p, *end = r->dr_end;
+	int i;
+
+	if (p == end || *p != '"')
+		return (-1);
+	*textp = ++p;
+	for (; p < end && *p != '"'; ++p) {
+		if ((uint8_t)*p < 0x20)
+			return (-1);
+		if (*p != '\\')
+			continue;
+		if (++p == end)
+			return (-1);
+		if (*p == 'u') {
+			if (end - p < 5)
+				return (-1);
+			for (i = 1; i <= 4; ++i) {
+				if (strchr("0123456789abcdefABCDEF", p[i]) ==
+				    NULL || p[i] == '\0') {
+					return (-1);
+				}
+			}
+			p += 4;
+		} else if (*p == '\0' || strchr("\"\\/bfnrt", *p) == NULL) {
+			return (-1);
+		}
+	}
+	if (p == end)
+		return (-1);
+	*lenp = p - *textp;
+	r->dr_p = p + 1;
+	return (0);
+}
+
+/*
+ * Parses the value at dr_p into the record, returning its index, or -1 if
+ * it isn't valid JSON.
+ */
+static int64_t
+dnsjson_value(struct dnsrec *r, int depth)
+{
+	struct dnsjson *v;
+	const char *start, *key = NULL;
+	size_t keylen = 0;
+	int64_t kid;
+	uint32_t idx, last = 0;
+	char close;
+
+	dnsjson_ws(r);
+	if (r->dr_p == r->dr_end || depth > DNSJSON_MAXDEPTH)
+		return (-1);
+
+	if (r->dr_nvals == r->dr_size) {
+		r->dr_size = (r->dr_size == 0) ? 64 : r->dr_size * 2;
+		v = realloc(r->dr_vals, r->dr_size * sizeof (*v));
+		if (v == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		r->dr_vals = v;
+	}
+	idx = r->dr_nvals++;
+	v = &r->dr_vals[idx];
+	bzero(v, sizeof (*v));
+	start = r->dr_p;
+
+	switch (*r->dr_p) {
+	case '{':
+	case '[':
+		v->dj_type = (*r->dr_p == '{') ? DJ_OBJ : DJ_ARR;
+		close = (*r->dr_p == '{') ? '}' : ']';
+		r->dr_p++;
+		dnsjson_ws(r);
+		if (r->dr_p < r->dr_end && *r->dr_p == close) {
+			r->dr_p++;
+			break;
+		}
+		for (;;) {
+			if (close == '}') {
+				dnsjson_ws(r);
+				if (dnsjson_str(r, &key, &keylen) != 0)
+					return (-1);
+				dnsjson_ws(r);
+				if (r->dr_p == r->dr_end || *r->dr_p++ != ':')
+					return (-1);
+			}
+			if ((kid = dnsjson_value(r, depth + 1)) < 0)
+				return (-1);
+			r->dr_vals[kid].dj_key = key;
+			r->dr_vals[kid].dj_keylen = keylen;
+			if (last == 0)
+				r->dr_vals[idx].dj_kids = kid;
+			else
+				r->dr_vals[last].dj_next = kid;
+			last = kid;
+
+			dnsjson_ws(r);
+			if (r->dr_p == r->dr_end)
+				return (-1);
+			if (*r->dr_p == ',') {
+				r->dr_p++;
+				continue;
+			}
+			if (*r->dr_p++ != close)
+				return (-1);
+			break;
+		}
+		break;
+
+	case '"':
+		v->dj_type = DJ_STR;
+		if (dnsjson_str(r, &v->dj_text, &v->dj_len) != 0)
+			return (-1);
+		return (idx);
+
+	case 't':
+	case 'f':
+	case 'n':
+		v->dj_type = (*r->dr_p == 'n') ? DJ_NULL : DJ_BOOL;
+		for (const char *lit = (*r->dr_p == 't') ? "true" :
+		    (*r->dr_p == 'f') ? "false" : "null"; *lit != '\0';
+		    ++lit) {
+			if (r->dr_p == r->dr_end || *r->dr_p++ != *lit)
+				return (-1);
+		}
+		break;
+
+	default:
+		v->dj_type = DJ_NUM;
+		if (*r->dr_p == '-')
+			r->dr_p++;
+		if (r->dr_p < r->dr_end && *r->dr_p == '0')
+			r->dr_p++;
+		else if (dnsjson_digits(r) != 0)
+			return (-1);
+		if (r->dr_p < r->dr_end && *r->dr_p == '.') {
+			r->dr_p++;
+			if (dnsjson_digits(r) != 0)
+				return (-1);
+		}
+		if (r->dr_p < r->dr_end && (*r->dr_p == 'e' ||
+		    *r->dr_p == 'E')) {
+			r->dr_p++;
+			if (r->dr_p < r->dr_end && (*r->dr_p == '+' ||
+			    *r->dr_p == '-'))
+				r->dr_p++;
+			if (dnsjson_digits(r) != 0)
+				return (-1);
+		}
+		break;
+	}
+
+	r->dr_vals[idx].dj_text = start;
+	r->dr_vals[idx].dj_len = r->dr_p - start;
+	return (idx);
+}
+
+/*
+ * Finds a member of an object (the last one, if the key is repeated, as in
+ * JSON.parse()).
+ */
+static const struct dnsjson *
+dnsjson_member(const struct dnsrec *r, const struct dnsjson *obj,
+    const char *key, size_t keylen)
+{
+	const struct dnsjson *v, *found = NULL;
+	uint32_t i;
+
+	if (obj == NULL || obj->dj_type != DJ_OBJ)
+		return (NULL);
+	for (i = obj->dj_kids; i != 0; i = v->dj_next) {
+		v = &r->dr_vals[i];
+		if (v->dj_keylen == keylen && bcmp(v->dj_key, key, keylen) == 0)
+			found = v;
+	}
+	return (found);
+}
+
+static const struct dnsjson *
+dnsjson_get(const struct dnsrec *r, const struct dnsjson *obj,
+    const char *key)
+{
+	return (dnsjson_member(r, obj, key, strlen(key)));
+}
+
+static int
+dnsjson_streq(const struct dnsjson *v, const char *str)
+{
+	return (v != NULL && v->dj_type == DJ_STR &&
+	    v->dj_len == strlen(str) && bcmp(v->dj_text, str, v->dj_len) == 0);
+}
+
+/* Whether JavaScript would say it's an object: "typeof (v) === 'object'". */
+static int
+dnsjson_isobj(const struct dnsjson *v)
+{
+	return (v != NULL && (v->dj_type == DJ_OBJ || v->dj_type == DJ_ARR));
+}
+
+/*
+ * Parses a node's data the way binder's cache does, returning the record, or
+ * NULL if there isn't one (no data, data that isn't a JSON object, or null).
+ * The record is only good until the next one is parsed.
+ */
+static const struct dnsjson *
+dns_record(struct dnsstate *ds, const struct zknode *n)
+{
+	struct dnsrec *r = &ds->ds_rec;
+
+	if (n->zn_datalen <= 0)
+		return (NULL);
+	r->dr_nvals = 0;
+	r->dr_p = (const char *)n->zn_data;
+	r->dr_end = r->dr_p + n->zn_datalen;
+	if (dnsjson_value(r, 0) != 0)
+		return (NULL);
+	dnsjson_ws(r);
+	if (r->dr_p != r->dr_end || !dnsjson_isobj(&r->dr_vals[0]))
+		return (NULL);
+	return (&r->dr_vals[0]);
+}
+
+/*
+ * For a record that binder considers valid, returns its type-specific
+ * sub-object (record[record.type]) and points "typep" at its type.
+ */
+static const struct dnsjson *
+dns_record_inner(struct dnsstate *ds, const struct dnsjson *rec,
+    const struct dnsjson **typep)
+{
+	const struct dnsjson *type, *inner;
+
+	if (rec == NULL || (type = dnsjson_get(&ds->ds_rec, rec, "type")) ==
+	    NULL || type->dj_type != DJ_STR)
+		return (NULL);
+	inner = dnsjson_member(&ds->ds_rec, rec, type->dj_text, type->dj_len);
+	if (!dnsjson_isobj(inner))
+		return (NULL);
+	*typep = type;
+	return (inner);
+}
+
+/* The host types, which have an address (and for the last five, ports). */
+static int
+dns_host_type(const struct dnsjson *type, int withports)
+{
+	return ((!withports && (dnsjson_streq(type, "db_host") ||
+	    dnsjson_streq(type, "host"))) ||
+	    dnsjson_streq(type, "load_balancer") ||
+	    dnsjson_streq(type, "moray_host") ||
+	    dnsjson_streq(type, "redis_host") ||
+	    dnsjson_streq(type, "ops_host") ||
+	    dnsjson_streq(type, "rr_host"));
+}
+
+/* Takes the TTL from an object, if it has one. */
+static void
+dns_ttl(const struct dnsrec *r, const struct dnsjson *obj, struct dnsttl *ttl)
+{
+	const struct dnsjson *v = dnsjson_get(r, obj, "ttl");
+	char buf[64];
+
+	if (v == NULL || v->dj_type != DJ_NUM || v->dj_len >= sizeof (buf))
+		return;
+	bcopy(v->dj_text, buf, v->dj_len);
+	buf[v->dj_len] = '\0';
+	ttl->dt_text = v->dj_text;
+	ttl->dt_len = v->dj_len;
+	ttl->dt_val = strtod(buf, NULL);
+}
+
+/* Starts a resource record in one of the sections of an answer. */
+static void
+dns_rr(struct zkbuf *b, const char *name, size_t namelen, const char *type,
+    const struct dnsttl *ttl)
+{
+	if (b->zb_len > 0)
+		ZKBUF_LIT(b, ",");
+	ZKBUF_LIT(b, "{\"name\":\"");
+	zkbuf_append(b, name, namelen);
+	ZKBUF_LIT(b, "\",\"type\":\"");
+	zkbuf_str(b, type);
+	ZKBUF_LIT(b, "\",\"ttl\":");
+	zkbuf_append(b, ttl->dt_text, ttl->dt_len);
+}
+
+static void
+dns_a(struct zkbuf *b, const char *name, size_t namelen,
+    const struct dnsjson *addr, const struct dnsttl *ttl)
+{
+	dns_rr(b, name, namelen, "A", ttl);
+	ZKBUF_LIT(b, ",\"address\":\"");
+	zkbuf_append(b, addr->dj_text, addr->dj_len);
+	ZKBUF_LIT(b, "\"}");
+}
+
+/* The node for a name, if it's under --path. */
+static struct zknode *
+dns_lookup(struct dnsstate *ds, const char *name, size_t len)
+{
+	struct zkbuf *path = &ds->ds_path;
+	const char *end = name + len, *dot;
+
+	/* An empty label makes an empty component, which we won't find. */
+	path->zb_len = 0;
+	for (end = name + len; ; end = dot - 1) {
+		for (dot = end; dot > name && dot[-1] != '.'; --dot)
+			;
+		ZKBUF_LIT(path, "/");
+		zkbuf_append(path, dot, end - dot);
+		if (dot == name)
+			break;
+	}
+	if (path->zb_len < ds->ds_rootlen || bcmp(path->zb_data, ds->ds_root,
+	    ds->ds_rootlen) != 0 || (ds->ds_rootlen > 1 &&
+	    path->zb_len > ds->ds_rootlen &&
+	    path->zb_data[ds->ds_rootlen] != '/')) {
+		return (NULL);
+	}
+	return (zktree_lookup(ds->ds_tree, path->zb_data, path->zb_len, NULL,
+	    NULL));
+}
+
+/* Appends the name of a node: its path, in reverse and in lower case. */
+static void
+dns_node_name(const struct zknode *n, struct zkbuf *b)
+{
+	size_t start = b->zb_len;
+
+	for (; n->zn_parent != NULL; n = n->zn_parent) {
+		if (b->zb_len > start)
+			ZKBUF_LIT(b, ".");
+		zkbuf_reserve(b, n->zn_namelen);
+		for (size_t i = 0; i < n->zn_namelen; ++i) {
+			char c = n->zn_name[i];
+			b->zb_data[b->zb_len++] = (c >= 'A' && c <= 'Z') ?
+			    c - 'A' + 'a' : c;
+		}
+	}
+}
+
+/*
+ * The host of a URL (the primary of a "database" record), as url.parse()
+ * would find it. Returns 0 if there isn't one.
+ */
+static size_t
+dns_url_host(const char *url, size_t len, const char **hostp)
+{
+	const char *p, *end = url + len, *at, *colon;
+
+	for (p = url; p + 2 < end && !(p[0] == '/' && p[1] == '/'); ++p) {
+		if (*p == '/' || *p == '?' || *p == '#')
+			return (0);
+	}
+	if (p + 2 >= end)
+		return (0);
+	p += 2;
+	for (end = p; end < url + len && *end != '/' && *end != '?' &&
+	    *end != '#'; ++end)
+		;
+	for (at = end; at > p && at[-1] != '@'; --at)
+		;
+	for (colon = at; colon < end && *colon != ':'; ++colon)
+		;
+	*hostp = at;
+	return (colon - at);
+}
+
+/* resolvePtr(), for names like "5.0.0.10.in-addr.arpa". */
+static void
+dns_resolve_ptr(struct dnsstate *ds, const char *qname, size_t qlen,
+    struct dnsans *a)
+{
+	static const char suffix[] = ".in-addr.arpa";
+	size_t slen = sizeof (suffix) - 1;
+	struct zkbuf *ip = &ds->ds_name;
+	const char *end, *dot;
+	struct zknode *root, *n, *best = NULL;
+	const struct dnsjson *rec, *type, *inner, *addr;
+	struct dnsttl ttl = { "30", 2, 30 };
+	struct zknode **stack = NULL;
+	size_t nstack = 0, stacksize = 0;
+
+	if (qlen < slen || bcmp(qname + qlen - slen, suffix, slen) != 0) {
+		a->da_rcode = "REFUSED";
+		return;
+	}
+
+	/* The address is the rest of the name, in reverse. */
+	ip->zb_len = 0;
+	for (end = qname + qlen - slen; ; end = dot - 1) {
+		for (dot = end; dot > qname && dot[-1] != '.'; --dot)
+			;
+		zkbuf_append(ip, dot, end - dot);
+		if (dot == qname)
+			break;
+		ZKBUF_LIT(ip, ".");
+	}
+
+	/*
+	 * binder keeps a map of addresses to the nodes that last set them. We
+	 * look at every node instead, and take the one changed most recently.
+	 */
+	root = zktree_lookup(ds->ds_tree, ds->ds_root, ds->ds_rootlen, NULL,
+	    NULL);
+	for (n = root; n != NULL; n = (nstack > 0) ? stack[--nstack] : NULL) {
+		if (nstack + n->zn_nkids > stacksize) {
+			stacksize = (nstack + n->zn_nkids) * 2;
+			stack = realloc(stack, stacksize * sizeof (*stack));
+			if (stack == NULL)
+				err(ZKLOG_EXIT_ERROR,
+				    "failed to allocate memory");
+		}
+		for (uint32_t i = 0; i < n->zn_nkids; ++i)
+			stack[nstack++] = n->zn_kids[i];
+
+		if ((inner = dns_record_inner(ds, dns_record(ds, n),
+		    &type)) == NULL || !dns_host_type(type, 0) ||
+		    (addr = dnsjson_get(&ds->ds_rec, inner, "address")) ==
+		    NULL || addr->dj_type != DJ_STR ||
+		    addr->dj_len != ip->zb_len ||
+		    bcmp(addr->dj_text, ip->zb_data, ip->zb_len) != 0) {
+			continue;
+		}
+		if (best == NULL || n->zn_mzxid > best->zn_mzxid)
+			best = n;
+	}
+	free(stack);
+
+	if (best == NULL) {
+		a->da_rcode = "REFUSED";
+		return;
+	}
+
+	rec = dns_record(ds, best);
+	inner = dns_record_inner(ds, rec, &type);
+	dns_ttl(&ds->ds_rec, rec, &ttl);
+	dns_ttl(&ds->ds_rec, inner, &ttl);
+	a->da_rcode = "NOERROR";
+	dns_rr(&a->da_an, qname, qlen, "PTR", &ttl);
+	ZKBUF_LIT(&a->da_an, ",\"target\":\"");
+	dns_node_name(best, &a->da_an);
+	ZKBUF_LIT(&a->da_an, "\"}");
+}
+
+/*
+ * The members of a service (its children with one of the host types that
+ * have ports), in order of name.
+ */
+static void
+dns_resolve_service(struct dnsstate *ds, const struct zknode *n,
+    const char *qname, size_t qlen, const char *domain, size_t dlen,
+    int srv, struct dnsttl *ttl, const struct dnsjson *port,
+    struct dnsans *a)
 {
-	if (type == ZK_ERROR) {
-		if (len < sizeof (struct zktxn_err)) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for ZK_ERROR: %lu", len);
-		}
-		struct zktxn_err *err = (struct zktxn_err *)inner;
-		err->ze_err = be32toh(err->ze_err);
-		(void) printf(",\"error\":\"%s\",\"errid\":%d",
-		    zkerr_to_name((int32_t)err->ze_err),
-		    (int32_t)err->ze_err);
+	struct zknode **kids;
+	const struct dnsjson *krec, *ktype, *kinner, *addr, *ports, *p;
+	struct dnsttl rttl;
+	uint32_t i, j, nkids = 0;
+
+	if (n->zn_nkids == 0)
+		return;
+	if ((kids = malloc(n->zn_nkids * sizeof (*kids))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < n->zn_nkids; ++i) {
+		if ((krec = dns_record(ds, n->zn_kids[i])) != NULL &&
+		    dns_host_type(dnsjson_get(&ds->ds_rec, krec, "type"), 1))
+			kids[nkids++] = n->zn_kids[i];
+	}
+	qsort(kids, nkids, sizeof (*kids), zknode_cmp);
 
-	} else if (type == ZK_CREATESESSION) {
-		if (len < sizeof (struct zktxn_createsess)) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for ZK_CREATESESSION: %lu", len);
+	for (i = 0; i < nkids; ++i) {
+		krec = dns_record(ds, kids[i]);
+		if ((kinner = dns_record_inner(ds, krec, &ktype)) == NULL) {
+			a->da_rcode = "SERVFAIL";
+			break;
+		}
+		if ((addr = dnsjson_get(&ds->ds_rec, kinner, "address")) !=
+		    NULL && addr->dj_type == DJ_NULL)
+			continue;
+		if (addr == NULL || addr->dj_type != DJ_STR) {
+			a->da_rcode = "SERVFAIL";
+			break;
 		}
-		struct zktxn_createsess *cs = (struct zktxn_createsess *)inner;
-		cs->zcs_timeout = be32toh(cs->zcs_timeout);
-		(void) printf(",\"timeout\":\"%d\"", (int32_t)cs->zcs_timeout);
 
-	} else if (type == ZK_CREATE || type == ZK_SETDATA ||
-	    type == ZK_DELETE || type == ZK_CHECK || type == ZK_SETACL) {
-		size_t offset = 0;
-		struct zk_string *name = (struct zk_string *)(inner + offset);
+		rttl = *ttl;
+		dns_ttl(&ds->ds_rec, krec, &rttl);
+		dns_ttl(&ds->ds_rec, kinner, &rttl);
 
-		OFFSET_ADD(offset, sizeof (struct zk_string));
-		if (offset > len) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for %s (decoding node name): %lu",
-			    zktxn_type_to_name(type), len);
+		if (!srv) {
+			/*
+			 * The A records for a service say both who's in it and
+			 * what their addresses are, so they get the smaller of
+			 * the two TTLs.
+			 */
+			dns_a(&a->da_an, domain, dlen, addr,
+			    ttl->dt_val < rttl.dt_val ? ttl : &rttl);
+			continue;
 		}
 
-		name->zs_len = be32toh(name->zs_len);
+		ds->ds_name.zb_len = 0;
+		zkbuf_append(&ds->ds_name, kids[i]->zn_name,
+		    kids[i]->zn_namelen);
+		ZKBUF_LIT(&ds->ds_name, ".");
+		zkbuf_append(&ds->ds_name, domain, dlen);
 
-		OFFSET_ADD(offset, name->zs_len);
-		if (offset > len) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for %s: %lu",
-			    zktxn_type_to_name(type), len);
+		ports = dnsjson_get(&ds->ds_rec, kinner, "ports");
+		if (ports == NULL || ports->dj_type != DJ_ARR ||
+		    ports->dj_kids == 0)
+			ports = NULL;
+		for (j = (ports != NULL) ? ports->dj_kids : 0; ; ) {
+			p = (ports != NULL) ? &ds->ds_rec.dr_vals[j] : port;
+			dns_rr(&a->da_an, qname, qlen, "SRV", ttl);
+			ZKBUF_LIT(&a->da_an, ",\"target\":\"");
+			zkbuf_append(&a->da_an, ds->ds_name.zb_data,
+			    ds->ds_name.zb_len);
+			ZKBUF_LIT(&a->da_an, "\",\"port\":");
+			/*
+			 * The port is whatever registrar put there, which
+			 * binder passes on as it is. A string's text is what
+			 * was between its quotes, so it needs them back.
+			 */
+			if (p == NULL) {
+				ZKBUF_LIT(&a->da_an, "null");
+			} else if (p->dj_type == DJ_STR) {
+				ZKBUF_LIT(&a->da_an, "\"");
+				zkbuf_append(&a->da_an, p->dj_text, p->dj_len);
+				ZKBUF_LIT(&a->da_an, "\"");
+			} else {
+				zkbuf_append(&a->da_an, p->dj_text, p->dj_len);
+			}
+			ZKBUF_LIT(&a->da_an, "}");
+			if (ports == NULL || (j = p->dj_next) == 0)
+				break;
 		}
+		dns_a(&a->da_ad, ds->ds_name.zb_data, ds->ds_name.zb_len, addr,
+		    &rttl);
+	}
 
-		char *namestr = strndup(name->zs_str, name->zs_len);
-		if (namestr == NULL)
-			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
-		(void) printf(",\"path\":\"%s\"", namestr);
-		free(namestr);
-
-		/* Only CREATE/SETDATA have data fields. */
-		if (type != ZK_CREATE && type != ZK_SETDATA)
-			return;
-		/* Skip unless they gave us -d. */
-		if (!zklog_dumpdata)
-			return;
+	free(kids);
+}
 
-		struct zk_string *data = (struct zk_string *)(inner + offset);
+/*
+ * Answers a query from the tree as resolve() would, leaving the answer in
+ * ds_ans.da_out.
+ */
+static void
+dns_resolve(struct dnsstate *ds, enum dns_qtype qtype, const char *qname,
+    size_t qlen)
+{
+	struct dnsans *a = &ds->ds_ans;
+	const char *domain = qname, *service = NULL, *proto = NULL, *p;
+	size_t dlen = qlen, slen = 0, plen = 0, i;
+	const struct dnsjson *rec, *type, *inner, *v, *s, *portp = NULL;
+	struct dnsjson host, port, srvce, sproto;
+	struct dnsttl ttl = { "30", 2, 30 };
+	struct zknode *n;
+	char *lower;
 
-		OFFSET_ADD(offset, sizeof (struct zk_string));
-		if (offset > len) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for %s (decoding data field): %lu",
-			    zktxn_type_to_name(type), len);
-		}
+	a->da_rcode = "NOERROR";
+	a->da_an.zb_len = a->da_ad.zb_len = a->da_au.zb_len = 0;
 
-		data->zs_len = be32toh(data->zs_len);
+	if (qtype == DNS_PTR) {
+		dns_resolve_ptr(ds, qname, qlen, a);
+		goto out;
+	}
 
-		/*
-		 * CREATE can have data len set to -1 (signed) to indicate
-		 * that no data was included with the CREATE command. ZK plays
-		 * a bit fast and loose with signedness unfortunately.
-		 */
-		if ((int32_t)data->zs_len < 0)
-			return;
+	if (qtype == DNS_SRV) {
+		/* The name has to look like "_service._proto.domain". */
+		for (i = 0, p = qname; i < 2; ++i) {
+			const char *start = p;
 
-		OFFSET_ADD(offset, data->zs_len);
-		if (offset > len) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for %s (in data, %u bytes): %lu",
-			    zktxn_type_to_name(type), data->zs_len, len);
+			if (p == qname + qlen || *p != '_') {
+				a->da_rcode = "REFUSED";
+				goto out;
+			}
+			for (++p; p < qname + qlen && *p != '_' && *p != '.';
+			    ++p)
+				;
+			if (p == qname + qlen || *p != '.') {
+				a->da_rcode = "REFUSED";
+				goto out;
+			}
+			if (i == 0) {
+				service = start;
+				slen = p - start;
+			} else {
+				proto = start;
+				plen = p - start;
+			}
+			p++;
 		}
-		(void) printf(",\"data\":\"");
-		for (size_t i = 0; i < data->zs_len; ++i)
-			(void) printf("%02x", data->zs_str[i]);
-		(void) printf("\"");
+		domain = p;
+		dlen = qname + qlen - p;
+	}
 
-	} else if (type == ZK_MULTI) {
-		size_t offset = 0;
-		if (len < sizeof (struct zktxn_multi)) {
-			errx(ZKLOG_EXIT_BAD_FORMAT,
-			    "txn too short for ZK_MULTI: %lu", len);
+	if (dlen == 0) {
+		a->da_rcode = "REFUSED";
+		goto out;
+	}
+	if ((lower = malloc(dlen)) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < dlen; ++i) {
+		char c = domain[i];
+
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+		if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+		    c == '_' || c == '.' || c == '-')) {
+			free(lower);
+			a->da_rcode = "REFUSED";
+			goto out;
 		}
-		struct zktxn_multi *m = &txn->zt_inner.zti_multi;
-		m->zm_ntxns = be32toh(m->zm_ntxns);
-		(void) printf(",\"count\":%d}\n", m->zm_ntxns);
+		lower[i] = c;
+	}
+	domain = lower;
 
-		OFFSET_ADD(offset, sizeof (struct zktxn_multi));
-		/* We already checked len above */
+	if ((n = dns_lookup(ds, domain, dlen)) == NULL) {
+		a->da_rcode = "REFUSED";
+		goto done;
+	}
 
-		for (size_t i = 0; i < m->zm_ntxns; ++i) {
-			struct zktxn_multitxn *mt =
-			    (struct zktxn_multitxn *)(inner + offset);
+	rec = dns_record(ds, n);
+	if ((inner = dns_record_inner(ds, rec, &type)) == NULL) {
+		a->da_rcode = "SERVFAIL";
+		goto done;
+	}
 
-			OFFSET_ADD(offset, offsetof(struct zktxn_multitxn,
-			    zmt_len));
-			OFFSET_ADD(offset, sizeof (mt->zmt_len));
-			if (offset > len) {
-				errx(ZKLOG_EXIT_BAD_FORMAT,
-				    "txn too short for ZK_MULTI (at child txn "
-				    "%zu): %lu", i, len);
-			}
+	/* The TTL from the deepest object that has one. */
+	dns_ttl(&ds->ds_rec, rec, &ttl);
+	dns_ttl(&ds->ds_rec, inner, &ttl);
 
-			mt->zmt_type = be32toh(mt->zmt_type);
-			mt->zmt_len = be32toh(mt->zmt_len);
+	if (service != NULL && !dnsjson_streq(type, "service")) {
+		/* Not a service: NODATA, with the TTL for negative caching. */
+		dns_rr(&a->da_au, domain, dlen, "SOA", &ttl);
+		ZKBUF_LIT(&a->da_au, "}");
+		goto done;
+	}
 
-			OFFSET_ADD(offset, mt->zmt_len);
-			if (offset > len) {
-				errx(ZKLOG_EXIT_BAD_FORMAT,
-				    "txn too short for ZK_MULTI (after inner "
-				    "length of child txn %zu): %lu", i, len);
+	if (dnsjson_streq(type, "database")) {
+		v = dnsjson_get(&ds->ds_rec, inner, "primary");
+		if (v == NULL || v->dj_type != DJ_STR || (host.dj_len =
+		    dns_url_host(v->dj_text, v->dj_len, &host.dj_text)) == 0) {
+			a->da_rcode = "SERVFAIL";
+			goto done;
+		}
+		dns_a(&a->da_an, domain, dlen, &host, &ttl);
+	} else if (dns_host_type(type, 0)) {
+		v = dnsjson_get(&ds->ds_rec, inner, "address");
+		if (v == NULL || v->dj_type != DJ_STR) {
+			a->da_rcode = "SERVFAIL";
+			goto done;
+		}
+		dns_a(&a->da_an, domain, dlen, v, &ttl);
+	} else if (dnsjson_streq(type, "service")) {
+		s = inner;
+		if ((v = dnsjson_get(&ds->ds_rec, s, "service")) != NULL &&
+		    (v->dj_type == DJ_OBJ || v->dj_type == DJ_ARR ||
+		    v->dj_type == DJ_NULL)) {
+			if (v->dj_type == DJ_NULL) {
+				a->da_rcode = "SERVFAIL";
+				goto done;
 			}
+			s = v;
+		}
+		dns_ttl(&ds->ds_rec, s, &ttl);
 
-			(void) printf("{\"time\":\"%s\",\"type\":\"%s\","
-			    "\"typeid\":%d,"
-			    "\"sessionid\":\"%" PRIx64 "\","
-			    "\"cxid\":\"%x\",\"zxid\":\"%" PRIx64 "\"",
-			    timebuf,
-			    zktxn_type_to_name((enum zktxn_type)mt->zmt_type),
-			    (int32_t)mt->zmt_type, txn->zt_sessionid,
-			    txn->zt_cxid, txn->zt_zxid);
-
-			print_inner(txn, timebuf, (enum zktxn_type)mt->zmt_type,
-			    &mt->zmt_inner, mt->zmt_len);
+		/* These point into the node, so they outlive the record. */
+		bzero(&srvce, sizeof (srvce));
+		bzero(&sproto, sizeof (sproto));
+		if ((v = dnsjson_get(&ds->ds_rec, s, "srvce")) != NULL)
+			srvce = *v;
+		if ((v = dnsjson_get(&ds->ds_rec, s, "proto")) != NULL)
+			sproto = *v;
+		if ((v = dnsjson_get(&ds->ds_rec, s, "port")) != NULL) {
+			port = *v;
+			portp = &port;
+		}
 
-			if (i + 1 < m->zm_ntxns)
-				(void) printf("}\n");
+		if (service != NULL && (srvce.dj_type != DJ_STR ||
+		    srvce.dj_len != slen ||
+		    bcmp(srvce.dj_text, service, slen) != 0 ||
+		    sproto.dj_type != DJ_STR || sproto.dj_len != plen ||
+		    bcmp(sproto.dj_text, proto, plen) != 0)) {
+			a->da_rcode = "NXDOMAIN";
+			goto done;
 		}
+		dns_resolve_service(ds, n, qname, qlen, domain, dlen,
+		    service != NULL, &ttl, portp, a);
+	}
+
+done:
+	free(lower);
+out:
+	a->da_out.zb_len = 0;
+	ZKBUF_LIT(&a->da_out, "\"rcode\":\"");
+	zkbuf_str(&a->da_out, a->da_rcode);
+	ZKBUF_LIT(&a->da_out, "\",\"answers\":[");
+	zkbuf_append(&a->da_out, a->da_an.zb_data, a->da_an.zb_len);
+	ZKBUF_LIT(&a->da_out, "]");
+	if (a->da_ad.zb_len > 0) {
+		ZKBUF_LIT(&a->da_out, ",\"additional\":[");
+		zkbuf_append(&a->da_out, a->da_ad.zb_data, a->da_ad.zb_len);
+		ZKBUF_LIT(&a->da_out, "]");
+	}
+	if (a->da_au.zb_len > 0) {
+		ZKBUF_LIT(&a->da_out, ",\"authority\":[");
+		zkbuf_append(&a->da_out, a->da_au.zb_data, a->da_au.zb_len);
+		ZKBUF_LIT(&a->da_out, "]");
 	}
-	/*
-	 * For other types we don't print any additional information. Not
-	 * handling them here is fine.
-	 */
 }
 
+/* Prints an answer as a record of the given type. */
 static void
-do_file(const char *fname)
+dns_print(struct dnsstate *ds, const char *rtype, enum dns_qtype qtype,
+    const char *qname, size_t qlen, uint64_t zxid, uint64_t time,
+    const char *ans, size_t anslen)
 {
-	int fd;
-	uint8_t *data;
-	struct zklog *log;
-	struct zktxn *txn;
-	struct stat stat;
-	size_t len;
-	size_t offset;
 	char timebuf[64];
-	time_t t, tms;
-	struct tm *tm;
-	struct session_state *sess, **head;
-	uint64_t duration;
-
-	fd = open(fname, O_RDONLY);
-	if (fd < 0)
-		err(ZKLOG_EXIT_ERROR, "error opening file '%s'", fname);
-
-	if (fstat(fd, &stat))
-		err(ZKLOG_EXIT_ERROR, "error getting size of file '%s'", fname);
+	ssize_t timelen;
 
-	len = stat.st_size;
-	if (len < sizeof (struct zklog)) {
-		errx(ZKLOG_EXIT_BAD_FORMAT, "file %s is too small to be "
-		    "a txnlog", fname);
+	ZKBUF_LIT(&zklog_out, "{\"type\":\"");
+	zkbuf_str(&zklog_out, rtype);
+	ZKBUF_LIT(&zklog_out, "\",\"zxid\":\"");
+	zkbuf_hex(&zklog_out, zxid);
+	ZKBUF_LIT(&zklog_out, "\"");
+	if (time != 0 && (timelen = format_time(&ds->ds_tc, time,
+	    timebuf)) > 0) {
+		ZKBUF_LIT(&zklog_out, ",\"time\":\"");
+		zkbuf_append(&zklog_out, timebuf, timelen);
+		ZKBUF_LIT(&zklog_out, "\"");
 	}
+	ZKBUF_LIT(&zklog_out, ",\"name\":\"");
+	zkbuf_append(&zklog_out, qname, qlen);
+	ZKBUF_LIT(&zklog_out, "\",\"qtype\":\"");
+	zkbuf_str(&zklog_out, dns_qtypes[qtype]);
+	ZKBUF_LIT(&zklog_out, "\",");
+	zkbuf_append(&zklog_out, ans, anslen);
+	ZKBUF_LIT(&zklog_out, "}\n");
+	zkout_check();
+}
 
-	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-	if (data == MAP_FAILED) {
-		err(ZKLOG_EXIT_ERROR, "error mapping file '%s' into memory",
-		    fname);
+/* Splits a query in the timeline ("A <name>") into its type and name. */
+static enum dns_qtype
+dns_query(const struct dnsstate *ds, uint32_t id, const char **namep,
+    size_t *lenp)
+{
+	const char *q = ds->ds_queries.zd_strs[id];
+	size_t len = ds->ds_queries.zd_lens[id];
+
+	if (q[0] == 'A') {
+		*namep = q + 2;
+		*lenp = len - 2;
+		return (DNS_A);
 	}
+	*namep = q + 4;
+	*lenp = len - 4;
+	return (DNS_SRV);
+}
 
-	log = (struct zklog *)data;
+static uint32_t
+dns_query_id(struct dnsstate *ds, const char *q, size_t len)
+{
+	uint32_t id;
+	int isnew;
 
-	log->zl_magic = be32toh(log->zl_magic);
-	if (log->zl_magic != ZKLOG_MAGIC)
-		errx(ZKLOG_EXIT_BAD_FORMAT, "bad magic number in '%s'", fname);
+	id = zkdict_id(&ds->ds_queries, q, len, &isnew);
+	if (id >= ds->ds_nents) {
+		size_t nsize = (ds->ds_nents == 0) ? 1024 : ds->ds_nents * 2;
+		struct dnsent *ents = realloc(ds->ds_ents,
+		    nsize * sizeof (*ents));
 
-	log->zl_version = be32toh(log->zl_version);
-	if (log->zl_version != ZKLOG_VERSION_2) {
-		errx(ZKLOG_EXIT_BAD_FORMAT, "txnlog '%s' has unknown log "
-		    "version: %u", fname, log->zl_version);
+		if (ents == NULL)
+			err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+		bzero(ents + ds->ds_nents,
+		    (nsize - ds->ds_nents) * sizeof (*ents));
+		ds->ds_ents = ents;
+		ds->ds_nents = nsize;
 	}
+	return (id);
+}
+
+/*
+ * Answers a query in the timeline again, printing the answer if it's changed
+ * (once we've started), and then either keeping it or, if the query isn't one
+ * we follow any more, forgetting it.
+ */
+static void
+dns_track(struct dnsstate *ds, uint32_t id, int keep, uint64_t zxid,
+    uint64_t time)
+{
+	struct dnsent *e = &ds->ds_ents[id];
+	struct zkbuf *ans = &ds->ds_ans.da_out;
+	enum dns_qtype qtype;
+	const char *name;
+	size_t len;
 
-	offset = (uintptr_t)log->zl_txns - (uintptr_t)data;
-	while (offset < len) {
-		txn = (struct zktxn *)(data + offset);
+	qtype = dns_query(ds, id, &name, &len);
+	dns_resolve(ds, qtype, name, len);
 
-		OFFSET_ADD(offset, offsetof(struct zktxn, zt_len));
-		OFFSET_ADD(offset, sizeof (txn->zt_len));
-		if (offset > len) {
-			errx(ZKLOG_EXIT_BAD_FORMAT, "bad txn entry in '%s' "
-			    "around +0x%lx", fname, offset);
+	if (e->de_ans == NULL || e->de_len != ans->zb_len ||
+	    bcmp(e->de_ans, ans->zb_data, ans->zb_len) != 0) {
+		if (ds->ds_started && (ds->ds_only == NULL ||
+		    strcmp(ds->ds_only, ds->ds_queries.zd_strs[id]) == 0)) {
+			dns_print(ds, "_DNSCHANGE", qtype, name, len, zxid,
+			    time, ans->zb_data, ans->zb_len);
+		}
+		free(e->de_ans);
+		e->de_ans = NULL;
+		if (keep) {
+			if ((e->de_ans = malloc(ans->zb_len)) == NULL)
+				err(ZKLOG_EXIT_ERROR,
+				    "failed to allocate memory");
+			bcopy(ans->zb_data, e->de_ans, ans->zb_len);
+			e->de_len = ans->zb_len;
 		}
+	}
+	if (!keep) {
+		free(e->de_ans);
+		e->de_ans = NULL;
+	}
+}
+
+/*
+ * Looks again at the queries for the name of a node that's changed (or been
+ * removed), by its path.
+ */
+static void
+dns_update(struct dnsstate *ds, const char *path, size_t len, uint64_t zxid,
+    uint64_t time)
+{
+	struct zkbuf *q = &ds->ds_key;
+	const struct dnsjson *rec, *type, *inner, *v, *srvce, *proto;
+	const char *end, *slash;
+	struct zknode *n;
+	uint32_t id, srv = 0, oldsrv;
+	size_t alen;
+	int tracked = 0;
 
-		txn->zt_len = be32toh(txn->zt_len);
+	if (len <= 1 || len < ds->ds_rootlen || bcmp(path, ds->ds_root,
+	    ds->ds_rootlen) != 0 || (ds->ds_rootlen > 1 &&
+	    len > ds->ds_rootlen && path[ds->ds_rootlen] != '/')) {
+		return;
+	}
 
-		if (txn->zt_len == 0)
-			break;
-		if (txn->zt_len < ZKTXN_MIN_LEN) {
-			errx(ZKLOG_EXIT_BAD_FORMAT, "txn entry too short in "
-			    "'%s' around +0x%lx", fname, offset);
+	/* Its name is its path in reverse. */
+	q->zb_len = 0;
+	ZKBUF_LIT(q, "A ");
+	for (end = path + len; end > path; end = slash) {
+		for (slash = end - 1; *slash != '/'; --slash)
+			;
+		for (const char *c = slash + 1; c < end; ++c) {
+			char lc = (*c >= 'A' && *c <= 'Z') ? *c - 'A' + 'a' :
+			    *c;
+			zkbuf_append(q, &lc, 1);
 		}
+		if (slash > path)
+			ZKBUF_LIT(q, ".");
+	}
+	id = dns_query_id(ds, q->zb_data, q->zb_len);
+	if (ds->ds_ents[id].de_gen == ds->ds_gen)
+		return;
+	ds->ds_ents[id].de_gen = ds->ds_gen;
 
-		OFFSET_ADD(offset, txn->zt_len);
-		if (offset >= len || data[offset] != ZKTXN_TERMINATOR) {
-			errx(ZKLOG_EXIT_BAD_FORMAT, "bad txn entry in '%s' "
-			    "around +0x%lx", fname, offset);
+	/*
+	 * We follow the names with records that have a type, and the SRV
+	 * names of the services.
+	 */
+	if ((n = zktree_lookup(ds->ds_tree, path, len, NULL, NULL)) != NULL &&
+	    (rec = dns_record(ds, n)) != NULL &&
+	    (type = dnsjson_get(&ds->ds_rec, rec, "type")) != NULL &&
+	    type->dj_type == DJ_STR) {
+		tracked = 1;
+		inner = dns_record_inner(ds, rec, &type);
+		if (inner != NULL && dnsjson_streq(type, "service") &&
+		    dnsjson_isobj(v = dnsjson_get(&ds->ds_rec, inner,
+		    "service"))) {
+			inner = v;
+		}
+		if (inner != NULL && dnsjson_streq(type, "service") &&
+		    (srvce = dnsjson_get(&ds->ds_rec, inner, "srvce")) !=
+		    NULL && srvce->dj_type == DJ_STR &&
+		    (proto = dnsjson_get(&ds->ds_rec, inner, "proto")) !=
+		    NULL && proto->dj_type == DJ_STR) {
+			/* "SRV _srvce._proto.<name>", after the A query. */
+			alen = q->zb_len;
+			zkbuf_reserve(q, alen + srvce->dj_len +
+			    proto->dj_len + 4);
+			ZKBUF_LIT(q, "SRV ");
+			zkbuf_append(q, srvce->dj_text, srvce->dj_len);
+			ZKBUF_LIT(q, ".");
+			zkbuf_append(q, proto->dj_text, proto->dj_len);
+			ZKBUF_LIT(q, ".");
+			zkbuf_append(q, q->zb_data + 2, alen - 2);
+			srv = dns_query_id(ds, q->zb_data + alen,
+			    q->zb_len - alen) + 1;
+			q->zb_len = alen;
 		}
+	}
+	if (!tracked && ds->ds_ents[id].de_ans == NULL)
+		return;
 
-		OFFSET_ADD(offset, 1);
-		/* Checked by the >= above */
+	dns_track(ds, id, tracked, zxid, time);
+	oldsrv = ds->ds_ents[id].de_srv;
+	if (oldsrv != 0 && oldsrv != srv)
+		dns_track(ds, oldsrv - 1, 0, zxid, time);
+	if (srv != 0)
+		dns_track(ds, srv - 1, 1, zxid, time);
+	ds->ds_ents[id].de_srv = srv;
+}
 
-		txn->zt_sessionid = be64toh(txn->zt_sessionid);
-		txn->zt_cxid = be32toh(txn->zt_cxid);
-		txn->zt_zxid = be64toh(txn->zt_zxid);
-		txn->zt_time = be64toh(txn->zt_time);
-		txn->zt_type = be32toh(txn->zt_type);
+/* Looks at a node that's changed, and at its parent (if it's a service). */
+static void
+dns_update_path(struct dnsstate *ds, const char *path, size_t len,
+    uint64_t zxid, uint64_t time)
+{
+	const char *slash;
 
-		tms = txn->zt_time % 1000;
-		t = txn->zt_time / 1000;
+	dns_update(ds, path, len, zxid, time);
+	for (slash = path + len - 1; slash > path && *slash != '/'; --slash)
+		;
+	dns_update(ds, path, slash - path, zxid, time);
+}
 
-		duration = 0;
+static int
+dns_query_cmp(const void *a, const void *b)
+{
+	const struct dnsstate *ds = &zklog_dns;
+	uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+	const char *na, *nb;
+	size_t la, lb;
+	enum dns_qtype ta, tb;
+	int rv;
 
-		head = &sessions[sid_to_hash_bucket(txn->zt_sessionid)];
-		for (sess = *head; sess != NULL; sess = sess->ss_next) {
-			if (sess->ss_sid == txn->zt_sessionid)
-				break;
-		}
+	ta = dns_query(ds, ia, &na, &la);
+	tb = dns_query(ds, ib, &nb, &lb);
+	if ((rv = memcmp(na, nb, la < lb ? la : lb)) != 0)
+		return (rv);
+	if (la != lb)
+		return (la < lb ? -1 : 1);
+	return ((int)ta - (int)tb);
+}
 
-		if (sess == NULL &&
-		    (enum zktxn_type)txn->zt_type == ZK_CREATESESSION) {
-			sess = calloc(1, sizeof (struct session_state));
-			if (sess == NULL) {
-				err(ZKLOG_EXIT_ERROR,
-				    "failed to allocate memory");
-			}
-			sess->ss_next = *head;
-			sess->ss_sid = txn->zt_sessionid;
-			sess->ss_start = txn->zt_time;
-			if (*head != NULL)
-				(*head)->ss_prev = sess;
-			*head = sess;
-		}
+/*
+ * Prints the answers to all the queries we're following, at the start of the
+ * range (or the end of the logs, if there's nothing in it).
+ */
+static void
+dns_print_all(struct dnsstate *ds)
+{
+	uint32_t *ids, n = 0, i;
+	const char *name;
+	size_t len;
+	enum dns_qtype qtype;
 
-		if (sess != NULL &&
-		    (enum zktxn_type)txn->zt_type == ZK_CLOSESESSION) {
-			duration = txn->zt_time - sess->ss_start;
-			if (sess->ss_next != NULL)
-				sess->ss_next->ss_prev = sess->ss_prev;
-			if (sess->ss_prev != NULL)
-				sess->ss_prev->ss_next = sess->ss_next;
-			if (*head == sess)
-				*head = sess->ss_next;
-			free(sess);
-		}
+	if ((ids = malloc((ds->ds_queries.zd_n + 1) * sizeof (*ids))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+	for (i = 0; i < ds->ds_queries.zd_n; ++i) {
+		if (ds->ds_ents[i].de_ans != NULL && (ds->ds_only == NULL ||
+		    strcmp(ds->ds_only, ds->ds_queries.zd_strs[i]) == 0))
+			ids[n++] = i;
+	}
+	qsort(ids, n, sizeof (*ids), dns_query_cmp);
+	for (i = 0; i < n; ++i) {
+		qtype = dns_query(ds, ids[i], &name, &len);
+		dns_print(ds, "_DNS", qtype, name, len,
+		    ds->ds_tree->ztr_zxid, ds->ds_tree->ztr_time,
+		    ds->ds_ents[ids[i]].de_ans, ds->ds_ents[ids[i]].de_len);
+	}
+	free(ids);
+	ds->ds_started = 1;
+}
 
-		if (t < zklog_mintime)
-			continue;
-		if (zklog_sid != 0 && zklog_sid != txn->zt_sessionid)
-			continue;
-		if (zklog_srvid != 0 &&
-		    sid_to_srvid(txn->zt_sessionid) != zklog_srvid) {
-			continue;
-		}
+/* The hook for the tree, called for each txn as we replay the logs. */
+static void
+dns_replayed(struct zktree *t, uint64_t zxid, uint64_t time)
+{
+	struct dnsstate *ds = &zklog_dns;
+	const char *p = t->ztr_changed.zb_data;
+	const char *end = p + t->ztr_changed.zb_len;
+	size_t len;
+
+	if (!ds->ds_started && zxid >= ds->ds_zxid_from &&
+	    time >= ds->ds_since)
+		dns_print_all(ds);
+
+	ds->ds_gen++;
+	for (; p < end; p += len + 1) {
+		len = strlen(p);
+		dns_update_path(ds, p, len, zxid, time);
+	}
+	t->ztr_changed.zb_len = 0;
+}
 
-		tm = gmtime(&t);
-		if (tm == NULL)
-			err(ZKLOG_EXIT_ERROR, "failed to convert time format");
-		(void) snprintf(timebuf, sizeof (timebuf),
-		    "%04d-%02d-%02dT%02d:%02d:%02d.%03zuZ",
-		    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-		    tm->tm_hour, tm->tm_min, tm->tm_sec, (size_t)tms);
+/* Follows the names under a node in the snapshot, before we replay. */
+static void
+dns_walk(struct dnsstate *ds, struct zknode *n, struct zkbuf *path)
+{
+	size_t pathlen = path->zb_len;
 
-		(void) printf("{\"time\":\"%s\",\"type\":\"%s\",\"typeid\":%d,"
-		    "\"sessionid\":\"%" PRIx64 "\","
-		    "\"cxid\":\"%x\",\"zxid\":\"%" PRIx64 "\"",
-		    timebuf, zktxn_type_to_name((enum zktxn_type)txn->zt_type),
-		    (int32_t)txn->zt_type, txn->zt_sessionid, txn->zt_cxid,
-		    txn->zt_zxid);
+	dns_update(ds, path->zb_data, path->zb_len, 0, 0);
+	for (uint32_t i = 0; i < n->zn_nkids; ++i) {
+		ZKBUF_LIT(path, "/");
+		zkbuf_append(path, n->zn_kids[i]->zn_name,
+		    n->zn_kids[i]->zn_namelen);
+		dns_walk(ds, n->zn_kids[i], path);
+		path->zb_len = pathlen;
+	}
+}
 
-		if ((enum zktxn_type)txn->zt_type == ZK_CLOSESESSION &&
-		    duration != 0) {
-			(void) printf(",\"duration\":%" PRIu64, duration);
-		}
+/*
+ * Answers a query (--dns) as of the end of the range, or prints the timeline
+ * of the answers for the names under "root" (--dns-timeline), optionally only
+ * for that query.
+ */
+static void
+do_dns(const char *snapshot, const char *dname, char **fnames,
+    size_t nfiles, const char *root, const char *qname,
+    enum dns_qtype qtype, int timeline)
+{
+	struct dnsstate *ds = &zklog_dns;
+	struct zktree tree;
+	struct zkbuf path, only;
+	struct zknode *n;
+
+	bzero(&tree, sizeof (tree));
+	ds->ds_tree = &tree;
+	ds->ds_root = root;
+	ds->ds_rootlen = strlen(root);
+	/* "/" is the prefix of everything; any other root is less a slash. */
+	while (ds->ds_rootlen > 1 && root[ds->ds_rootlen - 1] == '/')
+		ds->ds_rootlen--;
+	snap_load(&tree, snapshot);
+
+	if (!timeline) {
+		state_replay(&tree, dname, fnames, nfiles);
+		dns_resolve(ds, qtype, qname, strlen(qname));
+		dns_print(ds, "_DNS", qtype, qname, strlen(qname),
+		    tree.ztr_zxid, tree.ztr_time, ds->ds_ans.da_out.zb_data,
+		    ds->ds_ans.da_out.zb_len);
+		zkout_flush();
+		return;
+	}
+
+	bzero(&only, sizeof (only));
+	if (qname != NULL) {
+		zkbuf_str(&only, dns_qtypes[qtype]);
+		ZKBUF_LIT(&only, " ");
+		zkbuf_str(&only, qname);
+		zkbuf_append(&only, "", 1);
+		ds->ds_only = only.zb_data;
+	}
 
-		void *inner = &txn->zt_inner;
-		size_t innerlen = txn->zt_len - ZKTXN_MIN_LEN;
+	/*
+	 * The range is where we start printing: we replay everything from
+	 * the snapshot on, following the names all the way.
+	 */
+	ds->ds_zxid_from = zklog_zxid_from;
+	ds->ds_since = zklog_since;
+	zklog_zxid_from = 0;
+	zklog_since = 0;
+
+	bzero(&path, sizeof (path));
+	ds->ds_gen++;
+	if ((n = zktree_lookup(&tree, ds->ds_root, ds->ds_rootlen, NULL,
+	    NULL)) != NULL) {
+		if (n != &tree.ztr_root)
+			zkbuf_append(&path, ds->ds_root, ds->ds_rootlen);
+		dns_walk(ds, n, &path);
+	}
+	zkbuf_free(&path);
+	if (ds->ds_zxid_from <= tree.ztr_zxid && ds->ds_since == 0)
+		dns_print_all(ds);
+
+	tree.ztr_hook = dns_replayed;
+	state_replay(&tree, dname, fnames, nfiles);
+	if (!ds->ds_started)
+		dns_print_all(ds);
+	zkout_flush();
+	zkbuf_free(&only);
+}
+
+/*
+ * Parses the argument to --since or --until: either a number of seconds since
+ * the epoch, or a UTC time in the same form as the "time" field we output
+ * ("2019-04-01T12:34:56.789Z", where the seconds, milliseconds and Z are
+ * optional).
+ * Returns the time in ms since the epoch.
+ */
+static uint64_t
+parse_time(const char *opt, const char *arg)
+{
+	unsigned int y, mo, d, h, mi, sec, ms = 0;
+	int pos = 0, mpos = 0;
+	int64_t yy, era, doe, days;
+	unsigned int yoe, doy;
+	unsigned long long epoch;
+	char *p;
 
-		print_inner(txn, timebuf, (enum zktxn_type)txn->zt_type, inner,
-		    innerlen);
+	if (arg[0] >= '0' && arg[0] <= '9' &&
+	    arg[strspn(arg, "0123456789")] == '\0') {
+		errno = 0;
+		epoch = strtoull(arg, &p, 10);
+		if (errno != 0 || epoch > UINT64_MAX / 1000)
+			goto bad;
+		return (epoch * 1000);
+	}
 
-		(void) printf("}\n");
+	if (sscanf(arg, "%4u-%2u-%2uT%2u:%2u%n", &y, &mo, &d, &h, &mi,
+	    &pos) != 5 || pos != 16) {
+		goto bad;
 	}
+	sec = 0;
+	if (arg[pos] == ':') {
+		if (sscanf(arg + pos, ":%2u%n", &sec, &mpos) != 1 || mpos != 3)
+			goto bad;
+		pos += mpos;
+	}
+	if (arg[pos] == '.') {
+		if (sscanf(arg + pos, ".%3u%n", &ms, &mpos) != 1 || mpos != 4)
+			goto bad;
+		pos += mpos;
+	}
+	if (arg[pos] == 'Z')
+		pos++;
+	if (arg[pos] != '\0' || y < 1970 || mo < 1 || mo > 12 || d < 1 ||
+	    d > 31 || h > 23 || mi > 59 || sec > 60) {
+		goto bad;
+	}
+
+	/* Days since the epoch, in the proleptic Gregorian calendar. */
+	yy = (int64_t)y - (mo <= 2);
+	era = yy / 400;
+	yoe = (unsigned int)(yy - era * 400);
+	doy = (153 * (mo > 2 ? mo - 3 : mo + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	days = era * 146097 + doe - 719468;
 
-	if (munmap((void *)data, len))
-		err(ZKLOG_EXIT_ERROR, "error unmapping '%s'", fname);
+	return ((((uint64_t)days * 24 + h) * 60 + mi) * 60000 +
+	    sec * 1000 + ms);
 
-	if (close(fd))
-		err(ZKLOG_EXIT_ERROR, "error closing file '%s'", fname);
+bad:
+	errx(ZKLOG_EXIT_USAGE, "invalid time for %s: '%s'", opt, arg);
+}
+
+static uint64_t
+parse_zxid(const char *opt, const char *arg)
+{
+	uint64_t zxid;
+	char *p;
+
+	errno = 0;
+	zxid = strtoull(arg, &p, 16);
+	if (errno != 0 || *p != '\0' || arg[0] == '\0' || arg[0] == '-') {
+		errx(ZKLOG_EXIT_USAGE, "invalid zxid for %s: '%s'", opt,
+		    arg);
+	}
+	return (zxid);
 }
 
 static void
 usage(void)
 {
 	(void) fprintf(stderr,
-	    "usage: zklog [-Sd] [-t secs] [-s sid] [-z srvid] <txnlog> "
-	    "[txnlog2 ...]\n");
+	    "usage: zklog [-Sd] [-o fmt] [-j nthreads] [-t secs] [-s sid] "
+	    "[-z srvid]\n"
+	    "             [-e expr] [range options] [aggregate options]\n"
+	    "             [--merge] <txnlog> [txnlog2 ...] | -D <dir> "
+	    "[-D <dir2> ...]\n"
+	    "       zklog -f [-d] [-o fmt] [-t secs] [-s sid] [-z srvid] "
+	    "[-e expr] <txnlog>\n"
+	    "       zklog --state [-d] [--snapshot snap] [--path path] "
+	    "[--zxid-to zxid]\n"
+	    "             [--until time] [<txnlog> ... | -D <dir>]\n"
+	    "       zklog --dns name [--qtype type] [--snapshot snap] "
+	    "[--path path]\n"
+	    "             [--zxid-to zxid] [--until time] "
+	    "[<txnlog> ... | -D <dir>]\n"
+	    "       zklog --dns-timeline [--dns name [--qtype type]] "
+	    "[--snapshot snap]\n"
+	    "             [--path path] [range options] "
+	    "[<txnlog> ... | -D <dir>]\n"
+	    "       zklog --verify [-j nthreads] <txnlog> [txnlog2 ...] | "
+	    "-D <dir>\n");
 	(void) fprintf(stderr,
-	    "converts ZK replicated txn log files into JSON\n");
+	    "converts ZK replicated txn log files into JSON (they may be\n"
+	    "gzip- or zstd-compressed)\n");
 	(void) fprintf(stderr, "options:\n"
 	    "    -S        dumps records about all still-active sessions at\n"
 	    "              the end of the log (with type '_SESSION')\n"
 	    "    -d        include node data in the output (e.g. actual\n"
 	    "              contents of nodes)\n"
+	    "    -j nthr   decode in parallel on <nthr> threads (0 for one\n"
+	    "              per CPU), splitting up large files, and merge the\n"
+	    "              output into zxid order regardless of the order the\n"
+	    "              files were given in\n"
+	    "    -D dir    decode all the txnlogs in <dir> (a ZK\n"
+	    "              \"version-2\" directory), in order\n"
+	    "    --merge   the txnlogs (or each -D directory) come from\n"
+	    "              different members of the ensemble: merge them\n"
+	    "              into zxid order, outputting each txn once, and\n"
+	    "              report each range of zxids that none of them\n"
+	    "              have (with type '_GAP'), exiting with status 3\n"
+	    "              if there were any\n"
+	    "    --session-hist\n"
+	    "              also prints, for each server id, the number of\n"
+	    "              sessions created, closed by the client, expired\n"
+	    "              and still open, and histograms of the lifetimes\n"
+	    "              of those closed and expired (with type\n"
+	    "              '_SESSIONHIST')\n"
+	    "    -o fmt    output format: \"json\" (the default), or \"bin\"\n"
+	    "              for compact binary records with the paths in a\n"
+	    "              dictionary (the format is described under\n"
+	    "              \"Binary output\" in zklog.c); not with -S\n"
+	    "    -f        follow: once the end of the txnlog is reached,\n"
+	    "              wait for more txns to be written to it, moving on\n"
+	    "              to the next log in its directory when ZK rolls\n"
+	    "              over to a new one\n"
+	    "    --verify  instead of decoding the txns, checks them against\n"
+	    "              their checksums, reporting each damaged range\n"
+	    "              (with type '_CORRUPT') and a summary of each log\n"
+	    "              (with type '_VERIFY'), and exits with status 3 if\n"
+	    "              any were damaged; with -j, checks that many logs\n"
+	    "              at once\n"
 	    "\n"
 	    "filter options:\n"
 	    "    -t secs   output only records that were timestamped within\n"
@@ -599,10 +7688,76 @@ usage(void)
 	    "              id (in hex)\n"
 	    "    -z srvid  output only records recorded by the given server\n"
 	    "              id\n"
+	    "    -e expr   output only records matching a filter expression,\n"
+	    "              combining \"field op value\" terms with and, or,\n"
+	    "              not and parentheses. Fields and operators are:\n"
+	    "                type, err   = != in   (names or numbers)\n"
+	    "                sid, zxid   = != in   (hex)  zxid also < <= > >=\n"
+	    "                srvid       = != in\n"
+	    "                path        = != in   ^= (prefix)  ~ (contains)\n"
+	    "                data        ~ (contains)\n"
+	    "              where a value can be a list: \"in (A,B)\", and\n"
+	    "              can be quoted. Each child txn of a MULTI is\n"
+	    "              matched separately. e.g.\n"
+	    "                type in (CREATE,DELETE) and\n"
+	    "                    path ^= /com/joyent/us-east/moray\n"
+	    "\n"
+	    "range options (these index each txnlog to skip the parts\n"
+	    "outside the range):\n"
+	    "    --zxid-from zxid   output only records with a zxid of at\n"
+	    "    --zxid-to zxid     least/most <zxid> (in hex)\n"
+	    "    --since time       output only records timestamped at or\n"
+	    "    --until time       after/before <time>, which is either\n"
+	    "                       seconds since the epoch, or in UTC like\n"
+	    "                       2019-04-01T12:34[:56[.789]][Z]\n"
+	    "    --index-dir dir    keep the indexes in <dir> (created if\n"
+	    "                       need be) for the next query to reuse,\n"
+	    "                       removing any there whose txnlog has\n"
+	    "                       gone; by default they aren't kept\n"
+	    "\n"
+	    "state options:\n"
+	    "    --state            instead of the txns, print the nodes in\n"
+	    "                       the tree as of --zxid-to or --until (or\n"
+	    "                       the end of the logs), by replaying the\n"
+	    "                       txnlogs on top of a snapshot (container\n"
+	    "                       and TTL nodes go only when the txnlogs\n"
+	    "                       say the leader removed them)\n"
+	    "    --snapshot snap    the snapshot to start from; by default,\n"
+	    "                       the newest one in the -D directory from\n"
+	    "                       before that point\n"
+	    "    --path path        print only the nodes under <path>\n"
 	    "\n"
-	    "example:\n"
+	    "DNS options (these replay registrar's records the same way, and\n"
+	    "answer from them as binder would, with --path as its domain):\n"
+	    "    --dns name         instead of the txns, print the answer\n"
+	    "                       to a query for <name> as of --zxid-to\n"
+	    "                       or --until (with type '_DNS')\n"
+	    "    --qtype type       the type of query: A (the default), SRV\n"
+	    "                       or PTR\n"
+	    "    --dns-timeline     instead, print the answers to the A and\n"
+	    "                       SRV queries for all the names under\n"
+	    "                       --path (or just for --dns) at the start\n"
+	    "                       of the range ('_DNS'), and then each\n"
+	    "                       change to them ('_DNSCHANGE')\n"
+	    "\n"
+	    "aggregate options:\n"
+	    "    --aggregate        instead of the txns, print a summary of\n"
+	    "                       them: totals by type, server id and time\n"
+	    "                       interval, and the top path prefixes,\n"
+	    "                       paths and sessions by writes (records\n"
+	    "                       of type _SUMMARY, _TXNTYPE, _SERVER,\n"
+	    "                       _RATE, _PREFIX, _PATH and _SESSIONSTAT)\n"
+	    "    --top n            list the top <n> of each (default 10)\n"
+	    "    --depth n          count writes under prefixes of <n> path\n"
+	    "                       components (default 3)\n"
+	    "    --interval secs    give rates per <secs> seconds (default\n"
+	    "                       3600)\n"
+	    "\n"
+	    "examples:\n"
 	    "  find .../zookeeper/version-2 -name 'log.*' | "
-	    "sort -n | tail -n 10 | xargs ./zklog -d\n");
+	    "sort -n | tail -n 10 | xargs ./zklog -d\n"
+	    "  ./zklog -D .../zookeeper/version-2 --since 2019-04-01T12:00 "
+	    "--until 2019-04-01T13:00\n");
 	exit(ZKLOG_EXIT_USAGE);
 }
 
@@ -614,15 +7769,175 @@ main(int argc, char *argv[])
 	char *p;
 	int dumpsess = 0;
 	unsigned long int parsed;
+	long nthreads = -1;
+	int follow = 0;
+	uint64_t ms;
+	int longopt;
+	const char *dir = NULL;
+	const char **dirs;
+	size_t ndirs = 0;
+	char **fnames;
+	size_t nfiles;
+	int state = 0;
+	int verify = 0;
+	char *snapshot = NULL;
+	const char *root = "/";
+	const char *dnsname = NULL;
+	enum dns_qtype qtype = DNS_A;
+	int dnstimeline = 0;
+	static const struct option longopts[] = {
+		{ "zxid-from", required_argument, NULL, 'F' },
+		{ "zxid-to", required_argument, NULL, 'T' },
+		{ "since", required_argument, NULL, 'A' },
+		{ "until", required_argument, NULL, 'B' },
+		{ "state", no_argument, NULL, 'X' },
+		{ "snapshot", required_argument, NULL, 'N' },
+		{ "path", required_argument, NULL, 'P' },
+		{ "aggregate", no_argument, NULL, 'G' },
+		{ "top", required_argument, NULL, 'K' },
+		{ "depth", required_argument, NULL, 'H' },
+		{ "interval", required_argument, NULL, 'I' },
+		{ "session-hist", no_argument, NULL, 'L' },
+		{ "verify", no_argument, NULL, 'V' },
+		{ "dns", required_argument, NULL, 'Q' },
+		{ "qtype", required_argument, NULL, 'Y' },
+		{ "dns-timeline", no_argument, NULL, 'W' },
+		{ "merge", no_argument, NULL, 'M' },
+		{ "index-dir", required_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	if (gettimeofday(&now, NULL))
 		err(ZKLOG_EXIT_ERROR, "failed to get system time");
 
-	while ((opt = getopt(argc, argv, "Sdt:s:z:")) != -1) {
+	hextab_init();
+
+	if ((dirs = calloc(argc, sizeof (char *))) == NULL)
+		err(ZKLOG_EXIT_ERROR, "failed to allocate memory");
+
+	while ((opt = getopt_long(argc, argv, "SdfD:e:j:o:t:s:z:", longopts,
+	    &longopt)) != -1) {
 		switch (opt) {
+		case 'F':
+			zklog_zxid_from = parse_zxid("--zxid-from", optarg);
+			zklog_ranged = 1;
+			break;
+		case 'T':
+			zklog_zxid_to = parse_zxid("--zxid-to", optarg);
+			zklog_ranged = 1;
+			break;
+		case 'A':
+			ms = parse_time("--since", optarg);
+			if (ms > zklog_since)
+				zklog_since = ms;
+			zklog_ranged = 1;
+			break;
+		case 'B':
+			zklog_until = parse_time("--until", optarg);
+			zklog_ranged = 1;
+			break;
+		case 'X':
+			state = 1;
+			break;
+		case 'N':
+			snapshot = optarg;
+			state = 1;
+			break;
+		case 'P':
+			root = optarg;
+			break;
+		case 'G':
+			zklog_aggregate = 1;
+			break;
+		case 'K':
+		case 'H':
+		case 'I':
+			errno = 0;
+			parsed = strtoul(optarg, &p, 10);
+			if (errno != 0 || *p != '\0' || optarg[0] == '-' ||
+			    (opt != 'K' && parsed == 0)) {
+				errx(ZKLOG_EXIT_USAGE, "invalid argument for "
+				    "--%s: '%s'", longopts[longopt].name,
+				    optarg);
+			}
+			if (opt == 'K')
+				zkagg_top = parsed;
+			else if (opt == 'H')
+				zkagg_depth = parsed;
+			else
+				zkagg_interval = (uint64_t)parsed * 1000;
+			zklog_aggregate = 1;
+			break;
 		case 'S':
 			dumpsess++;
 			break;
+		case 'L':
+			zklog_sesshist = 1;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'Q':
+			dnsname = optarg;
+			break;
+		case 'Y':
+			if (strcasecmp(optarg, "A") == 0) {
+				qtype = DNS_A;
+			} else if (strcasecmp(optarg, "SRV") == 0) {
+				qtype = DNS_SRV;
+			} else if (strcasecmp(optarg, "PTR") == 0) {
+				qtype = DNS_PTR;
+			} else {
+				errx(ZKLOG_EXIT_USAGE,
+				    "invalid query type '%s'", optarg);
+			}
+			break;
+		case 'W':
+			dnstimeline = 1;
+			break;
+		case 'M':
+			zklog_merge = 1;
+			break;
+		case 'R':
+			zklog_index_dir = optarg;
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'D':
+			if (dir == NULL)
+				dir = optarg;
+			dirs[ndirs++] = optarg;
+			break;
+		case 'e':
+			zklog_filter = filt_compile(optarg);
+			break;
+		case 'o':
+			if (strcmp(optarg, "bin") == 0) {
+				zklog_binary = 1;
+			} else if (strcmp(optarg, "json") == 0) {
+				zklog_binary = 0;
+			} else {
+				errx(ZKLOG_EXIT_USAGE,
+				    "invalid output format '%s'", optarg);
+			}
+			break;
+		case 'j':
+			errno = 0;
+			nthreads = strtol(optarg, &p, 10);
+			if (errno != 0 || *p != '\0' || nthreads < 0 ||
+			    nthreads > ZKLOG_MAX_THREADS) {
+				errx(ZKLOG_EXIT_USAGE,
+				    "invalid argument for -j: '%s'", optarg);
+			}
+			if (nthreads == 0) {
+				nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+				if (nthreads < 1)
+					nthreads = 1;
+				if (nthreads > ZKLOG_MAX_THREADS)
+					nthreads = ZKLOG_MAX_THREADS;
+			}
+			break;
 		case 't':
 			errno = 0;
 			parsed = strtoul(optarg, &p, 10);
@@ -630,7 +7945,12 @@ main(int argc, char *argv[])
 				errx(ZKLOG_EXIT_USAGE,
 				    "invalid argument for -t: '%s'", optarg);
 			}
-			zklog_mintime = now.tv_sec - parsed;
+			if (parsed < (unsigned long)now.tv_sec) {
+				ms = (uint64_t)(now.tv_sec - parsed) * 1000;
+				if (ms > zklog_since)
+					zklog_since = ms;
+			}
+			zklog_ranged = 1;
 			break;
 		case 's':
 			errno = 0;
@@ -657,17 +7977,179 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc) {
+	if (dir != NULL && optind < argc) {
+		(void) fprintf(stderr, "error: -D can't be used with a list "
+		    "of txnlogs\n");
+		usage();
+	}
+	if (ndirs > 1 && !zklog_merge) {
+		(void) fprintf(stderr, "error: -D can only be given more than "
+		    "once with --merge\n");
+		usage();
+	}
+	if (zklog_merge && (state || verify || follow || dnsname != NULL ||
+	    dnstimeline)) {
+		(void) fprintf(stderr, "error: --merge can't be used with -f, "
+		    "--state, --verify, --dns or --dns-timeline\n");
+		usage();
+	}
+	if (zklog_binary && (state || dumpsess || zklog_sesshist)) {
+		(void) fprintf(stderr, "error: -o bin can't be used with -S, "
+		    "--session-hist or --state\n");
+		usage();
+	}
+	if (zklog_aggregate && (zklog_binary || state || dumpsess || follow)) {
+		(void) fprintf(stderr, "error: --aggregate can't be used with "
+		    "-o bin, -S, -f or --state\n");
+		usage();
+	}
+	if (verify && (zklog_binary || state || dumpsess || follow ||
+	    zklog_aggregate || zklog_sesshist || zklog_ranged ||
+	    zklog_filter != NULL || zklog_sid != 0 || zklog_srvid != 0)) {
+		(void) fprintf(stderr, "error: --verify can't be used with "
+		    "-o bin, -S, -f, -e, -s, -z, --state, --aggregate, "
+		    "--session-hist or the range options\n");
+		usage();
+	}
+	/* We only need the lengths of the data. */
+	if (zklog_aggregate)
+		zklog_dumpdata = 0;
+	if (zklog_binary && isatty(STDOUT_FILENO)) {
+		errx(ZKLOG_EXIT_USAGE, "not writing binary output to a "
+		    "terminal");
+	}
+	if (zklog_index_dir != NULL) {
+		if (mkdir(zklog_index_dir, 0755) != 0 && errno != EEXIST) {
+			err(ZKLOG_EXIT_ERROR, "error creating directory '%s'",
+			    zklog_index_dir);
+		}
+		zkidx_prune();
+	}
+
+	if (dnsname != NULL || dnstimeline) {
+		if (state || verify || follow || dumpsess || zklog_sesshist ||
+		    zklog_aggregate || zklog_binary || nthreads > 0 ||
+		    zklog_filter != NULL || zklog_sid != 0 ||
+		    zklog_srvid != 0) {
+			(void) fprintf(stderr, "error: --dns and "
+			    "--dns-timeline can't be used with -o bin, -f, "
+			    "-S, -e, -s, -z, -j, --state, --verify, "
+			    "--aggregate or --session-hist\n");
+			usage();
+		}
+		if (!dnstimeline && (zklog_zxid_from != 0 ||
+		    zklog_since != 0)) {
+			(void) fprintf(stderr, "error: --dns can't be used "
+			    "with -t, --zxid-from or --since (except with "
+			    "--dns-timeline)\n");
+			usage();
+		}
+		if (dnstimeline && qtype == DNS_PTR) {
+			(void) fprintf(stderr, "error: --dns-timeline only "
+			    "follows A and SRV queries\n");
+			usage();
+		}
+		if (snapshot == NULL && dir == NULL) {
+			(void) fprintf(stderr, "error: --dns and "
+			    "--dns-timeline need either --snapshot or -D\n");
+			usage();
+		}
+		/* For a timeline, the snapshot has to be from the start. */
+		if (snapshot == NULL && dnstimeline &&
+		    (zklog_zxid_from != 0 || zklog_since != 0)) {
+			snapshot = dir_snapshot(dir, zklog_zxid_from != 0 ?
+			    zklog_zxid_from - 1 : zklog_zxid_to,
+			    zklog_since != 0 ? zklog_since : zklog_until);
+		} else if (snapshot == NULL) {
+			snapshot = dir_snapshot(dir, zklog_zxid_to,
+			    zklog_until);
+		}
+		do_dns(snapshot, dir, &argv[optind], argc - optind, root,
+		    dnsname, qtype, dnstimeline);
+		return (0);
+	}
+
+	if (state) {
+		if (follow || dumpsess || zklog_sesshist || nthreads > 0 ||
+		    zklog_zxid_from != 0 || zklog_since != 0) {
+			(void) fprintf(stderr, "error: --state can't be used "
+			    "with -f, -S, --session-hist, -j, -t, --zxid-from "
+			    "or --since\n");
+			usage();
+		}
+		if (snapshot == NULL && dir == NULL) {
+			(void) fprintf(stderr, "error: --state needs either "
+			    "--snapshot or -D\n");
+			usage();
+		}
+		if (snapshot == NULL)
+			snapshot = dir_snapshot(dir, zklog_zxid_to,
+			    zklog_until);
+		do_state(snapshot, dir, &argv[optind], argc - optind, root);
+		return (0);
+	}
+
+	if (dir == NULL && optind >= argc) {
 		(void) fprintf(stderr, "error: no zklog files specified\n");
 		usage();
 	}
 
-	while (optind < argc)
-		do_file(argv[optind++]);
+	if (zklog_binary)
+		zkbin_start();
+
+	if (follow) {
+		if (argc - optind != 1 || nthreads > 0 || dumpsess ||
+		    zklog_sesshist) {
+			(void) fprintf(stderr, "error: -f takes a single "
+			    "txnlog and can't be used with -j, -S, "
+			    "--session-hist or -D\n");
+			usage();
+		}
+		do_follow(argv[optind]);
+	}
+
+	/*
+	 * To list the sessions still active at the end, we need to have seen
+	 * every session created and closed, so we can't skip anything.
+	 */
+	if (dumpsess)
+		zklog_ranged = 0;
+
+	if (ndirs > 1) {
+		zklog_logs = merge_dir_logs(dirs, ndirs, &zklog_nlogs,
+		    &zklog_logs_first, &nfiles);
+	} else if (dir != NULL) {
+		zklog_logs = dir_logs(dir, &zklog_nlogs, &zklog_logs_first,
+		    &nfiles);
+	} else {
+		zklog_logs = &argv[optind];
+		zklog_nlogs = argc - optind;
+		nfiles = zklog_nlogs;
+	}
+	fnames = &zklog_logs[zklog_logs_first];
+
+	if (verify) {
+		do_verify(fnames, nfiles,
+		    nthreads > 0 ? (unsigned int)nthreads : 0);
+		return (0);
+	}
+
+	if (nthreads == 1 && !zklog_merge) {
+		order_files(fnames, nfiles);
+		do_files(fnames, nfiles);
+	} else if ((nthreads > 0 || zklog_merge) && nfiles > 0) {
+		do_files_parallel(fnames, nfiles,
+		    nthreads > 0 ? (unsigned int)nthreads : 1);
+	} else {
+		do_files(fnames, nfiles);
+	}
+
+	if (zklog_aggregate)
+		zkagg_print();
 
 	if (dumpsess) {
 		struct session_state *sess;
-		size_t sidlow;
+		size_t i;
 		uint64_t nowms, duration;
 
 		/*
@@ -680,25 +8162,35 @@ main(int argc, char *argv[])
 
 		nowms = now.tv_sec * 1000 + (now.tv_usec / 1000);
 
-		for (sidlow = 0; sidlow < SID_HASH_BUCKETS; ++sidlow) {
-			sess = sessions[sidlow];
-			for (; sess != NULL; sess = sess->ss_next) {
-				if (zklog_sid != 0 && zklog_sid != sess->ss_sid)
-					continue;
-				if (zklog_srvid != 0 &&
-				    sid_to_srvid(sess->ss_sid) != zklog_srvid) {
-					continue;
-				}
-				duration = nowms - sess->ss_start;
-				if (sess->ss_start > nowms)
-					duration = 0;
-				(void) printf("{\"type\":\"_SESSION\","
-				    "\"sid\":\"%" PRIx64 "\""
-				    ",\"duration\":%" PRIu64 "}\n",
-				    sess->ss_sid, duration);
+		for (i = 0; i < sessions.st_size; ++i) {
+			if ((sess = sessions.st_slots[i]) == NULL)
+				continue;
+			if (zklog_sid != 0 && zklog_sid != sess->ss_sid)
+				continue;
+			if (zklog_srvid != 0 &&
+			    sid_to_srvid(sess->ss_sid) != zklog_srvid) {
+				continue;
 			}
+			duration = nowms - sess->ss_start;
+			if (sess->ss_start > nowms)
+				duration = 0;
+			ZKBUF_LIT(&zklog_out,
+			    "{\"type\":\"_SESSION\",\"sid\":\"");
+			zkbuf_hex(&zklog_out, sess->ss_sid);
+			ZKBUF_LIT(&zklog_out, "\",\"duration\":");
+			zkbuf_uint(&zklog_out, duration);
+			ZKBUF_LIT(&zklog_out, "}\n");
+			zkout_check();
 		}
 	}
 
+	if (zklog_sesshist)
+		session_hist_print();
+
+	zkout_flush();
+
+	if (zklog_gaps > 0)
+		exit(ZKLOG_EXIT_BAD_FORMAT);
+
 	return (0);
 }
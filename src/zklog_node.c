@@ -0,0 +1,440 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+/*
+ * A native (N-API) binding of libzklog for node, so that scripts can walk a
+ * txnlog without running zklog and parsing its JSON back in. This is only
+ * the native half: scripts should use it through tools/zklog.js.
+ *
+ * It exports a Cursor class, which is constructed from a path or a Buffer
+ * holding a log, and the constructor for the objects to make for txns, which
+ * next() calls with:
+ *
+ *	(time, type, typeid, sessionid, cxid, zxid, path, data, error, errid,
+ *	    timeout, count, children)
+ *
+ * leaving out (as undefined) whatever the txn doesn't have. Having the
+ * constructor set the properties is much faster than setting each of them
+ * from here. The ids are hex strings, as they don't all fit in a number. The
+ * data is a Buffer, and the children of a MULTI are an array of txns.
+ *
+ * Bad txns throw an Error with the ZKL_E* name of the problem as its "code",
+ * and its offset in the log as "offset". If only the body of the txn was bad,
+ * the cursor has already moved past it, and next() can go on.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <node_api.h>
+
+#include "libzklog.h"
+
+/* What a Cursor wraps. */
+struct zkn_cursor {
+	struct zkl_cursor *zn_cur;
+	/* The Buffer the log is in, if we were given one. */
+	napi_ref zn_buf;
+	/* The constructor for txns. */
+	napi_ref zn_txn;
+};
+
+/* The arguments to the constructor for txns. */
+enum zkn_arg {
+	ZKN_TIME,
+	ZKN_TYPE,
+	ZKN_TYPEID,
+	ZKN_SESSIONID,
+	ZKN_CXID,
+	ZKN_ZXID,
+	ZKN_PATH,
+	ZKN_DATA,
+	ZKN_ERROR,
+	ZKN_ERRID,
+	ZKN_TIMEOUT,
+	ZKN_COUNT,
+	ZKN_CHILDREN,
+	ZKN_NARGS
+};
+
+static const char *
+zkn_code(int err)
+{
+	switch (err) {
+	case ZKL_ESYS:
+		return ("ZKL_ESYS");
+	case ZKL_ECOMPRESSED:
+		return ("ZKL_ECOMPRESSED");
+	case ZKL_ESMALL:
+		return ("ZKL_ESMALL");
+	case ZKL_EMAGIC:
+		return ("ZKL_EMAGIC");
+	case ZKL_EVERSION:
+		return ("ZKL_EVERSION");
+	case ZKL_ETRUNC:
+		return ("ZKL_ETRUNC");
+	case ZKL_ETXNLEN:
+		return ("ZKL_ETXNLEN");
+	case ZKL_ETERM:
+		return ("ZKL_ETERM");
+	case ZKL_ESHORT:
+		return ("ZKL_ESHORT");
+	case ZKL_EPATHLEN:
+		return ("ZKL_EPATHLEN");
+	case ZKL_EPATH:
+		return ("ZKL_EPATH");
+	case ZKL_EDATALEN:
+		return ("ZKL_EDATALEN");
+	case ZKL_EDATA:
+		return ("ZKL_EDATA");
+	case ZKL_ECHILD:
+		return ("ZKL_ECHILD");
+	case ZKL_ECHILDLEN:
+		return ("ZKL_ECHILDLEN");
+	default:
+		return ("ZKL_EUNKNOWN");
+	}
+}
+
+/*
+ * Throws an Error for a libzklog error, unless something else has already
+ * been thrown.
+ */
+static void
+zkn_throw(napi_env env, int err, const struct zkl_cursor *cur)
+{
+	napi_value msg, code, off, e;
+	char buf[256];
+	bool pending;
+
+	if (napi_is_exception_pending(env, &pending) != napi_ok || pending)
+		return;
+
+	if (cur != NULL) {
+		(void) snprintf(buf, sizeof (buf), "%s (around +0x%zx)",
+		    zkl_strerror(err), zkl_offset(cur));
+	} else {
+		(void) snprintf(buf, sizeof (buf), "%s", zkl_strerror(err));
+	}
+
+	if (napi_create_string_utf8(env, buf, NAPI_AUTO_LENGTH, &msg) !=
+	    napi_ok ||
+	    napi_create_string_utf8(env, zkn_code(err), NAPI_AUTO_LENGTH,
+	    &code) != napi_ok ||
+	    napi_create_error(env, code, msg, &e) != napi_ok) {
+		(void) napi_throw_error(env, zkn_code(err), buf);
+		return;
+	}
+	if (cur != NULL && napi_create_double(env, (double)zkl_offset(cur),
+	    &off) == napi_ok) {
+		(void) napi_set_named_property(env, e, "offset", off);
+	}
+	(void) napi_throw(env, e);
+}
+
+/* Throws for a failed N-API call, unless it's thrown already. */
+static void
+zkn_throw_napi(napi_env env)
+{
+	const napi_extended_error_info *info;
+	bool pending;
+
+	if (napi_is_exception_pending(env, &pending) != napi_ok || pending)
+		return;
+	if (napi_get_last_error_info(env, &info) == napi_ok &&
+	    info->error_message != NULL) {
+		(void) napi_throw_error(env, NULL, info->error_message);
+	} else {
+		(void) napi_throw_error(env, NULL, "N-API call failed");
+	}
+}
+
+/* Like "%" PRIx64, as zklog writes ids in its JSON. */
+static napi_status
+zkn_hex(napi_env env, uint64_t v, napi_value *valp)
+{
+	char buf[17];
+
+	(void) snprintf(buf, sizeof (buf), "%" PRIx64, v);
+	return (napi_create_string_utf8(env, buf, NAPI_AUTO_LENGTH, valp));
+}
+
+/*
+ * Makes the object for a txn (and any children). If a child is bad, this
+ * throws, and returns napi_pending_exception.
+ */
+static napi_status
+zkn_txn(napi_env env, const struct zkn_cursor *zn, napi_value ctor,
+    const struct zkl_txn *t, napi_value *objp)
+{
+	const struct zktxnhdr *hdr = &t->zkt_hdr;
+	napi_value args[ZKN_NARGS], kid;
+	struct zkl_multi m;
+	struct zkl_txn c;
+	napi_status s;
+	uint32_t i;
+	int rv;
+
+#define	ZKN_TRY(call)	do { \
+	if ((s = (call)) != napi_ok) \
+		return (s); \
+    } while (0)
+
+	ZKN_TRY(napi_get_undefined(env, &args[ZKN_PATH]));
+	for (i = ZKN_PATH + 1; i < ZKN_NARGS; ++i)
+		args[i] = args[ZKN_PATH];
+
+	ZKN_TRY(napi_create_double(env, (double)hdr->zth_time,
+	    &args[ZKN_TIME]));
+	ZKN_TRY(napi_create_string_utf8(env,
+	    zktxn_type_to_name((enum zktxn_type)t->zkt_type),
+	    NAPI_AUTO_LENGTH, &args[ZKN_TYPE]));
+	ZKN_TRY(napi_create_int32(env, t->zkt_type, &args[ZKN_TYPEID]));
+	ZKN_TRY(zkn_hex(env, hdr->zth_sessionid, &args[ZKN_SESSIONID]));
+	ZKN_TRY(zkn_hex(env, hdr->zth_cxid, &args[ZKN_CXID]));
+	ZKN_TRY(zkn_hex(env, hdr->zth_zxid, &args[ZKN_ZXID]));
+
+	if (t->zkt_path != NULL) {
+		ZKN_TRY(napi_create_string_utf8(env, t->zkt_path,
+		    t->zkt_pathlen, &args[ZKN_PATH]));
+	}
+
+	/*
+	 * The data is copied: a Buffer pointing into the log would outlive
+	 * the mapping if the script held on to it past close().
+	 */
+	if (t->zkt_data != NULL) {
+		ZKN_TRY(napi_create_buffer_copy(env, t->zkt_datalen,
+		    t->zkt_data, NULL, &args[ZKN_DATA]));
+	}
+
+	if (t->zkt_type == ZK_ERROR) {
+		ZKN_TRY(napi_create_string_utf8(env, zkerr_to_name(t->zkt_err),
+		    NAPI_AUTO_LENGTH, &args[ZKN_ERROR]));
+		ZKN_TRY(napi_create_int32(env, t->zkt_err, &args[ZKN_ERRID]));
+	} else if (t->zkt_type == ZK_CREATESESSION) {
+		ZKN_TRY(napi_create_int32(env, t->zkt_timeout,
+		    &args[ZKN_TIMEOUT]));
+	} else if (t->zkt_type == ZK_MULTI) {
+		ZKN_TRY(napi_create_int32(env, (int32_t)t->zkt_count,
+		    &args[ZKN_COUNT]));
+		ZKN_TRY(napi_create_array(env, &args[ZKN_CHILDREN]));
+		zkl_multi_init(&m, t);
+		for (i = 0; (rv = zkl_multi_next(&m, &c)) != 0; ++i) {
+			if (rv < 0) {
+				zkn_throw(env, rv, zn->zn_cur);
+				return (napi_pending_exception);
+			}
+			ZKN_TRY(zkn_txn(env, zn, ctor, &c, &kid));
+			ZKN_TRY(napi_set_element(env, args[ZKN_CHILDREN], i,
+			    kid));
+		}
+	}
+
+#undef	ZKN_TRY
+
+	return (napi_new_instance(env, ctor, ZKN_NARGS, args, objp));
+}
+
+static void
+zkn_finalize(napi_env env, void *data, void *hint)
+{
+	struct zkn_cursor *zn = data;
+
+	(void) hint;
+	zkl_close(zn->zn_cur);
+	if (zn->zn_buf != NULL)
+		(void) napi_delete_reference(env, zn->zn_buf);
+	if (zn->zn_txn != NULL)
+		(void) napi_delete_reference(env, zn->zn_txn);
+	free(zn);
+}
+
+static struct zkn_cursor *
+zkn_unwrap(napi_env env, napi_callback_info info)
+{
+	struct zkn_cursor *zn;
+	napi_value this;
+
+	if (napi_get_cb_info(env, info, NULL, NULL, &this, NULL) != napi_ok ||
+	    napi_unwrap(env, this, (void **)&zn) != napi_ok) {
+		zkn_throw_napi(env);
+		return (NULL);
+	}
+	if (zn->zn_cur == NULL) {
+		(void) napi_throw_error(env, NULL, "cursor is closed");
+		return (NULL);
+	}
+	return (zn);
+}
+
+/* new Cursor(path or buffer, constructor for txns) */
+static napi_value
+zkn_cursor_new(napi_env env, napi_callback_info info)
+{
+	struct zkn_cursor *zn;
+	napi_value this, argv[2];
+	napi_valuetype vt, ctortype;
+	size_t argc = 2, len;
+	char *path;
+	void *data;
+	bool isbuf;
+	int rv;
+
+	if (napi_get_cb_info(env, info, &argc, argv, &this, NULL) != napi_ok) {
+		zkn_throw_napi(env);
+		return (NULL);
+	}
+	if (argc < 2 || napi_typeof(env, argv[0], &vt) != napi_ok ||
+	    napi_is_buffer(env, argv[0], &isbuf) != napi_ok ||
+	    (vt != napi_string && !isbuf) ||
+	    napi_typeof(env, argv[1], &ctortype) != napi_ok ||
+	    ctortype != napi_function) {
+		(void) napi_throw_type_error(env, NULL,
+		    "Cursor needs a path or a Buffer, and a constructor");
+		return (NULL);
+	}
+
+	if ((zn = calloc(1, sizeof (*zn))) == NULL) {
+		zkn_throw(env, ZKL_ESYS, NULL);
+		return (NULL);
+	}
+	if (napi_create_reference(env, argv[1], 1, &zn->zn_txn) != napi_ok)
+		goto fail;
+
+	if (isbuf) {
+		if (napi_get_buffer_info(env, argv[0], &data, &len) !=
+		    napi_ok ||
+		    napi_create_reference(env, argv[0], 1, &zn->zn_buf) !=
+		    napi_ok) {
+			goto fail;
+		}
+		rv = zkl_open_buf(data, len, &zn->zn_cur);
+	} else {
+		if (napi_get_value_string_utf8(env, argv[0], NULL, 0, &len) !=
+		    napi_ok)
+			goto fail;
+		if ((path = malloc(len + 1)) == NULL) {
+			zkn_throw(env, ZKL_ESYS, NULL);
+			goto fail;
+		}
+		(void) napi_get_value_string_utf8(env, argv[0], path, len + 1,
+		    &len);
+		rv = zkl_open(path, &zn->zn_cur);
+		free(path);
+	}
+
+	if (rv != ZKL_OK) {
+		zkn_throw(env, rv, NULL);
+		goto fail;
+	}
+	if (napi_wrap(env, this, zn, zkn_finalize, NULL, NULL) != napi_ok)
+		goto fail;
+	return (this);
+
+fail:
+	zkn_throw_napi(env);
+	zkn_finalize(env, zn, NULL);
+	return (NULL);
+}
+
+/* cursor.next(): the next txn, or null at the end of the log. */
+static napi_value
+zkn_cursor_next(napi_env env, napi_callback_info info)
+{
+	struct zkn_cursor *zn;
+	struct zkl_txn t;
+	napi_value ctor, obj;
+	int rv;
+
+	if ((zn = zkn_unwrap(env, info)) == NULL)
+		return (NULL);
+
+	if ((rv = zkl_next(zn->zn_cur, &t)) < 0) {
+		zkn_throw(env, rv, zn->zn_cur);
+		return (NULL);
+	}
+	if (rv == 0) {
+		if (napi_get_null(env, &obj) != napi_ok) {
+			zkn_throw_napi(env);
+			return (NULL);
+		}
+		return (obj);
+	}
+
+	if (napi_get_reference_value(env, zn->zn_txn, &ctor) != napi_ok ||
+	    zkn_txn(env, zn, ctor, &t, &obj) != napi_ok) {
+		zkn_throw_napi(env);
+		return (NULL);
+	}
+	return (obj);
+}
+
+/* cursor.close(): unmaps the log (which the GC would do eventually). */
+static napi_value
+zkn_cursor_close(napi_env env, napi_callback_info info)
+{
+	struct zkn_cursor *zn;
+
+	if ((zn = zkn_unwrap(env, info)) == NULL)
+		return (NULL);
+	zkl_close(zn->zn_cur);
+	zn->zn_cur = NULL;
+	if (zn->zn_buf != NULL) {
+		(void) napi_delete_reference(env, zn->zn_buf);
+		zn->zn_buf = NULL;
+	}
+	return (NULL);
+}
+
+/* cursor.offset(): where in the log the cursor is (or went wrong). */
+static napi_value
+zkn_cursor_offset(napi_env env, napi_callback_info info)
+{
+	struct zkn_cursor *zn;
+	napi_value v;
+
+	if ((zn = zkn_unwrap(env, info)) == NULL)
+		return (NULL);
+	if (napi_create_double(env, (double)zkl_offset(zn->zn_cur), &v) !=
+	    napi_ok) {
+		zkn_throw_napi(env);
+		return (NULL);
+	}
+	return (v);
+}
+
+static napi_value
+zkn_init(napi_env env, napi_value exports)
+{
+	napi_property_descriptor methods[] = {
+		{ "next", NULL, zkn_cursor_next, NULL, NULL, NULL,
+		    napi_default, NULL },
+		{ "close", NULL, zkn_cursor_close, NULL, NULL, NULL,
+		    napi_default, NULL },
+		{ "offset", NULL, zkn_cursor_offset, NULL, NULL, NULL,
+		    napi_default, NULL }
+	};
+	napi_value cls;
+
+	if (napi_define_class(env, "Cursor", NAPI_AUTO_LENGTH, zkn_cursor_new,
+	    NULL, sizeof (methods) / sizeof (methods[0]), methods, &cls) !=
+	    napi_ok ||
+	    napi_set_named_property(env, exports, "Cursor", cls) != napi_ok) {
+		zkn_throw_napi(env);
+		return (NULL);
+	}
+	return (exports);
+}
+
+NAPI_MODULE(zklog, zkn_init)
@@ -0,0 +1,628 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+/*
+ * ZKLOGGEN
+ *
+ * Writes synthetic ZooKeeper txnlogs (the same version-2 format zklog reads,
+ * checksums and all), for benchmarking and testing zklog against fixed
+ * workloads: see "make bench-zklog". The mix of txn types, the sizes of the
+ * node data, and the numbers of nodes and sessions are all configurable, and
+ * the same options and seed always produce the same logs, on any platform.
+ *
+ * By default the txns look roughly like the ones in a binder ensemble's logs:
+ * registrar sessions coming and going, creating and deleting ephemeral nodes
+ * with small JSON payloads under /com/joyent, with some MULTIs and errors.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "libzklog.h"
+
+/* ZK preallocates its logs in blocks of this many bytes. */
+#define	ZKLOGGEN_PREALLOC	(64 * 1024 * 1024)
+
+enum zkgen_kind {
+	ZKGEN_CREATE = 0,
+	ZKGEN_SETDATA,
+	ZKGEN_DELETE,
+	ZKGEN_MULTI,
+	ZKGEN_CREATESESSION,
+	ZKGEN_CLOSESESSION,
+	ZKGEN_ERROR,
+	ZKGEN_NKINDS
+};
+
+static const char *zkgen_kind_names[ZKGEN_NKINDS] = {
+	"create", "setdata", "delete", "multi", "createsession",
+	"closesession", "error"
+};
+
+/* The default mix, in parts. */
+static unsigned int zkgen_mix[ZKGEN_NKINDS] = {
+	25,	/* create */
+	30,	/* setdata */
+	15,	/* delete */
+	5,	/* multi */
+	10,	/* createsession */
+	10,	/* closesession */
+	5	/* error */
+};
+
+static const char *zkgen_services[] = {
+	"moray", "manatee", "authcache", "electric-moray", "storage",
+	"webapi", "loadbalancer", "nameservice"
+};
+#define	ZKGEN_NSERVICES	(sizeof (zkgen_services) / sizeof (zkgen_services[0]))
+
+/*
+ * A growable buffer holding the log being written.
+ */
+struct zkgen_buf {
+	uint8_t *zgb_data;
+	size_t zgb_len;
+	size_t zgb_size;
+};
+
+static void
+buf_reserve(struct zkgen_buf *buf, size_t len)
+{
+	size_t nsize;
+	uint8_t *ndata;
+
+	if (buf->zgb_size - buf->zgb_len >= len)
+		return;
+	nsize = (buf->zgb_size == 0) ? 1024 * 1024 : buf->zgb_size;
+	while (nsize - buf->zgb_len < len)
+		nsize *= 2;
+	if ((ndata = realloc(buf->zgb_data, nsize)) == NULL)
+		err(EXIT_FAILURE, "failed to allocate memory");
+	buf->zgb_data = ndata;
+	buf->zgb_size = nsize;
+}
+
+static void
+buf_append(struct zkgen_buf *buf, const void *data, size_t len)
+{
+	buf_reserve(buf, len);
+	bcopy(data, buf->zgb_data + buf->zgb_len, len);
+	buf->zgb_len += len;
+}
+
+static void
+buf_u8(struct zkgen_buf *buf, uint8_t v)
+{
+	buf_append(buf, &v, sizeof (v));
+}
+
+static void
+buf_u32(struct zkgen_buf *buf, uint32_t v)
+{
+	v = htobe32(v);
+	buf_append(buf, &v, sizeof (v));
+}
+
+static void
+buf_u64(struct zkgen_buf *buf, uint64_t v)
+{
+	v = htobe64(v);
+	buf_append(buf, &v, sizeof (v));
+}
+
+/* Writes a big-endian u32 at an offset we've already appended past. */
+static void
+buf_put32(struct zkgen_buf *buf, size_t off, uint32_t v)
+{
+	v = htobe32(v);
+	bcopy(&v, buf->zgb_data + off, sizeof (v));
+}
+
+static void
+buf_put64(struct zkgen_buf *buf, size_t off, uint64_t v)
+{
+	v = htobe64(v);
+	bcopy(&v, buf->zgb_data + off, sizeof (v));
+}
+
+/* A jute string (or buffer): its length, then its bytes. */
+static void
+buf_str(struct zkgen_buf *buf, const void *str, size_t len)
+{
+	buf_u32(buf, len);
+	buf_append(buf, str, len);
+}
+
+/*
+ * Our own PRNG (xorshift64*), so that a seed gives the same logs everywhere.
+ */
+static uint64_t zkgen_rng = 1;
+
+static uint64_t
+rng_next(void)
+{
+	zkgen_rng ^= zkgen_rng >> 12;
+	zkgen_rng ^= zkgen_rng << 25;
+	zkgen_rng ^= zkgen_rng >> 27;
+	return (zkgen_rng * 0x2545F4914F6CDD1DULL);
+}
+
+/* A number from 0 to n - 1. */
+static uint64_t
+rng_below(uint64_t n)
+{
+	return (n == 0 ? 0 : (rng_next() >> 11) % n);
+}
+
+/* What we're generating, from the options. */
+static uint64_t zkgen_ntxns = 1000000;
+static uint64_t zkgen_per_log = 100000;
+static uint32_t zkgen_nnodes = 10000;
+static uint32_t zkgen_nsessions = 1000;
+static uint32_t zkgen_nservers = 3;
+static size_t zkgen_data_min = 64;
+static size_t zkgen_data_max = 256;
+static size_t zkgen_prealloc = ZKLOGGEN_PREALLOC;
+
+/* The state of the tree and the sessions, to keep the txns plausible. */
+static char **zkgen_paths;
+static size_t *zkgen_pathlens;
+static uint8_t *zkgen_exists;
+static uint32_t zkgen_nexist;
+static uint64_t *zkgen_sessions;
+static uint32_t zkgen_nlive;
+static uint64_t zkgen_next_sid = 1;
+
+static uint64_t zkgen_zxid = 1;
+static uint64_t zkgen_time = 1600000000000ULL;
+
+static void
+tree_init(void)
+{
+	char path[PATH_MAX];
+	uint32_t i;
+	int len;
+
+	zkgen_paths = calloc(zkgen_nnodes, sizeof (char *));
+	zkgen_pathlens = calloc(zkgen_nnodes, sizeof (size_t));
+	zkgen_exists = calloc(zkgen_nnodes, sizeof (uint8_t));
+	zkgen_sessions = calloc(zkgen_nsessions, sizeof (uint64_t));
+	if (zkgen_paths == NULL || zkgen_pathlens == NULL ||
+	    zkgen_exists == NULL || zkgen_sessions == NULL) {
+		err(EXIT_FAILURE, "failed to allocate memory");
+	}
+
+	for (i = 0; i < zkgen_nnodes; ++i) {
+		len = snprintf(path, sizeof (path), "/com/joyent/us-east/%s/"
+		    "%08" PRIx64 "-%04" PRIx64, zkgen_services[i %
+		    ZKGEN_NSERVICES], rng_next() >> 32, rng_below(0x10000));
+		if ((zkgen_paths[i] = strdup(path)) == NULL)
+			err(EXIT_FAILURE, "failed to allocate memory");
+		zkgen_pathlens[i] = len;
+	}
+
+	/* Start with half the nodes there, and half the sessions open. */
+	for (i = 0; i < zkgen_nnodes; i += 2) {
+		zkgen_exists[i] = 1;
+		zkgen_nexist++;
+	}
+	while (zkgen_nlive < zkgen_nsessions / 2) {
+		zkgen_sessions[zkgen_nlive++] =
+		    ((uint64_t)(1 + rng_below(zkgen_nservers)) << 56) |
+		    zkgen_next_sid++;
+	}
+}
+
+/*
+ * Picks a node that does (or doesn't) exist, if there is one, by probing from
+ * a random one.
+ */
+static int
+tree_pick(int exists, uint32_t *idxp)
+{
+	uint32_t i, start;
+
+	if ((exists && zkgen_nexist == 0) ||
+	    (!exists && zkgen_nexist == zkgen_nnodes)) {
+		return (0);
+	}
+	start = rng_below(zkgen_nnodes);
+	for (i = start; ; i = (i + 1) % zkgen_nnodes) {
+		if (zkgen_exists[i] == exists) {
+			*idxp = i;
+			return (1);
+		}
+	}
+}
+
+static void
+gen_data(struct zkgen_buf *buf)
+{
+	static const char tmpl[] = "{\"type\":\"host\",\"address\":\"10.%u.%u."
+	    "%u\",\"ttl\":60,\"host\":{\"address\":\"10.%u.%u.%u\"},\"pad\":\"";
+	char head[256];
+	size_t len, n;
+
+	len = zkgen_data_min + rng_below(zkgen_data_max - zkgen_data_min + 1);
+	n = snprintf(head, sizeof (head), tmpl, (unsigned int)rng_below(256),
+	    (unsigned int)rng_below(256), (unsigned int)rng_below(256),
+	    (unsigned int)rng_below(256), (unsigned int)rng_below(256),
+	    (unsigned int)rng_below(256));
+	if (n > len)
+		n = len;
+
+	buf_u32(buf, len);
+	buf_append(buf, head, n);
+	for (; n < len; ++n)
+		buf_u8(buf, 'a' + rng_below(26));
+}
+
+static void
+gen_acl(struct zkgen_buf *buf)
+{
+	/* One ACL: world:anyone with all permissions. */
+	buf_u32(buf, 1);
+	buf_u32(buf, 31);
+	buf_str(buf, "world", 5);
+	buf_str(buf, "anyone", 6);
+}
+
+static void
+gen_create(struct zkgen_buf *buf, uint32_t idx)
+{
+	buf_str(buf, zkgen_paths[idx], zkgen_pathlens[idx]);
+	gen_data(buf);
+	gen_acl(buf);
+	buf_u8(buf, 1);		/* ephemeral */
+	buf_u32(buf, (uint32_t)rng_below(1000));
+	zkgen_exists[idx] = 1;
+	zkgen_nexist++;
+}
+
+static void
+gen_delete(struct zkgen_buf *buf, uint32_t idx)
+{
+	buf_str(buf, zkgen_paths[idx], zkgen_pathlens[idx]);
+	zkgen_exists[idx] = 0;
+	zkgen_nexist--;
+}
+
+static void
+gen_setdata(struct zkgen_buf *buf, uint32_t idx)
+{
+	buf_str(buf, zkgen_paths[idx], zkgen_pathlens[idx]);
+	gen_data(buf);
+	buf_u32(buf, (uint32_t)rng_below(100));
+}
+
+/*
+ * Appends the body of a create, delete or setdata (whichever makes sense for
+ * the tree), returning its type.
+ */
+static int32_t
+gen_op(struct zkgen_buf *buf, enum zkgen_kind kind)
+{
+	uint32_t idx;
+
+	if (kind == ZKGEN_CREATE && tree_pick(0, &idx)) {
+		gen_create(buf, idx);
+		return (ZK_CREATE);
+	}
+	if (kind == ZKGEN_DELETE && tree_pick(1, &idx)) {
+		gen_delete(buf, idx);
+		return (ZK_DELETE);
+	}
+	if (tree_pick(1, &idx)) {
+		gen_setdata(buf, idx);
+		return (ZK_SETDATA);
+	}
+	/* There are no nodes at all, so there's one to create. */
+	(void) tree_pick(0, &idx);
+	gen_create(buf, idx);
+	return (ZK_CREATE);
+}
+
+static enum zkgen_kind
+pick_kind(unsigned int total)
+{
+	unsigned int r = rng_below(total);
+	int k;
+
+	for (k = 0; k < ZKGEN_NKINDS - 1; ++k) {
+		if (r < zkgen_mix[k])
+			break;
+		r -= zkgen_mix[k];
+	}
+	return ((enum zkgen_kind)k);
+}
+
+/* Appends one txn to the log. */
+static void
+gen_txn(struct zkgen_buf *buf, unsigned int total)
+{
+	enum zkgen_kind kind = pick_kind(total);
+	size_t start = buf->zgb_len, body, typeoff, sub;
+	uint64_t sid;
+	uint32_t cxid = 1 + rng_below(0x10000), i, n, slot;
+	int32_t type;
+
+	/* Sessions stay between empty and full. */
+	if (kind == ZKGEN_CREATESESSION && zkgen_nlive == zkgen_nsessions)
+		kind = ZKGEN_CLOSESESSION;
+	else if (kind == ZKGEN_CLOSESESSION && zkgen_nlive == 0)
+		kind = ZKGEN_CREATESESSION;
+
+	if (kind == ZKGEN_CREATESESSION) {
+		sid = ((uint64_t)(1 + rng_below(zkgen_nservers)) << 56) |
+		    zkgen_next_sid++;
+		zkgen_sessions[zkgen_nlive++] = sid;
+		cxid = 0;
+	} else if (zkgen_nlive == 0) {
+		/* Nothing's open: a txn from a session we never saw. */
+		sid = zkgen_next_sid++;
+	} else {
+		slot = rng_below(zkgen_nlive);
+		sid = zkgen_sessions[slot];
+		if (kind == ZKGEN_CLOSESESSION) {
+			zkgen_sessions[slot] = zkgen_sessions[--zkgen_nlive];
+			/* About a third of sessions expire (with cxid 0). */
+			if (rng_below(3) == 0)
+				cxid = 0;
+		}
+	}
+
+	/* Checksum and length, filled in at the end. */
+	buf_u64(buf, 0);
+	buf_u32(buf, 0);
+	body = buf->zgb_len;
+	buf_u64(buf, sid);
+	buf_u32(buf, cxid);
+	buf_u64(buf, zkgen_zxid++);
+	buf_u64(buf, zkgen_time);
+	typeoff = buf->zgb_len;
+	buf_u32(buf, 0);
+	zkgen_time += rng_below(10);
+
+	switch (kind) {
+	case ZKGEN_CREATESESSION:
+		type = ZK_CREATESESSION;
+		buf_u32(buf, rng_below(2) ? 30000 : 60000);
+		break;
+	case ZKGEN_CLOSESESSION:
+		type = ZK_CLOSESESSION;
+		break;
+	case ZKGEN_ERROR:
+		type = ZK_ERROR;
+		buf_u32(buf, rng_below(2) ? ERR_NO_NODE : ERR_NODE_EXISTS);
+		break;
+	case ZKGEN_MULTI:
+		type = ZK_MULTI;
+		n = 1 + rng_below(4);
+		buf_u32(buf, n);
+		for (i = 0; i < n; ++i) {
+			sub = buf->zgb_len;
+			buf_u32(buf, 0);
+			buf_u32(buf, 0);
+			buf_put32(buf, sub, gen_op(buf, (enum zkgen_kind)
+			    rng_below(ZKGEN_DELETE + 1)));
+			buf_put32(buf, sub + 4, buf->zgb_len - sub - 8);
+		}
+		break;
+	default:
+		type = gen_op(buf, kind);
+		break;
+	}
+
+	buf_put32(buf, typeoff, (uint32_t)type);
+	buf_put32(buf, start + 8, buf->zgb_len - body);
+	buf_put64(buf, start, adler32(1, buf->zgb_data + body,
+	    buf->zgb_len - body));
+	buf_u8(buf, ZKTXN_TERMINATOR);
+}
+
+static void
+write_log(const char *dir, uint64_t first, const struct zkgen_buf *buf)
+{
+	char path[PATH_MAX];
+	size_t off = 0, len;
+	ssize_t n;
+	int fd;
+
+	(void) snprintf(path, sizeof (path), "%s/log.%" PRIx64, dir, first);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		err(EXIT_FAILURE, "error creating '%s'", path);
+	while (off < buf->zgb_len) {
+		if ((n = write(fd, buf->zgb_data + off,
+		    buf->zgb_len - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "error writing '%s'", path);
+		}
+		off += n;
+	}
+
+	/* The preallocated space is zeros, so it can be sparse. */
+	if (zkgen_prealloc > 0) {
+		len = buf->zgb_len + zkgen_prealloc - 1;
+		len -= len % zkgen_prealloc;
+		if (ftruncate(fd, len) != 0)
+			err(EXIT_FAILURE, "error extending '%s'", path);
+	}
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "error closing '%s'", path);
+}
+
+static void
+parse_mix(char *arg)
+{
+	char *term, *val, *p;
+	unsigned long parsed;
+	int k;
+
+	bzero(zkgen_mix, sizeof (zkgen_mix));
+	for (term = strtok(arg, ","); term != NULL; term = strtok(NULL, ",")) {
+		if ((val = strchr(term, '=')) == NULL)
+			errx(EXIT_FAILURE, "invalid mix term '%s'", term);
+		*val++ = '\0';
+		for (k = 0; k < ZKGEN_NKINDS; ++k) {
+			if (strcmp(term, zkgen_kind_names[k]) == 0)
+				break;
+		}
+		errno = 0;
+		parsed = strtoul(val, &p, 10);
+		if (k == ZKGEN_NKINDS || errno != 0 || *p != '\0' ||
+		    val[0] == '-' || parsed > 1000000) {
+			errx(EXIT_FAILURE, "invalid mix term '%s=%s'", term,
+			    val);
+		}
+		zkgen_mix[k] = parsed;
+	}
+}
+
+static uint64_t
+parse_num(int opt, const char *arg, uint64_t min)
+{
+	unsigned long long parsed;
+	char *p;
+
+	errno = 0;
+	parsed = strtoull(arg, &p, 10);
+	if (errno != 0 || *p != '\0' || arg[0] == '-' || parsed < min)
+		errx(EXIT_FAILURE, "invalid argument for -%c: '%s'", opt, arg);
+	return (parsed);
+}
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr,
+	    "usage: zkloggen [-n txns] [-l txns] [-k nodes] [-c sessions] "
+	    "[-i servers]\n"
+	    "                [-d min[,max]] [-m mix] [-P bytes] [-r seed] "
+	    "<dir>\n");
+	(void) fprintf(stderr,
+	    "writes synthetic ZK txnlogs (\"log.<zxid>\") into <dir>\n");
+	(void) fprintf(stderr, "options:\n"
+	    "    -n txns      total number of txns (default 1000000)\n"
+	    "    -l txns      txns in each log (default 100000)\n"
+	    "    -k nodes     number of distinct node paths (default 10000)\n"
+	    "    -c sessions  most sessions open at once (default 1000)\n"
+	    "    -i servers   server ids to spread sessions over (default 3)\n"
+	    "    -d min,max   size range of node data, in bytes (default\n"
+	    "                 64,256)\n"
+	    "    -m mix       relative amounts of each kind of txn, e.g. the\n"
+	    "                 default: create=25,setdata=30,delete=15,"
+	    "multi=5,\n"
+	    "                 createsession=10,closesession=10,error=5\n"
+	    "    -P bytes     preallocate each log to a multiple of <bytes>\n"
+	    "                 as ZK does (default 64MB; 0 for none)\n"
+	    "    -r seed      seed for the random choices (default 1)\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct zkgen_buf buf;
+	unsigned int total = 0;
+	uint64_t done, first, seed = 1;
+	const char *dir;
+	char *p;
+	int opt, k;
+
+	while ((opt = getopt(argc, argv, "n:l:k:c:i:d:m:P:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			zkgen_ntxns = parse_num(opt, optarg, 1);
+			break;
+		case 'l':
+			zkgen_per_log = parse_num(opt, optarg, 1);
+			break;
+		case 'k':
+			zkgen_nnodes = parse_num(opt, optarg, 1);
+			break;
+		case 'c':
+			zkgen_nsessions = parse_num(opt, optarg, 1);
+			break;
+		case 'i':
+			zkgen_nservers = parse_num(opt, optarg, 1);
+			if (zkgen_nservers > 255)
+				errx(EXIT_FAILURE, "at most 255 servers");
+			break;
+		case 'd':
+			if ((p = strchr(optarg, ',')) != NULL) {
+				*p++ = '\0';
+				zkgen_data_max = parse_num(opt, p, 0);
+			}
+			zkgen_data_min = parse_num(opt, optarg, 0);
+			if (p == NULL)
+				zkgen_data_max = zkgen_data_min;
+			if (zkgen_data_max < zkgen_data_min ||
+			    zkgen_data_max > 1024 * 1024) {
+				errx(EXIT_FAILURE, "invalid data sizes");
+			}
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 'P':
+			zkgen_prealloc = parse_num(opt, optarg, 0);
+			break;
+		case 'r':
+			seed = parse_num(opt, optarg, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	dir = argv[optind];
+
+	for (k = 0; k < ZKGEN_NKINDS; ++k)
+		total += zkgen_mix[k];
+	if (total == 0)
+		errx(EXIT_FAILURE, "the mix has nothing in it");
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		err(EXIT_FAILURE, "error creating '%s'", dir);
+
+	/* xorshift can't start from zero. */
+	zkgen_rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+	tree_init();
+
+	bzero(&buf, sizeof (buf));
+	for (done = 0; done < zkgen_ntxns; ) {
+		buf.zgb_len = 0;
+		buf_u32(&buf, ZKLOG_MAGIC);
+		buf_u32(&buf, ZKLOG_VERSION_2);
+		buf_u64(&buf, 0);	/* dbid */
+		first = zkgen_zxid;
+		for (; done < zkgen_ntxns && zkgen_zxid - first < zkgen_per_log;
+		    ++done) {
+			gen_txn(&buf, total);
+		}
+		write_log(dir, first, &buf);
+	}
+
+	return (0);
+}
@@ -0,0 +1,478 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+//
+// Checks that "zklog --dns" answers the way binder does. We write a small
+// snapshot and txnlog of registrar records, and after each txn in it, ask
+// both zklog and binder's own query handler (lib/server.js, fed from a
+// cache of the tree as it was at that point) the same A, SRV and PTR
+// queries, and compare the answers.
+//
+// binder is given a freshly-built cache at each point, as if it had just
+// started, and only asked about names in its DNS domain: zklog doesn't model
+// what a long-running binder keeps from earlier versions of the tree, or its
+// configuration (see "DNS replay" in src/zklog.c).
+//
+
+var child_process = require('child_process');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+
+var core = require('../lib');
+
+if (require.cache[__dirname + '/helper.js'])
+        delete require.cache[__dirname + '/helper.js'];
+var helper = require('./helper.js');
+
+
+
+///--- Globals
+
+var after = helper.after;
+var before = helper.before;
+var test = helper.test;
+
+var ZKLOG = process.env.ZKLOG || path.join(__dirname, '..', 'zklog');
+
+var DOMAIN = 'foo.com';
+var ROOT = '/com/foo';
+
+var ZK_CREATE = 1;
+var ZK_DELETE = 2;
+var ZK_SETDATA = 5;
+var ZK_MULTI = 14;
+var ZK_CREATESESSION = -10;
+var ZK_CLOSESESSION = -11;
+
+var REGISTRAR = 0x100;
+var CLIENT = 0x300;
+
+// The logs' directory, and the cache and server binder answers from.
+var DIR;
+var CACHE;
+var SERVER;
+
+// Every node gets the one ACL, "world:anyone" with all permissions.
+var ACL = Buffer.concat([ int32(1), int32(31), string('world'),
+    string('anyone') ]);
+
+function rec(obj) {
+        return (JSON.stringify(obj));
+}
+
+// The tree in the snapshot: path -> [ data, ephemeral owner ].
+var SNAPSHOT = {
+        '/com': [ null, 0 ],
+        '/com/foo': [ null, 0 ],
+        '/com/foo/db': [ rec({ type: 'host',
+            host: { address: '10.0.0.1' } }), 0 ],
+        '/com/foo/pg': [ rec({ type: 'database',
+            database: { primary: 'tcp://postgres@10.0.0.9:5432/moray' },
+            ttl: 5 }), 0 ],
+        '/com/foo/moray': [ rec({ type: 'service',
+            service: { type: 'service', service: { srvce: '_moray',
+            proto: '_tcp', port: 2020, ttl: 60 } }, ttl: 120 }), 0 ],
+        '/com/foo/moray/m1': [ rec({ type: 'moray_host',
+            moray_host: { address: '10.1.0.1', ports: [ 2021, 2022 ] },
+            ttl: 30 }), REGISTRAR ],
+        '/com/foo/moray/m2': [ rec({ type: 'load_balancer',
+            load_balancer: { address: '10.1.0.2', ttl: 90 } }), REGISTRAR ],
+        '/com/foo/moray/m3': [ rec({ type: 'host',
+            host: { address: '10.1.0.3' } }), REGISTRAR ],
+        '/com/foo/moray/m4': [ rec({ type: 'redis_host',
+            redis_host: { address: null } }), REGISTRAR ],
+        '/com/foo/web': [ rec({ type: 'service', service: { srvce: '_http',
+            proto: '_tcp', port: 80 } }), 0 ],
+        '/com/foo/web/w1': [ rec({ type: 'rr_host',
+            rr_host: { address: '10.2.0.1', ttl: 10 } }), 0 ],
+        '/com/foo/str': [ rec({ type: 'service', service: { srvce: '_x',
+            proto: '_tcp', port: '8080' } }), 0 ],
+        '/com/foo/str/s1': [ rec({ type: 'ops_host',
+            ops_host: { address: '10.3.0.1' } }), 0 ],
+        '/com/foo/bad': [ 'notjson', 0 ],
+        '/com/foo/arr': [ '[1]', 0 ]
+};
+
+// The txns in the log after it, in order (the first has zxid 1).
+var TXNS = [
+        createSession(CLIENT),
+        create(CLIENT, '/com/foo/web/w2', rec({ type: 'ops_host',
+            ops_host: { address: '10.2.0.2' }, ttl: 45 }), true),
+        setData(CLIENT, '/com/foo/db', rec({ type: 'host',
+            host: { address: '10.0.0.2', ttl: 120 } })),
+        closeSession(REGISTRAR),
+        setData(CLIENT, '/com/foo/web', rec({ type: 'service',
+            service: { srvce: '_https', proto: '_tcp', port: 443 } })),
+        multi(CLIENT, [
+            create(CLIENT, '/com/foo/new', rec({ type: 'host',
+                host: { address: '10.9.9.9' } }), false),
+            setData(CLIENT, '/com/foo/pg', rec({ type: 'database',
+                database: { primary: 'tcp://10.0.0.10/x' } }))
+        ]),
+        del(CLIENT, '/com/foo/web/w1'),
+        setData(CLIENT, '/com/foo/db', 'garbage')
+];
+
+/*
+ * m4's null address is left out of A: what binder does with it is up to
+ * mname's ARecord. Its service skips it, which is binder's own doing.
+ */
+var QUERIES = {
+        A: [ 'db.foo.com', 'pg.foo.com',
+            'moray.foo.com', 'm1.moray.foo.com', 'm2.moray.foo.com',
+            'web.foo.com', 'w1.web.foo.com',
+            'w2.web.foo.com', 'str.foo.com', 'new.foo.com', 'bad.foo.com',
+            'arr.foo.com', 'nope.foo.com', 'a..b.foo.com', 'x%y.foo.com' ],
+        SRV: [ '_moray._tcp.moray.foo.com', '_http._tcp.web.foo.com',
+            '_https._tcp.web.foo.com', '_http._udp.web.foo.com',
+            '_x._tcp.db.foo.com', '_x._tcp.m1.moray.foo.com',
+            '_x._tcp.nope.foo.com', 'moray.foo.com' ],
+        PTR: [ '1.0.0.10.in-addr.arpa', '2.0.0.10.in-addr.arpa',
+            '9.0.0.10.in-addr.arpa', '1.0.1.10.in-addr.arpa',
+            '2.0.1.10.in-addr.arpa', '3.0.1.10.in-addr.arpa',
+            '1.0.2.10.in-addr.arpa', '2.0.2.10.in-addr.arpa',
+            '9.9.9.10.in-addr.arpa', '1.1.1.1.in-addr.arpa', 'foo.arpa' ]
+};
+
+var RCODES = {
+        noerror: 'NOERROR',
+        nxdomain: 'NXDOMAIN',
+        refused: 'REFUSED',
+        servfail: 'SERVFAIL',
+        eserver: 'SERVFAIL',
+        enotimp: 'NOTIMP'
+};
+
+
+
+///--- Writing the logs
+
+function int32(v) {
+        var b = Buffer.alloc(4);
+        b.writeInt32BE(v, 0);
+        return (b);
+}
+
+// Only for values that fit in a double, which is all we need.
+function int64(v) {
+        var b = Buffer.alloc(8);
+        b.writeUInt32BE(Math.floor(v / 4294967296), 0);
+        b.writeUInt32BE(v % 4294967296, 4);
+        return (b);
+}
+
+function string(str) {
+        var b = Buffer.from(str, 'utf8');
+        return (Buffer.concat([ int32(b.length), b ]));
+}
+
+function buffer(str) {
+        return (str === null ? int32(-1) : string(str));
+}
+
+function adler32(buf) {
+        var a = 1, b = 0;
+
+        for (var i = 0; i < buf.length; ++i) {
+                a = (a + buf[i]) % 65521;
+                b = (b + a) % 65521;
+        }
+        return (b * 65536 + a);
+}
+
+// Each txn has its body, and what it does to the tree.
+function createSession(sid) {
+        return ({ sid: sid, type: ZK_CREATESESSION, body: int32(30000),
+            apply: function () {} });
+}
+
+function closeSession(sid) {
+        return ({ sid: sid, type: ZK_CLOSESESSION, body: Buffer.alloc(0),
+            apply: function (tree) {
+                Object.keys(tree).forEach(function (p) {
+                        if (tree[p][1] === sid)
+                                delete (tree[p]);
+                });
+        } });
+}
+
+function create(sid, p, data, ephemeral) {
+        return ({ sid: sid, type: ZK_CREATE, body: Buffer.concat([
+            string(p), buffer(data), ACL, Buffer.from([ ephemeral ? 1 : 0 ]),
+            int32(1) ]), apply: function (tree) {
+                tree[p] = [ data, ephemeral ? sid : 0 ];
+        } });
+}
+
+function setData(sid, p, data) {
+        return ({ sid: sid, type: ZK_SETDATA, body: Buffer.concat([
+            string(p), buffer(data), int32(1) ]), apply: function (tree) {
+                tree[p] = [ data, tree[p][1] ];
+        } });
+}
+
+function del(sid, p) {
+        return ({ sid: sid, type: ZK_DELETE, body: string(p),
+            apply: function (tree) {
+                delete (tree[p]);
+        } });
+}
+
+function multi(sid, txns) {
+        var bufs = [ int32(txns.length) ];
+
+        txns.forEach(function (t) {
+                bufs.push(int32(t.type), int32(t.body.length), t.body);
+        });
+        return ({ sid: sid, type: ZK_MULTI, body: Buffer.concat(bufs),
+            apply: function (tree) {
+                txns.forEach(function (t) {
+                        t.apply(tree);
+                });
+        } });
+}
+
+function writeSnapshot(file) {
+        var bufs = [ int32(0x5A4B534E), int32(2), int64(0) ];
+
+        bufs.push(int32(1), int64(REGISTRAR), int32(30000));
+        bufs.push(int32(1), int64(1), ACL);
+        [ '' ].concat(Object.keys(SNAPSHOT).sort()).forEach(function (p) {
+                var node = SNAPSHOT[p] || [ null, 0 ];
+
+                bufs.push(string(p), buffer(node[0]), int64(1));
+                bufs.push(int64(1), int64(1), int64(1500000000000),
+                    int64(1500000000000), int32(0), int32(0), int32(0),
+                    int64(node[1]), int64(1));
+        });
+        bufs.push(string('/'), int64(0), string('/'));
+        fs.writeFileSync(file, Buffer.concat(bufs));
+}
+
+function writeLog(file) {
+        var bufs = [ int32(0x5A4B4C47), int32(2), int64(0) ];
+
+        TXNS.forEach(function (t, i) {
+                var body = Buffer.concat([ int64(t.sid), int32(1),
+                    int64(i + 1), int64(1700000000000 + i * 1000),
+                    int32(t.type), t.body ]);
+
+                bufs.push(int64(adler32(body)), int32(body.length), body,
+                    Buffer.from([ 0x42 ]));
+        });
+        bufs.push(Buffer.alloc(64));
+        fs.writeFileSync(file, Buffer.concat(bufs));
+}
+
+
+
+///--- Asking binder
+
+// The tree as of a zxid.
+function treeAt(zxid) {
+        var tree = {};
+
+        Object.keys(SNAPSHOT).forEach(function (p) {
+                tree[p] = SNAPSHOT[p];
+        });
+        TXNS.slice(0, zxid).forEach(function (t) {
+                t.apply(tree);
+        });
+        return (tree);
+}
+
+// A cache of the tree under ROOT, built the way lib/zk.js builds one.
+function Cache() {
+        this.nodes = {};
+        this.rev = {};
+}
+
+Cache.prototype.load = function (tree) {
+        var self = this;
+
+        this.nodes = {};
+        this.rev = {};
+
+        Object.keys(tree).sort().forEach(function (p) {
+                if (p !== ROOT && p.indexOf(ROOT + '/') !== 0)
+                        return;
+
+                var names = p.split('/').slice(1).reverse();
+                var node = {
+                        name: names[0],
+                        domain: names.join('.').toLowerCase(),
+                        data: null,
+                        children: []
+                };
+                var parent = self.nodes[names.slice(1).join('.')];
+                var data;
+
+                try {
+                        data = JSON.parse(tree[p][0]);
+                } catch (e) {
+                        data = undefined;
+                }
+                if (typeof (data) === 'object')
+                        node.data = data;
+                if (parent !== undefined)
+                        parent.children.push(node);
+                self.nodes[node.domain] = node;
+
+                if (data && typeof (data.type) === 'string' &&
+                    [ 'db_host', 'host', 'load_balancer', 'moray_host',
+                    'redis_host', 'ops_host', 'rr_host' ].indexOf(
+                    data.type) !== -1 && data[data.type] &&
+                    typeof (data[data.type]) === 'object' &&
+                    data[data.type].address)
+                        self.rev[data[data.type].address] = node;
+        });
+};
+
+Cache.prototype.isReady = function () {
+        return (true);
+};
+
+Cache.prototype.lookup = function (domain) {
+        return (this.nodes[domain]);
+};
+
+Cache.prototype.reverseLookup = function (ip) {
+        return (this.rev[ip]);
+};
+
+function toJSON(name, record, ttl) {
+        var type = record._type ||
+            record.constructor.name.replace(/Record$/, '');
+        var rr = { name: name, type: type, ttl: ttl };
+
+        if (type === 'A')
+                rr.address = record.target;
+        if (type === 'SRV' || type === 'PTR')
+                rr.target = record.target;
+        if (type === 'SRV')
+                rr.port = record.port;
+        return (rr);
+}
+
+// Puts the query to binder's handler, which answers it synchronously.
+function askBinder(server, qtype, name) {
+        var ans = { rcode: 'NOERROR', answers: [], additional: [],
+            authority: [] };
+        var done = false;
+        var query = {
+                id: 0,
+                src: { address: '::1', port: 53, family: 'udp6' },
+                response: { header: { arCount: 0 } },
+                name: function () { return (name); },
+                type: function () { return (qtype); },
+                testFlag: function () { return (false); },
+                setError: function (err) { ans.rcode = RCODES[err]; },
+                addAnswer: function (n, r, ttl) {
+                        ans.answers.push(toJSON(n, r, ttl));
+                },
+                addAdditional: function (n, r, ttl) {
+                        ans.additional.push(toJSON(n, r, ttl));
+                },
+                addAuthority: function (n, r, ttl) {
+                        ans.authority.push(toJSON(n, r, ttl));
+                },
+                respond: function () {}
+        };
+
+        server.emit('query', query, function () {
+                done = true;
+        });
+        if (!done)
+                throw (new Error('binder didn\'t answer ' + name));
+        return (ans);
+}
+
+function askZklog(dir, zxid, qtype, name) {
+        var res = child_process.spawnSync(ZKLOG, [ '--dns', name,
+            '--qtype', qtype, '-D', dir, '--path', ROOT,
+            '--zxid-to', zxid.toString(16) ]);
+
+        if (res.error)
+                throw (res.error);
+        if (res.status !== 0) {
+                throw (new Error('zklog failed: ' +
+                    res.stderr.toString()));
+        }
+        return (JSON.parse(res.stdout.toString()));
+}
+
+// binder shuffles the members of a service, and zklog sorts them.
+function normalize(ans) {
+        var ret = { rcode: ans.rcode };
+
+        [ 'answers', 'additional', 'authority' ].forEach(function (k) {
+                ret[k] = (ans[k] || []).map(function (rr) {
+                        return (JSON.stringify(rr, Object.keys(rr).sort()));
+                }).sort();
+        });
+        return (ret);
+}
+
+
+
+///--- Tests
+
+before(function (callback) {
+        DIR = fs.mkdtempSync(path.join(os.tmpdir(), 'zklog-dns.'));
+        writeSnapshot(path.join(DIR, 'snapshot.0'));
+        writeLog(path.join(DIR, 'log.1'));
+
+        CACHE = new Cache();
+        SERVER = core.createServer({
+                log: helper.createLogger('zklog-dns'),
+                dnsDomain: DOMAIN,
+                zkCache: CACHE
+        });
+        callback();
+});
+
+
+test('answers match binder after each txn', function (t) {
+        for (var zxid = 0; zxid <= TXNS.length; ++zxid) {
+                CACHE.load(treeAt(zxid));
+                Object.keys(QUERIES).forEach(function (qtype) {
+                        QUERIES[qtype].forEach(function (name) {
+                                t.deepEqual(normalize(askZklog(DIR,
+                                    zxid, qtype, name)),
+                                    normalize(askBinder(SERVER, qtype,
+                                    name)), qtype + ' ' + name + ' at ' +
+                                    zxid);
+                        });
+                });
+        }
+        t.end();
+});
+
+
+test('string port', function (t) {
+        var ans = askZklog(DIR, TXNS.length, 'SRV', '_x._tcp.str.' +
+            DOMAIN);
+
+        t.equal(ans.rcode, 'NOERROR');
+        t.equal(ans.answers.length, 1);
+        t.equal(ans.answers[0].port, '8080');
+        t.equal(ans.answers[0].target, 's1.str.' + DOMAIN);
+        t.end();
+});
+
+
+after(function (callback) {
+        fs.readdirSync(DIR).forEach(function (name) {
+                fs.unlinkSync(path.join(DIR, name));
+        });
+        fs.rmdirSync(DIR);
+        callback();
+});
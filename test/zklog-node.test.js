@@ -0,0 +1,181 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+//
+// Checks that the node binding of zklog's decoder (tools/zklog.js, over
+// zklog.node) reads a log written by zkloggen the same as zklog does, by
+// turning its txns back into zklog's JSON records.
+//
+
+var child_process = require('child_process');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+
+var zklog = require('../tools/zklog');
+
+if (require.cache[__dirname + '/helper.js'])
+        delete require.cache[__dirname + '/helper.js'];
+var helper = require('./helper.js');
+
+
+
+///--- Globals
+
+var after = helper.after;
+var before = helper.before;
+var test = helper.test;
+
+var ZKLOG = process.env.ZKLOG || path.join(__dirname, '..', 'zklog');
+var ZKLOGGEN = process.env.ZKLOGGEN ||
+    path.join(__dirname, '..', 'zkloggen');
+
+// The log, and zklog's records for it (with the data).
+var DIR;
+var LOG;
+var RECORDS;
+
+
+
+///--- Helpers
+
+// zklog's records for a txn: a MULTI's children follow it.
+function toRecords(txn) {
+        var rec = {
+                time: new Date(txn.time).toISOString(),
+                type: txn.type,
+                typeid: txn.typeid,
+                sessionid: txn.sessionid,
+                cxid: txn.cxid,
+                zxid: txn.zxid
+        };
+        var recs = [ rec ];
+
+        if (txn.error !== undefined) {
+                rec.error = txn.error;
+                rec.errid = txn.errid;
+        }
+        if (txn.timeout !== undefined)
+                rec.timeout = String(txn.timeout);
+        if (txn.path !== undefined)
+                rec.path = txn.path;
+        if (txn.data !== undefined)
+                rec.data = txn.data.toString('hex');
+        if (txn.count !== undefined) {
+                rec.count = txn.count;
+                txn.children.forEach(function (kid) {
+                        recs = recs.concat(toRecords(kid));
+                });
+        }
+        return (recs);
+}
+
+function rmr(dir) {
+        fs.readdirSync(dir).forEach(function (name) {
+                fs.unlinkSync(path.join(dir, name));
+        });
+        fs.rmdirSync(dir);
+}
+
+
+
+///--- Tests
+
+before(function (callback) {
+        var res;
+
+        DIR = fs.mkdtempSync(path.join(os.tmpdir(), 'zklog-node.'));
+        res = child_process.spawnSync(ZKLOGGEN, [ '-n', '20000', '-l',
+            '20000', '-k', '500', '-c', '100', '-P', '0', DIR ]);
+        if (res.error)
+                throw (res.error);
+        if (res.status !== 0)
+                throw (new Error('zkloggen failed: ' + res.stderr));
+        LOG = path.join(DIR, 'log.1');
+
+        res = child_process.spawnSync(ZKLOG, [ '-d', LOG ], {
+                maxBuffer: 1024 * 1024 * 1024
+        });
+        if (res.error)
+                throw (res.error);
+        if (res.status !== 0)
+                throw (new Error('zklog failed: ' + res.stderr));
+
+        // The durations are zklog's own session tracking.
+        RECORDS = res.stdout.toString().split('\n').filter(function (line) {
+                return (line.length > 0);
+        }).map(function (line) {
+                var rec = JSON.parse(line);
+
+                delete rec.duration;
+                return (rec);
+        });
+        callback();
+});
+
+
+test('open() reads what zklog does', function (t) {
+        var cur = zklog.open(LOG);
+        var recs = [];
+        var txn;
+
+        while ((txn = cur.next()) !== null)
+                recs = recs.concat(toRecords(txn));
+        cur.close();
+
+        t.equal(recs.length, RECORDS.length);
+        t.deepEqual(recs, RECORDS);
+        t.end();
+});
+
+
+test('createReadStream() of a Buffer reads what zklog does', function (t) {
+        var recs = [];
+        var rs = zklog.createReadStream(fs.readFileSync(LOG));
+
+        rs.on('data', function (txn) {
+                recs = recs.concat(toRecords(txn));
+        });
+        rs.on('error', function (err) {
+                t.ifError(err);
+                t.end();
+        });
+        rs.on('end', function () {
+                t.deepEqual(recs, RECORDS);
+                t.end();
+        });
+});
+
+
+test('a truncated log throws after the txns before it', function (t) {
+        var buf = fs.readFileSync(LOG);
+        var cur = zklog.open(buf.slice(0, Math.floor(buf.length / 3)));
+        var recs = [];
+        var txn;
+
+        t.throws(function () {
+                while ((txn = cur.next()) !== null)
+                        recs = recs.concat(toRecords(txn));
+        }, function (err) {
+                return (err.code === 'ZKL_ETRUNC' &&
+                    typeof (err.offset) === 'number');
+        });
+        cur.close();
+
+        t.ok(recs.length > 0);
+        t.deepEqual(recs, RECORDS.slice(0, recs.length));
+        t.end();
+});
+
+
+after(function (callback) {
+        rmr(DIR);
+        callback();
+});
@@ -0,0 +1,457 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+//
+// Checks zklog's decoding against itself and against simple references,
+// over txnlogs written by zkloggen (which is seeded, so they're the same
+// each time). The logs are big enough that -j splits each of them up.
+//
+
+var child_process = require('child_process');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var zlib = require('zlib');
+
+if (require.cache[__dirname + '/helper.js'])
+        delete require.cache[__dirname + '/helper.js'];
+var helper = require('./helper.js');
+
+
+
+///--- Globals
+
+var after = helper.after;
+var before = helper.before;
+var test = helper.test;
+
+var ZKLOG = process.env.ZKLOG || path.join(__dirname, '..', 'zklog');
+var ZKLOGGEN = process.env.ZKLOGGEN ||
+    path.join(__dirname, '..', 'zkloggen');
+
+// Three logs of 50000 txns each, each over twice zklog's -j chunk size.
+var TXNS = 150000;
+var TXNS_PER_LOG = 50000;
+
+var EXIT_DAMAGED = 3;
+
+// Where the logs are, and zklog's output for all of them.
+var DIR;
+var LOGS;
+var SERIAL;
+
+
+
+///--- Helpers
+
+function zklog(args) {
+        var res = child_process.spawnSync(ZKLOG, args, {
+                maxBuffer: 1024 * 1024 * 1024
+        });
+
+        if (res.error)
+                throw (res.error);
+        return ({
+                status: res.status,
+                stdout: res.stdout.toString(),
+                stderr: res.stderr.toString()
+        });
+}
+
+function records(out) {
+        return (out.split('\n').filter(function (line) {
+                return (line.length > 0);
+        }).map(function (line) {
+                return (JSON.parse(line));
+        }));
+}
+
+function sessions(recs) {
+        return (recs.filter(function (r) {
+                return (r.type === '_SESSION');
+        }).map(function (r) {
+                return (r.sid);
+        }).sort());
+}
+
+function copy(from, to) {
+        fs.writeFileSync(to, fs.readFileSync(from));
+}
+
+function rmr(dir) {
+        fs.readdirSync(dir).forEach(function (name) {
+                var p = path.join(dir, name);
+
+                if (fs.statSync(p).isDirectory())
+                        rmr(p);
+                else
+                        fs.unlinkSync(p);
+        });
+        fs.rmdirSync(dir);
+}
+
+//
+// Filters zklog's unfiltered output the way -e should: a MULTI's children
+// are matched one by one, and it's printed (with just the children that
+// matched) if any of them did, or with all of them if it matched itself.
+//
+function filter(out, match) {
+        var lines = out.split('\n').filter(function (line) {
+                return (line.length > 0);
+        });
+        var ret = [];
+        var i, j, r, kids;
+
+        for (i = 0; i < lines.length; ++i) {
+                r = JSON.parse(lines[i]);
+                if (r.type !== 'MULTI') {
+                        if (match(r))
+                                ret.push(lines[i]);
+                        continue;
+                }
+
+                kids = lines.slice(i + 1, i + 1 + r.count);
+                i += r.count;
+                if (!match(r)) {
+                        kids = kids.filter(function (line) {
+                                return (match(JSON.parse(line)));
+                        });
+                        if (kids.length === 0)
+                                continue;
+                }
+                ret.push(lines[i - r.count]);
+                for (j = 0; j < kids.length; ++j)
+                        ret.push(kids[j]);
+        }
+        return (ret.length === 0 ? '' : ret.join('\n') + '\n');
+}
+
+function int32(v) {
+        var b = Buffer.alloc(4);
+        b.writeInt32BE(v, 0);
+        return (b);
+}
+
+function int64(v) {
+        var b = Buffer.alloc(8);
+        b.writeUInt32BE(Math.floor(v / 4294967296), 0);
+        b.writeUInt32BE(v % 4294967296, 4);
+        return (b);
+}
+
+function string(str) {
+        var b = Buffer.from(str, 'utf8');
+        return (Buffer.concat([ int32(b.length), b ]));
+}
+
+// A snapshot (as of zxid 0) of just the given paths, with no sessions.
+function writeSnapshot(file, paths) {
+        var bufs = [ int32(0x5A4B534E), int32(2), int64(0), int32(0),
+            int32(0) ];
+
+        [ '' ].concat(paths.sort()).forEach(function (p) {
+                bufs.push(string(p), int32(-1), int64(0), int64(0),
+                    int64(0), int64(0), int64(0), int32(0), int32(0),
+                    int32(0), int64(0), int64(0));
+        });
+        bufs.push(string('/'), int64(0), string('/'));
+        fs.writeFileSync(file, Buffer.concat(bufs));
+}
+
+//
+// The nodes under "root" once the given records have been replayed on top of
+// "paths", as "path owner" strings. zkloggen's nodes are all ephemeral.
+//
+function replay(recs, paths, root) {
+        var owners = {};
+
+        paths.forEach(function (p) {
+                owners[p] = '0';
+        });
+        recs.forEach(function (r) {
+                var parent;
+
+                switch (r.type) {
+                case 'CREATE':
+                        parent = r.path.slice(0, r.path.lastIndexOf('/'));
+                        if (owners[parent] !== undefined &&
+                            owners[r.path] === undefined)
+                                owners[r.path] = r.sessionid;
+                        break;
+                case 'DELETE':
+                        delete owners[r.path];
+                        break;
+                case 'CLOSESESSION':
+                        Object.keys(owners).forEach(function (p) {
+                                if (owners[p] === r.sessionid)
+                                        delete owners[p];
+                        });
+                        break;
+                default:
+                        break;
+                }
+        });
+        return (Object.keys(owners).filter(function (p) {
+                return (p === root || p.indexOf(root + '/') === 0);
+        }).map(function (p) {
+                return (p + ' ' + owners[p]);
+        }).sort());
+}
+
+
+
+///--- Tests
+
+before(function (callback) {
+        var res;
+
+        DIR = fs.mkdtempSync(path.join(os.tmpdir(), 'zklog.'));
+        fs.mkdirSync(path.join(DIR, 'logs'));
+        res = child_process.spawnSync(ZKLOGGEN, [ '-n', String(TXNS),
+            '-l', String(TXNS_PER_LOG), '-k', '1000', '-c', '200',
+            '-P', '0', path.join(DIR, 'logs') ]);
+        if (res.error)
+                throw (res.error);
+        if (res.status !== 0)
+                throw (new Error('zkloggen failed: ' + res.stderr));
+
+        LOGS = fs.readdirSync(path.join(DIR, 'logs')).sort(function (a, b) {
+                return (parseInt(a.slice(4), 16) - parseInt(b.slice(4), 16));
+        }).map(function (name) {
+                return (path.join(DIR, 'logs', name));
+        });
+        SERIAL = zklog([ '-D', path.join(DIR, 'logs') ]);
+        callback();
+});
+
+
+test('decodes the logs', function (t) {
+        var recs = records(SERIAL.stdout);
+
+        t.equal(SERIAL.status, 0);
+        t.equal(LOGS.length, TXNS / TXNS_PER_LOG);
+        t.equal(recs[0].zxid, '1');
+        t.equal(recs[recs.length - 1].zxid, TXNS.toString(16));
+        t.end();
+});
+
+
+test('-j matches serial output', function (t) {
+        [ '1', '2', '4', '0' ].forEach(function (n) {
+                var res = zklog([ '-j', n, '-D', path.join(DIR, 'logs') ]);
+
+                t.equal(res.status, 0);
+                t.ok(res.stdout === SERIAL.stdout, '-j ' + n);
+        });
+
+        // -j puts the files into zxid order itself, even on one thread.
+        [ '1', '4' ].forEach(function (n) {
+                t.ok(zklog([ '-j', n ].concat(LOGS.slice().reverse()))
+                    .stdout === SERIAL.stdout, '-j ' + n +
+                    ' with the logs reversed');
+        });
+        t.end();
+});
+
+
+test('-S sessions', function (t) {
+        var open = {};
+        var serial = zklog([ '-S', '-D', path.join(DIR, 'logs') ]);
+        var parallel = zklog([ '-S', '-j', '4', '-D',
+            path.join(DIR, 'logs') ]);
+
+        records(SERIAL.stdout).forEach(function (r) {
+                if (r.type === 'CREATESESSION')
+                        open[r.sessionid] = true;
+                else if (r.type === 'CLOSESESSION')
+                        delete open[r.sessionid];
+        });
+
+        t.equal(serial.status, 0);
+        t.ok(sessions(records(serial.stdout)).length > 0);
+        t.deepEqual(sessions(records(serial.stdout)),
+            Object.keys(open).sort());
+        t.deepEqual(sessions(records(parallel.stdout)),
+            sessions(records(serial.stdout)));
+        t.end();
+});
+
+
+test('--verify finds a flipped byte', function (t) {
+        var bad = path.join(DIR, 'bad');
+        var buf = fs.readFileSync(LOGS[1]);
+        var ok, res, recs;
+
+        ok = zklog([ '--verify' ].concat(LOGS));
+        t.equal(ok.status, 0);
+        t.equal(records(ok.stdout).filter(function (r) {
+                return (r.type === '_CORRUPT');
+        }).length, 0);
+
+        buf[1000] ^= 0xff;
+        fs.writeFileSync(bad, buf);
+        res = zklog([ '--verify', bad ]);
+        recs = records(res.stdout);
+
+        t.equal(res.status, EXIT_DAMAGED);
+        t.equal(recs.length, 2);
+        t.equal(recs[0].type, '_CORRUPT');
+        t.equal(recs[0].file, bad);
+        t.equal(recs[0].txns, 1);
+        t.ok(recs[0].start <= 1000 && 1000 < recs[0].end);
+        t.equal(recs[1].type, '_VERIFY');
+        t.equal(recs[1].corrupt, 1);
+        t.equal(recs[1].ok, false);
+        t.end();
+});
+
+
+test('--merge reports a gap', function (t) {
+        var a = path.join(DIR, 'a');
+        var b = path.join(DIR, 'b');
+        var first = parseInt(path.basename(LOGS[1]).slice(4), 16);
+        var last = parseInt(path.basename(LOGS[2]).slice(4), 16) - 1;
+        var res, gaps;
+
+        fs.mkdirSync(a);
+        fs.mkdirSync(b);
+
+        // Each member has all the logs, so merging them gives each txn once.
+        LOGS.forEach(function (log) {
+                copy(log, path.join(a, path.basename(log)));
+                copy(log, path.join(b, path.basename(log)));
+        });
+        res = zklog([ '--merge', '-D', a, '-D', b ]);
+        t.equal(res.status, 0);
+        t.ok(res.stdout === SERIAL.stdout, 'merged output');
+
+        // Then neither has the middle one.
+        fs.unlinkSync(path.join(a, path.basename(LOGS[1])));
+        fs.unlinkSync(path.join(b, path.basename(LOGS[1])));
+        fs.unlinkSync(path.join(b, path.basename(LOGS[2])));
+        res = zklog([ '--merge', '-D', a, '-D', b ]);
+        gaps = records(res.stdout).filter(function (r) {
+                return (r.type === '_GAP');
+        });
+
+        t.equal(res.status, EXIT_DAMAGED);
+        t.equal(gaps.length, 1);
+        t.equal(gaps[0].firstZxid, first.toString(16));
+        t.equal(gaps[0].lastZxid, last.toString(16));
+        t.equal(gaps[0].count, last - first + 1);
+        t.end();
+});
+
+
+test('.gz input matches raw', function (t) {
+        var gz = path.join(DIR, 'gz');
+        var res;
+
+        fs.mkdirSync(gz);
+        LOGS.forEach(function (log) {
+                fs.writeFileSync(path.join(gz, path.basename(log) + '.gz'),
+                    zlib.gzipSync(fs.readFileSync(log)));
+        });
+
+        res = zklog([ '-D', gz ]);
+        t.equal(res.status, 0);
+        t.ok(res.stdout === SERIAL.stdout, '-D');
+
+        //
+        // -j decodes a compressed log a chunk's worth of output at a time,
+        // so that its memory use doesn't grow with the log (which isn't
+        // measured here). Each of these logs comes out in a few parts, which
+        // have to be merged back in order, and interleaved with the chunks
+        // of the raw logs when they're merged with them.
+        //
+        res = zklog([ '-j', '4', '-D', gz ]);
+        t.equal(res.status, 0);
+        t.ok(res.stdout === SERIAL.stdout, '-j 4 -D');
+
+        res = zklog([ '-j', '4', '--merge', '-D', gz, '-D',
+            path.join(DIR, 'logs') ]);
+        t.equal(res.status, 0);
+        t.ok(res.stdout === SERIAL.stdout, '-j 4 --merge');
+        t.end();
+});
+
+
+test('-e matches a reference filter', function (t) {
+        var PREFIX = '/com/joyent/us-east/moray';
+        var EXPRS = {};
+
+        EXPRS['type in (CREATE,DELETE) and path ^= ' + PREFIX] =
+            function (r) {
+                return ((r.type === 'CREATE' || r.type === 'DELETE') &&
+                    r.path !== undefined && r.path.indexOf(PREFIX) === 0);
+        };
+        EXPRS['type = MULTI or path ~ authcache'] = function (r) {
+                return (r.type === 'MULTI' || (r.path !== undefined &&
+                    r.path.indexOf('authcache') !== -1));
+        };
+        EXPRS['not type in (SETDATA,MULTI,ERROR)'] = function (r) {
+                return (r.type !== 'SETDATA' && r.type !== 'MULTI' &&
+                    r.type !== 'ERROR');
+        };
+
+        Object.keys(EXPRS).forEach(function (expr) {
+                var want = filter(SERIAL.stdout, EXPRS[expr]);
+                var res = zklog([ '-e', expr, '-D',
+                    path.join(DIR, 'logs') ]);
+
+                t.equal(res.status, 0);
+                t.ok(want.length > 0, expr);
+                t.ok(res.stdout === want, expr);
+                t.ok(zklog([ '-j', '4', '-e', expr, '-D',
+                    path.join(DIR, 'logs') ]).stdout === want, '-j ' + expr);
+        });
+        t.end();
+});
+
+
+test('--state matches a replay of the records', function (t) {
+        var ROOT = '/com/joyent/us-east';
+        var snap = path.join(DIR, 'snapshot.0');
+        var recs = records(SERIAL.stdout);
+        var paths = [ '/com', '/com/joyent', ROOT ];
+
+        recs.forEach(function (r) {
+                var dir;
+
+                if (r.path === undefined)
+                        return;
+                dir = r.path.split('/').slice(0, 5).join('/');
+                if (paths.indexOf(dir) === -1)
+                        paths.push(dir);
+        });
+        writeSnapshot(snap, paths);
+
+        [ TXNS / 2, TXNS ].forEach(function (zxid) {
+                var res = zklog([ '--state', '--snapshot', snap, '--path',
+                    ROOT, '--zxid-to', zxid.toString(16), '-D',
+                    path.join(DIR, 'logs') ]);
+                var want = replay(recs.filter(function (r) {
+                        return (parseInt(r.zxid, 16) <= zxid);
+                }), paths, ROOT);
+
+                t.equal(res.status, 0);
+                t.ok(want.length > paths.length, 'nodes at ' + zxid);
+                t.deepEqual(records(res.stdout).map(function (n) {
+                        return (n.path + ' ' + n.ephemeralOwner);
+                }).sort(), want, 'state at ' + zxid);
+        });
+        t.end();
+});
+
+
+after(function (callback) {
+        rmr(DIR);
+        callback();
+});
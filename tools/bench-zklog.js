@@ -0,0 +1,196 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+//
+// Throughput benchmark for zklog (see "make bench-zklog").
+//
+// Usage: node bench-zklog.js <zklog> <zkloggen> <workdir> [workload ...]
+//
+// Each workload is a fixed set of txnlogs written by zkloggen into
+// <workdir>/<name> (and only rewritten if the options for it change), which
+// we decode with each output mode in turn, reporting the best of
+// ZKLOG_BENCH_RUNS runs (3 by default) in MB/s of txnlog and txns/s. Any
+// extra zklog options (such as "-j 4") can be given in ZKLOG_BENCH_ARGS.
+//
+
+var child_process = require('child_process');
+var fs = require('fs');
+var path = require('path');
+var sprintf = require('util').format;
+
+
+
+///--- Globals
+
+// These are meant to look like the logs from our own ensembles.
+var WORKLOADS = {
+        // Registrar sessions and their ephemeral nodes, with small payloads.
+        registrar: [ '-n', '1000000', '-l', '250000', '-r', '1' ],
+        // Mostly SETDATA, with big payloads.
+        bigdata: [ '-n', '200000', '-l', '50000', '-r', '2',
+            '-m', 'create=10,setdata=80,delete=10', '-d', '4096,16384' ],
+        // Lots of short-lived sessions.
+        churn: [ '-n', '1000000', '-l', '250000', '-r', '3', '-c', '100000',
+            '-m', 'createsession=40,closesession=40,create=10,delete=10' ]
+};
+
+var MODES = [
+        { name: 'plain', args: [] },
+        { name: '-d', args: [ '-d' ] },
+        { name: '-S', args: [ '-S' ] },
+        { name: 'filtered', args: [ '-e',
+            'type in (CREATE,DELETE) and path ^= /com/joyent/us-east/moray' ] }
+];
+
+
+
+///--- Helpers
+
+function fatal(msg) {
+        console.error('bench-zklog: ' + msg);
+        process.exit(1);
+}
+
+
+// Pads to "width" on the left (or on the right, if it's negative).
+function pad(val, width) {
+        var str = String(val);
+
+        while (str.length < Math.abs(width))
+                str = width < 0 ? str + ' ' : ' ' + str;
+        return (str);
+}
+
+
+function run(cmd, args, stdout) {
+        var res = child_process.spawnSync(cmd, args,
+            { stdio: [ 'ignore', stdout, 'inherit' ] });
+
+        if (res.error)
+                fatal(sprintf('failed to run %s: %s', cmd, res.error.message));
+        if (res.status !== 0)
+                fatal(sprintf('%s %s exited with %d', cmd, args.join(' '),
+                    res.status));
+        return (res);
+}
+
+
+// Writes the logs for a workload, unless they're already there.
+function generate(zkloggen, dir, args) {
+        var stamp = path.join(dir, '.zkloggen-args');
+        var want = JSON.stringify(args);
+
+        try {
+                if (fs.readFileSync(stamp, 'utf8') === want)
+                        return;
+        } catch (e) {
+                if (e.code !== 'ENOENT')
+                        throw (e);
+        }
+
+        console.error('generating %s', dir);
+        if (fs.existsSync(dir)) {
+                fs.readdirSync(dir).forEach(function (name) {
+                        fs.unlinkSync(path.join(dir, name));
+                });
+        }
+        run(zkloggen, args.concat([ dir ]), 'inherit');
+        fs.writeFileSync(stamp, want);
+}
+
+
+// Totals up the txns in a workload, and the bytes of the logs they take up.
+function measure(zklog, dir) {
+        var res = run(zklog, [ '--verify', '-D', dir ], 'pipe');
+        var total = { txns: 0, bytes: 0 };
+
+        res.stdout.toString().split('\n').forEach(function (line) {
+                if (line === '')
+                        return;
+                var rec = JSON.parse(line);
+                total.txns += rec.txns;
+                total.bytes += rec.bytes;
+        });
+
+        return (total);
+}
+
+
+function time(zklog, args, devnull) {
+        var start = process.hrtime();
+        var secs;
+
+        run(zklog, args, devnull);
+        secs = process.hrtime(start);
+        return (secs[0] + secs[1] / 1e9);
+}
+
+
+
+///--- Mainline
+
+function main() {
+        var argv = process.argv.slice(2);
+        var runs = parseInt(process.env.ZKLOG_BENCH_RUNS || '3', 10);
+        var extra = (process.env.ZKLOG_BENCH_ARGS || '').split(/\s+/).filter(
+            function (a) { return (a !== ''); });
+        var names, devnull;
+
+        if (argv.length < 3)
+                fatal('usage: bench-zklog.js <zklog> <zkloggen> <workdir> ' +
+                    '[workload ...]');
+        if (isNaN(runs) || runs < 1)
+                fatal('invalid ZKLOG_BENCH_RUNS');
+
+        names = argv.length > 3 ? argv.slice(3) : Object.keys(WORKLOADS);
+        names.forEach(function (name) {
+                if (!WORKLOADS.hasOwnProperty(name))
+                        fatal('unknown workload: ' + name);
+        });
+
+        if (!fs.existsSync(argv[2]))
+                fs.mkdirSync(argv[2]);
+        devnull = fs.openSync('/dev/null', 'w');
+
+        console.log('%s  %s  %s  %s  %s  %s',
+            pad('WORKLOAD', -10), pad('MODE', -8), pad('TXNS', 8),
+            pad('MB', 7), pad('MB/s', 8), pad('TXNS/s', 10));
+
+        names.forEach(function (name) {
+                var dir = path.join(argv[2], name);
+                var total;
+
+                generate(argv[1], dir, WORKLOADS[name]);
+                total = measure(argv[0], dir);
+
+                MODES.forEach(function (mode) {
+                        var args = extra.concat(mode.args, [ '-D', dir ]);
+                        var best = Infinity;
+                        var i;
+
+                        for (i = 0; i < runs; i++)
+                                best = Math.min(best,
+                                    time(argv[0], args, devnull));
+
+                        console.log('%s  %s  %s  %s  %s  %s',
+                            pad(name, -10), pad(mode.name, -8),
+                            pad(total.txns, 8),
+                            pad((total.bytes / 1e6).toFixed(1), 7),
+                            pad((total.bytes / 1e6 / best).toFixed(1), 8),
+                            pad(Math.round(total.txns / best), 10));
+                });
+        });
+
+        fs.closeSync(devnull);
+}
+
+
+
+main();
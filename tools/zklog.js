@@ -0,0 +1,125 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 Joyent, Inc.
+ */
+
+//
+// Reads ZooKeeper txnlogs through the native binding of zklog's decoder
+// (src/zklog_node.c, built with "make zklog.node"), rather than by running
+// zklog and parsing its JSON:
+//
+//      var zklog = require('./tools/zklog');
+//      var cur = zklog.open('/zookeeper/version-2/log.1');
+//      var txn;
+//
+//      while ((txn = cur.next()) !== null)
+//              console.log(txn.zxid, txn.type, txn.path);
+//      cur.close();
+//
+// or, as a stream of txns:
+//
+//      zklog.createReadStream('/zookeeper/version-2/log.1').on('data', ...);
+//
+// Txns have the same fields as in zklog's JSON, except that "time" is in ms
+// since the epoch, "timeout" is a number, "data" (which is always there, for
+// txns that have it) is a Buffer, and the children of a MULTI are in
+// "children". Compressed logs aren't supported: they have to be mapped.
+//
+
+var path = require('path');
+var stream = require('stream');
+
+var binding = require(path.join(__dirname, '..', 'zklog.node'));
+
+
+
+///--- Globals
+
+// Txns read at a time by a stream, between checks for back-pressure.
+var STREAM_HWM = 1024;
+
+
+
+///--- API
+
+function Txn(time, type, typeid, sessionid, cxid, zxid, path_, data, error,
+    errid, timeout, count, children) {
+        this.time = time;
+        this.type = type;
+        this.typeid = typeid;
+        this.sessionid = sessionid;
+        this.cxid = cxid;
+        this.zxid = zxid;
+        if (error !== undefined) {
+                this.error = error;
+                this.errid = errid;
+        }
+        if (timeout !== undefined)
+                this.timeout = timeout;
+        if (path_ !== undefined)
+                this.path = path_;
+        if (data !== undefined)
+                this.data = data;
+        if (count !== undefined) {
+                this.count = count;
+                this.children = children;
+        }
+}
+
+
+// Opens a log (a path, or a Buffer holding one), returning a cursor with
+// next(), offset() and close() methods. next() returns null at the end of the
+// log, and throws for bad txns (see src/zklog_node.c).
+function open(log) {
+        return (new binding.Cursor(log, Txn));
+}
+
+
+function createReadStream(log) {
+        var cur = open(log);
+        var done = false;
+        var rs = new stream.Readable({
+                objectMode: true,
+                highWaterMark: STREAM_HWM
+        });
+
+        rs._read = function () {
+                var txn;
+
+                // After an error, we may still be asked for more.
+                if (done)
+                        return;
+
+                try {
+                        while ((txn = cur.next()) !== null) {
+                                if (!rs.push(txn))
+                                        return;
+                        }
+                } catch (e) {
+                        done = true;
+                        cur.close();
+                        rs.emit('error', e);
+                        return;
+                }
+                done = true;
+                cur.close();
+                rs.push(null);
+        };
+
+        return (rs);
+}
+
+
+
+///--- Exports
+
+module.exports = {
+        Txn: Txn,
+        open: open,
+        createReadStream: createReadStream
+};